@@ -8,34 +8,44 @@
  * @brief Command-line interface (CLI) utilities for the FAT32 emulator.
  *
  * This module provides functions to display the prompt and process user commands
- * within the emulator's interactive CLI. It interacts with the Fat32Context to
- * execute filesystem operations such as format, ls, mkdir, cd, and touch.
+ * within the emulator's interactive CLI. Commands run in a Fat32Session, which
+ * supplies the current directory and output stream, against the session's
+ * shared Fat32Volume (format, ls, mkdir, cd, touch, ...).
  */
 
 /**
  * @brief Display the CLI prompt with the current working path.
  *
- * @param ctx Pointer to the Fat32Context containing the current path and state.
+ * @param session Pointer to the Fat32Session containing the current path.
  *
  * @note This function only prints to stdout and flushes the output.
  */
-void print_prompt(Fat32Context* ctx);
+void print_prompt(Fat32Session* session);
 
 /**
  * @brief Process a single command entered by the user in the CLI.
  *
  * Parses the given command string and executes the corresponding filesystem
- * operation in the provided Fat32Context.
+ * operation in the provided Fat32Session.
  *
  * Supported commands include:
- * - format
- * - ls
+ * - format [size] [cluster]
+ * - ls [path]
+ * - stat <path>
+ * - stats
  * - mkdir <name>
  * - touch <name>
  * - cd <path>
+ * - put <host_path> <image_path>
+ * - get <image_path> <host_path>
+ * - import <host_dir> <image_dir>
+ * - export-tar <image_dir> <out|->
+ * - clone <count> <dir>
+ * - begin / commit / abort
+ * - profile <on|off>
  * - exit / quit
  *
- * @param ctx Pointer to the Fat32Context representing the current filesystem state.
+ * @param session Pointer to the Fat32Session running the command.
  * @param command Null-terminated string containing the user command.
  * 
  * @return int Returns 0 on successful execution of a command.
@@ -44,6 +54,51 @@ void print_prompt(Fat32Context* ctx);
  * @note The function prints command results or error messages directly to stdout.
  * @see print_prompt()
  */
-int process_command(Fat32Context* ctx, const char* command);
+int process_command(Fat32Session* session, const char* command);
+
+/**
+ * @brief Execute a single command and report whether it succeeded.
+ *
+ * Behaves like process_command() and additionally stores the outcome of
+ * the command, which batch mode uses for status codes and stop-on-error.
+ *
+ * @param session Pointer to the Fat32Session running the command.
+ * @param command Null-terminated string containing the user command.
+ * @param status Set to 0 if the command succeeded, 1 if it failed, was
+ *               malformed or needed a mounted volume.
+ *
+ * @return int Same as process_command().
+ * @see process_command()
+ */
+int execute_command(Fat32Session* session, const char* command, int* status);
+
+/**
+ * @brief Print the per-command profile totals.
+ *
+ * Writes one row per command type (calls, wall and CPU time, sectors
+ * read and written, syscalls, flushes, cache hit ratio) to stderr.
+ * Nothing is printed if no command was profiled.
+ *
+ * @param ctx Pointer to the Fat32Volume holding the profile.
+ */
+void print_profile_summary(Fat32Volume* ctx);
+
+/**
+ * @brief Run every command of a script in one session (batch mode).
+ *
+ * Blank lines and lines starting with '#' are skipped and no prompt is
+ * printed. The script ends early at exit / quit, and with
+ * @p stop_on_error at the first failing command. The CLI exits with
+ * status 0 only if this returns 0.
+ *
+ * @param session Pointer to the Fat32Session running the commands.
+ * @param script Path of the script, or "-" to read stdin.
+ * @param print_status Nonzero to print "status 0" or "status 1" after each command.
+ * @param stop_on_error Nonzero to stop at the first failing command.
+ *
+ * @return int Number of failed commands, or -1 if the script cannot be read.
+ * @see execute_command()
+ */
+int run_batch(Fat32Session* session, const char* script, int print_status, int stop_on_error);
 
 #endif // CLI_H
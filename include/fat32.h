@@ -1,8 +1,16 @@
 #ifndef FAT32_H
 #define FAT32_H
 
+/* pthread_rwlock_t is POSIX, which a strict -std=c99 build hides */
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 /**
  * @file fat32.h
@@ -10,15 +18,27 @@
  *
  * This header defines the data structures, constants, and function prototypes
  * necessary for working with a FAT32 filesystem in a file-backed emulator.
+ *
+ * The volume embeds POSIX locks. Unless the includer chose a feature
+ * test macro, the header selects POSIX.1-2008; it must then be included
+ * before any system header, since those fix the feature set on first
+ * inclusion.
  */
 
 #define SECTOR_SIZE 512
-#define CLUSTER_SIZE 4096  /**< 8 sectors per cluster */
-#define TOTAL_SECTORS 40960 /**< 20 MB disk size */
+#define SECTOR_SHIFT 9     /**< log2(SECTOR_SIZE) */
+#define CLUSTER_SIZE 4096  /**< Default cluster size used by format (8 sectors) */
+#define TOTAL_SECTORS 40960 /**< Default size of a new image (20 MB) */
+#define FAT32_MIN_CLUSTER_SIZE 512    /**< Smallest cluster size accepted by format */
+#define FAT32_MAX_CLUSTER_SIZE 32768  /**< Largest cluster size; sizes stack buffers */
+#define FAT32_MAX_SECTORS 0xFFFFFFFFu /**< BPB total_sectors_32 limit (2 TiB) */
 #define RESERVED_SECTORS 32
 #define FAT_COUNT 2
 #define ROOT_CLUSTER 2
 
+#define FAT_EOC 0x0FFFFFFF     /**< End-of-chain marker written to the FAT */
+#define FAT_EOC_MIN 0x0FFFFFF8 /**< Smallest value treated as end-of-chain */
+
 /**
  * @brief FAT32 Boot Sector structure.
  *
@@ -86,48 +106,348 @@ typedef struct {
 #define ATTR_ARCHIVE 0x20
 #define ATTR_LONG_NAME 0x0F
 
+/** Callback invoked for each entry of a directory listing. */
+typedef int (*Fat32EntryFn)(const DirEntry* entry, void* arg);
+
+/**
+ * @brief Cached tail of a file's cluster chain, keyed by its first cluster.
+ */
+typedef struct {
+    uint32_t first_cluster; /**< Key (0 marks an empty slot) */
+    uint32_t last_cluster;  /**< Last cluster of the chain */
+    uint32_t length;        /**< Number of clusters in the chain */
+} Fat32TailEntry;
+
+#define FAT32_TAIL_CACHE_SIZE 64 /**< Slots in the per-file tail cache */
+
+/**
+ * @brief Directory entry that open handles refer to, keyed by its slot.
+ */
+typedef struct {
+    uint32_t cluster;  /**< Directory cluster holding the entry */
+    uint32_t index;    /**< Entry index within the cluster */
+    uint32_t handles;  /**< Number of open handles on the entry */
+    uint32_t writers;  /**< Handles among them opened for writing (at most one) */
+} Fat32OpenEntry;
+
 /**
- * @brief FAT32 emulator context structure.
+ * @brief Reader/writer lock of one directory, keyed by its first cluster.
+ */
+typedef struct {
+    uint32_t cluster;       /**< Key (0 marks a free slot) */
+    uint32_t users;         /**< Threads holding or waiting for the lock */
+    pthread_rwlock_t lock;  /**< The directory lock */
+} Fat32DirLock;
+
+#define FAT32_DIR_LOCKS 64 /**< Directories that can be locked at the same time */
+
+/**
+ * @brief Cumulative I/O counters of a volume.
  *
- * Stores all relevant information about the current state of the
- * emulated FAT32 filesystem.
+ * Updated with atomic adds because pool workers share the volume.
+ */
+typedef struct {
+    uint64_t sectors_read;    /**< Image sectors read (syscalls and mapped copies) */
+    uint64_t sectors_written; /**< Image sectors written */
+    uint64_t syscalls;        /**< System calls issued against the image or host files */
+    uint64_t flushes;         /**< File handle flushes that wrote data or metadata */
+    uint64_t cache_hits;      /**< Tail and chain cache hits */
+    uint64_t cache_misses;    /**< Tail and chain cache misses (FAT walks) */
+} Fat32Stats;
+
+/**
+ * @brief Accumulated profile of one CLI command type.
+ */
+typedef struct {
+    char command[16];         /**< Command name */
+    uint64_t calls;           /**< Number of invocations */
+    double wall_ms;           /**< Total wall-clock time */
+    double cpu_ms;            /**< Total process CPU time (all threads) */
+    Fat32Stats io;            /**< Total I/O counters */
+} Fat32ProfileRow;
+
+/** Sectors written inside a transaction, kept in memory until commit */
+typedef struct Fat32Txn Fat32Txn;
+
+/** Workload recorder (see trace.h) */
+typedef struct Fat32Trace Fat32Trace;
+
+/** One client's view of a volume (defined below) */
+typedef struct Fat32Session Fat32Session;
+
+/**
+ * @brief Mounted FAT32 volume.
+ *
+ * Holds the image, its geometry and the caches derived from it. One
+ * volume is shared by any number of sessions (see Fat32Session), which
+ * may use it from different threads. Operations on files and directories
+ * hold the volume lock shared and lock the directories they touch;
+ * operations on the whole volume (format, transactions) hold it
+ * exclusively. See lock.c for the lock order.
  */
 typedef struct {
     FILE* disk_file;         /**< File pointer to the disk image */
     char* disk_path;         /**< Path to the disk image file */
+    int mounted;             /**< Nonzero while a validated volume is loaded */
+    uint32_t generation;     /**< Bumped by every format; invalidates handles and session directories */
+    uint8_t* map;            /**< Shared mapping of the image (NULL if not mapped) */
+    uint64_t map_size;       /**< Length of the mapping in bytes */
     uint32_t fat_start;      /**< Starting sector of the FAT */
     uint32_t data_start;     /**< Starting sector of the data region */
     uint32_t fat_size;       /**< Number of sectors in a FAT */
-    uint32_t total_clusters; /**< Total number of clusters */
+    uint32_t fat_count;      /**< Number of FAT copies */
+    uint32_t total_sectors;  /**< Volume size in sectors (from the BPB) */
+    uint32_t total_clusters; /**< Number of data clusters (from the BPB) */
+    uint32_t cluster_end;    /**< One past the highest valid cluster number */
+    uint32_t cluster_size;   /**< Bytes per cluster */
+    uint32_t cluster_shift;  /**< log2(cluster_size) */
+    uint32_t cluster_mask;   /**< cluster_size - 1 */
+    uint32_t sectors_per_cluster; /**< Sectors per cluster */
+    uint32_t spc_shift;      /**< log2(sectors_per_cluster) */
+    uint8_t* zero_map;       /**< Bit per cluster, set while the cluster is known to read as zeros */
+    uint32_t alloc_cursor;   /**< Where small allocations look for free clusters first (allocator lock) */
+    Fat32Txn* txn;           /**< Open transaction (NULL outside fat32_begin()/fat32_commit()) */
+    Fat32Session* txn_owner; /**< Session that opened txn */
+    uint32_t sessions;       /**< Sessions initialized so far (numbers the next one) */
+    Fat32TailEntry tail_cache[FAT32_TAIL_CACHE_SIZE]; /**< Chain tails for O(1) appends */
+    Fat32OpenEntry* open_entries; /**< Entries with open handles (see fat32_entry_in_use()) */
+    uint32_t open_count;     /**< Number of open_entries in use */
+    uint32_t open_cap;       /**< Capacity of open_entries */
+    Fat32Stats stats;        /**< Cumulative I/O counters */
+    int profiling;           /**< Nonzero while CLI commands are profiled */
+    int json;                /**< Nonzero for NDJSON output from ls, stat and stats */
+    Fat32Trace* trace;       /**< Workload recorder (NULL when not recording) */
+    Fat32ProfileRow* profile; /**< Per-command profile rows */
+    uint32_t profile_rows;   /**< Number of profile rows */
+    pthread_rwlock_t lock;   /**< Volume lock (see fat32_lock_shared()) */
+    Fat32DirLock dir_locks[FAT32_DIR_LOCKS]; /**< Locks of the directories in use */
+    pthread_mutex_t dir_table_lock; /**< Guards the keys and users of dir_locks */
+    pthread_cond_t dir_table_cond; /**< Signalled when a dir_locks slot is released */
+    pthread_mutex_t rename_lock; /**< Serializes renames that move a directory */
+    pthread_mutex_t alloc_lock; /**< Allocator lock: FAT updates and free space (recursive) */
+    pthread_mutex_t tail_lock; /**< Guards tail_cache, which shared holders update */
+    pthread_mutex_t open_lock; /**< Guards open_entries */
+    pthread_mutex_t profile_lock; /**< Guards profile and profile_rows */
+} Fat32Volume;
+
+/**
+ * @brief One client's view of a shared volume.
+ *
+ * A session is cheap and holds only per-client state: the working
+ * directory and where CLI output goes. It is used by one thread at a
+ * time; any number of sessions may work on the same volume in parallel.
+ */
+struct Fat32Session {
+    Fat32Volume* volume;     /**< Volume the session works on */
     char current_path[256];  /**< Current working directory path */
     uint32_t current_cluster; /**< Cluster number of the current directory */
-} Fat32Context;
+    uint32_t generation;     /**< Volume generation current_cluster belongs to */
+    uint32_t id;             /**< Number given by fat32_session_init(), unique per volume (tags trace records) */
+    uint32_t aborts;         /**< Transactions the session aborted; invalidates its handles */
+    FILE* out;               /**< Stream for CLI command output (NULL for stdout) */
+};
+
+/**
+ * @brief Run of physically adjacent clusters.
+ */
+typedef struct {
+    uint32_t start;  /**< First cluster of the run */
+    uint32_t count;  /**< Number of clusters in the run */
+} Fat32Extent;
+
+/** Maximum segments passed to one vectored device request */
+#define FAT32_IOV_MAX 64
+
+/** Bytes of zeros per segment when clearing a range without hole punching */
+#define FAT32_ZERO_CHUNK (1024 * 1024)
+
+/** Number of FAT sectors read or written per request when scanning or batching */
+#define FAT32_SCAN_SECTORS 64
+
+/** Requests of up to this many clusters look near the free-space cursor before scanning the whole FAT */
+#define FAT32_NEAR_CLUSTERS 256
+
+/** Sectors a transaction may hold in memory (256 MiB) */
+#define FAT32_TXN_MAX_SECTORS (512 * 1024)
+
+/** Buffered bytes per handle that force a flush (delayed allocation limit) */
+#define FAT32_DELALLOC_MAX (8 * 1024 * 1024)
+
+/** File open flags for fat32_open() */
+#define FAT32_O_RDONLY 0x00
+#define FAT32_O_WRONLY 0x01
+#define FAT32_O_RDWR 0x02
+#define FAT32_O_ACCMODE 0x03
+#define FAT32_O_CREAT 0x04
+#define FAT32_O_TRUNC 0x08
+#define FAT32_O_APPEND 0x10
+
+/** Flags for fat32_init_opts() */
+#define FAT32_INIT_PREALLOCATE 0x01 /**< Reserve host blocks for a new image instead of leaving it sparse */
+
+/** Mode flags for fat32_fallocate() */
+#define FAT32_FALLOC_KEEP_SIZE 0x01 /**< Reserve clusters without changing the file size */
+#define FAT32_FALLOC_NO_ZERO 0x02   /**< Do not zero bytes added to the file size */
+
+/**
+ * @brief Open file handle.
+ *
+ * Tracks the byte position within a file together with the cluster that
+ * holds it, and caches the part of the cluster chain walked so far so that
+ * sequential and backward access never re-walk the FAT from the start.
+ */
+typedef struct {
+    Fat32Volume* ctx;         /**< Volume the file belongs to */
+    Fat32Session* session;    /**< Session the handle was opened in */
+    uint32_t parent_cluster;  /**< First cluster of the directory holding the entry (keys its lock) */
+    uint32_t dir_cluster;     /**< Directory cluster holding the entry */
+    uint32_t dir_index;       /**< Entry index within dir_cluster */
+    uint32_t first_cluster;   /**< First cluster of the file (0 if empty) */
+    uint32_t file_size;       /**< Current file size in bytes */
+    uint32_t position;        /**< Current byte offset */
+    uint32_t cur_cluster;     /**< Cluster holding position (0 if not allocated) */
+    uint32_t cur_index;       /**< Index of cur_cluster within the chain */
+    uint32_t* chain;          /**< Cached cluster chain */
+    uint32_t chain_len;       /**< Number of cached chain entries */
+    uint32_t chain_cap;       /**< Capacity of the chain array */
+    int chain_complete;       /**< Nonzero once the end of the chain was cached */
+    int tail_known;           /**< Nonzero once last_cluster/cluster_count are valid */
+    uint32_t last_cluster;    /**< Last cluster of the chain (0 if empty) */
+    uint32_t cluster_count;   /**< Number of clusters in the chain */
+    uint8_t* pending;         /**< Buffered bytes past the last allocated cluster */
+    uint32_t pending_len;     /**< Number of buffered bytes */
+    uint32_t pending_cap;     /**< Capacity of the pending buffer */
+    int flags;                /**< FAT32_O_* flags passed to fat32_open() */
+    uint32_t generation;      /**< Volume generation the handle was opened in */
+    uint32_t aborts;          /**< session->aborts when the handle was opened */
+    int dirty;                /**< Nonzero if the directory entry needs updating */
+} Fat32File;
 
 /** @name FAT32 Core Functions */
 //@{
-int fat32_init(Fat32Context* ctx, const char* disk_path);
-int fat32_format(Fat32Context* ctx);
-int fat32_mkdir(Fat32Context* ctx, const char* name);
-int fat32_touch(Fat32Context* ctx, const char* name);
-int fat32_cd(Fat32Context* ctx, const char* path);
-int fat32_ls(Fat32Context* ctx, const char* path);
-void fat32_cleanup(Fat32Context* ctx);
-int fat32_is_valid(Fat32Context* ctx);
+int fat32_init(Fat32Volume* ctx, const char* disk_path);
+int fat32_init_opts(Fat32Volume* ctx, const char* disk_path, int flags);
+int fat32_format(Fat32Volume* ctx);
+int fat32_format_opts(Fat32Volume* ctx, uint64_t size, uint32_t cluster_size);
+int fat32_mkdir(Fat32Session* session, const char* name);
+int fat32_touch(Fat32Session* session, const char* name);
+int fat32_cd(Fat32Session* session, const char* path);
+int fat32_ls(Fat32Session* session, const char* path);
+int fat32_ls_each(Fat32Session* session, const char* path, Fat32EntryFn fn, void* arg);
+int fat32_stat(Fat32Session* session, const char* path, DirEntry* entry);
+int fat32_rename(Fat32Session* session, const char* old_path, const char* new_path);
+void fat32_cleanup(Fat32Volume* ctx);
+int fat32_is_valid(Fat32Volume* ctx);
+int fat32_mount(Fat32Volume* ctx);
+int fat32_is_mounted(const Fat32Volume* ctx);
+int fat32_begin(Fat32Session* session);
+int fat32_commit(Fat32Session* session);
+int fat32_abort(Fat32Session* session);
+int fat32_in_txn(Fat32Session* session);
+void fat32_session_init(Fat32Session* session, Fat32Volume* volume);
+uint32_t fat32_session_cwd(Fat32Session* session);
+FILE* fat32_session_out(const Fat32Session* session);
+//@}
+
+/** @name FAT32 Locking Functions */
+//@{
+void fat32_lock_init(Fat32Volume* ctx);
+void fat32_lock_destroy(Fat32Volume* ctx);
+int fat32_lock_shared(Fat32Volume* ctx);
+int fat32_lock_exclusive(Fat32Volume* ctx);
+void fat32_unlock(Fat32Volume* ctx);
+int fat32_lock_dir(Fat32Volume* ctx, uint32_t cluster, int exclusive);
+int fat32_lock_dirs(Fat32Volume* ctx, const uint32_t* clusters, int count);
+void fat32_unlock_dirs(Fat32Volume* ctx, const uint32_t* clusters, int count);
+void fat32_unlock_dir(Fat32Volume* ctx, uint32_t cluster);
+void fat32_alloc_lock(Fat32Volume* ctx);
+void fat32_alloc_unlock(Fat32Volume* ctx);
+//@}
+
+/** @name FAT32 File Functions */
+//@{
+int fat32_open(Fat32Session* session, const char* path, int flags, Fat32File* file);
+int64_t fat32_read(Fat32File* file, void* buffer, uint32_t size);
+int64_t fat32_write(Fat32File* file, const void* buffer, uint32_t size);
+int64_t fat32_readv(Fat32File* file, const struct iovec* iov, int iovcnt);
+int64_t fat32_writev(Fat32File* file, const struct iovec* iov, int iovcnt);
+int64_t fat32_lseek(Fat32File* file, int64_t offset, int whence);
+int fat32_fallocate(Fat32File* file, uint32_t length, int mode);
+int fat32_truncate(Fat32File* file, uint32_t length);
+int fat32_replace_chain(Fat32File* file, uint32_t first_cluster, uint32_t last_cluster,
+                        uint32_t cluster_count, uint32_t size);
+int fat32_flush(Fat32File* file);
+int fat32_close(Fat32File* file);
+int fat32_map_file(Fat32File* file, uint32_t offset, uint32_t length, struct iovec** iov);
+//@}
+
+/** @name FAT32 Host Transfer Functions */
+//@{
+int fat32_put(Fat32Session* session, const char* host_path, const char* image_path);
+int fat32_get(Fat32Session* session, const char* image_path, const char* host_path);
+int fat32_import(Fat32Session* session, const char* host_dir, const char* image_dir);
+int fat32_export_tar(Fat32Session* session, const char* image_dir, const char* out_path);
+int fat32_provision(const char* template_path, uint32_t count, const char* out_dir);
 //@}
 
 /** @name FAT32 Utility Functions */
 //@{
+int fat32_create_image(Fat32Volume* ctx, uint64_t size, int preallocate);
+uint64_t fat32_image_size(Fat32Volume* ctx);
+int fat32_resize_image(Fat32Volume* ctx, uint64_t size);
+int fat32_set_geometry(Fat32Volume* ctx, const Fat32BootSector* bs);
+int fat32_map_image(Fat32Volume* ctx);
+void fat32_unmap_image(Fat32Volume* ctx);
+void fat32_count(uint64_t* counter, uint64_t amount);
+void fat32_stats_get(Fat32Volume* ctx, Fat32Stats* stats);
 uint32_t fat32_get_cluster_from_entry(const DirEntry* entry);
 void fat32_set_cluster_to_entry(DirEntry* entry, uint32_t cluster);
+void fat32_set_entry_time(DirEntry* entry, time_t when, int created);
 void fat32_format_name(const char* name, char* formatted_name);
-int fat32_read_sector(Fat32Context* ctx, uint32_t sector, void* buffer);
-int fat32_write_sector(Fat32Context* ctx, uint32_t sector, const void* buffer);
-uint32_t fat32_get_fat_entry(Fat32Context* ctx, uint32_t cluster);
-int fat32_set_fat_entry(Fat32Context* ctx, uint32_t cluster, uint32_t value);
-uint32_t fat32_find_free_cluster(Fat32Context* ctx);
-int fat32_clear_cluster(Fat32Context* ctx, uint32_t cluster);
-int fat32_read_cluster(Fat32Context* ctx, uint32_t cluster, void* buffer);
-int fat32_write_cluster(Fat32Context* ctx, uint32_t cluster, const void* buffer);
+void fat32_entry_name(const DirEntry* entry, char* name);
+int fat32_read_sector(Fat32Volume* ctx, uint32_t sector, void* buffer);
+int fat32_write_sector(Fat32Volume* ctx, uint32_t sector, const void* buffer);
+int fat32_read_sectors(Fat32Volume* ctx, uint32_t sector, uint32_t count, void* buffer);
+int fat32_write_sectors(Fat32Volume* ctx, uint32_t sector, uint32_t count, const void* buffer);
+int fat32_zero_sectors(Fat32Volume* ctx, uint32_t sector, uint64_t count);
+int fat32_discard_sectors(Fat32Volume* ctx, uint32_t sector, uint64_t count);
+int fat32_discard_clusters(Fat32Volume* ctx, uint32_t first, uint32_t count);
+int fat32_scan_zero_clusters(Fat32Volume* ctx);
+int fat32_cluster_is_zero(Fat32Volume* ctx, uint32_t cluster);
+uint32_t fat32_get_fat_entry(Fat32Volume* ctx, uint32_t cluster);
+int fat32_set_fat_entry(Fat32Volume* ctx, uint32_t cluster, uint32_t value);
+uint32_t fat32_find_free_cluster(Fat32Volume* ctx);
+int fat32_clear_cluster(Fat32Volume* ctx, uint32_t cluster);
+int fat32_read_cluster(Fat32Volume* ctx, uint32_t cluster, void* buffer);
+int fat32_write_cluster(Fat32Volume* ctx, uint32_t cluster, const void* buffer);
+uint64_t fat32_cluster_offset(Fat32Volume* ctx, uint32_t cluster);
+int fat32_read_data(Fat32Volume* ctx, uint32_t cluster, uint32_t offset, void* buffer, uint32_t size);
+int fat32_write_data(Fat32Volume* ctx, uint32_t cluster, uint32_t offset, const void* buffer, uint32_t size);
+int fat32_readv_data(Fat32Volume* ctx, uint32_t cluster, uint32_t offset, const struct iovec* iov, int iovcnt);
+int fat32_writev_data(Fat32Volume* ctx, uint32_t cluster, uint32_t offset, const struct iovec* iov, int iovcnt);
+int fat32_free_chain(Fat32Volume* ctx, uint32_t cluster);
+int fat32_chain_extents(Fat32Volume* ctx, uint32_t cluster, uint32_t max_clusters,
+                        Fat32Extent** extents, uint32_t* extent_count);
+int fat32_free_extents(Fat32Volume* ctx, const Fat32Extent* extents, uint32_t extent_count);
+int fat32_set_fat_run(Fat32Volume* ctx, uint32_t first, uint32_t count, uint32_t last_value);
+int fat32_set_fat_values(Fat32Volume* ctx, uint32_t first, uint32_t count, const uint32_t* values);
+int fat32_reserve_extents(Fat32Volume* ctx, uint32_t count, uint32_t prev_cluster,
+                          Fat32Extent** extents, uint32_t* extent_count);
+int fat32_alloc_extents(Fat32Volume* ctx, uint32_t count, uint32_t prev_cluster,
+                        Fat32Extent** extents, uint32_t* extent_count);
+int fat32_tail_lookup(Fat32Volume* ctx, uint32_t first_cluster, uint32_t* last_cluster, uint32_t* length);
+void fat32_tail_store(Fat32Volume* ctx, uint32_t first_cluster, uint32_t last_cluster, uint32_t length);
+void fat32_tail_forget(Fat32Volume* ctx, uint32_t first_cluster);
+int fat32_entry_in_use(Fat32Volume* ctx, uint32_t entry_cluster, uint32_t entry_index);
+int fat32_txn_denies(const Fat32Session* session);
+int fat32_resolve_parent(Fat32Session* session, const char* path, uint32_t* dir_cluster, char* formatted_name);
+int fat32_resolve_dir(Fat32Session* session, const char* path, uint32_t* dir_cluster);
+int fat32_find_entry(Fat32Volume* ctx, uint32_t dir_cluster, const char* formatted_name,
+                     DirEntry* entry, uint32_t* entry_cluster, uint32_t* entry_index);
+int fat32_add_entry(Fat32Volume* ctx, uint32_t dir_cluster, const DirEntry* entry,
+                    uint32_t* entry_cluster, uint32_t* entry_index);
+int fat32_read_entry(Fat32Volume* ctx, uint32_t entry_cluster, uint32_t entry_index, DirEntry* entry);
+int fat32_update_entry(Fat32Volume* ctx, uint32_t entry_cluster, uint32_t entry_index, const DirEntry* entry);
 //@}
 
 #endif // FAT32_H
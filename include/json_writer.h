@@ -0,0 +1,88 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @file json_writer.h
+ * @brief Buffered writer for newline-delimited JSON (NDJSON) records.
+ *
+ * Records are flat objects built field by field into a memory buffer
+ * and handed to the output stream in large blocks, so a listing of any
+ * size costs a handful of fwrite() calls. Each record ends with a
+ * newline, which lets consumers process output incrementally.
+ */
+
+#define JSON_WRITER_BUFFER_SIZE (64 * 1024) /**< Bytes buffered before a write */
+
+/**
+ * @brief NDJSON writer state.
+ */
+typedef struct {
+    FILE* out;          /**< Destination stream */
+    char* buffer;       /**< Pending output */
+    size_t len;         /**< Bytes in @p buffer */
+    int fields;         /**< Fields written to the open record */
+    int error;          /**< Set once a write failed */
+} JsonWriter;
+
+/**
+ * @brief Initializes a writer.
+ *
+ * @param writer Writer to initialize.
+ * @param out Destination stream.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int json_writer_init(JsonWriter* writer, FILE* out);
+
+/**
+ * @brief Starts a record.
+ *
+ * @param writer Writer.
+ */
+void json_begin(JsonWriter* writer);
+
+/**
+ * @brief Adds a string field (escaped as needed).
+ *
+ * @param writer Writer.
+ * @param key Field name (plain ASCII, not escaped).
+ * @param value Field value.
+ */
+void json_string(JsonWriter* writer, const char* key, const char* value);
+
+/**
+ * @brief Adds an unsigned integer field.
+ *
+ * @param writer Writer.
+ * @param key Field name (plain ASCII, not escaped).
+ * @param value Field value.
+ */
+void json_uint(JsonWriter* writer, const char* key, uint64_t value);
+
+/**
+ * @brief Ends the record and its line.
+ *
+ * @param writer Writer.
+ */
+void json_end(JsonWriter* writer);
+
+/**
+ * @brief Writes buffered records to the stream.
+ *
+ * @param writer Writer.
+ * @return 0 on success, -1 if any write failed.
+ */
+int json_flush(JsonWriter* writer);
+
+/**
+ * @brief Flushes and frees the writer.
+ *
+ * @param writer Writer.
+ * @return 0 on success, -1 if any write failed.
+ */
+int json_writer_destroy(JsonWriter* writer);
+
+#endif // JSON_WRITER_H
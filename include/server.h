@@ -0,0 +1,65 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "fat32.h"
+
+/**
+ * @file server.h
+ * @brief Long-running command server on a UNIX domain socket.
+ *
+ * The image is mounted once and shared by every client, so all clients
+ * benefit from the same warm caches. An epoll loop accepts connections
+ * and reads requests; complete requests are executed on a worker pool.
+ *
+ * Protocol: the client sends one CLI command per line (as accepted by
+ * process_command()). Commands may be pipelined. For every command the
+ * server answers with a header line "<status> <length>\n", where status
+ * is 0 on success and 1 on failure, followed by exactly <length> bytes
+ * of command output. "exit" or "quit" is answered with "0 0\n" and then
+ * the connection is closed. Each client has its own session (current
+ * directory); commands of different clients run in parallel.
+ */
+
+/** Longest accepted request line, in bytes. */
+#define SERVER_MAX_LINE 4096
+
+/** Opaque server. */
+typedef struct Server Server;
+
+/**
+ * @brief Creates a server listening on a UNIX domain socket.
+ *
+ * A stale socket file at @p socket_path is replaced.
+ *
+ * @param ctx Mounted FAT32 volume shared by all clients.
+ * @param socket_path Filesystem path of the socket.
+ * @param workers Number of worker threads (values < 1 select one per online CPU).
+ * @return New server, or NULL on failure.
+ */
+Server* server_create(Fat32Volume* ctx, const char* socket_path, int workers);
+
+/**
+ * @brief Runs the event loop until server_stop() is called.
+ *
+ * @param server Server.
+ * @return 0 on a clean stop, -1 on failure.
+ */
+int server_run(Server* server);
+
+/**
+ * @brief Asks a running server to stop.
+ *
+ * Async-signal-safe, so it may be called from a signal handler.
+ *
+ * @param server Server.
+ */
+void server_stop(Server* server);
+
+/**
+ * @brief Closes the socket, removes its file and frees the server.
+ *
+ * @param server Server (may be NULL).
+ */
+void server_destroy(Server* server);
+
+#endif // SERVER_H
@@ -0,0 +1,59 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/**
+ * @file thread_pool.h
+ * @brief Fixed-size worker thread pool used by bulk operations.
+ *
+ * Tasks are plain function pointers with an argument. Tasks may submit
+ * further tasks (e.g. a directory scan queuing its subdirectories), and
+ * thread_pool_wait() returns once the queue is empty and every worker
+ * is idle.
+ */
+
+/** Task function run by a worker thread. */
+typedef void (*ThreadPoolTask)(void* arg);
+
+/** Opaque thread pool. */
+typedef struct ThreadPool ThreadPool;
+
+/**
+ * @brief Creates a pool and starts its workers.
+ *
+ * @param threads Number of worker threads (values < 1 select one per online CPU).
+ * @return New pool, or NULL on failure.
+ */
+ThreadPool* thread_pool_create(int threads);
+
+/**
+ * @brief Queues a task.
+ *
+ * @param pool Thread pool.
+ * @param task Function to run.
+ * @param arg Argument passed to @p task.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int thread_pool_submit(ThreadPool* pool, ThreadPoolTask task, void* arg);
+
+/**
+ * @brief Blocks until all queued tasks, including ones they queued, have run.
+ *
+ * @param pool Thread pool.
+ */
+void thread_pool_wait(ThreadPool* pool);
+
+/**
+ * @brief Waits for outstanding tasks, stops the workers and frees the pool.
+ *
+ * @param pool Thread pool (may be NULL).
+ */
+void thread_pool_destroy(ThreadPool* pool);
+
+/**
+ * @brief Returns the number of online CPUs, clamped to [1, 64].
+ *
+ * @return Suggested worker count.
+ */
+int thread_pool_default_size(void);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,132 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "fat32.h"
+
+/**
+ * @file trace.h
+ * @brief Workload recorder and replay.
+ *
+ * A trace is a binary file: one TraceHeader followed by fixed-size
+ * TraceRecords. Command records are followed by the command text.
+ * Commands are recorded with their start time, duration and status.
+ * Device records describe every transfer against the image file: reads,
+ * writes and discards, with their byte offset and length. All values are
+ * in host byte order.
+ *
+ * Replay formats a fresh image with the recorded geometry and runs the
+ * recorded commands, either back to back or at their original pacing.
+ * Each recorded session gets a replay session of its own, so clients of
+ * a --serve recording keep their working directories. Commands that read
+ * or write host files are skipped. Replay reports throughput and the
+ * command latency distribution.
+ */
+
+#define TRACE_MAGIC "F32TRACE"  /**< First bytes of a trace file */
+#define TRACE_VERSION 2         /**< Current trace format (2 added TraceRecord.session) */
+
+/** Record types */
+#define TRACE_COMMAND 1  /**< CLI command; TraceRecord.text_len bytes of text follow */
+#define TRACE_READ 2     /**< Image bytes read */
+#define TRACE_WRITE 3    /**< Image bytes written */
+#define TRACE_DISCARD 4  /**< Image bytes discarded (hole punched) */
+
+/**
+ * @brief Start of a trace file.
+ */
+typedef struct {
+    char magic[8];          /**< TRACE_MAGIC without the terminator */
+    uint32_t version;       /**< TRACE_VERSION */
+    uint32_t cluster_size;  /**< Cluster size of the volume when recording started (0 if unformatted) */
+    uint64_t volume_size;   /**< Volume size in bytes when recording started (0 if unformatted) */
+    uint64_t start_time;    /**< Wall-clock start, nanoseconds since the epoch */
+} TraceHeader;
+
+/**
+ * @brief One recorded event (32 bytes).
+ */
+typedef struct {
+    uint8_t type;           /**< TRACE_* record type */
+    uint8_t status;         /**< Command status (0 success, 1 failure) */
+    uint16_t text_len;      /**< Length of the command text that follows */
+    uint32_t size;          /**< Bytes transferred, or command duration in microseconds */
+    uint64_t time;          /**< Nanoseconds since the start of the trace */
+    uint64_t offset;        /**< Image byte offset (device records) */
+    uint32_t session;       /**< Fat32Session.id that ran the command (command records) */
+    uint32_t reserved;      /**< Zero */
+} TraceRecord;
+
+/**
+ * @brief Result of a replay.
+ */
+typedef struct {
+    uint64_t commands;          /**< Commands replayed */
+    uint64_t failures;          /**< Commands that failed */
+    uint64_t skipped;           /**< Commands not replayed because they use host files */
+    double elapsed_ms;          /**< Wall time of the replay */
+    double latency_p50_ms;      /**< Median command latency */
+    double latency_p95_ms;      /**< 95th percentile command latency */
+    double latency_p99_ms;      /**< 99th percentile command latency */
+    double latency_max_ms;      /**< Slowest command */
+    double recorded_ms;         /**< Duration of the recorded workload */
+    uint64_t recorded_read;     /**< Bytes read in the recording */
+    uint64_t recorded_written;  /**< Bytes written in the recording */
+    Fat32Stats io;              /**< I/O counters of the replay */
+} TraceReport;
+
+/**
+ * @brief Starts recording to a new trace file.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param path Trace file to create (truncated if it exists).
+ * @return 0 on success, -1 on failure or if already recording.
+ */
+int trace_start(Fat32Volume* ctx, const char* path);
+
+/**
+ * @brief Stops recording and closes the trace file.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @return 0 on success, -1 if not recording or a write failed.
+ */
+int trace_stop(Fat32Volume* ctx);
+
+/**
+ * @brief Returns the current time on the trace clock.
+ *
+ * @return Monotonic time in nanoseconds.
+ */
+uint64_t trace_clock(void);
+
+/**
+ * @brief Records a device transfer (called by the I/O layer).
+ *
+ * @param ctx Pointer to FAT32 volume (must be recording).
+ * @param type TRACE_READ, TRACE_WRITE or TRACE_DISCARD.
+ * @param offset Image byte offset.
+ * @param size Number of bytes.
+ */
+void trace_io(Fat32Volume* ctx, int type, uint64_t offset, uint64_t size);
+
+/**
+ * @brief Records a finished command.
+ *
+ * @param session Session that ran the command (its volume must be recording).
+ * @param command Command text.
+ * @param start trace_clock() when the command started.
+ * @param status Command status.
+ */
+void trace_command(Fat32Session* session, const char* command, uint64_t start, int status);
+
+/**
+ * @brief Replays a trace against a fresh image.
+ *
+ * @param trace_path Trace file.
+ * @param image_path Image to create (replaced if it exists).
+ * @param paced Nonzero to start each command at its recorded time, zero to run back to back.
+ * @param report Output statistics.
+ * @return 0 on success, -1 if the trace or the image cannot be used.
+ */
+int trace_replay(const char* trace_path, const char* image_path, int paced, TraceReport* report);
+
+#endif // TRACE_H
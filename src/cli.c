@@ -6,57 +6,288 @@
  * filesystem operations on the FAT32 emulator.
  */
 
+#define _POSIX_C_SOURCE 200809L
 #include "fat32.h"
+#include "json_writer.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 
 /**
  * @brief Prints the CLI prompt showing the current directory.
  *
- * @param ctx Pointer to the FAT32 context containing the current path.
+ * @param session Session containing the current path.
  */
-void print_prompt(Fat32Context* ctx) {
-    printf("%s>", ctx->current_path);
+void print_prompt(Fat32Session* session) {
+    if (fat32_lock_shared(session->volume) == 0) {
+        fat32_session_cwd(session);  // Back at the root after a format or abort
+        fat32_unlock(session->volume);
+    }
+    printf("%s>", session->current_path);
     fflush(stdout);
 }
 
 /**
- * @brief Processes a single user command in the CLI.
+ * @brief Parses a byte count with an optional K, M, G or T suffix.
+ *
+ * @param text Input such as "512", "32K" or "4G".
+ * @param value Output number of bytes.
+ * @return 0 on success, -1 if the text is not a valid size.
+ */
+static int parse_size(const char* text, uint64_t* value) {
+    char* end;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (end == text) return -1;
+    
+    int shift = 0;
+    switch (*end) {
+        case '\0': break;
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        case 'T': case 't': shift = 40; end++; break;
+        default: return -1;
+    }
+    if (*end != '\0' || number > (UINT64_MAX >> shift)) return -1;
+    
+    *value = (uint64_t)number << shift;
+    return 0;
+}
+
+/**
+ * @brief Returns the stream command output goes to.
+ *
+ * @param session Session running the command.
+ * @return session->out, or stdout if none is set.
+ */
+static FILE* cli_out(Fat32Session* session) {
+    return fat32_session_out(session);
+}
+
+/**
+ * @brief Prints one directory entry name (fat32_ls_each() callback).
+ */
+static int print_ls_entry(const DirEntry* entry, void* arg) {
+    char name[13];
+    fat32_entry_name(entry, name);
+    return fprintf((FILE*)arg, "%s\n", name) < 0;
+}
+
+/**
+ * @brief Prints an error message, as an {"error": ...} record in JSON mode.
+ *
+ * @param session Session running the command.
+ * @param message Message text.
+ */
+static void report_error(Fat32Session* session, const char* message) {
+    FILE* out = cli_out(session);
+    if (!session->volume->json) {
+        fprintf(out, "%s\n", message);
+        return;
+    }
+    JsonWriter writer;
+    if (json_writer_init(&writer, out) != 0) return;
+    json_begin(&writer);
+    json_string(&writer, "error", message);
+    json_end(&writer);
+    json_writer_destroy(&writer);
+}
+
+/**
+ * @brief Returns the type name of a directory entry.
+ */
+static const char* entry_type(const DirEntry* entry) {
+    if (entry->attr & ATTR_VOLUME_ID) return "volume";
+    return (entry->attr & ATTR_DIRECTORY) ? "dir" : "file";
+}
+
+/**
+ * @brief Adds the fields describing a directory entry to the open record.
+ */
+static void json_entry_fields(JsonWriter* writer, const DirEntry* entry) {
+    char name[13];
+    fat32_entry_name(entry, name);
+    json_string(writer, "name", name);
+    json_string(writer, "type", entry_type(entry));
+    json_uint(writer, "size", entry->file_size);
+    json_uint(writer, "cluster", fat32_get_cluster_from_entry(entry));
+    json_uint(writer, "attr", entry->attr);
+}
+
+/**
+ * @brief Writes one listing entry as an NDJSON record (fat32_ls_each() callback).
+ */
+static int json_ls_entry(const DirEntry* entry, void* arg) {
+    JsonWriter* writer = arg;
+    json_begin(writer);
+    json_entry_fields(writer, entry);
+    json_end(writer);
+    return writer->error;
+}
+
+/**
+ * @brief Prints the entry of a path (stat command).
+ *
+ * @param session Session running the command.
+ * @param path Path to describe.
+ * @return 0 on success, -1 if the path does not exist.
+ */
+static int stat_command(Fat32Session* session, const char* path) {
+    Fat32Volume* ctx = session->volume;
+    FILE* out = cli_out(session);
+    DirEntry entry;
+    if (fat32_lock_shared(ctx) != 0) {
+        return -1;
+    }
+    if (fat32_stat(session, path, &entry) != 0) {
+        fat32_unlock(ctx);
+        return -1;
+    }
+    
+    uint32_t first = fat32_get_cluster_from_entry(&entry);
+    uint64_t clusters = 0;
+    Fat32Extent* extents;
+    uint32_t extent_count;
+    if (first >= 2 && fat32_chain_extents(ctx, first, UINT32_MAX, &extents, &extent_count) == 0) {
+        for (uint32_t i = 0; i < extent_count; i++) {
+            clusters += extents[i].count;
+        }
+        free(extents);
+    }
+    fat32_unlock(ctx);
+    
+    if (ctx->json) {
+        JsonWriter writer;
+        if (json_writer_init(&writer, out) != 0) return -1;
+        json_begin(&writer);
+        json_entry_fields(&writer, &entry);
+        json_uint(&writer, "clusters", clusters);
+        json_end(&writer);
+        return json_writer_destroy(&writer);
+    }
+    
+    char name[13];
+    fat32_entry_name(&entry, name);
+    fprintf(out, "name: %s\ntype: %s\nsize: %u\ncluster: %u\nclusters: %llu\n", name, entry_type(&entry),
+           entry.file_size, first, (unsigned long long)clusters);
+    return 0;
+}
+
+/**
+ * @brief Prints the volume geometry and I/O counters (stats command).
+ *
+ * @param session Session running the command.
+ * @return 0 on success, -1 on output failure.
+ */
+static int stats_command(Fat32Session* session) {
+    Fat32Volume* ctx = session->volume;
+    FILE* out = cli_out(session);
+    Fat32Stats io;
+    fat32_stats_get(ctx, &io);
+    if (fat32_lock_shared(ctx) != 0) {
+        return -1;
+    }
+    
+    const struct {
+        const char* key;
+        uint64_t value;
+    } fields[] = {
+        { "total_sectors", ctx->total_sectors },
+        { "cluster_size", ctx->cluster_size },
+        { "total_clusters", ctx->total_clusters },
+        { "fat_count", ctx->fat_count },
+        { "fat_size", ctx->fat_size },
+        { "data_start", ctx->data_start },
+        { "generation", ctx->generation },
+        { "sectors_read", io.sectors_read },
+        { "sectors_written", io.sectors_written },
+        { "syscalls", io.syscalls },
+        { "flushes", io.flushes },
+        { "cache_hits", io.cache_hits },
+        { "cache_misses", io.cache_misses },
+    };
+    size_t count = sizeof(fields) / sizeof(fields[0]);
+    fat32_unlock(ctx);
+    
+    if (!ctx->json) {
+        for (size_t i = 0; i < count; i++) {
+            fprintf(out, "%s: %llu\n", fields[i].key, (unsigned long long)fields[i].value);
+        }
+        return 0;
+    }
+    
+    JsonWriter writer;
+    if (json_writer_init(&writer, out) != 0) return -1;
+    json_begin(&writer);
+    for (size_t i = 0; i < count; i++) {
+        json_uint(&writer, fields[i].key, fields[i].value);
+    }
+    json_end(&writer);
+    return json_writer_destroy(&writer);
+}
+
+/**
+ * @brief Runs a single CLI command and reports whether it succeeded.
  *
  * Supported commands:
- * - format : formats the disk image with FAT32
- * - ls [path] : lists directory contents
+ * - format [size] [cluster] : formats the disk image with FAT32 (e.g. format 4G 32K)
+ * - ls [path] : lists directory contents (NDJSON records in JSON mode)
+ * - stat <path> : describes one file or directory
+ * - stats : prints the volume geometry and I/O counters
  * - mkdir <name> : creates a new directory
  * - touch <name> : creates a new empty file
  * - cd <path> : changes the current working directory
+ * - mv <old_path> <new_path> : renames or moves a file or directory
+ * - put <host_path> <image_path> : copies a host file into the image
+ * - get <image_path> <host_path> : copies a file from the image to the host
+ * - import <host_dir> <image_dir> : copies a host directory tree into the image
+ * - export-tar <image_dir> <out|-> : writes a directory tree as a tar archive
+ * - clone <count> <dir> : makes copies of the image (reflinks where supported)
+ * - begin : keeps the session's following writes in memory until commit; other sessions may only read
+ * - commit : writes the session's transaction in one sorted pass and syncs the image
+ * - abort : discards the session's transaction
+ * - profile <on|off> : prints timing and I/O counters after every command
  * - exit / quit : exits the CLI
  *
- * @param ctx Pointer to the FAT32 context.
+ * @param session Session running the command.
  * @param command Null-terminated string containing the user command.
+ * @param status Set to 0 if the command succeeded, 1 if it failed or was rejected.
  * @return 0 on success, -1 on exit or error.
  */
-int process_command(Fat32Context* ctx, const char* command) {
+static int dispatch_command(Fat32Session* session, const char* command, int* status) {
+    Fat32Volume* ctx = session->volume;
     char cmd[256];
     char arg1[256] = {0};
     char arg2[256] = {0};
+    FILE* out = cli_out(session);
     
+    *status = 0;
     int parsed = sscanf(command, "%255s %255s %255s", cmd, arg1, arg2);
     
-    if (parsed == 0) {
+    if (parsed <= 0) {
         return 0; /**< Empty command */
     }
     
     if (strcmp(cmd, "format") == 0) {
-        if (fat32_format(ctx) == 0) {
-            printf("Ok\n");
+        uint64_t size = 0, cluster_size = 0;
+        if ((arg1[0] != '\0' && parse_size(arg1, &size) != 0) ||
+            (arg2[0] != '\0' && (parse_size(arg2, &cluster_size) != 0 || cluster_size > UINT32_MAX))) {
+            fprintf(out, "Usage: format [size] [cluster]\n");
+            *status = 1;
+        } else if (fat32_format_opts(ctx, size, (uint32_t)cluster_size) == 0) {
+            fprintf(out, "Ok\n");
         } else {
-            printf("Format failed\n");
+            fprintf(out, "Format failed\n");
+            *status = 1;
         }
     }
     else if (strcmp(cmd, "ls") == 0) {
-        if (fat32_is_valid(ctx) != 0) {
-            printf("Unknown disk format\n");
+        if (!fat32_is_mounted(ctx)) {
+            report_error(session, "Unknown disk format");
+            *status = 1;
             return -1;
         }
         
@@ -65,58 +296,476 @@ int process_command(Fat32Context* ctx, const char* command) {
             path = arg1;
         }
         
-        if (fat32_ls(ctx, path) != 0) {
-            printf("ls failed\n");
+        int listed;
+        if (ctx->json) {
+            JsonWriter writer;
+            listed = json_writer_init(&writer, out);
+            if (listed == 0) {
+                listed = fat32_ls_each(session, path, json_ls_entry, &writer);
+                if (json_writer_destroy(&writer) != 0) listed = -1;
+            }
+        } else {
+            listed = fat32_ls_each(session, path, print_ls_entry, out);
+        }
+        if (listed != 0) {
+            report_error(session, "ls failed");
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "stat") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            report_error(session, "Unknown disk format");
+            *status = 1;
+            return -1;
+        }
+        
+        if (arg1[0] == '\0') {
+            fprintf(out, "Usage: stat <path>\n");
+            *status = 1;
+        } else if (stat_command(session, arg1) != 0) {
+            report_error(session, "stat failed");
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "stats") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            report_error(session, "Unknown disk format");
+            *status = 1;
+            return -1;
+        }
+        
+        if (stats_command(session) != 0) {
+            report_error(session, "stats failed");
+            *status = 1;
         }
     }
     else if (strcmp(cmd, "mkdir") == 0) {
-        if (fat32_is_valid(ctx) != 0) {
-            printf("Unknown disk format\n");
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
             return -1;
         }
         
         if (arg1[0] == '\0') {
-            printf("Usage: mkdir <name>\n");
-        } else if (fat32_mkdir(ctx, arg1) == 0) {
-            printf("Ok\n");
+            fprintf(out, "Usage: mkdir <name>\n");
+            *status = 1;
+        } else if (fat32_mkdir(session, arg1) == 0) {
+            fprintf(out, "Ok\n");
         } else {
-            printf("mkdir failed\n");
+            fprintf(out, "mkdir failed\n");
+            *status = 1;
         }
     }
     else if (strcmp(cmd, "touch") == 0) {
-        if (fat32_is_valid(ctx) != 0) {
-            printf("Unknown disk format\n");
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
             return -1;
         }
         
         if (arg1[0] == '\0') {
-            printf("Usage: touch <name>\n");
-        } else if (fat32_touch(ctx, arg1) == 0) {
-            printf("Ok\n");
+            fprintf(out, "Usage: touch <name>\n");
+            *status = 1;
+        } else if (fat32_touch(session, arg1) == 0) {
+            fprintf(out, "Ok\n");
         } else {
-            printf("touch failed\n");
+            fprintf(out, "touch failed\n");
+            *status = 1;
         }
     }
     else if (strcmp(cmd, "cd") == 0) {
-        if (fat32_is_valid(ctx) != 0) {
-            printf("Unknown disk format\n");
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
             return -1;
         }
         
         if (arg1[0] == '\0') {
-            printf("Usage: cd <path>\n");
-        } else if (fat32_cd(ctx, arg1) == 0) {
+            fprintf(out, "Usage: cd <path>\n");
+            *status = 1;
+        } else if (fat32_cd(session, arg1) == 0) {
             /**< Successfully changed directory, no message needed */
         } else {
-            printf("cd failed\n");
+            fprintf(out, "cd failed\n");
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "mv") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
+            return -1;
+        }
+        
+        if (arg1[0] == '\0' || arg2[0] == '\0') {
+            fprintf(out, "Usage: mv <old_path> <new_path>\n");
+            *status = 1;
+        } else if (fat32_rename(session, arg1, arg2) == 0) {
+            fprintf(out, "Ok\n");
+        } else {
+            fprintf(out, "mv failed\n");
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "put") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
+            return -1;
+        }
+        
+        if (arg1[0] == '\0' || arg2[0] == '\0') {
+            fprintf(out, "Usage: put <host_path> <image_path>\n");
+            *status = 1;
+        } else if (fat32_put(session, arg1, arg2) == 0) {
+            fprintf(out, "Ok\n");
+        } else {
+            fprintf(out, "put failed\n");
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "get") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
+            return -1;
+        }
+        
+        if (arg1[0] == '\0' || arg2[0] == '\0') {
+            fprintf(out, "Usage: get <image_path> <host_path>\n");
+            *status = 1;
+        } else if (fat32_get(session, arg1, arg2) == 0) {
+            fprintf(out, "Ok\n");
+        } else {
+            fprintf(out, "get failed\n");
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "import") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
+            return -1;
+        }
+        
+        if (arg1[0] == '\0' || arg2[0] == '\0') {
+            fprintf(out, "Usage: import <host_dir> <image_dir>\n");
+            *status = 1;
+        } else if (fat32_import(session, arg1, arg2) == 0) {
+            fprintf(out, "Ok\n");
+        } else {
+            fprintf(out, "import failed\n");
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "export-tar") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
+            return -1;
+        }
+        
+        if (arg1[0] == '\0' || arg2[0] == '\0' || (strcmp(arg2, "-") == 0 && session->out)) {
+            fprintf(out, "Usage: export-tar <image_dir> <out|->\n");  /**< "-" needs the real stdout */
+            *status = 1;
+        } else if (fat32_export_tar(session, arg1, arg2) != 0) {
+            fprintf(stderr, "export-tar failed\n");
+            *status = 1;
+        } else if (strcmp(arg2, "-") != 0) {
+            fprintf(out, "Ok\n");  /**< No status on stdout when it carries the archive */
+        }
+    }
+    else if (strcmp(cmd, "clone") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
+            return -1;
+        }
+        
+        char* end;
+        unsigned long count = strtoul(arg1, &end, 10);
+        if (arg1[0] == '\0' || *end != '\0' || count == 0 || count > UINT32_MAX || arg2[0] == '\0') {
+            fprintf(out, "Usage: clone <count> <dir>\n");
+            *status = 1;
+        } else {
+            int locked = fat32_lock_exclusive(ctx) == 0;  /**< No session writes while the image is copied */
+            if (locked && ctx->txn) {
+                fprintf(out, "Commit or abort the transaction first\n");  /**< Copies would miss it */
+                *status = 1;
+            } else if (locked && fat32_provision(ctx->disk_path, (uint32_t)count, arg2) == 0) {
+                fprintf(out, "Ok\n");
+            } else {
+                fprintf(out, "clone failed\n");
+                *status = 1;
+            }
+            if (locked) fat32_unlock(ctx);
+        }
+    }
+    else if (strcmp(cmd, "begin") == 0) {
+        if (!fat32_is_mounted(ctx)) {
+            fprintf(out, "Unknown disk format\n");
+            *status = 1;
+            return -1;
+        }
+        
+        if (fat32_begin(session) == 0) {
+            fprintf(out, "Ok\n");
+        } else {
+            fprintf(out, "begin failed\n");
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "commit") == 0 || strcmp(cmd, "abort") == 0) {
+        if (!fat32_in_txn(session)) {
+            fprintf(out, "No open transaction\n");
+            *status = 1;
+        } else if ((cmd[0] == 'c' ? fat32_commit(session) : fat32_abort(session)) == 0) {
+            fprintf(out, "Ok\n");
+        } else {
+            fprintf(out, "%s failed\n", cmd);
+            *status = 1;
+        }
+    }
+    else if (strcmp(cmd, "profile") == 0) {
+        if (strcmp(arg1, "on") == 0 || strcmp(arg1, "off") == 0) {
+            __atomic_store_n(&ctx->profiling, arg1[1] == 'n', __ATOMIC_RELAXED);  /**< Shared by all sessions */
+        } else {
+            fprintf(out, "Usage: profile <on|off>\n");
+            *status = 1;
         }
     }
     else if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0) {
         return -1; /**< Signal to exit CLI */
     }
     else {
-        printf("Unknown command: %s\n", cmd);
+        fprintf(out, "Unknown command: %s\n", cmd);
+        *status = 1;
     }
     
     return 0; /**< Command processed successfully */
 }
+
+/**
+ * @brief Milliseconds between two timestamps.
+ */
+static double elapsed_ms(const struct timespec* start, const struct timespec* end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e3 + (double)(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * @brief Formats a cache hit ratio ("n/a" without lookups).
+ */
+static const char* hit_ratio(const Fat32Stats* io, char* text, size_t size) {
+    uint64_t lookups = io->cache_hits + io->cache_misses;
+    if (lookups == 0) {
+        snprintf(text, size, "n/a");
+    } else {
+        snprintf(text, size, "%.1f%%", 100.0 * (double)io->cache_hits / (double)lookups);
+    }
+    return text;
+}
+
+/**
+ * @brief Adds one profiled command to the per-command totals.
+ *
+ * @param ctx Pointer to the FAT32 volume.
+ * @param name Command name.
+ * @param wall_ms Wall-clock time of the command.
+ * @param cpu_ms Process CPU time of the command.
+ * @param io I/O counters of the command.
+ */
+static void profile_record(Fat32Volume* ctx, const char* name, double wall_ms, double cpu_ms,
+                           const Fat32Stats* io) {
+    Fat32ProfileRow* row = NULL;
+    pthread_mutex_lock(&ctx->profile_lock);  /**< Sessions finish commands concurrently */
+    for (uint32_t i = 0; i < ctx->profile_rows; i++) {
+        if (strcmp(ctx->profile[i].command, name) == 0) {
+            row = &ctx->profile[i];
+            break;
+        }
+    }
+    if (!row) {
+        Fat32ProfileRow* rows = realloc(ctx->profile, (ctx->profile_rows + 1) * sizeof(Fat32ProfileRow));
+        if (!rows) {
+            pthread_mutex_unlock(&ctx->profile_lock);
+            return;
+        }
+        ctx->profile = rows;
+        row = &rows[ctx->profile_rows++];
+        memset(row, 0, sizeof(Fat32ProfileRow));
+        snprintf(row->command, sizeof(row->command), "%s", name);
+    }
+    
+    row->calls++;
+    row->wall_ms += wall_ms;
+    row->cpu_ms += cpu_ms;
+    row->io.sectors_read += io->sectors_read;
+    row->io.sectors_written += io->sectors_written;
+    row->io.syscalls += io->syscalls;
+    row->io.flushes += io->flushes;
+    row->io.cache_hits += io->cache_hits;
+    row->io.cache_misses += io->cache_misses;
+    pthread_mutex_unlock(&ctx->profile_lock);
+}
+
+/**
+ * @brief Runs a single CLI command, profiling it while profiling is on.
+ *
+ * The command's wall time, CPU time and I/O counters are printed to
+ * stderr (stdout may carry command output such as a tar stream) and
+ * added to the per-command totals.
+ *
+ * @param session Session running the command.
+ * @param command Null-terminated string containing the user command.
+ * @param status Set to 0 if the command succeeded, 1 if it failed or was rejected.
+ * @return 0 on success, -1 on exit or error.
+ */
+static int profile_command(Fat32Session* session, const char* command, int* status) {
+    Fat32Volume* ctx = session->volume;
+    char name[16];
+    if (!__atomic_load_n(&ctx->profiling, __ATOMIC_RELAXED) || sscanf(command, "%15s", name) != 1) {
+        return dispatch_command(session, command, status);
+    }
+    
+    struct timespec wall_start, wall_end, cpu_start, cpu_end;
+    Fat32Stats before, after, io;
+    fat32_stats_get(ctx, &before);
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    
+    int ret = dispatch_command(session, command, status);
+    
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    fat32_stats_get(ctx, &after);
+    io.sectors_read = after.sectors_read - before.sectors_read;
+    io.sectors_written = after.sectors_written - before.sectors_written;
+    io.syscalls = after.syscalls - before.syscalls;
+    io.flushes = after.flushes - before.flushes;
+    io.cache_hits = after.cache_hits - before.cache_hits;
+    io.cache_misses = after.cache_misses - before.cache_misses;
+    
+    double wall_ms = elapsed_ms(&wall_start, &wall_end);
+    double cpu_ms = elapsed_ms(&cpu_start, &cpu_end);
+    char ratio[16];
+    fflush(cli_out(session));
+    fprintf(stderr, "[profile] %s: wall %.3f ms, cpu %.3f ms, sectors %llu read / %llu written, "
+            "%llu syscalls, %llu flushes, cache hits %s\n", name, wall_ms, cpu_ms,
+            (unsigned long long)io.sectors_read, (unsigned long long)io.sectors_written,
+            (unsigned long long)io.syscalls, (unsigned long long)io.flushes,
+            hit_ratio(&io, ratio, sizeof(ratio)));
+    profile_record(ctx, name, wall_ms, cpu_ms, &io);
+    return ret;
+}
+
+/**
+ * @brief Executes a single CLI command and reports whether it succeeded.
+ *
+ * Profiles the command while profiling is on (see profile_command()) and
+ * appends it to the trace while recording.
+ *
+ * @param session Session running the command.
+ * @param command Null-terminated string containing the user command.
+ * @param status Set to 0 if the command succeeded, 1 if it failed or was rejected.
+ * @return 0 on success, -1 on exit or error.
+ */
+int execute_command(Fat32Session* session, const char* command, int* status) {
+    Fat32Volume* ctx = session->volume;
+    if (!ctx->trace || command[strspn(command, " \t")] == '\0') {
+        return profile_command(session, command, status);
+    }
+    
+    uint64_t start = trace_clock();
+    int ret = profile_command(session, command, status);
+    trace_command(session, command, start, *status);
+    return ret;
+}
+
+/**
+ * @brief Prints the per-command profile totals as a table on stderr.
+ *
+ * Prints nothing if no command was profiled.
+ *
+ * @param ctx Pointer to the FAT32 volume.
+ */
+void print_profile_summary(Fat32Volume* ctx) {
+    pthread_mutex_lock(&ctx->profile_lock);
+    if (ctx->profile_rows == 0) {
+        pthread_mutex_unlock(&ctx->profile_lock);
+        return;
+    }
+    
+    char ratio[16];
+    fprintf(stderr, "%-12s %8s %12s %12s %10s %10s %10s %8s %8s\n", "command", "calls", "wall ms",
+            "cpu ms", "sect rd", "sect wr", "syscalls", "flushes", "cache");
+    for (uint32_t i = 0; i < ctx->profile_rows; i++) {
+        const Fat32ProfileRow* row = &ctx->profile[i];
+        fprintf(stderr, "%-12s %8llu %12.3f %12.3f %10llu %10llu %10llu %8llu %8s\n", row->command,
+                (unsigned long long)row->calls, row->wall_ms, row->cpu_ms,
+                (unsigned long long)row->io.sectors_read, (unsigned long long)row->io.sectors_written,
+                (unsigned long long)row->io.syscalls, (unsigned long long)row->io.flushes,
+                hit_ratio(&row->io, ratio, sizeof(ratio)));
+    }
+    pthread_mutex_unlock(&ctx->profile_lock);
+}
+
+/**
+ * @brief Processes a single user command in the CLI.
+ *
+ * Same as execute_command() for callers that do not need the status.
+ *
+ * @param session Session running the command.
+ * @param command Null-terminated string containing the user command.
+ * @return 0 on success, -1 on exit or error.
+ */
+int process_command(Fat32Session* session, const char* command) {
+    int status;
+    return execute_command(session, command, &status);
+}
+
+/**
+ * @brief Runs every command of a script in one session.
+ *
+ * Blank lines and lines starting with '#' are skipped, and no prompt is
+ * printed. Stops early at exit / quit.
+ *
+ * @param session Session to run the commands in.
+ * @param script Script path, or "-" for stdin.
+ * @param print_status Nonzero to print "status <0|1>" after each command.
+ * @param stop_on_error Nonzero to stop at the first failing command.
+ * @return Number of failed commands, or -1 if the script cannot be read.
+ */
+int run_batch(Fat32Session* session, const char* script, int print_status, int stop_on_error) {
+    FILE* in = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+    if (!in) return -1;
+    
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int failures = 0;
+    while ((len = getline(&line, &line_cap, in)) >= 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        
+        const char* command = line + strspn(line, " \t");
+        if (command[0] == '\0' || command[0] == '#') {
+            continue;
+        }
+        
+        int status;
+        int ret = execute_command(session, command, &status);
+        if (print_status) {
+            printf("status %d\n", status);
+        }
+        if (status != 0) {
+            failures++;
+            if (stop_on_error) break;
+        } else if (ret == -1) {
+            break;  // exit / quit
+        }
+    }
+    
+    free(line);
+    if (in != stdin) fclose(in);
+    fflush(stdout);
+    return failures;
+}
@@ -4,107 +4,765 @@
  *
  * This module provides functions to read and write sectors and clusters
  * on the FAT32 disk image, as well as functions to manipulate the FAT table.
+ * All transfers use positional I/O on the image's descriptor, so no
+ * seek state or stdio buffer sits between the callers and the file.
+ * When the image is memory-mapped (fat32_map_image()), transfers that fall
+ * inside the mapping are plain memory copies instead. Apart from the
+ * transaction entry points, nothing here takes the volume or directory
+ * locks: callers hold them (see lock.c). FAT updates take the allocator
+ * lock themselves, since they rewrite whole sectors that other chains
+ * share.
  */
 
+#define _GNU_SOURCE
 #include "fat32.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Updates the known-zero bits of the clusters in a byte range.
+ *
+ * With @p zero set, only clusters lying entirely inside the range are
+ * marked; otherwise every cluster the range touches loses its bit. Bits
+ * are updated atomically because pool workers write concurrently.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param offset Byte offset within the image.
+ * @param size Number of bytes.
+ * @param zero Nonzero to mark the clusters as zero, zero to mark them written.
+ */
+static void zero_map_update(Fat32Volume* ctx, uint64_t offset, uint64_t size, int zero) {
+    uint64_t data = (uint64_t)ctx->data_start << SECTOR_SHIFT;
+    if (!ctx->zero_map || size == 0 || offset + size <= data) return;
+    if (zero && ctx->txn) return;  // An abort would leave the bits wrong
+    
+    uint64_t start = offset > data ? offset - data : 0;
+    uint64_t end = offset + size - data;
+    uint64_t first = zero ? (start + ctx->cluster_mask) >> ctx->cluster_shift : start >> ctx->cluster_shift;
+    uint64_t last = zero ? end >> ctx->cluster_shift : (end + ctx->cluster_mask) >> ctx->cluster_shift;  // exclusive
+    if (last > ctx->total_clusters) last = ctx->total_clusters;
+    
+    for (uint64_t i = first; i < last; i++) {
+        uint64_t bit = i + 2;
+        uint8_t mask = (uint8_t)(1u << (bit & 7));
+        if (zero) {
+            __atomic_fetch_or(&ctx->zero_map[bit >> 3], mask, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(&ctx->zero_map[bit >> 3], (uint8_t)~mask, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Sectors written inside a transaction.
+ *
+ * Sector images are appended to one growing array; an open-addressing
+ * table maps sector numbers to their slot.
+ */
+struct Fat32Txn {
+    pthread_mutex_t lock;   /**< Pool workers write concurrently */
+    uint32_t* sectors;      /**< Sector number of each slot */
+    uint8_t* data;          /**< SECTOR_SIZE bytes per slot */
+    uint32_t count;         /**< Slots in use */
+    uint32_t cap;           /**< Slots allocated */
+    uint32_t* table;        /**< Slot + 1 per bucket (0 marks an empty bucket) */
+    uint32_t table_mask;    /**< Number of buckets - 1 */
+    int failed;             /**< Set by the first failed write; the transaction can only be aborted */
+};
+
+/**
+ * @brief Reads or writes a whole buffer at an absolute image offset.
+ *
+ * Short transfers are retried until the buffer is done. Open
+ * transactions are bypassed.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param offset Byte offset within the image.
+ * @param buffer Data buffer.
+ * @param size Number of bytes.
+ * @param write Nonzero to write, zero to read.
+ * @return 0 on success, -1 on failure.
+ */
+static int device_transfer(Fat32Volume* ctx, uint64_t offset, void* buffer, size_t size, int write) {
+    int fd = fileno(ctx->disk_file);
+    uint8_t* buf = (uint8_t*)buffer;
+    
+    if (write) {
+        zero_map_update(ctx, offset, size, 0);
+    }
+    fat32_count(write ? &ctx->stats.sectors_written : &ctx->stats.sectors_read,
+                (size + SECTOR_SIZE - 1) >> SECTOR_SHIFT);
+    if (ctx->trace) {
+        trace_io(ctx, write ? TRACE_WRITE : TRACE_READ, offset, size);
+    }
+    
+    if (ctx->map && offset + size <= ctx->map_size) {
+        if (write) {
+            memcpy(ctx->map + offset, buf, size);
+        } else {
+            memcpy(buf, ctx->map + offset, size);
+        }
+        return 0;
+    }
+    
+    while (size > 0) {
+        ssize_t n = write ? pwrite(fd, buf, size, (off_t)offset) : pread(fd, buf, size, (off_t)offset);
+        fat32_count(&ctx->stats.syscalls, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        offset += (uint64_t)n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the bucket of a sector in the transaction table.
+ */
+static uint32_t txn_bucket(const Fat32Txn* txn, uint32_t sector) {
+    return (sector * 2654435761u) & txn->table_mask;
+}
+
+/**
+ * @brief Looks up the buffered image of a sector.
+ *
+ * @param txn Transaction (lock held).
+ * @param sector Sector number.
+ * @return Sector data, or NULL if the sector was not written.
+ */
+static uint8_t* txn_find(Fat32Txn* txn, uint32_t sector) {
+    for (uint32_t b = txn_bucket(txn, sector); txn->table[b] != 0; b = (b + 1) & txn->table_mask) {
+        uint32_t slot = txn->table[b] - 1;
+        if (txn->sectors[slot] == sector) {
+            return txn->data + ((size_t)slot << SECTOR_SHIFT);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Doubles the slot arrays and rebuilds the table at twice the slots.
+ *
+ * @param txn Transaction (lock held).
+ * @return 0 on success, -1 on allocation failure or when the size limit is reached.
+ */
+static int txn_grow(Fat32Txn* txn) {
+    uint32_t cap = txn->cap ? txn->cap * 2 : 64;
+    if (cap > FAT32_TXN_MAX_SECTORS) return -1;
+    
+    uint32_t* sectors = realloc(txn->sectors, cap * sizeof(uint32_t));
+    if (!sectors) return -1;
+    txn->sectors = sectors;
+    uint8_t* data = realloc(txn->data, (size_t)cap << SECTOR_SHIFT);
+    if (!data) return -1;
+    txn->data = data;
+    uint32_t* table = calloc((size_t)cap * 2, sizeof(uint32_t));
+    if (!table) return -1;
+    
+    free(txn->table);
+    txn->table = table;
+    txn->table_mask = cap * 2 - 1;
+    txn->cap = cap;
+    for (uint32_t slot = 0; slot < txn->count; slot++) {
+        uint32_t b = txn_bucket(txn, txn->sectors[slot]);
+        while (txn->table[b] != 0) b = (b + 1) & txn->table_mask;
+        txn->table[b] = slot + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Records a write in the open transaction.
+ *
+ * Sectors only partly covered by the write start from their current
+ * image contents. Clusters written here lose their known-zero bits right
+ * away; bits are never set during a transaction, so an abort cannot
+ * leave a cluster wrongly marked as zero.
+ *
+ * An operation that fails here has usually written part of its changes
+ * already (say, allocated clusters but no directory entry). The first
+ * failure therefore marks the transaction failed: later writes fail
+ * too, and fat32_commit() refuses it.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param offset Byte offset within the image.
+ * @param buffer Data to write.
+ * @param size Number of bytes.
+ * @return 0 on success, -1 on failure (including a full or failed transaction).
+ */
+static int txn_write(Fat32Volume* ctx, uint64_t offset, const uint8_t* buffer, size_t size) {
+    Fat32Txn* txn = ctx->txn;
+    int result = 0;
+    
+    pthread_mutex_lock(&txn->lock);
+    if (txn->failed) {
+        pthread_mutex_unlock(&txn->lock);
+        return -1;
+    }
+    zero_map_update(ctx, offset, size, 0);
+    while (size > 0) {
+        uint32_t sector = (uint32_t)(offset >> SECTOR_SHIFT);
+        size_t start = (size_t)(offset & (SECTOR_SIZE - 1));
+        size_t chunk = SECTOR_SIZE - start < size ? SECTOR_SIZE - start : size;
+        
+        uint8_t* data = txn_find(txn, sector);
+        if (!data) {
+            if (txn->count == txn->cap && txn_grow(txn) != 0) {
+                result = -1;
+                break;
+            }
+            data = txn->data + ((size_t)txn->count << SECTOR_SHIFT);
+            if (chunk < SECTOR_SIZE &&
+                device_transfer(ctx, (uint64_t)sector << SECTOR_SHIFT, data, SECTOR_SIZE, 0) != 0) {
+                result = -1;
+                break;
+            }
+            uint32_t b = txn_bucket(txn, sector);
+            while (txn->table[b] != 0) b = (b + 1) & txn->table_mask;
+            txn->table[b] = txn->count + 1;
+            txn->sectors[txn->count++] = sector;
+        }
+        memcpy(data + start, buffer, chunk);
+        buffer += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    if (result != 0) {
+        txn->failed = 1;
+    }
+    pthread_mutex_unlock(&txn->lock);
+    return result;
+}
+
+/**
+ * @brief Reads from the image and overlays sectors written in the open transaction.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param offset Byte offset within the image.
+ * @param buffer Destination buffer.
+ * @param size Number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+static int txn_read(Fat32Volume* ctx, uint64_t offset, uint8_t* buffer, size_t size) {
+    if (device_transfer(ctx, offset, buffer, size, 0) != 0) {
+        return -1;
+    }
+    
+    Fat32Txn* txn = ctx->txn;
+    pthread_mutex_lock(&txn->lock);
+    if (txn->count > 0) {
+        uint64_t end = offset + size;
+        for (uint64_t sector = offset >> SECTOR_SHIFT; (sector << SECTOR_SHIFT) < end; sector++) {
+            const uint8_t* data = txn_find(txn, (uint32_t)sector);
+            if (!data) continue;
+            
+            uint64_t from = sector << SECTOR_SHIFT > offset ? sector << SECTOR_SHIFT : offset;
+            uint64_t to = (sector + 1) << SECTOR_SHIFT < end ? (sector + 1) << SECTOR_SHIFT : end;
+            memcpy(buffer + (from - offset), data + (from & (SECTOR_SIZE - 1)), (size_t)(to - from));
+        }
+    }
+    pthread_mutex_unlock(&txn->lock);
+    return 0;
+}
+
+/**
+ * @brief Reads or writes a whole buffer at an absolute image offset.
+ *
+ * Inside a transaction, writes are kept in memory and reads see them.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param offset Byte offset within the image.
+ * @param buffer Data buffer.
+ * @param size Number of bytes.
+ * @param write Nonzero to write, zero to read.
+ * @return 0 on success, -1 on failure.
+ */
+static int transfer_at(Fat32Volume* ctx, uint64_t offset, void* buffer, size_t size, int write) {
+    if (ctx->txn) {
+        return write ? txn_write(ctx, offset, buffer, size) : txn_read(ctx, offset, buffer, size);
+    }
+    return device_transfer(ctx, offset, buffer, size, write);
+}
+
+/**
+ * @brief Reads or writes a list of buffers at an absolute image offset.
+ *
+ * Uses one preadv()/pwritev() call per FAT32_IOV_MAX segments and
+ * resumes after short transfers.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param offset Byte offset within the image.
+ * @param iov Segments to transfer, in order.
+ * @param iovcnt Number of segments.
+ * @param write Nonzero to write, zero to read.
+ * @return 0 on success, -1 on failure.
+ */
+static int transfer_vector_at(Fat32Volume* ctx, uint64_t offset, const struct iovec* iov, int iovcnt, int write) {
+    int fd = fileno(ctx->disk_file);
+    struct iovec local[FAT32_IOV_MAX];
+    
+    if (ctx->txn) {
+        for (int i = 0; i < iovcnt; i++) {
+            if (transfer_at(ctx, offset, iov[i].iov_base, iov[i].iov_len, write) != 0) {
+                return -1;
+            }
+            offset += iov[i].iov_len;
+        }
+        return 0;
+    }
+    
+    if (write) {
+        uint64_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+        zero_map_update(ctx, offset, total, 0);
+    }
+    
+    if (ctx->map) {
+        uint64_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+        if (offset + total <= ctx->map_size) {
+            for (int i = 0; i < iovcnt; i++) {
+                if (transfer_at(ctx, offset, iov[i].iov_base, iov[i].iov_len, write) != 0) {
+                    return -1;
+                }
+                offset += iov[i].iov_len;
+            }
+            return 0;
+        }
+    }
+    
+    uint64_t bytes = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        bytes += iov[i].iov_len;
+    }
+    fat32_count(write ? &ctx->stats.sectors_written : &ctx->stats.sectors_read,
+                (bytes + SECTOR_SIZE - 1) >> SECTOR_SHIFT);
+    if (ctx->trace) {
+        trace_io(ctx, write ? TRACE_WRITE : TRACE_READ, offset, bytes);
+    }
+    
+    while (iovcnt > 0) {
+        int count = iovcnt < FAT32_IOV_MAX ? iovcnt : FAT32_IOV_MAX;
+        memcpy(local, iov, count * sizeof(struct iovec));
+        
+        struct iovec* cur = local;
+        int left = count;
+        while (left > 0) {
+            ssize_t n = write ? pwritev(fd, cur, left, (off_t)offset) : preadv(fd, cur, left, (off_t)offset);
+            fat32_count(&ctx->stats.syscalls, 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            offset += (uint64_t)n;
+            
+            // Skip the fully transferred segments and trim a partial one
+            while (left > 0 && (size_t)n >= cur->iov_len) {
+                n -= (ssize_t)cur->iov_len;
+                cur++;
+                left--;
+            }
+            if (left > 0) {
+                cur->iov_base = (uint8_t*)cur->iov_base + n;
+                cur->iov_len -= (size_t)n;
+            }
+        }
+        iov += count;
+        iovcnt -= count;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sizes a freshly created, empty image file.
+ *
+ * By default the file is only extended with ftruncate(), which leaves it
+ * sparse: no data blocks are written and unwritten ranges read as zeros.
+ * With @p preallocate the blocks are reserved up front with
+ * posix_fallocate() so later writes cannot fail for lack of host space.
+ * Either way the cost does not depend on the image size.
+ *
+ * @param ctx Pointer to FAT32 volume (disk_file open for writing).
+ * @param size Image size in bytes.
+ * @param preallocate Nonzero to reserve host blocks for the whole image.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_create_image(Fat32Volume* ctx, uint64_t size, int preallocate) {
+    if (!ctx || !ctx->disk_file) return -1;
+    
+    int fd = fileno(ctx->disk_file);
+    fat32_count(&ctx->stats.syscalls, preallocate ? 2 : 1);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        return -1;
+    }
+    if (preallocate && posix_fallocate(fd, 0, (off_t)size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the current size of the image file.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @return Size in bytes, or 0 on failure.
+ */
+uint64_t fat32_image_size(Fat32Volume* ctx) {
+    struct stat st;
+    if (!ctx || !ctx->disk_file || fstat(fileno(ctx->disk_file), &st) != 0) {
+        return 0;
+    }
+    return (uint64_t)st.st_size;
+}
+
+/**
+ * @brief Changes the size of an existing image file.
+ *
+ * Growing leaves the new range sparse. A live mapping is replaced with
+ * one covering the new size.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param size New image size in bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_resize_image(Fat32Volume* ctx, uint64_t size) {
+    if (!ctx || !ctx->disk_file) return -1;
+    
+    int mapped = ctx->map != NULL;
+    fat32_unmap_image(ctx);
+    fat32_count(&ctx->stats.syscalls, 1);
+    if (ftruncate(fileno(ctx->disk_file), (off_t)size) != 0) {
+        return -1;
+    }
+    return mapped ? fat32_map_image(ctx) : 0;
+}
+
+/**
+ * @brief Switches the volume to the memory-mapped backend.
+ *
+ * The whole image is mapped shared, so stores through the mapping and
+ * positional writes see the same pages.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_map_image(Fat32Volume* ctx) {
+    if (!ctx || !ctx->disk_file) return -1;
+    if (ctx->map) return 0;
+    
+    struct stat st;
+    int fd = fileno(ctx->disk_file);
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        return -1;
+    }
+    
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    ctx->map = (uint8_t*)map;
+    ctx->map_size = (uint64_t)st.st_size;
+    return 0;
+}
+
+/**
+ * @brief Returns the volume to plain positional I/O.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ */
+void fat32_unmap_image(Fat32Volume* ctx) {
+    if (ctx && ctx->map) {
+        munmap(ctx->map, (size_t)ctx->map_size);
+        ctx->map = NULL;
+        ctx->map_size = 0;
+    }
+}
+
+/**
+ * @brief Adds to one of the volume's I/O counters.
+ *
+ * @param counter Field of ctx->stats.
+ * @param amount Value to add.
+ */
+void fat32_count(uint64_t* counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Takes a snapshot of the volume's I/O counters.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param stats Output counters.
+ */
+void fat32_stats_get(Fat32Volume* ctx, Fat32Stats* stats) {
+    stats->sectors_read = __atomic_load_n(&ctx->stats.sectors_read, __ATOMIC_RELAXED);
+    stats->sectors_written = __atomic_load_n(&ctx->stats.sectors_written, __ATOMIC_RELAXED);
+    stats->syscalls = __atomic_load_n(&ctx->stats.syscalls, __ATOMIC_RELAXED);
+    stats->flushes = __atomic_load_n(&ctx->stats.flushes, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&ctx->stats.cache_hits, __ATOMIC_RELAXED);
+    stats->cache_misses = __atomic_load_n(&ctx->stats.cache_misses, __ATOMIC_RELAXED);
+}
 
 /**
  * @brief Reads a single 512-byte sector from the disk.
  *
- * @param ctx Pointer to FAT32 context.
+ * @param ctx Pointer to FAT32 volume.
  * @param sector Sector number to read.
  * @param buffer Pointer to a buffer of at least SECTOR_SIZE bytes.
  * @return 0 on success, -1 on failure.
  */
-int fat32_read_sector(Fat32Context* ctx, uint32_t sector, void* buffer) {
+int fat32_read_sector(Fat32Volume* ctx, uint32_t sector, void* buffer) {
     if (!ctx || !ctx->disk_file || !buffer) return -1;
     
-    if (fseek(ctx->disk_file, sector * SECTOR_SIZE, SEEK_SET) != 0) {
-        return -1;
-    }
-    
-    return fread(buffer, SECTOR_SIZE, 1, ctx->disk_file) == 1 ? 0 : -1;
+    return transfer_at(ctx, (uint64_t)sector << SECTOR_SHIFT, buffer, SECTOR_SIZE, 0);
 }
 
 /**
  * @brief Writes a single 512-byte sector to the disk.
  *
- * @param ctx Pointer to FAT32 context.
+ * @param ctx Pointer to FAT32 volume.
  * @param sector Sector number to write.
  * @param buffer Pointer to the data buffer to write (SECTOR_SIZE bytes).
  * @return 0 on success, -1 on failure.
  */
-int fat32_write_sector(Fat32Context* ctx, uint32_t sector, const void* buffer) {
+int fat32_write_sector(Fat32Volume* ctx, uint32_t sector, const void* buffer) {
+    if (!ctx || !ctx->disk_file || !buffer) return -1;
+    
+    return transfer_at(ctx, (uint64_t)sector << SECTOR_SHIFT, (void*)buffer, SECTOR_SIZE, 1);
+}
+
+/**
+ * @brief Reads a run of consecutive sectors with a single request.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param sector First sector to read.
+ * @param count Number of sectors.
+ * @param buffer Pointer to a buffer of at least count * SECTOR_SIZE bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_read_sectors(Fat32Volume* ctx, uint32_t sector, uint32_t count, void* buffer) {
+    if (!ctx || !ctx->disk_file || !buffer) return -1;
+    
+    return transfer_at(ctx, (uint64_t)sector << SECTOR_SHIFT, buffer, (size_t)count * SECTOR_SIZE, 0);
+}
+
+/**
+ * @brief Writes a run of consecutive sectors with a single request.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param sector First sector to write.
+ * @param count Number of sectors.
+ * @param buffer Pointer to count * SECTOR_SIZE bytes of data.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_write_sectors(Fat32Volume* ctx, uint32_t sector, uint32_t count, const void* buffer) {
     if (!ctx || !ctx->disk_file || !buffer) return -1;
     
-    if (fseek(ctx->disk_file, sector * SECTOR_SIZE, SEEK_SET) != 0) {
+    return transfer_at(ctx, (uint64_t)sector << SECTOR_SHIFT, (void*)buffer, (size_t)count * SECTOR_SIZE, 1);
+}
+
+/**
+ * @brief Zeroes a run of consecutive sectors.
+ *
+ * The range is first released with a hole punch, which costs one call
+ * regardless of its length and leaves the range reading as zeros. Where
+ * the host filesystem cannot punch holes, the zeros are written as large
+ * vectored requests of FAT32_ZERO_CHUNK bytes per segment.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param sector First sector to clear.
+ * @param count Number of sectors.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_zero_sectors(Fat32Volume* ctx, uint32_t sector, uint64_t count) {
+    if (!ctx || !ctx->disk_file) return -1;
+    if (count == 0) return 0;
+    
+    if (fat32_discard_sectors(ctx, sector, count) == 0) {
+        return 0;
+    }
+    
+    uint64_t offset = (uint64_t)sector << SECTOR_SHIFT;
+    uint64_t length = count << SECTOR_SHIFT;
+    uint64_t zero_offset = offset, zero_length = length;
+    
+    uint8_t* zeros = calloc(1, FAT32_ZERO_CHUNK);
+    if (!zeros) return -1;
+    
+    struct iovec iov[FAT32_IOV_MAX];
+    int result = 0;
+    while (length > 0 && result == 0) {
+        int iovcnt = 0;
+        uint64_t request = 0;
+        while (iovcnt < FAT32_IOV_MAX && request < length) {
+            uint64_t chunk = length - request < FAT32_ZERO_CHUNK ? length - request : FAT32_ZERO_CHUNK;
+            iov[iovcnt].iov_base = zeros;
+            iov[iovcnt].iov_len = (size_t)chunk;
+            iovcnt++;
+            request += chunk;
+        }
+        result = transfer_vector_at(ctx, offset, iov, iovcnt, 1);
+        offset += request;
+        length -= request;
+    }
+    
+    free(zeros);
+    if (result == 0) {
+        zero_map_update(ctx, zero_offset, zero_length, 1);
+    }
+    return result;
+}
+
+/**
+ * @brief Discards a run of sectors so that it reads as zeros.
+ *
+ * Page-aligned ranges of a mapped image are released with
+ * madvise(MADV_REMOVE), which drops the pages and frees the backing
+ * blocks in one step; everything else gets a hole punched in the image
+ * file. Either way the host blocks are returned and no data is written.
+ * Nothing happens when the host filesystem cannot punch holes or a
+ * transaction is open; the caller decides whether zeros have to be
+ * written instead.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param sector First sector to discard.
+ * @param count Number of sectors.
+ * @return 0 if the range now reads as zeros, -1 if discard is unsupported or failed.
+ */
+int fat32_discard_sectors(Fat32Volume* ctx, uint32_t sector, uint64_t count) {
+    if (!ctx || !ctx->disk_file || ctx->txn) return -1;
+    if (count == 0) return 0;
+    
+    uint64_t offset = (uint64_t)sector << SECTOR_SHIFT;
+    uint64_t length = count << SECTOR_SHIFT;
+    uint64_t page_mask = (uint64_t)sysconf(_SC_PAGESIZE) - 1;
+    int discarded = 0;
+    
+    if (ctx->map && offset + length <= ctx->map_size && ((offset | length) & page_mask) == 0) {
+        fat32_count(&ctx->stats.syscalls, 1);
+        discarded = madvise(ctx->map + offset, length, MADV_REMOVE) == 0;
+    }
+    fat32_count(&ctx->stats.syscalls, !discarded);
+    if (!discarded && fallocate(fileno(ctx->disk_file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                (off_t)offset, (off_t)length) != 0) {
         return -1;
     }
+    zero_map_update(ctx, offset, length, 1);
+    if (ctx->trace) {
+        trace_io(ctx, TRACE_DISCARD, offset, length);
+    }
+    return 0;
+}
+
+/**
+ * @brief Discards the data of a run of adjacent clusters.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param first First cluster of the run.
+ * @param count Number of clusters.
+ * @return 0 if the clusters now read as zeros, -1 otherwise.
+ */
+int fat32_discard_clusters(Fat32Volume* ctx, uint32_t first, uint32_t count) {
+    if (first < 2 || (uint64_t)first + count > ctx->cluster_end) return -1;
     
-    int result = fwrite(buffer, SECTOR_SIZE, 1, ctx->disk_file);
-    fflush(ctx->disk_file);
-    return result == 1 ? 0 : -1;
+    uint32_t sector = (uint32_t)(fat32_cluster_offset(ctx, first) >> SECTOR_SHIFT);
+    return fat32_discard_sectors(ctx, sector, (uint64_t)count << ctx->spc_shift);
 }
 
 /**
- * @brief Reads an entire cluster from the disk.
+ * @brief Rebuilds the known-zero map from the image's sparse holes.
  *
- * @param ctx Pointer to FAT32 context.
- * @param cluster Cluster number to read (>=2).
- * @param buffer Pointer to a buffer of at least CLUSTER_SIZE bytes.
+ * Clusters lying entirely inside a hole of the image file read as zeros,
+ * so the map survives remounts without any on-disk metadata. Hosts that
+ * do not report holes simply leave every cluster unknown.
+ *
+ * @param ctx Pointer to FAT32 volume (geometry already loaded).
  * @return 0 on success, -1 on failure.
  */
-int fat32_read_cluster(Fat32Context* ctx, uint32_t cluster, void* buffer) {
-    if (cluster < 2) return -1;
+int fat32_scan_zero_clusters(Fat32Volume* ctx) {
+    if (!ctx || !ctx->disk_file || !ctx->zero_map) return -1;
     
-    uint32_t sector = ctx->data_start + (cluster - 2) * (CLUSTER_SIZE / SECTOR_SIZE);
-    uint8_t* buf = (uint8_t*)buffer;
+    memset(ctx->zero_map, 0, ((uint64_t)ctx->cluster_end + 7) / 8);
     
-    for (int i = 0; i < CLUSTER_SIZE / SECTOR_SIZE; i++) {
-        if (fat32_read_sector(ctx, sector + i, buf + i * SECTOR_SIZE) != 0) {
-            return -1;
-        }
+    int fd = fileno(ctx->disk_file);
+    off_t pos = (off_t)((uint64_t)ctx->data_start << SECTOR_SHIFT);
+    off_t end = (off_t)(fat32_cluster_offset(ctx, ctx->cluster_end));
+    while (pos < end) {
+        off_t hole = lseek(fd, pos, SEEK_HOLE);
+        if (hole < 0 || hole >= end) break;
+        off_t data = lseek(fd, hole, SEEK_DATA);
+        fat32_count(&ctx->stats.syscalls, 2);
+        if (data < 0 || data > end) data = end;  // Hole runs to the end of the file
+        zero_map_update(ctx, (uint64_t)hole, (uint64_t)(data - hole), 1);
+        pos = data;
     }
     return 0;
 }
 
+/**
+ * @brief Tells whether a cluster is known to read as zeros.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster Cluster number.
+ * @return Nonzero if the cluster holds only zeros, zero if unknown.
+ */
+int fat32_cluster_is_zero(Fat32Volume* ctx, uint32_t cluster) {
+    if (!ctx->zero_map || cluster < 2 || cluster >= ctx->cluster_end) return 0;
+    return (__atomic_load_n(&ctx->zero_map[cluster >> 3], __ATOMIC_RELAXED) >> (cluster & 7)) & 1;
+}
+
+/**
+ * @brief Reads an entire cluster from the disk.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster Cluster number to read (>=2).
+ * @param buffer Pointer to a buffer of at least ctx->cluster_size bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_read_cluster(Fat32Volume* ctx, uint32_t cluster, void* buffer) {
+    if (cluster < 2) return -1;
+    
+    return fat32_read_data(ctx, cluster, 0, buffer, ctx->cluster_size);
+}
+
 /**
  * @brief Writes an entire cluster to the disk.
  *
- * @param ctx Pointer to FAT32 context.
+ * @param ctx Pointer to FAT32 volume.
  * @param cluster Cluster number to write (>=2).
- * @param buffer Pointer to a buffer containing CLUSTER_SIZE bytes of data.
+ * @param buffer Pointer to a buffer containing ctx->cluster_size bytes of data.
  * @return 0 on success, -1 on failure.
  */
-int fat32_write_cluster(Fat32Context* ctx, uint32_t cluster, const void* buffer) {
+int fat32_write_cluster(Fat32Volume* ctx, uint32_t cluster, const void* buffer) {
     if (cluster < 2) return -1;
     
-    uint32_t sector = ctx->data_start + (cluster - 2) * (CLUSTER_SIZE / SECTOR_SIZE);
-    const uint8_t* buf = (const uint8_t*)buffer;
-    
-    for (int i = 0; i < CLUSTER_SIZE / SECTOR_SIZE; i++) {
-        if (fat32_write_sector(ctx, sector + i, buf + i * SECTOR_SIZE) != 0) {
-            return -1;
-        }
-    }
-    return 0;
+    return fat32_write_data(ctx, cluster, 0, buffer, ctx->cluster_size);
 }
 
 /**
  * @brief Reads a FAT entry for a given cluster.
  *
- * @param ctx Pointer to FAT32 context.
+ * @param ctx Pointer to FAT32 volume.
  * @param cluster Cluster number.
  * @return FAT entry value (0x0FFFFFFF if invalid cluster).
  */
-uint32_t fat32_get_fat_entry(Fat32Context* ctx, uint32_t cluster) {
-    if (cluster >= ctx->total_clusters) return 0x0FFFFFFF;
+uint32_t fat32_get_fat_entry(Fat32Volume* ctx, uint32_t cluster) {
+    if (cluster >= ctx->cluster_end) return 0x0FFFFFFF;
     
-    uint32_t fat_sector = ctx->fat_start + (cluster * 4) / SECTOR_SIZE;
-    uint32_t fat_offset = (cluster * 4) % SECTOR_SIZE;
+    uint32_t fat_sector = ctx->fat_start + (cluster >> (SECTOR_SHIFT - 2));
+    uint32_t fat_offset = (cluster << 2) & (SECTOR_SIZE - 1);
     
     uint8_t sector[SECTOR_SIZE];
     if (fat32_read_sector(ctx, fat_sector, sector) != 0) {
@@ -118,43 +776,52 @@ uint32_t fat32_get_fat_entry(Fat32Context* ctx, uint32_t cluster) {
 /**
  * @brief Updates a FAT entry for a given cluster.
  *
- * @param ctx Pointer to FAT32 context.
+ * The sector is rewritten under the allocator lock.
+ *
+ * @param ctx Pointer to FAT32 volume.
  * @param cluster Cluster number.
  * @param value New FAT entry value.
  * @return 0 on success, -1 on failure.
  */
-int fat32_set_fat_entry(Fat32Context* ctx, uint32_t cluster, uint32_t value) {
-    if (cluster >= ctx->total_clusters) return -1;
+int fat32_set_fat_entry(Fat32Volume* ctx, uint32_t cluster, uint32_t value) {
+    if (cluster >= ctx->cluster_end) return -1;
     
     value &= 0x0FFFFFFF;
     
-    for (int fat_copy = 0; fat_copy < FAT_COUNT; fat_copy++) {
-        uint32_t fat_sector = ctx->fat_start + (fat_copy * ctx->fat_size) + (cluster * 4) / SECTOR_SIZE;
-        uint32_t fat_offset = (cluster * 4) % SECTOR_SIZE;
+    int result = 0;
+    fat32_alloc_lock(ctx);
+    for (uint32_t fat_copy = 0; fat_copy < ctx->fat_count && result == 0; fat_copy++) {
+        uint32_t fat_sector = ctx->fat_start + (fat_copy * ctx->fat_size) + (cluster >> (SECTOR_SHIFT - 2));
+        uint32_t fat_offset = (cluster << 2) & (SECTOR_SIZE - 1);
         
         uint8_t sector[SECTOR_SIZE];
         if (fat32_read_sector(ctx, fat_sector, sector) != 0) {
-            return -1;
+            result = -1;
+            break;
         }
         
         uint32_t* fat_entry = (uint32_t*)(sector + fat_offset);
         *fat_entry = (*fat_entry & 0xF0000000) | value;
         
         if (fat32_write_sector(ctx, fat_sector, sector) != 0) {
-            return -1;
+            result = -1;
         }
     }
-    return 0;
+    fat32_alloc_unlock(ctx);
+    return result;
 }
 
 /**
  * @brief Finds the first free cluster in the FAT.
  *
- * @param ctx Pointer to FAT32 context.
+ * Unless the volume is locked exclusively, hold the allocator lock until
+ * the cluster is marked used, or another thread may pick it as well.
+ *
+ * @param ctx Pointer to FAT32 volume.
  * @return Cluster number of the first free cluster, or 0 if none found.
  */
-uint32_t fat32_find_free_cluster(Fat32Context* ctx) {
-    for (uint32_t cluster = 2; cluster < ctx->total_clusters; cluster++) {
+uint32_t fat32_find_free_cluster(Fat32Volume* ctx) {
+    for (uint32_t cluster = 2; cluster < ctx->cluster_end; cluster++) {
         uint32_t fat_entry = fat32_get_fat_entry(ctx, cluster);
         if (fat_entry == 0) {  /**< Free cluster found */
             return cluster;
@@ -164,13 +831,850 @@ uint32_t fat32_find_free_cluster(Fat32Context* ctx) {
 }
 
 /**
- * @brief Clears all data in a cluster by writing zeros.
+ * @brief Clears all data in a cluster.
+ *
+ * Nothing is done for clusters already known to be zero. Otherwise the
+ * cluster is discarded, and only hosts without hole punching get an
+ * explicit zero write.
  *
- * @param ctx Pointer to FAT32 context.
+ * @param ctx Pointer to FAT32 volume.
  * @param cluster Cluster number to clear.
  * @return 0 on success, -1 on failure.
  */
-int fat32_clear_cluster(Fat32Context* ctx, uint32_t cluster) {
-    uint8_t zero_buffer[CLUSTER_SIZE] = {0};
-    return fat32_write_cluster(ctx, cluster, zero_buffer);
+int fat32_clear_cluster(Fat32Volume* ctx, uint32_t cluster) {
+    if (cluster < 2 || cluster >= ctx->cluster_end) return -1;
+    if (fat32_cluster_is_zero(ctx, cluster)) return 0;
+    
+    uint32_t sector = (uint32_t)(fat32_cluster_offset(ctx, cluster) >> SECTOR_SHIFT);
+    return fat32_zero_sectors(ctx, sector, ctx->sectors_per_cluster);
+}
+
+/**
+ * @brief Returns the byte offset of a cluster within the disk image.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster Cluster number (>=2).
+ * @return Offset of the cluster's first byte.
+ */
+uint64_t fat32_cluster_offset(Fat32Volume* ctx, uint32_t cluster) {
+    return ((uint64_t)ctx->data_start << SECTOR_SHIFT) + ((uint64_t)(cluster - 2) << ctx->cluster_shift);
+}
+
+/**
+ * @brief Reads bytes from a run of physically contiguous clusters.
+ *
+ * The whole range is transferred with a single read, so callers can
+ * cover several adjacent clusters at once.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the run (>=2).
+ * @param offset Byte offset from the start of @p cluster.
+ * @param buffer Destination buffer of at least @p size bytes.
+ * @param size Number of bytes to read.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_read_data(Fat32Volume* ctx, uint32_t cluster, uint32_t offset, void* buffer, uint32_t size) {
+    if (!ctx || !ctx->disk_file || !buffer || cluster < 2) return -1;
+    
+    return transfer_at(ctx, fat32_cluster_offset(ctx, cluster) + offset, buffer, size, 0);
+}
+
+/**
+ * @brief Writes bytes to a run of physically contiguous clusters.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the run (>=2).
+ * @param offset Byte offset from the start of @p cluster.
+ * @param buffer Source buffer of at least @p size bytes.
+ * @param size Number of bytes to write.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_write_data(Fat32Volume* ctx, uint32_t cluster, uint32_t offset, const void* buffer, uint32_t size) {
+    if (!ctx || !ctx->disk_file || !buffer || cluster < 2) return -1;
+    
+    return transfer_at(ctx, fat32_cluster_offset(ctx, cluster) + offset, (void*)buffer, size, 1);
+}
+
+/**
+ * @brief Reads into a list of buffers from a run of contiguous clusters.
+ *
+ * The segments are filled in order from consecutive image bytes with
+ * vectored reads, so scattered destinations cost no extra requests.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the run (>=2).
+ * @param offset Byte offset from the start of @p cluster.
+ * @param iov Destination segments.
+ * @param iovcnt Number of segments.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_readv_data(Fat32Volume* ctx, uint32_t cluster, uint32_t offset, const struct iovec* iov, int iovcnt) {
+    if (!ctx || !ctx->disk_file || !iov || cluster < 2) return -1;
+    
+    return transfer_vector_at(ctx, fat32_cluster_offset(ctx, cluster) + offset, iov, iovcnt, 0);
+}
+
+/**
+ * @brief Writes a list of buffers to a run of contiguous clusters.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the run (>=2).
+ * @param offset Byte offset from the start of @p cluster.
+ * @param iov Source segments, written back to back.
+ * @param iovcnt Number of segments.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_writev_data(Fat32Volume* ctx, uint32_t cluster, uint32_t offset, const struct iovec* iov, int iovcnt) {
+    if (!ctx || !ctx->disk_file || !iov || cluster < 2) return -1;
+    
+    return transfer_vector_at(ctx, fat32_cluster_offset(ctx, cluster) + offset, iov, iovcnt, 1);
+}
+
+/**
+ * @brief Releases every cluster of a chain back to the free pool.
+ *
+ * The chain is first collected as extents and each extent is then
+ * cleared with batched FAT writes.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the chain (values below 2 are ignored).
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_free_chain(Fat32Volume* ctx, uint32_t cluster) {
+    if (cluster < 2 || cluster >= FAT_EOC_MIN) return 0;
+    
+    Fat32Extent* extents;
+    uint32_t extent_count;
+    if (fat32_chain_extents(ctx, cluster, UINT32_MAX, &extents, &extent_count) != 0) {
+        return -1;
+    }
+    
+    int result = fat32_free_extents(ctx, extents, extent_count);
+    free(extents);
+    fat32_tail_forget(ctx, cluster);
+    return result;
+}
+
+/**
+ * @brief Rewrites the FAT entries of a run of adjacent clusters in large spans.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param first First cluster of the run.
+ * @param count Number of clusters in the run.
+ * @param values Explicit value per cluster, or NULL to use @p link.
+ * @param link Nonzero to chain cluster i to i + 1, zero to mark every entry free.
+ * @param last_value Value stored for the last cluster when @p link is set.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_fat_run(Fat32Volume* ctx, uint32_t first, uint32_t count, const uint32_t* values,
+                         int link, uint32_t last_value) {
+    if (count == 0) return 0;
+    if (first < 2 || first + count > ctx->cluster_end) return -1;
+    
+    uint32_t entries_per_sector = SECTOR_SIZE / 4;
+    uint8_t* span = malloc(FAT32_SCAN_SECTORS * SECTOR_SIZE);
+    if (!span) return -1;
+    
+    int result = 0;
+    fat32_alloc_lock(ctx);
+    uint32_t last = first + count - 1;
+    uint32_t cluster = first;
+    while (result == 0 && cluster <= last) {
+        uint32_t rel_sector = cluster / entries_per_sector;
+        uint32_t sectors = last / entries_per_sector - rel_sector + 1;
+        if (sectors > FAT32_SCAN_SECTORS) sectors = FAT32_SCAN_SECTORS;
+        uint32_t span_end = (rel_sector + sectors) * entries_per_sector;  // exclusive
+        
+        for (uint32_t fat_copy = 0; fat_copy < ctx->fat_count && result == 0; fat_copy++) {
+            uint32_t sector = ctx->fat_start + fat_copy * ctx->fat_size + rel_sector;
+            if (fat32_read_sectors(ctx, sector, sectors, span) != 0) {
+                result = -1;
+                break;
+            }
+            
+            uint32_t* entries = (uint32_t*)span;
+            for (uint32_t c = cluster; c <= last && c < span_end; c++) {
+                uint32_t value = values ? values[c - first] : !link ? 0 : (c == last ? last_value : c + 1);
+                uint32_t* entry = &entries[c - rel_sector * entries_per_sector];
+                *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+            }
+            
+            if (fat32_write_sectors(ctx, sector, sectors, span) != 0) {
+                result = -1;
+            }
+        }
+        cluster = span_end;
+    }
+    fat32_alloc_unlock(ctx);
+    
+    free(span);
+    return result;
+}
+
+/**
+ * @brief Marks every cluster of the given extents as free.
+ *
+ * The freed data is discarded as well, so the image only occupies host
+ * space for live clusters. Discarding is best effort: where the host
+ * cannot punch holes the old contents simply stay behind. Each run is
+ * discarded while it still belongs to its chain, since once its FAT
+ * entries are clear another directory's writer may allocate and fill it.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param extents Extents to release.
+ * @param extent_count Number of extents.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_free_extents(Fat32Volume* ctx, const Fat32Extent* extents, uint32_t extent_count) {
+    for (uint32_t i = 0; i < extent_count; i++) {
+        fat32_discard_clusters(ctx, extents[i].start, extents[i].count);
+        if (write_fat_run(ctx, extents[i].start, extents[i].count, NULL, 0, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Links a run of adjacent clusters into a chain with batched FAT writes.
+ *
+ * Cluster i of the run points to cluster i + 1 and the last cluster gets
+ * @p last_value. The FAT sectors covering the run are read and written in
+ * large spans instead of once per entry.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param first First cluster of the run.
+ * @param count Number of clusters in the run.
+ * @param last_value Value stored for the last cluster (next cluster, FAT_EOC or 0).
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_set_fat_run(Fat32Volume* ctx, uint32_t first, uint32_t count, uint32_t last_value) {
+    return write_fat_run(ctx, first, count, NULL, 1, last_value);
+}
+
+/**
+ * @brief Stores explicit FAT values for a run of adjacent clusters.
+ *
+ * Lets callers that lay out many chains at once (e.g. bulk import)
+ * write every entry of a run with one batched update.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param first First cluster of the run.
+ * @param count Number of clusters in the run.
+ * @param values Value for each cluster of the run.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_set_fat_values(Fat32Volume* ctx, uint32_t first, uint32_t count, const uint32_t* values) {
+    return write_fat_run(ctx, first, count, values, 0, 0);
+}
+
+/**
+ * @brief Collects every run of free clusters by scanning the FAT in large spans.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param runs Output array of free runs (caller frees).
+ * @param run_count Output number of runs.
+ * @return 0 on success, -1 on failure.
+ */
+static int collect_free_runs(Fat32Volume* ctx, Fat32Extent** runs, uint32_t* run_count) {
+    uint32_t entries_per_sector = SECTOR_SIZE / 4;
+    uint32_t fat_sectors = (ctx->cluster_end + entries_per_sector - 1) / entries_per_sector;
+    uint32_t* span = malloc(FAT32_SCAN_SECTORS * SECTOR_SIZE);
+    Fat32Extent* list = NULL;
+    uint32_t count = 0, cap = 0;
+    uint32_t run_start = 0;
+    
+    if (!span) return -1;
+    
+    for (uint32_t rel = 0; rel < fat_sectors; rel += FAT32_SCAN_SECTORS) {
+        uint32_t sectors = fat_sectors - rel;
+        if (sectors > FAT32_SCAN_SECTORS) sectors = FAT32_SCAN_SECTORS;
+        if (fat32_read_sectors(ctx, ctx->fat_start + rel, sectors, span) != 0) {
+            free(span);
+            free(list);
+            return -1;
+        }
+        
+        uint32_t base = rel * entries_per_sector;
+        for (uint32_t i = 0; i < sectors * entries_per_sector; i++) {
+            uint32_t cluster = base + i;
+            int is_free = cluster >= 2 && cluster < ctx->cluster_end && (span[i] & 0x0FFFFFFF) == 0;
+            
+            if (is_free && run_start == 0) {
+                run_start = cluster;
+            } else if (!is_free && run_start != 0) {
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    Fat32Extent* grown = realloc(list, cap * sizeof(Fat32Extent));
+                    if (!grown) {
+                        free(span);
+                        free(list);
+                        return -1;
+                    }
+                    list = grown;
+                }
+                list[count].start = run_start;
+                list[count].count = cluster - run_start;
+                count++;
+                run_start = 0;
+            }
+        }
+    }
+    free(span);
+    
+    if (run_start != 0) {
+        Fat32Extent* grown = realloc(list, (count + 1) * sizeof(Fat32Extent));
+        if (!grown) {
+            free(list);
+            return -1;
+        }
+        list = grown;
+        list[count].start = run_start;
+        list[count].count = ctx->cluster_end - run_start;
+        count++;
+    }
+    
+    *runs = list;
+    *run_count = count;
+    return 0;
+}
+
+/**
+ * @brief Counts the free clusters that directly follow a chain's tail.
+ *
+ * Only the FAT sectors covering the next @p count entries are read, and
+ * the scan stops at the first cluster in use.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param prev_cluster Last cluster of the chain (>= 2).
+ * @param count Most clusters wanted.
+ * @return Number of free clusters right after @p prev_cluster (0 on failure).
+ */
+static uint32_t free_after(Fat32Volume* ctx, uint32_t prev_cluster, uint32_t count) {
+    uint32_t entries_per_sector = SECTOR_SIZE / 4;
+    uint32_t first = prev_cluster + 1;
+    if (first >= ctx->cluster_end) return 0;
+    if (count > ctx->cluster_end - first) count = ctx->cluster_end - first;
+    
+    uint32_t* span = malloc(FAT32_SCAN_SECTORS * SECTOR_SIZE);
+    if (!span) return 0;
+    
+    uint32_t found = 0;
+    int used = 0;
+    while (!used && found < count) {
+        uint32_t cluster = first + found;
+        uint32_t rel = cluster / entries_per_sector;
+        uint32_t sectors = (first + count - 1) / entries_per_sector - rel + 1;
+        if (sectors > FAT32_SCAN_SECTORS) sectors = FAT32_SCAN_SECTORS;
+        if (fat32_read_sectors(ctx, ctx->fat_start + rel, sectors, span) != 0) {
+            found = 0;
+            break;
+        }
+        
+        uint32_t span_end = (rel + sectors) * entries_per_sector;
+        for (; cluster < first + count && cluster < span_end; cluster++) {
+            if ((span[cluster - rel * entries_per_sector] & 0x0FFFFFFF) != 0) {
+                used = 1;
+                break;
+            }
+            found++;
+        }
+    }
+    free(span);
+    return found;
+}
+
+/**
+ * @brief Picks free clusters for a small request without scanning the whole FAT.
+ *
+ * Free clusters right after @p prev_cluster come first; the rest are
+ * taken from at most FAT32_SCAN_SECTORS FAT sectors starting at the
+ * free-space cursor, wrapping to the start of the FAT. The cursor then
+ * moves past the last cluster taken. Call with the allocator lock held.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param count Number of clusters wanted (> 0).
+ * @param prev_cluster Current last cluster of the chain to extend, or 0.
+ * @param extents Output array of extents in chain order (caller frees).
+ * @param extent_count Output number of extents.
+ * @return 0 on success, -1 if too few free clusters were found nearby.
+ */
+static int reserve_near(Fat32Volume* ctx, uint32_t count, uint32_t prev_cluster,
+                        Fat32Extent** extents, uint32_t* extent_count) {
+    uint32_t entries_per_sector = SECTOR_SIZE / 4;
+    Fat32Extent* chosen = malloc(count * sizeof(Fat32Extent));  // One per cluster at worst
+    uint32_t* span = malloc(FAT32_SCAN_SECTORS * SECTOR_SIZE);
+    if (!chosen || !span) {
+        free(chosen);
+        free(span);
+        return -1;
+    }
+    uint32_t chosen_count = 0;
+    uint32_t remaining = count;
+    uint32_t in_place_end = 0;
+    
+    if (prev_cluster >= 2) {
+        uint32_t take = free_after(ctx, prev_cluster, count);
+        if (take > 0) {
+            chosen[chosen_count].start = prev_cluster + 1;
+            chosen[chosen_count].count = take;
+            chosen_count++;
+            remaining -= take;
+            in_place_end = prev_cluster + 1 + take;
+        }
+    }
+    
+    uint32_t cluster = ctx->alloc_cursor >= 2 && ctx->alloc_cursor < ctx->cluster_end ? ctx->alloc_cursor : 2;
+    uint32_t budget = FAT32_SCAN_SECTORS;
+    uint32_t visited = 0;
+    while (remaining > 0 && budget > 0 && visited < ctx->total_clusters) {
+        if (cluster >= ctx->cluster_end) cluster = 2;
+        uint32_t rel = cluster / entries_per_sector;
+        // Enough sectors for the remainder if every entry were free
+        uint32_t sectors = (cluster + remaining - 1) / entries_per_sector - rel + 1;
+        uint32_t to_end = (ctx->cluster_end - 1) / entries_per_sector - rel + 1;
+        if (sectors > to_end) sectors = to_end;
+        if (sectors > budget) sectors = budget;
+        if (fat32_read_sectors(ctx, ctx->fat_start + rel, sectors, span) != 0) {
+            break;
+        }
+        budget -= sectors;
+        
+        uint32_t span_end = (rel + sectors) * entries_per_sector;
+        if (span_end > ctx->cluster_end) span_end = ctx->cluster_end;
+        for (; cluster < span_end && remaining > 0 && visited < ctx->total_clusters; cluster++, visited++) {
+            if (cluster > prev_cluster && cluster < in_place_end) continue;  // Taken already
+            if ((span[cluster - rel * entries_per_sector] & 0x0FFFFFFF) != 0) continue;
+            
+            Fat32Extent* tail = chosen_count ? &chosen[chosen_count - 1] : NULL;
+            if (tail && tail->start + tail->count == cluster) {
+                tail->count++;
+            } else {
+                chosen[chosen_count].start = cluster;
+                chosen[chosen_count].count = 1;
+                chosen_count++;
+            }
+            remaining--;
+        }
+    }
+    free(span);
+    
+    if (remaining > 0) {
+        free(chosen);
+        return -1;
+    }
+    ctx->alloc_cursor = chosen[chosen_count - 1].start + chosen[chosen_count - 1].count;
+    *extents = chosen;
+    *extent_count = chosen_count;
+    return 0;
+}
+
+static int compare_extent_length_desc(const void* a, const void* b) {
+    const Fat32Extent* x = a;
+    const Fat32Extent* y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+static int compare_extent_start(const void* a, const void* b) {
+    const Fat32Extent* x = a;
+    const Fat32Extent* y = b;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+/**
+ * @brief Picks free clusters as the fewest possible contiguous extents.
+ *
+ * Requests of up to FAT32_NEAR_CLUSTERS clusters (directory growth,
+ * delayed-allocation flushes) are served by reserve_near(), which reads
+ * a bounded number of FAT sectors. Larger requests such as put and
+ * import, and small ones that found too little nearby, want the fewest
+ * extents: when the clusters right after @p prev_cluster are all free,
+ * the chain grows in place and only the FAT sectors covering them are
+ * read. Otherwise the FAT is scanned once for free runs. If a free run starts right after @p prev_cluster it
+ * is used first; the rest comes from the smallest run that fits, or else
+ * from the largest runs available. The FAT itself is not modified, so unless the
+ * volume is locked exclusively, hold the allocator lock until the
+ * extents are linked.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param count Number of clusters wanted (> 0).
+ * @param prev_cluster Current last cluster of the chain to extend, or 0.
+ * @param extents Output array of extents in chain order (caller frees).
+ * @param extent_count Output number of extents.
+ * @return 0 on success, -1 if there is not enough free space or on failure.
+ */
+int fat32_reserve_extents(Fat32Volume* ctx, uint32_t count, uint32_t prev_cluster,
+                          Fat32Extent** extents, uint32_t* extent_count) {
+    if (!ctx || count == 0 || !extents || !extent_count) return -1;
+    
+    if (count <= FAT32_NEAR_CLUSTERS && reserve_near(ctx, count, prev_cluster, extents, extent_count) == 0) {
+        return 0;
+    }
+    if (prev_cluster >= 2 && free_after(ctx, prev_cluster, count) == count) {
+        Fat32Extent* in_place = malloc(sizeof(Fat32Extent));
+        if (!in_place) return -1;
+        in_place->start = prev_cluster + 1;
+        in_place->count = count;
+        *extents = in_place;
+        *extent_count = 1;
+        return 0;
+    }
+    
+    Fat32Extent* runs;
+    uint32_t run_count;
+    if (collect_free_runs(ctx, &runs, &run_count) != 0) {
+        return -1;
+    }
+    
+    Fat32Extent* chosen = malloc((run_count + 1) * sizeof(Fat32Extent));
+    if (!chosen) {
+        free(runs);
+        return -1;
+    }
+    uint32_t chosen_count = 0;
+    uint32_t remaining = count;
+    uint32_t sorted_from = 0;
+    
+    // Keep growing in place when the clusters after the tail are free
+    if (prev_cluster >= 2) {
+        for (uint32_t i = 0; i < run_count; i++) {
+            if (runs[i].start == prev_cluster + 1) {
+                uint32_t take = runs[i].count < remaining ? runs[i].count : remaining;
+                chosen[chosen_count].start = runs[i].start;
+                chosen[chosen_count].count = take;
+                chosen_count++;
+                sorted_from = 1;
+                remaining -= take;
+                runs[i].start += take;
+                runs[i].count -= take;
+                break;
+            }
+        }
+    }
+    
+    qsort(runs, run_count, sizeof(Fat32Extent), compare_extent_length_desc);
+    for (uint32_t i = 0; i < run_count && remaining > 0; i++) {
+        if (runs[i].count == 0) break;
+        
+        // Best fit: the last (smallest) run that still covers the remainder
+        uint32_t fit = i;
+        while (fit + 1 < run_count && runs[fit + 1].count >= remaining) {
+            fit++;
+        }
+        
+        if (runs[fit].count >= remaining) {
+            chosen[chosen_count].start = runs[fit].start;
+            chosen[chosen_count].count = remaining;
+            chosen_count++;
+            remaining = 0;
+        } else {
+            chosen[chosen_count++] = runs[i];
+            remaining -= runs[i].count;
+        }
+    }
+    free(runs);
+    
+    if (remaining > 0) {
+        free(chosen);
+        return -1;  // Not enough free clusters
+    }
+    
+    qsort(chosen + sorted_from, chosen_count - sorted_from, sizeof(Fat32Extent), compare_extent_start);
+    
+    *extents = chosen;
+    *extent_count = chosen_count;
+    return 0;
+}
+
+/**
+ * @brief Allocates clusters as the fewest possible contiguous extents.
+ *
+ * Reserves the extents with fat32_reserve_extents() and links them into
+ * one chain ending in FAT_EOC with batched FAT writes. @p prev_cluster
+ * (if >= 2) is pointed at the first allocated cluster. Runs under the
+ * allocator lock.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param count Number of clusters to allocate (> 0).
+ * @param prev_cluster Current last cluster of the chain to extend, or 0.
+ * @param extents Output array of extents in chain order (caller frees).
+ * @param extent_count Output number of extents.
+ * @return 0 on success, -1 if there is not enough free space or on failure.
+ */
+int fat32_alloc_extents(Fat32Volume* ctx, uint32_t count, uint32_t prev_cluster,
+                        Fat32Extent** extents, uint32_t* extent_count) {
+    Fat32Extent* chosen;
+    uint32_t chosen_count;
+    fat32_alloc_lock(ctx);
+    if (fat32_reserve_extents(ctx, count, prev_cluster, &chosen, &chosen_count) != 0) {
+        fat32_alloc_unlock(ctx);
+        return -1;
+    }
+    
+    int result = 0;
+    for (uint32_t i = 0; i < chosen_count && result == 0; i++) {
+        uint32_t next = i + 1 < chosen_count ? chosen[i + 1].start : FAT_EOC;
+        result = fat32_set_fat_run(ctx, chosen[i].start, chosen[i].count, next);
+    }
+    if (result == 0 && prev_cluster >= 2) {
+        result = fat32_set_fat_entry(ctx, prev_cluster, chosen[0].start);
+    }
+    fat32_alloc_unlock(ctx);
+    if (result != 0) {
+        free(chosen);
+        return -1;
+    }
+    
+    *extents = chosen;
+    *extent_count = chosen_count;
+    return 0;
+}
+
+/**
+ * @brief Describes a cluster chain as runs of physically adjacent clusters.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the chain.
+ * @param max_clusters Stop after this many clusters (e.g. the file size in clusters).
+ * @param extents Output array of extents in chain order (caller frees).
+ * @param extent_count Output number of extents.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_chain_extents(Fat32Volume* ctx, uint32_t cluster, uint32_t max_clusters,
+                        Fat32Extent** extents, uint32_t* extent_count) {
+    Fat32Extent* list = NULL;
+    uint32_t count = 0, cap = 0;
+    uint32_t walked = 0;
+    
+    while (cluster >= 2 && cluster < FAT_EOC_MIN && walked < max_clusters) {
+        if (count > 0 && list[count - 1].start + list[count - 1].count == cluster) {
+            list[count - 1].count++;
+        } else {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 16;
+                Fat32Extent* grown = realloc(list, cap * sizeof(Fat32Extent));
+                if (!grown) {
+                    free(list);
+                    return -1;
+                }
+                list = grown;
+            }
+            list[count].start = cluster;
+            list[count].count = 1;
+            count++;
+        }
+        walked++;
+        cluster = fat32_get_fat_entry(ctx, cluster);
+    }
+    
+    *extents = list;
+    *extent_count = count;
+    return 0;
+}
+
+/**
+ * @brief Frees a transaction and its buffered sectors.
+ */
+static void txn_free(Fat32Txn* txn) {
+    pthread_mutex_destroy(&txn->lock);
+    free(txn->sectors);
+    free(txn->data);
+    free(txn->table);
+    free(txn);
+}
+
+/**
+ * @brief Orders 64-bit keys ascending (qsort callback).
+ */
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Body of fat32_begin(); the volume is locked exclusively.
+ */
+static int begin_txn(Fat32Session* session) {
+    Fat32Volume* ctx = session->volume;
+    if (!fat32_is_mounted(ctx) || ctx->txn) return -1;
+    
+    Fat32Txn* txn = calloc(1, sizeof(Fat32Txn));
+    if (!txn) return -1;
+    pthread_mutex_init(&txn->lock, NULL);
+    if (txn_grow(txn) != 0) {
+        txn_free(txn);
+        return -1;
+    }
+    ctx->txn = txn;
+    ctx->txn_owner = session;
+    return 0;
+}
+
+/**
+ * @brief Opens a transaction.
+ *
+ * Until fat32_commit() or fat32_abort(), every write to the image (file
+ * data, FAT updates and directory changes) is kept in memory, and reads
+ * see those writes. Freed clusters are not discarded inside a
+ * transaction, and zero-copy access to the mapped image is disabled.
+ * The transaction belongs to @p session: only it may write, commit or
+ * abort until the transaction ends (see fat32_txn_denies()). Other
+ * sessions still read, and see the uncommitted writes.
+ *
+ * @param session Session opening the transaction, on a mounted volume.
+ * @return 0 on success, -1 if not mounted, a transaction is already open, or on allocation failure.
+ */
+int fat32_begin(Fat32Session* session) {
+    if (!session || fat32_lock_exclusive(session->volume) != 0) return -1;
+    
+    int result = begin_txn(session);
+    fat32_unlock(session->volume);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_commit(); the volume is locked exclusively.
+ */
+static int commit_txn(Fat32Session* session) {
+    Fat32Volume* ctx = session->volume;
+    if (!ctx->txn || ctx->txn_owner != session || ctx->txn->failed) return -1;
+    
+    Fat32Txn* txn = ctx->txn;
+    ctx->txn = NULL;  // Writes below go to the image
+    ctx->txn_owner = NULL;
+    
+    uint64_t* keys = malloc(((size_t)txn->count + 1) * sizeof(uint64_t));
+    struct iovec* iov = malloc(((size_t)txn->count + 1) * sizeof(struct iovec));
+    int result = keys && iov ? 0 : -1;
+    for (uint32_t slot = 0; result == 0 && slot < txn->count; slot++) {
+        keys[slot] = ((uint64_t)txn->sectors[slot] << 32) | slot;
+    }
+    if (result == 0) {
+        qsort(keys, txn->count, sizeof(uint64_t), compare_u64);
+    }
+    
+    uint32_t i = 0;
+    while (result == 0 && i < txn->count) {
+        uint32_t first = (uint32_t)(keys[i] >> 32);
+        int iovcnt = 0;
+        uint32_t j = i;
+        for (; j < txn->count && (uint32_t)(keys[j] >> 32) == first + (j - i); j++) {
+            uint8_t* data = txn->data + ((size_t)(uint32_t)keys[j] << SECTOR_SHIFT);
+            if (iovcnt > 0 && (uint8_t*)iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len == data) {
+                iov[iovcnt - 1].iov_len += SECTOR_SIZE;  // Slots were filled in order
+            } else {
+                iov[iovcnt].iov_base = data;
+                iov[iovcnt].iov_len = SECTOR_SIZE;
+                iovcnt++;
+            }
+        }
+        result = transfer_vector_at(ctx, (uint64_t)first << SECTOR_SHIFT, iov, iovcnt, 1);
+        i = j;
+    }
+    
+    if (result == 0 && txn->count > 0) {
+        fat32_count(&ctx->stats.syscalls, 1);
+        if (fdatasync(fileno(ctx->disk_file)) != 0) {
+            result = -1;
+        }
+    }
+    
+    free(iov);
+    free(keys);
+    txn_free(txn);
+    return result;
+}
+
+/**
+ * @brief Writes the open transaction to the image.
+ *
+ * Buffered sectors are sorted, runs of adjacent sectors are written with
+ * one vectored request each, and the image is synced once at the end.
+ * Data still buffered in open file handles is not part of the
+ * transaction until the handle is flushed.
+ *
+ * A transaction in which a write failed is refused and stays open, as
+ * it may hold half of an operation; fat32_abort() discards it.
+ *
+ * @param session Session that opened the transaction.
+ * @return 0 on success, -1 if the session has no open transaction, the
+ *         transaction failed, or a write to the image failed (the image
+ *         may then hold part of the transaction).
+ */
+int fat32_commit(Fat32Session* session) {
+    if (!session || fat32_lock_exclusive(session->volume) != 0) return -1;
+    
+    int result = commit_txn(session);
+    fat32_unlock(session->volume);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_abort(); the volume is locked exclusively.
+ */
+static int abort_txn(Fat32Session* session) {
+    Fat32Volume* ctx = session->volume;
+    if (!ctx->txn || ctx->txn_owner != session) return -1;
+    
+    txn_free(ctx->txn);
+    ctx->txn = NULL;
+    ctx->txn_owner = NULL;
+    memset(ctx->tail_cache, 0, sizeof(ctx->tail_cache));
+    strcpy(session->current_path, "/");
+    session->current_cluster = ROOT_CLUSTER;
+    session->aborts++;
+    return 0;
+}
+
+/**
+ * @brief Discards the session's open transaction.
+ *
+ * The image is left as it was at fat32_begin(). In-memory state derived
+ * from the discarded writes is dropped as well: the tail cache is
+ * cleared, the session's current directory returns to the root, and the
+ * file handles the session opened before the abort are rejected. Other
+ * sessions were kept from writing, opening files and changing directory
+ * while the transaction was open, so their state is left alone.
+ *
+ * @param session Session that opened the transaction.
+ * @return 0 on success, -1 if the session has no open transaction.
+ */
+int fat32_abort(Fat32Session* session) {
+    if (!session || fat32_lock_exclusive(session->volume) != 0) return -1;
+    
+    int result = abort_txn(session);
+    fat32_unlock(session->volume);
+    return result;
+}
+
+/**
+ * @brief Tells whether a session has a transaction open.
+ *
+ * @param session Session to check.
+ * @return 1 if @p session opened the current transaction, 0 otherwise.
+ */
+int fat32_in_txn(Fat32Session* session) {
+    if (!session || fat32_lock_shared(session->volume) != 0) return 0;
+    
+    int result = session->volume->txn != NULL && session->volume->txn_owner == session;
+    fat32_unlock(session->volume);
+    return result;
+}
+
+/**
+ * @brief Tells whether another session's transaction keeps a session out.
+ *
+ * While a transaction is open, other sessions may only read. Their
+ * writes would be committed or discarded by a session they do not
+ * control, and a directory or file they entered could vanish with an
+ * abort, so writing, opening files and changing directory are refused.
+ * Call with the volume locked.
+ *
+ * @param session Session about to act.
+ * @return Nonzero if a transaction owned by another session is open.
+ */
+int fat32_txn_denies(const Fat32Session* session) {
+    const Fat32Volume* ctx = session->volume;
+    return ctx->txn != NULL && ctx->txn_owner != session;
 }
@@ -3,40 +3,62 @@
  * @brief High-level FAT32 filesystem operations.
  *
  * Implements FAT32 initialization, formatting, file and directory
- * management (mkdir, touch, cd, ls) on a disk image.
+ * management (mkdir, touch, cd, ls, rename) on a disk image. Path
+ * operations work on a session, which supplies the current directory;
+ * each public operation locks the volume for its duration and the
+ * directories it reads or changes (see lock.c).
  */
 
+#define _POSIX_C_SOURCE 200809L
 #include "fat32.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 #include <unistd.h>
 
 /**
- * @brief Initializes the FAT32 context and disk image.
+ * @brief Initializes the FAT32 volume and disk image.
  *
  * Opens the disk file (existing or creates new) and initializes
- * context fields. Creates a 20 MB disk file if it does not exist.
+ * volume fields. Creates a 20 MB disk file if it does not exist.
  *
- * @param ctx Pointer to FAT32 context.
+ * @param ctx Pointer to FAT32 volume.
  * @param disk_path Path to disk image file.
  * @return 0 on success, -1 on failure.
  */
 
-int fat32_init(Fat32Context* ctx, const char* disk_path) {
+int fat32_init(Fat32Volume* ctx, const char* disk_path) {
+    return fat32_init_opts(ctx, disk_path, 0);
+}
+
+/**
+ * @brief Initializes the FAT32 volume with creation options.
+ *
+ * Like fat32_init(). A new image is created sparse unless
+ * FAT32_INIT_PREALLOCATE is given, in which case its host blocks are
+ * reserved up front.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param disk_path Path to disk image file.
+ * @param flags FAT32_INIT_* flags.
+ * @return 0 on success, -1 on failure.
+ */
+
+int fat32_init_opts(Fat32Volume* ctx, const char* disk_path, int flags) {
     if (!ctx || !disk_path) return -1;
     
-    memset(ctx, 0, sizeof(Fat32Context));
+    memset(ctx, 0, sizeof(Fat32Volume));
     ctx->disk_path = malloc(strlen(disk_path) + 1);
     if (!ctx->disk_path) return -1;
     strcpy(ctx->disk_path, disk_path);
-    strcpy(ctx->current_path, "/");
-    ctx->current_cluster = ROOT_CLUSTER;
+    fat32_lock_init(ctx);
     
     ctx->disk_file = fopen(disk_path, "r+b");
     if (ctx->disk_file) {
-        if (fat32_is_valid(ctx) == 0) {
+        if (fat32_mount(ctx) == 0) {
             return 0; 
         }
         fclose(ctx->disk_file);
@@ -44,20 +66,20 @@ int fat32_init(Fat32Context* ctx, const char* disk_path) {
     
     ctx->disk_file = fopen(disk_path, "w+b");
     if (!ctx->disk_file) {
+        fat32_lock_destroy(ctx);
         free(ctx->disk_path);
         return -1;
     }
     
-    // Create 20MB file by writing zeros
-    uint8_t zero_sector[SECTOR_SIZE] = {0};
-    for (uint32_t i = 0; i < TOTAL_SECTORS; i++) {
-        if (fwrite(zero_sector, SECTOR_SIZE, 1, ctx->disk_file) != 1) {
-            fclose(ctx->disk_file);
-            free(ctx->disk_path);
-            return -1;
-        }
+    // Size the 20MB file in one call instead of writing zeros
+    if (fat32_create_image(ctx, (uint64_t)TOTAL_SECTORS * SECTOR_SIZE,
+                           (flags & FAT32_INIT_PREALLOCATE) != 0) != 0) {
+        fclose(ctx->disk_file);
+        ctx->disk_file = NULL;
+        fat32_lock_destroy(ctx);
+        free(ctx->disk_path);
+        return -1;
     }
-    fflush(ctx->disk_file);
     
     return 0;
 }
@@ -65,28 +87,42 @@ int fat32_init(Fat32Context* ctx, const char* disk_path) {
 /**
  * @brief Frees resources and closes the disk file.
  *
- * @param ctx Pointer to FAT32 context.
+ * No session may use the volume any more.
+ *
+ * @param ctx Pointer to FAT32 volume.
  */
 
-void fat32_cleanup(Fat32Context* ctx) {
+void fat32_cleanup(Fat32Volume* ctx) {
     if (ctx) {
+        if (ctx->txn) {
+            fat32_abort(ctx->txn_owner);  // Uncommitted writes are dropped
+        }
+        if (ctx->trace) {
+            trace_stop(ctx);
+        }
+        fat32_unmap_image(ctx);
         if (ctx->disk_file) {
             fclose(ctx->disk_file);
         }
         free(ctx->disk_path);
+        free(ctx->zero_map);
+        free(ctx->open_entries);
+        free(ctx->profile);
+        fat32_lock_destroy(ctx);
+        ctx->mounted = 0;
     }
 }
 
 /**
  * @brief Validates the FAT32 disk by reading boot sector.
  *
- * Fills the context with FAT and data area parameters.
+ * Fills the volume with FAT and data area parameters.
  *
- * @param ctx Pointer to FAT32 context.
+ * @param ctx Pointer to FAT32 volume.
  * @return 0 if valid FAT32, -1 otherwise.
  */
 
-int fat32_is_valid(Fat32Context* ctx) {
+int fat32_is_valid(Fat32Volume* ctx) {
     if (!ctx || !ctx->disk_file) return -1;
     
     Fat32BootSector bs;
@@ -102,26 +138,203 @@ int fat32_is_valid(Fat32Context* ctx) {
         return -1;
     }
     
-    // Calculate FAT32 parameters
-    ctx->fat_size = bs.fat_size_32;
-    ctx->fat_start = bs.reserved_sectors;
-    ctx->data_start = bs.reserved_sectors + (bs.fat_count * bs.fat_size_32);
-    ctx->total_clusters = (TOTAL_SECTORS - ctx->data_start) / bs.sectors_per_cluster;
+    return fat32_set_geometry(ctx, &bs);
+}
+
+/**
+ * @brief Validates the boot sector once and marks the volume as mounted.
+ *
+ * The geometry stays in the volume afterwards, so commands only need
+ * fat32_is_mounted() instead of re-reading sector 0. Call this again to
+ * pick up changes made to the image outside the emulator; the known-zero
+ * map is rebuilt from the image on every mount for the same reason.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @return 0 if a valid FAT32 volume is mounted, -1 otherwise.
+ */
+
+int fat32_mount(Fat32Volume* ctx) {
+    if (!ctx || fat32_lock_exclusive(ctx) != 0) return -1;
     
+    ctx->mounted = fat32_is_valid(ctx) == 0;
+    if (ctx->mounted) {
+        fat32_scan_zero_clusters(ctx);  // Another tool may have written any cluster
+    }
+    int result = ctx->mounted ? 0 : -1;
+    fat32_unlock(ctx);
+    return result;
+}
+
+/**
+ * @brief Tells whether a validated volume is loaded, without any I/O.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @return Nonzero if mounted, zero otherwise.
+ */
+
+int fat32_is_mounted(const Fat32Volume* ctx) {
+    return ctx && ctx->mounted;
+}
+
+/**
+ * @brief Starts a session on a volume, in the root directory.
+ *
+ * Only takes a number from the volume's session counter, so sessions
+ * may be started while other sessions are busy.
+ *
+ * @param session Session to initialize.
+ * @param volume Volume the session works on.
+ */
+
+void fat32_session_init(Fat32Session* session, Fat32Volume* volume) {
+    memset(session, 0, sizeof(Fat32Session));
+    session->volume = volume;
+    strcpy(session->current_path, "/");
+    session->current_cluster = ROOT_CLUSTER;  // Right for any generation
+    session->id = __atomic_add_fetch(&volume->sessions, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the first cluster of the session's current directory.
+ *
+ * A directory chosen before the volume was last formatted may no longer
+ * exist; the session then moves back to the root. Call with the volume
+ * locked.
+ *
+ * @param session Session.
+ * @return Cluster of the current directory.
+ */
+
+uint32_t fat32_session_cwd(Fat32Session* session) {
+    if (session->generation != session->volume->generation) {
+        strcpy(session->current_path, "/");
+        session->current_cluster = ROOT_CLUSTER;
+        session->generation = session->volume->generation;
+    }
+    return session->current_cluster;
+}
+
+/**
+ * @brief Returns the stream a session's messages go to.
+ *
+ * @param session Session.
+ * @return session->out, or stdout if none is set.
+ */
+
+FILE* fat32_session_out(const Fat32Session* session) {
+    return session->out ? session->out : stdout;
+}
+
+/**
+ * @brief Loads the volume geometry from a boot sector into the volume.
+ *
+ * Sizes come from the BPB, not from compile-time constants. Shifts and
+ * masks are precomputed so that offset math never divides.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param bs Boot sector to take the geometry from.
+ * @return 0 on success, -1 if the geometry is not supported.
+ */
+
+int fat32_set_geometry(Fat32Volume* ctx, const Fat32BootSector* bs) {
+    uint32_t spc = bs->sectors_per_cluster;
+    if (bs->bytes_per_sector != SECTOR_SIZE || spc == 0 || (spc & (spc - 1)) != 0 ||
+        spc * SECTOR_SIZE > FAT32_MAX_CLUSTER_SIZE || bs->fat_count == 0 || bs->fat_size_32 == 0) {
+        return -1;
+    }
+    
+    uint32_t total_sectors = bs->total_sectors_32 ? bs->total_sectors_32 : bs->total_sectors_16;
+    uint64_t data_start = bs->reserved_sectors + (uint64_t)bs->fat_count * bs->fat_size_32;
+    if (data_start + spc > total_sectors) {
+        return -1;
+    }
+    
+    uint32_t shift = 0;
+    while ((1u << shift) < spc) shift++;
+    int same_layout = ctx->zero_map && ctx->data_start == data_start && ctx->spc_shift == shift;
+    
+    ctx->fat_size = bs->fat_size_32;
+    ctx->fat_count = bs->fat_count;
+    ctx->fat_start = bs->reserved_sectors;
+    ctx->data_start = (uint32_t)data_start;
+    ctx->total_sectors = total_sectors;
+    ctx->sectors_per_cluster = spc;
+    ctx->spc_shift = shift;
+    ctx->cluster_shift = shift + SECTOR_SHIFT;
+    ctx->cluster_size = 1u << ctx->cluster_shift;
+    ctx->cluster_mask = ctx->cluster_size - 1;
+    
+    // Data clusters, limited by what one FAT copy can address
+    uint32_t clusters = (total_sectors - ctx->data_start) >> shift;
+    uint64_t fat_entries = (uint64_t)ctx->fat_size * (SECTOR_SIZE / 4);
+    if ((uint64_t)clusters + 2 > fat_entries) clusters = (uint32_t)(fat_entries - 2);
+    if (clusters > 0x0FFFFFF5 - 2) clusters = 0x0FFFFFF5 - 2;
+    
+    // A new geometry invalidates the known-zero map; the same one keeps it
+    // for format, and fat32_mount() rescans it
+    if (!same_layout || clusters + 2 != ctx->cluster_end) {
+        free(ctx->zero_map);
+        ctx->zero_map = calloc(((uint64_t)clusters + 2 + 7) / 8, 1);
+        if (!ctx->zero_map) return -1;
+    }
+    ctx->total_clusters = clusters;
+    ctx->cluster_end = clusters + 2;
     return 0;
 }
 
 /**
  * @brief Formats the disk as FAT32.
  *
- * Initializes boot sector, FAT tables, and root directory cluster.
+ * Keeps the current image size (or the default size for an empty file)
+ * and uses the default cluster size.
  *
- * @param ctx Pointer to FAT32 context.
+ * @param ctx Pointer to FAT32 volume.
  * @return 0 on success, -1 on failure.
  */
 
-int fat32_format(Fat32Context* ctx) {
-    if (!ctx || !ctx->disk_file) return -1;
+int fat32_format(Fat32Volume* ctx) {
+    return fat32_format_opts(ctx, 0, 0);
+}
+
+/**
+ * @brief Body of fat32_format_opts(); the volume is locked exclusively.
+ */
+
+static int format_volume(Fat32Volume* ctx, uint64_t size, uint32_t cluster_size) {
+    if (!ctx->disk_file || ctx->txn) return -1;
+    
+    if (cluster_size == 0) cluster_size = CLUSTER_SIZE;
+    if (cluster_size < FAT32_MIN_CLUSTER_SIZE || cluster_size > FAT32_MAX_CLUSTER_SIZE ||
+        (cluster_size & (cluster_size - 1)) != 0) {
+        return -1;
+    }
+    
+    uint64_t image_size = fat32_image_size(ctx);
+    if (size == 0) {
+        size = image_size ? image_size : (uint64_t)TOTAL_SECTORS * SECTOR_SIZE;
+    }
+    uint64_t total_sectors = size >> SECTOR_SHIFT;
+    if (total_sectors > FAT32_MAX_SECTORS) {
+        return -1;
+    }
+    
+    uint32_t spc = cluster_size / SECTOR_SIZE;
+    if (total_sectors < RESERVED_SECTORS + (uint64_t)FAT_COUNT + 2 * spc) {
+        return -1;  // No room for a FAT and the root directory
+    }
+    
+    // From here on the old volume is gone: unmount it and orphan its handles
+    ctx->mounted = 0;
+    ctx->generation++;
+    ctx->open_count = 0;  // Orphaned handles no longer hold their entries
+    if ((total_sectors << SECTOR_SHIFT) != image_size &&
+        fat32_resize_image(ctx, total_sectors << SECTOR_SHIFT) != 0) {
+        return -1;
+    }
+    
+    // Sectors per FAT: 128 four-byte entries per sector for spc sectors each
+    uint64_t fat_span = (256 * (uint64_t)spc + FAT_COUNT) / 2;
+    uint64_t fat_size = (total_sectors - RESERVED_SECTORS + fat_span - 1) / fat_span;
     
     Fat32BootSector bs;
     memset(&bs, 0, sizeof(bs));
@@ -132,7 +345,7 @@ int fat32_format(Fat32Context* ctx) {
     bs.jump[2] = 0x90;
     memcpy(bs.oem, "MSWIN4.1", 8);
     bs.bytes_per_sector = SECTOR_SIZE;
-    bs.sectors_per_cluster = CLUSTER_SIZE / SECTOR_SIZE;
+    bs.sectors_per_cluster = spc;
     bs.reserved_sectors = RESERVED_SECTORS;
     bs.fat_count = FAT_COUNT;
     bs.root_entries = 0;  // FAT32 has root in data area
@@ -142,8 +355,8 @@ int fat32_format(Fat32Context* ctx) {
     bs.sectors_per_track = 32;
     bs.head_count = 64;
     bs.hidden_sectors = 0;
-    bs.total_sectors_32 = TOTAL_SECTORS;
-    bs.fat_size_32 = 256;  // Calculated for 20MB
+    bs.total_sectors_32 = (uint32_t)total_sectors;
+    bs.fat_size_32 = (uint32_t)fat_size;
     bs.ext_flags = 0;
     bs.fs_version = 0;
     bs.root_cluster = ROOT_CLUSTER;
@@ -156,17 +369,24 @@ int fat32_format(Fat32Context* ctx) {
     memcpy(bs.fs_type, "FAT32   ", 8);
     bs.signature = 0xAA55;
     
+    if (fat32_set_geometry(ctx, &bs) != 0) {
+        return -1;
+    }
     if (fat32_write_sector(ctx, 0, &bs) != 0) {
         return -1;
     }
+    memset(ctx->tail_cache, 0, sizeof(ctx->tail_cache));
+    ctx->alloc_cursor = 0;
     
-    // Calculate parameters
-    ctx->fat_size = bs.fat_size_32;
-    ctx->fat_start = bs.reserved_sectors;
-    ctx->data_start = bs.reserved_sectors + (bs.fat_count * bs.fat_size_32);
-    ctx->total_clusters = (TOTAL_SECTORS - ctx->data_start) / bs.sectors_per_cluster;
+    // Discard the data region so every cluster is known to be zero; where
+    // that is unsupported, stale contents stay and clusters are zeroed on use
+    fat32_discard_sectors(ctx, ctx->data_start, (uint64_t)ctx->total_clusters << ctx->spc_shift);
+    
+    // Clear every FAT copy at once (they are adjacent), then set the first sectors
+    if (fat32_zero_sectors(ctx, ctx->fat_start, (uint64_t)ctx->fat_size * ctx->fat_count) != 0) {
+        return -1;
+    }
     
-    // Initialize FAT tables
     uint8_t fat_sector[SECTOR_SIZE] = {0};
     
     // Mark first two FAT entries
@@ -174,24 +394,15 @@ int fat32_format(Fat32Context* ctx) {
     fat_entries[0] = 0x0FFFFFF8;  // Media type
     fat_entries[1] = 0x0FFFFFFF;  // EOF
     
-    for (int i = 0; i < FAT_COUNT; i++) {
+    for (uint32_t i = 0; i < ctx->fat_count; i++) {
         if (fat32_write_sector(ctx, ctx->fat_start + i * ctx->fat_size, fat_sector) != 0) {
             return -1;
         }
     }
     
-    // Clear remaining FAT sectors
-    memset(fat_sector, 0, SECTOR_SIZE);
-    for (int fat_copy = 0; fat_copy < FAT_COUNT; fat_copy++) {
-        for (uint32_t sector = 1; sector < ctx->fat_size; sector++) {
-            if (fat32_write_sector(ctx, ctx->fat_start + fat_copy * ctx->fat_size + sector, fat_sector) != 0) {
-                return -1;
-            }
-        }
-    }
-    
     // Create root directory
-    uint8_t root_cluster[CLUSTER_SIZE] = {0};
+    uint8_t root_cluster[FAT32_MAX_CLUSTER_SIZE];
+    memset(root_cluster, 0, ctx->cluster_size);
     DirEntry* entries = (DirEntry*)root_cluster;
     
     // Create "." entry
@@ -213,9 +424,37 @@ int fat32_format(Fat32Context* ctx) {
         return -1;
     }
     
+    ctx->mounted = 1;
     return 0;
 }
 
+/**
+ * @brief Formats the disk as FAT32 with the given geometry.
+ *
+ * Initializes boot sector, FAT tables, and root directory cluster. The
+ * image file is resized to @p size first. The FAT size follows the
+ * standard FAT32 computation, so every data cluster is addressable.
+ * Clearing the FATs is a quick format: one hole punch or a few large
+ * writes, independent of how many sectors the FATs span. The volume
+ * generation is bumped, which invalidates handles opened on the old
+ * volume, and the current directory of every session returns to the
+ * root. Formatting is refused while a transaction is open.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param size Volume size in bytes (0 keeps the current image size).
+ * @param cluster_size Bytes per cluster, a power of two from
+ *        FAT32_MIN_CLUSTER_SIZE to FAT32_MAX_CLUSTER_SIZE (0 for CLUSTER_SIZE).
+ * @return 0 on success, -1 on failure.
+ */
+
+int fat32_format_opts(Fat32Volume* ctx, uint64_t size, uint32_t cluster_size) {
+    if (!ctx || fat32_lock_exclusive(ctx) != 0) return -1;
+    
+    int result = format_volume(ctx, size, cluster_size);
+    fat32_unlock(ctx);
+    return result;
+}
+
 /**
  * @brief Converts a filename to FAT32 8.3 format.
  *
@@ -255,6 +494,35 @@ void fat32_format_name(const char* name, char* formatted_name) {
     
 }
 
+/**
+ * @brief Converts an 8.3 directory entry name to readable form.
+ *
+ * Trailing spaces are dropped from both parts and the dot is only
+ * added when there is an extension (e.g. "FILE    TXT" -> "FILE.TXT").
+ *
+ * @param entry Directory entry.
+ * @param name Output buffer of 13 bytes.
+ */
+
+void fat32_entry_name(const DirEntry* entry, char* name) {
+    int name_len = 8;
+    while (name_len > 0 && entry->name[name_len - 1] == ' ') {
+        name_len--;
+    }
+    memcpy(name, entry->name, name_len);
+    
+    int ext_len = 3;
+    while (ext_len > 0 && entry->name[8 + ext_len - 1] == ' ') {
+        ext_len--;
+    }
+    if (ext_len > 0) {
+        name[name_len++] = '.';
+        memcpy(name + name_len, entry->name + 8, ext_len);
+        name_len += ext_len;
+    }
+    name[name_len] = '\0';
+}
+
 /**
  * @brief Retrieves the cluster number from a directory entry.
  *
@@ -279,55 +547,97 @@ void fat32_set_cluster_to_entry(DirEntry* entry, uint32_t cluster) {
 }
 
 /**
- * @brief Creates a new directory in the current directory.
+ * @brief Stores a write time in a directory entry.
  *
- * @param ctx Pointer to FAT32 context.
- * @param name Name of new directory.
- * @return 0 on success, -1 on failure.
+ * FAT has no time zone field; the emulator stores UTC, which is what
+ * export-tar reads back. Times outside 1980-2107 are clamped.
+ *
+ * @param entry Pointer to DirEntry.
+ * @param when Seconds since the epoch.
+ * @param created Nonzero to set the creation and access dates as well.
  */
 
-int fat32_mkdir(Fat32Context* ctx, const char* name) {
-    if (!ctx || !name || strlen(name) == 0) return -1;
-    
-    uint8_t cluster[CLUSTER_SIZE];
-    if (fat32_read_cluster(ctx, ctx->current_cluster, cluster) != 0) {
-        return -1;
-    }
-    
-    DirEntry* entries = (DirEntry*)cluster;
-    int entry_count = CLUSTER_SIZE / sizeof(DirEntry);
-    
-    char formatted_name[11];
-    fat32_format_name(name, formatted_name);
-    
-    for (int i = 0; i < entry_count; i++) {
-        if (entries[i].name[0] == 0x00) break;  // End of directory
-        if ((uint8_t)entries[i].name[0] == 0xE5) continue;  // Deleted entry
-        
-        if (memcmp(entries[i].name, formatted_name, 11) == 0) {
-            return -1;  // Name exists
+void fat32_set_entry_time(DirEntry* entry, time_t when, int created) {
+    struct tm tm;
+    uint16_t date = (1 << 5) | 1;  // 1980-01-01
+    uint16_t time_of_day = 0;
+    if (gmtime_r(&when, &tm) && tm.tm_year >= 80) {
+        if (tm.tm_year > 207) {
+            date = (127 << 9) | (12 << 5) | 31;
+            time_of_day = (23 << 11) | (59 << 5) | 29;
+        } else {
+            date = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+            time_of_day = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
         }
     }
     
-    // Find free entry
-    int free_entry = -1;
-    for (int i = 0; i < entry_count; i++) {
-        if (entries[i].name[0] == 0x00 || (uint8_t)entries[i].name[0] == 0xE5) {
-            free_entry = i;
-            break;
+    entry->wrt_date = date;
+    entry->wrt_time = time_of_day;
+    if (created) {
+        entry->crt_date = date;
+        entry->crt_time = time_of_day;
+        entry->crt_time_tenth = 0;
+        entry->lst_acc_date = date;
+    }
+}
+
+/**
+ * @brief Runs an operation on the current directory of a session.
+ *
+ * Locks the volume shared and the current directory as requested, and
+ * rejects unmounted volumes and sessions kept out by another session's
+ * transaction (all callers create entries or change directory).
+ *
+ * @param session Session supplying the current directory.
+ * @param arg Argument passed to @p body.
+ * @param exclusive Nonzero if @p body changes the directory.
+ * @param body Operation to run.
+ * @return Result of @p body, or -1 on failure.
+ */
+
+static int in_cwd(Fat32Session* session, const char* arg, int exclusive,
+                  int (*body)(Fat32Session*, const char*)) {
+    if (!session || fat32_lock_shared(session->volume) != 0) return -1;
+    
+    Fat32Volume* ctx = session->volume;
+    int result = -1;
+    if (fat32_is_mounted(ctx) && !fat32_txn_denies(session)) {
+        uint32_t cwd = fat32_session_cwd(session);
+        if (fat32_lock_dir(ctx, cwd, exclusive) == 0) {
+            result = body(session, arg);
+            fat32_unlock_dir(ctx, cwd);
         }
     }
+    fat32_unlock(ctx);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_mkdir(); the volume is locked shared and the current directory exclusively.
+ */
+
+static int create_dir(Fat32Session* session, const char* name) {
+    if (!name || strlen(name) == 0) return -1;
+    
+    Fat32Volume* ctx = session->volume;
+    uint32_t cwd = fat32_session_cwd(session);
+    char formatted_name[11];
+    fat32_format_name(name, formatted_name);
     
-    if (free_entry == -1) {
-        return -1;  // No space in directory
+    // The whole chain is searched; the directory may have grown
+    if (fat32_find_entry(ctx, cwd, formatted_name, NULL, NULL, NULL) == 0) {
+        return -1;  // Name exists
     }
     
-    // Allocate new cluster for the directory
-    uint32_t new_cluster = fat32_find_free_cluster(ctx);
-    if (new_cluster == 0) return -1;
+    // Allocate new cluster for the directory (marked used before anyone else finds it)
+    Fat32Extent* extents;
+    uint32_t extent_count;
+    if (fat32_alloc_extents(ctx, 1, 0, &extents, &extent_count) != 0) return -1;
+    uint32_t new_cluster = extents[0].start;
+    free(extents);
     
     // Initialize new directory cluster
-    uint8_t new_dir[CLUSTER_SIZE] = {0};
+    uint8_t new_dir[FAT32_MAX_CLUSTER_SIZE] = {0};
     DirEntry* new_entries = (DirEntry*)new_dir;
     
     // Create "." entry
@@ -338,24 +648,27 @@ int fat32_mkdir(Fat32Context* ctx, const char* name) {
     // Create ".." entry
     memcpy(new_entries[1].name, "..         ", 11);
     new_entries[1].attr = ATTR_DIRECTORY;
-    fat32_set_cluster_to_entry(&new_entries[1], ctx->current_cluster);
-    
-    if (fat32_write_cluster(ctx, new_cluster, new_dir) != 0) {
+    fat32_set_cluster_to_entry(&new_entries[1], cwd);
+    
+    // A known-zero cluster only needs the "." and ".." entries written
+    int written = fat32_cluster_is_zero(ctx, new_cluster)
+                  ? fat32_write_data(ctx, new_cluster, 0, new_dir, 2 * sizeof(DirEntry))
+                  : fat32_write_cluster(ctx, new_cluster, new_dir);
+    if (written != 0) {
+        fat32_set_fat_entry(ctx, new_cluster, 0);
         return -1;
     }
     
-    // Mark cluster as used (EOF)
-    if (fat32_set_fat_entry(ctx, new_cluster, 0x0FFFFFFF) != 0) {
-        return -1;
-    }
-    
-    // Create directory entry in parent
-    memset(&entries[free_entry], 0, sizeof(DirEntry));
-    memcpy(entries[free_entry].name, formatted_name, 11);
-    entries[free_entry].attr = ATTR_DIRECTORY;
-    fat32_set_cluster_to_entry(&entries[free_entry], new_cluster);
+    // Create directory entry in parent (grows it when every slot is taken)
+    DirEntry entry;
+    memset(&entry, 0, sizeof(DirEntry));
+    memcpy(entry.name, formatted_name, 11);
+    entry.attr = ATTR_DIRECTORY;
+    fat32_set_cluster_to_entry(&entry, new_cluster);
+    fat32_set_entry_time(&entry, time(NULL), 1);
     
-    if (fat32_write_cluster(ctx, ctx->current_cluster, cluster) != 0) {
+    if (fat32_add_entry(ctx, cwd, &entry, NULL, NULL) != 0) {
+        fat32_set_fat_entry(ctx, new_cluster, 0);
         return -1;
     }
     
@@ -363,110 +676,98 @@ int fat32_mkdir(Fat32Context* ctx, const char* name) {
 }
 
 /**
- * @brief Creates a new empty file in the current directory.
+ * @brief Creates a new directory in the current directory.
  *
- * @param ctx Pointer to FAT32 context.
- * @param name Name of the file.
+ * @param session Session whose current directory receives the entry.
+ * @param name Name of new directory.
  * @return 0 on success, -1 on failure.
  */
 
-int fat32_touch(Fat32Context* ctx, const char* name) {
-    if (!ctx || !name || strlen(name) == 0) {
-        printf("Error: Invalid parameters\n");
-        return -1;
-    }
-    
-    printf("Debug: touch called with name '%s'\n", name);
-    
-    uint8_t cluster[CLUSTER_SIZE];
-    if (fat32_read_cluster(ctx, ctx->current_cluster, cluster) != 0) {
-        printf("Error: Cannot read current directory cluster\n");
+int fat32_mkdir(Fat32Session* session, const char* name) {
+    return in_cwd(session, name, 1, create_dir);
+}
+
+/**
+ * @brief Body of fat32_touch(); the volume is locked shared and the current directory exclusively.
+ */
+
+static int create_file(Fat32Session* session, const char* name) {
+    FILE* out = fat32_session_out(session);
+    if (!name || strlen(name) == 0) {
+        fprintf(out, "Error: Invalid parameters\n");
         return -1;
     }
     
-    DirEntry* entries = (DirEntry*)cluster;
-    int entry_count = CLUSTER_SIZE / sizeof(DirEntry);
+    fprintf(out, "Debug: touch called with name '%s'\n", name);
     
+    Fat32Volume* ctx = session->volume;
+    uint32_t cwd = fat32_session_cwd(session);
     char formatted_name[11];
     fat32_format_name(name, formatted_name);
     
-    printf("Debug: Formatted name: '");
+    fprintf(out, "Debug: Formatted name: '");
     for (int i = 0; i < 11; i++) {
-        printf("%c", formatted_name[i] == ' ' ? '.' : formatted_name[i]);
+        fputc(formatted_name[i] == ' ' ? '.' : formatted_name[i], out);
     }
-    printf("'\n");
+    fprintf(out, "'\n");
     
-    for (int i = 0; i < entry_count; i++) {
-        if (entries[i].name[0] == 0x00) break;
-        if ((uint8_t)entries[i].name[0] == 0xE5) continue;
-        
-        printf("Debug: Existing entry %d: '", i);
-        for (int j = 0; j < 11; j++) {
-            printf("%c", entries[i].name[j] == ' ' ? '.' : entries[i].name[j]);
-        }
-        printf("'\n");
-        
-        if (memcmp(entries[i].name, formatted_name, 11) == 0) {
-            printf("Error: Name already exists\n");
-            return -1;  // Name exists
-        }
-    }
-    
-    int free_entry = -1;
-    for (int i = 0; i < entry_count; i++) {
-        if (entries[i].name[0] == 0x00 || (uint8_t)entries[i].name[0] == 0xE5) {
-            free_entry = i;
-            printf("Debug: Found free entry at position %d\n", i);
-            break;
-        }
-    }
-    
-    if (free_entry == -1) {
-        printf("Error: No free directory entries\n");
-        return -1;
+    // The whole chain is searched; the directory may have grown
+    if (fat32_find_entry(ctx, cwd, formatted_name, NULL, NULL, NULL) == 0) {
+        fprintf(out, "Error: Name already exists\n");
+        return -1;  // Name exists
     }
     
-    memset(&entries[free_entry], 0, sizeof(DirEntry));
-    memcpy(entries[free_entry].name, formatted_name, 11);
-    entries[free_entry].attr = ATTR_ARCHIVE;
-    entries[free_entry].file_size = 0;
-    fat32_set_cluster_to_entry(&entries[free_entry], 0);
+    DirEntry entry;
+    memset(&entry, 0, sizeof(DirEntry));
+    memcpy(entry.name, formatted_name, 11);
+    entry.attr = ATTR_ARCHIVE;
+    entry.file_size = 0;
+    fat32_set_cluster_to_entry(&entry, 0);
+    fat32_set_entry_time(&entry, time(NULL), 1);
     
-    printf("Debug: Creating file entry with name '");
+    fprintf(out, "Debug: Creating file entry with name '");
     for (int i = 0; i < 11; i++) {
-        printf("%c", entries[free_entry].name[i] == ' ' ? '.' : entries[free_entry].name[i]);
+        fputc(entry.name[i] == ' ' ? '.' : entry.name[i], out);
     }
-    printf("'\n");
+    fprintf(out, "'\n");
     
-    if (fat32_write_cluster(ctx, ctx->current_cluster, cluster) != 0) {
-        printf("Error: Cannot write directory cluster\n");
+    if (fat32_add_entry(ctx, cwd, &entry, NULL, NULL) != 0) {
+        fprintf(out, "Error: Cannot write directory entry\n");
         return -1;
     }
     
-    printf("Debug: File created successfully\n");
+    fprintf(out, "Debug: File created successfully\n");
     return 0;
 }
 
 /**
- * @brief Changes the current directory.
- *
- * Supports "/", ".", "..", and immediate subdirectories.
+ * @brief Creates a new empty file in the current directory.
  *
- * @param ctx Pointer to FAT32 context.
- * @param path Path to change to.
+ * @param session Session whose current directory receives the entry.
+ * @param name Name of the file.
  * @return 0 on success, -1 on failure.
  */
 
-int fat32_cd(Fat32Context* ctx, const char* path) {
-    if (!ctx || !path) return -1;
+int fat32_touch(Fat32Session* session, const char* name) {
+    return in_cwd(session, name, 1, create_file);
+}
+
+/**
+ * @brief Body of fat32_cd(); the volume and the current directory are locked shared.
+ */
+
+static int change_dir(Fat32Session* session, const char* path) {
+    if (!path) return -1;
     
     if (path[0] != '/') {
         return -1;
     }
     
+    Fat32Volume* ctx = session->volume;
+    fat32_session_cwd(session);
     if (strcmp(path, "/") == 0) {
-        ctx->current_cluster = ROOT_CLUSTER;
-        strcpy(ctx->current_path, "/");
+        session->current_cluster = ROOT_CLUSTER;
+        strcpy(session->current_path, "/");
         return 0;
     }
     
@@ -480,89 +781,312 @@ int fat32_cd(Fat32Context* ctx, const char* path) {
     
     if (strcmp(dir_name, "..") == 0) {
         // Go to parent directory
-        if (ctx->current_cluster == ROOT_CLUSTER) {
+        if (session->current_cluster == ROOT_CLUSTER) {
             // Already at root, stay here
             return 0;
         }
         
-        // Read current directory to find ".." entry
-        uint8_t cluster[CLUSTER_SIZE];
-        if (fat32_read_cluster(ctx, ctx->current_cluster, cluster) != 0) {
+        // Find ".." entry to get parent cluster
+        DirEntry parent;
+        if (fat32_find_entry(ctx, session->current_cluster, "..         ", &parent, NULL, NULL) != 0) {
             return -1;
         }
+        session->current_cluster = fat32_get_cluster_from_entry(&parent);
         
-        DirEntry* entries = (DirEntry*)cluster;
-        int entry_count = CLUSTER_SIZE / sizeof(DirEntry);
-        
-        // Find ".." entry to get parent cluster
-        for (int i = 0; i < entry_count; i++) {
-            if (entries[i].name[0] == 0x00) break;
-            if ((uint8_t)entries[i].name[0] == 0xE5) continue;
-            
-            if (strncmp(entries[i].name, "..         ", 11) == 0) {
-                uint32_t parent_cluster = fat32_get_cluster_from_entry(&entries[i]);
-                ctx->current_cluster = parent_cluster;
-                
-                // Update current path - go up one level
-                char* last_slash = strrchr(ctx->current_path, '/');
-                if (last_slash && last_slash != ctx->current_path) {
-                    *last_slash = '\0';
-                } else {
-                    strcpy(ctx->current_path, "/");
-                }
-                return 0;
-            }
+        // Update current path - go up one level
+        char* last_slash = strrchr(session->current_path, '/');
+        if (last_slash && last_slash != session->current_path) {
+            *last_slash = '\0';
+        } else {
+            strcpy(session->current_path, "/");
         }
-        return -1;
+        return 0;
     }
     
     // For now, keep simple implementation - only handles immediate subdirectories
     if (strchr(dir_name, '/') != NULL) {
-        printf("Multi-level paths not supported in this version\n");
+        fprintf(fat32_session_out(session), "Multi-level paths not supported in this version\n");
         return -1;
     }
     
-    // Read current directory
-    uint8_t cluster[CLUSTER_SIZE];
-    if (fat32_read_cluster(ctx, ctx->current_cluster, cluster) != 0) {
+    char formatted_name[11];
+    fat32_format_name(dir_name, formatted_name);
+    
+    // Search the whole directory chain
+    DirEntry entry;
+    if (fat32_find_entry(ctx, session->current_cluster, formatted_name, &entry, NULL, NULL) != 0 ||
+        !(entry.attr & ATTR_DIRECTORY)) {
         return -1;
     }
     
-    DirEntry* entries = (DirEntry*)cluster;
-    int entry_count = CLUSTER_SIZE / sizeof(DirEntry);
+    session->current_cluster = fat32_get_cluster_from_entry(&entry);
+    snprintf(session->current_path, sizeof(session->current_path), "/%s", dir_name);
+    return 0;
+}
+
+/**
+ * @brief Changes the current directory.
+ *
+ * Supports "/", ".", "..", and immediate subdirectories.
+ *
+ * @param session Session whose current directory changes.
+ * @param path Path to change to.
+ * @return 0 on success, -1 on failure.
+ */
+
+int fat32_cd(Fat32Session* session, const char* path) {
+    return in_cwd(session, path, 0, change_dir);
+}
+
+/**
+ * @brief Prints one directory entry name for fat32_ls() to the stream in @p arg.
+ */
+
+static int print_entry(const DirEntry* entry, void* arg) {
+    char name[13];
+    fat32_entry_name(entry, name);
+    fprintf((FILE*)arg, "%s\n", name);
+    return 0;
+}
+
+/**
+ * @brief Lists the contents of a directory.
+ *
+ * Supports current directory or a simple absolute path (one level).
+ *
+ * @param session Session supplying the current directory.
+ * @param path Optional path (NULL to list current directory).
+ * @return 0 on success, -1 on failure.
+ */
+
+int fat32_ls(Fat32Session* session, const char* path) {
+    return fat32_ls_each(session, path, print_entry, fat32_session_out(session));
+}
+
+/**
+ * @brief Looks up an entry with its directory locked shared.
+ *
+ * @param ctx Pointer to FAT32 volume (locked).
+ * @param dir_cluster First cluster of the directory to search.
+ * @param formatted_name 11-byte name as produced by fat32_format_name().
+ * @param entry Output copy of the entry (may be NULL).
+ * @return 0 if found, -1 otherwise.
+ */
+
+static int find_locked(Fat32Volume* ctx, uint32_t dir_cluster, const char* formatted_name, DirEntry* entry) {
+    if (fat32_lock_dir(ctx, dir_cluster, 0) != 0) return -1;
+    
+    int result = fat32_find_entry(ctx, dir_cluster, formatted_name, entry, NULL, NULL);
+    fat32_unlock_dir(ctx, dir_cluster);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_stat(); the volume is locked shared.
+ */
+
+static int stat_path(Fat32Session* session, const char* path, DirEntry* entry) {
+    if (path[0] == '/' && path[strspn(path, "/")] == '\0') {
+        memset(entry, 0, sizeof(DirEntry));
+        memcpy(entry->name, "/          ", 11);
+        entry->attr = ATTR_DIRECTORY;
+        fat32_set_cluster_to_entry(entry, ROOT_CLUSTER);
+        return 0;
+    }
+    
+    uint32_t dir_cluster;
     char formatted_name[11];
-    fat32_format_name(dir_name, formatted_name);
+    if (fat32_resolve_parent(session, path, &dir_cluster, formatted_name) != 0) {
+        return -1;
+    }
+    return find_locked(session->volume, dir_cluster, formatted_name, entry);
+}
+
+/**
+ * @brief Looks up the directory entry of a path.
+ *
+ * The root directory has no entry of its own; a synthesized directory
+ * entry pointing at ROOT_CLUSTER is returned for "/".
+ *
+ * @param session Session supplying the current directory.
+ * @param path Absolute path, or relative to the current directory.
+ * @param entry Output directory entry.
+ * @return 0 on success, -1 if the path does not exist.
+ */
+
+int fat32_stat(Fat32Session* session, const char* path, DirEntry* entry) {
+    if (!session || !path || !entry || fat32_lock_shared(session->volume) != 0) return -1;
     
-    // Search for directory
-    for (int i = 0; i < entry_count; i++) {
-        if (entries[i].name[0] == 0x00) break;
-        if ((uint8_t)entries[i].name[0] == 0xE5) continue;
+    int result = fat32_is_mounted(session->volume) ? stat_path(session, path, entry) : -1;
+    fat32_unlock(session->volume);
+    return result;
+}
+
+/**
+ * @brief Tells whether a directory lies inside the subtree of another.
+ *
+ * Follows ".." entries up to the root. Only renames that move a
+ * directory change those entries, and they hold the rename lock, so the
+ * walk needs no directory locks.
+ *
+ * @param ctx Pointer to FAT32 volume (rename lock held).
+ * @param dir First cluster of the directory to test.
+ * @param top First cluster of the subtree's top directory.
+ * @return Nonzero if @p dir is @p top or below it, or if the walk fails.
+ */
+
+static int in_subtree(Fat32Volume* ctx, uint32_t dir, uint32_t top) {
+    for (uint32_t depth = 0; depth < ctx->total_clusters; depth++) {
+        if (dir == top) return 1;
+        if (dir == ROOT_CLUSTER) return 0;
         
-        if ((entries[i].attr & ATTR_DIRECTORY) && 
-            memcmp(entries[i].name, formatted_name, 11) == 0) {
-            
-            uint32_t new_cluster = fat32_get_cluster_from_entry(&entries[i]);
-            ctx->current_cluster = new_cluster;
-            snprintf(ctx->current_path, sizeof(ctx->current_path), "/%s", dir_name);
-            return 0;
+        DirEntry parent;
+        if (fat32_find_entry(ctx, dir, "..         ", &parent, NULL, NULL) != 0) {
+            return 1;
+        }
+        dir = fat32_get_cluster_from_entry(&parent);
+        if (dir == 0) {
+            dir = ROOT_CLUSTER;  // ".." of a first-level directory
+        }
+    }
+    return 1;  // Loop in the tree
+}
+
+/**
+ * @brief Moves an entry; both directories are locked exclusively.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param old_dir First cluster of the source directory.
+ * @param old_name 8.3 name of the entry.
+ * @param new_dir First cluster of the destination directory.
+ * @param new_name New 8.3 name.
+ * @param moved Directory the entry was looked up as, locked exclusively
+ *        when it changes parent (0 for a file).
+ * @return 0 on success, -1 on failure.
+ */
+
+static int move_entry(Fat32Volume* ctx, uint32_t old_dir, const char* old_name,
+                      uint32_t new_dir, const char* new_name, uint32_t moved) {
+    DirEntry entry;
+    uint32_t entry_cluster, entry_index;
+    if (fat32_find_entry(ctx, old_dir, old_name, &entry, &entry_cluster, &entry_index) != 0 ||
+        (entry.attr & ATTR_VOLUME_ID) ||
+        fat32_find_entry(ctx, new_dir, new_name, NULL, NULL, NULL) == 0) {
+        return -1;  // Missing source or existing target
+    }
+    
+    memcpy(entry.name, new_name, 11);
+    if (old_dir == new_dir) {
+        return fat32_update_entry(ctx, entry_cluster, entry_index, &entry);
+    }
+    if (fat32_entry_in_use(ctx, entry_cluster, entry_index)) {
+        return -1;  // Open handles keep the slot of their entry
+    }
+    
+    uint32_t cluster = fat32_get_cluster_from_entry(&entry);
+    int is_dir = (entry.attr & ATTR_DIRECTORY) != 0;
+    if (is_dir && cluster != moved) {
+        return -1;  // Replaced since it was looked up, so its ".." is not locked
+    }
+    if (is_dir && in_subtree(ctx, new_dir, cluster)) {
+        return -1;  // A directory cannot move below itself
+    }
+    if (fat32_add_entry(ctx, new_dir, &entry, NULL, NULL) != 0) {
+        return -1;
+    }
+    
+    DirEntry old_entry = entry;
+    memcpy(old_entry.name, old_name, 11);
+    old_entry.name[0] = (char)0xE5;  // Deleted
+    if (fat32_update_entry(ctx, entry_cluster, entry_index, &old_entry) != 0) {
+        return -1;
+    }
+    
+    if (is_dir) {
+        DirEntry dotdot;
+        if (fat32_read_entry(ctx, cluster, 1, &dotdot) != 0) {
+            return -1;
         }
+        fat32_set_cluster_to_entry(&dotdot, new_dir);
+        return fat32_update_entry(ctx, cluster, 1, &dotdot);
+    }
+    return 0;
+}
+
+/**
+ * @brief Body of fat32_rename(); the volume is locked shared.
+ *
+ * Both paths are resolved first. Then the two parent directories, and a
+ * directory that changes parent (its ".." is rewritten), are locked in
+ * lock order (see lock.c), after the rename lock when the parents differ.
+ */
+
+static int rename_path(Fat32Session* session, const char* old_path, const char* new_path) {
+    Fat32Volume* ctx = session->volume;
+    uint32_t old_dir, new_dir;
+    char old_name[11], new_name[11];
+    DirEntry entry;
+    if (fat32_resolve_parent(session, old_path, &old_dir, old_name) != 0 ||
+        fat32_resolve_parent(session, new_path, &new_dir, new_name) != 0 ||
+        find_locked(ctx, old_dir, old_name, &entry) != 0) {
+        return -1;
+    }
+    if (old_name[0] == '.' || new_name[0] == '.') {
+        return -1;  // "." and ".." are not renamed
     }
     
-    return -1;
+    int moves = old_dir != new_dir;
+    uint32_t dirs[3] = { old_dir, new_dir, 0 };
+    int dir_count = 2;
+    if (moves && (entry.attr & ATTR_DIRECTORY)) {
+        dirs[dir_count++] = fat32_get_cluster_from_entry(&entry);
+    }
+    if (moves) {
+        pthread_mutex_lock(&ctx->rename_lock);
+    }
+    int result = -1;
+    if (fat32_lock_dirs(ctx, dirs, dir_count) == 0) {
+        result = move_entry(ctx, old_dir, old_name, new_dir, new_name, dirs[2]);
+        fat32_unlock_dirs(ctx, dirs, dir_count);
+    }
+    if (moves) {
+        pthread_mutex_unlock(&ctx->rename_lock);
+    }
+    return result;
 }
 
 /**
- * @brief Lists the contents of a directory.
+ * @brief Renames or moves a file or directory.
  *
- * Supports current directory or a simple absolute path (one level).
+ * The entry keeps its clusters; only directory entries change. Handles
+ * refer to the slot of their entry, so a file with open handles may be
+ * renamed within its directory but not moved to another one.
  *
- * @param ctx Pointer to FAT32 context.
- * @param path Optional path (NULL to list current directory).
+ * @param session Session supplying the current directory.
+ * @param old_path Existing path.
+ * @param new_path New path; its parent must exist and the name must be free.
  * @return 0 on success, -1 on failure.
  */
 
-int fat32_ls(Fat32Context* ctx, const char* path) {
-    uint32_t target_cluster = ctx->current_cluster;
+int fat32_rename(Fat32Session* session, const char* old_path, const char* new_path) {
+    if (!session || !old_path || !new_path || fat32_lock_shared(session->volume) != 0) return -1;
+    
+    int result = fat32_is_mounted(session->volume) && !fat32_txn_denies(session)
+        ? rename_path(session, old_path, new_path) : -1;
+    fat32_unlock(session->volume);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_ls_each(); the volume is locked shared.
+ *
+ * The root is locked shared while a path is looked up in it, then the
+ * listed directory while its entries are passed to @p fn.
+ */
+
+static int list_dir(Fat32Session* session, const char* path, Fat32EntryFn fn, void* arg) {
+    Fat32Volume* ctx = session->volume;
+    uint32_t target_cluster = fat32_session_cwd(session);
     
     if (path) {
         if (strcmp(path, "/") == 0) {
@@ -575,13 +1099,18 @@ int fat32_ls(Fat32Context* ctx, const char* path) {
                 fat32_format_name(dir_name, formatted_name);
                 
                 // Read root directory
-                uint8_t cluster[CLUSTER_SIZE];
-                if (fat32_read_cluster(ctx, ROOT_CLUSTER, cluster) != 0) {
+                uint8_t cluster[FAT32_MAX_CLUSTER_SIZE];
+                if (fat32_lock_dir(ctx, ROOT_CLUSTER, 0) != 0) {
+                    return -1;
+                }
+                int read = fat32_read_cluster(ctx, ROOT_CLUSTER, cluster);
+                fat32_unlock_dir(ctx, ROOT_CLUSTER);
+                if (read != 0) {
                     return -1;
                 }
                 
                 DirEntry* entries = (DirEntry*)cluster;
-                int entry_count = CLUSTER_SIZE / sizeof(DirEntry);
+                int entry_count = ctx->cluster_size / sizeof(DirEntry);
                 for (int i = 0; i < entry_count; i++) {
                     if (entries[i].name[0] == 0x00) break;
                     if ((uint8_t)entries[i].name[0] == 0xE5) continue;
@@ -596,46 +1125,326 @@ int fat32_ls(Fat32Context* ctx, const char* path) {
         }
     }
     
-    // Read directory
-    uint8_t cluster[CLUSTER_SIZE];
-    if (fat32_read_cluster(ctx, target_cluster, cluster) != 0) {
+    uint8_t cluster[FAT32_MAX_CLUSTER_SIZE];
+    DirEntry* entries = (DirEntry*)cluster;
+    int entry_count = ctx->cluster_size / sizeof(DirEntry);
+    int end_of_dir = 0;
+    int result = 0;
+    uint32_t dir_cluster = target_cluster;
+    if (fat32_lock_dir(ctx, dir_cluster, 0) != 0) {
         return -1;
     }
     
+    // Read directory cluster by cluster along its chain
+    while (result == 0 && !end_of_dir && target_cluster >= 2 && target_cluster < FAT_EOC_MIN) {
+        if (fat32_read_cluster(ctx, target_cluster, cluster) != 0) {
+            result = -1;
+            break;
+        }
+        
+        // List entries
+        for (int i = 0; i < entry_count; i++) {
+            if (entries[i].name[0] == 0x00) {
+                end_of_dir = 1;  // End of directory
+                break;
+            }
+            if ((uint8_t)entries[i].name[0] == 0xE5) continue;  // Deleted entry
+            
+            if (fn(&entries[i], arg) != 0) {
+                result = -1;
+                break;
+            }
+        }
+        target_cluster = fat32_get_fat_entry(ctx, target_cluster);
+    }
+    
+    fat32_unlock_dir(ctx, dir_cluster);
+    return result;
+}
+
+/**
+ * @brief Calls a function for every entry of a directory.
+ *
+ * Resolves @p path like fat32_ls() and streams the entries cluster by
+ * cluster, so callers can emit huge directories incrementally. @p fn
+ * runs with the volume and the directory locked shared and must not
+ * modify the volume.
+ *
+ * @param session Session supplying the current directory.
+ * @param path Optional path (NULL for the current directory).
+ * @param fn Called for each live entry; a nonzero return stops the listing.
+ * @param arg Passed to @p fn.
+ * @return 0 on success, -1 on failure or when @p fn stopped the listing.
+ */
+
+int fat32_ls_each(Fat32Session* session, const char* path, Fat32EntryFn fn, void* arg) {
+    if (!session || !fn || fat32_lock_shared(session->volume) != 0) return -1;
+    
+    int result = fat32_is_mounted(session->volume) ? list_dir(session, path, fn, arg) : -1;
+    fat32_unlock(session->volume);
+    return result;
+}
+
+/**
+ * @brief Looks up an entry by its 8.3 name in a directory.
+ *
+ * Follows the directory's cluster chain, so entries beyond the first
+ * cluster are found as well.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param dir_cluster First cluster of the directory to search.
+ * @param formatted_name 11-byte name as produced by fat32_format_name().
+ * @param entry Output copy of the entry (may be NULL).
+ * @param entry_cluster Output cluster holding the entry (may be NULL).
+ * @param entry_index Output index of the entry within that cluster (may be NULL).
+ * @return 0 if found, -1 otherwise.
+ */
+
+int fat32_find_entry(Fat32Volume* ctx, uint32_t dir_cluster, const char* formatted_name,
+                     DirEntry* entry, uint32_t* entry_cluster, uint32_t* entry_index) {
+    uint8_t cluster[FAT32_MAX_CLUSTER_SIZE];
     DirEntry* entries = (DirEntry*)cluster;
-    int entry_count = CLUSTER_SIZE / sizeof(DirEntry);
+    int entry_count = ctx->cluster_size / sizeof(DirEntry);
     
-    // List entries
-    for (int i = 0; i < entry_count; i++) {
-        if (entries[i].name[0] == 0x00) break;  // End of directory
-        if ((uint8_t)entries[i].name[0] == 0xE5) continue;  // Deleted entry
-        
-        // Convert 8.3 name to readable format
-        char name[13];
-        memcpy(name, entries[i].name, 8);
-        name[8] = '\0';
-        
-        // Trim trailing spaces from name
-        int name_len = 8;
-        while (name_len > 0 && name[name_len - 1] == ' ') {
-            name_len--;
+    while (dir_cluster >= 2 && dir_cluster < FAT_EOC_MIN) {
+        if (fat32_read_cluster(ctx, dir_cluster, cluster) != 0) {
+            return -1;
         }
-        name[name_len] = '\0';
         
-        if (entries[i].name[8] != ' ') {
-            strcat(name, ".");
-            strncat(name, entries[i].name + 8, 3);
+        for (int i = 0; i < entry_count; i++) {
+            if (entries[i].name[0] == 0x00) return -1;  // End of directory
+            if ((uint8_t)entries[i].name[0] == 0xE5) continue;  // Deleted entry
             
-            // Trim trailing spaces from extension
-            int ext_len = 3;
-            while (ext_len > 0 && name[strlen(name) - 1] == ' ') {
-                name[strlen(name) - 1] = '\0';
-                ext_len--;
+            if (memcmp(entries[i].name, formatted_name, 11) == 0) {
+                if (entry) *entry = entries[i];
+                if (entry_cluster) *entry_cluster = dir_cluster;
+                if (entry_index) *entry_index = i;
+                return 0;
             }
         }
+        dir_cluster = fat32_get_fat_entry(ctx, dir_cluster);
+    }
+    return -1;
+}
+
+/**
+ * @brief Stores a new entry in the first free slot of a directory.
+ *
+ * Only the sector holding the slot is rewritten. When every cluster of
+ * the directory is full, a zeroed cluster is appended to its chain (a
+ * cluster known to be zero gets just the new entry written).
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param dir_cluster First cluster of the directory.
+ * @param entry Entry to store.
+ * @param entry_cluster Output cluster holding the new entry (may be NULL).
+ * @param entry_index Output index of the entry within that cluster (may be NULL).
+ * @return 0 on success, -1 if the disk is full or on I/O failure.
+ */
+
+int fat32_add_entry(Fat32Volume* ctx, uint32_t dir_cluster, const DirEntry* entry,
+                    uint32_t* entry_cluster, uint32_t* entry_index) {
+    uint8_t cluster[FAT32_MAX_CLUSTER_SIZE];
+    DirEntry* entries = (DirEntry*)cluster;
+    int entry_count = ctx->cluster_size / sizeof(DirEntry);
+    
+    while (dir_cluster >= 2 && dir_cluster < FAT_EOC_MIN) {
+        if (fat32_read_cluster(ctx, dir_cluster, cluster) != 0) {
+            return -1;
+        }
+        
+        for (int i = 0; i < entry_count; i++) {
+            if (entries[i].name[0] == 0x00 || (uint8_t)entries[i].name[0] == 0xE5) {
+                if (fat32_update_entry(ctx, dir_cluster, i, entry) != 0) {
+                    return -1;
+                }
+                if (entry_cluster) *entry_cluster = dir_cluster;
+                if (entry_index) *entry_index = i;
+                return 0;
+            }
+        }
+        
+        uint32_t next = fat32_get_fat_entry(ctx, dir_cluster);
+        if (next >= 2 && next < FAT_EOC_MIN) {
+            dir_cluster = next;
+            continue;
+        }
+        
+        // Directory is full: grow it by one zeroed cluster
+        Fat32Extent* extents;
+        uint32_t extent_count;
+        if (fat32_alloc_extents(ctx, 1, dir_cluster, &extents, &extent_count) != 0) {
+            return -1;
+        }
+        dir_cluster = extents[0].start;
+        free(extents);
+        
+        int written;
+        if (fat32_cluster_is_zero(ctx, dir_cluster)) {
+            written = fat32_write_data(ctx, dir_cluster, 0, entry, sizeof(DirEntry));
+        } else {
+            memset(cluster, 0, ctx->cluster_size);
+            memcpy(cluster, entry, sizeof(DirEntry));
+            written = fat32_write_cluster(ctx, dir_cluster, cluster);
+        }
+        if (written != 0) {
+            return -1;
+        }
+        if (entry_cluster) *entry_cluster = dir_cluster;
+        if (entry_index) *entry_index = 0;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Reads a single directory entry.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param entry_cluster Cluster holding the entry.
+ * @param entry_index Index of the entry within the cluster.
+ * @param entry Output entry.
+ * @return 0 on success, -1 on failure.
+ */
+
+int fat32_read_entry(Fat32Volume* ctx, uint32_t entry_cluster, uint32_t entry_index, DirEntry* entry) {
+    if (entry_index >= ctx->cluster_size / sizeof(DirEntry)) return -1;
+    
+    uint32_t byte_offset = entry_index * sizeof(DirEntry);
+    uint32_t sector = (uint32_t)(fat32_cluster_offset(ctx, entry_cluster) >> SECTOR_SHIFT)
+                      + byte_offset / SECTOR_SIZE;
+    
+    uint8_t buffer[SECTOR_SIZE];
+    if (fat32_read_sector(ctx, sector, buffer) != 0) {
+        return -1;
+    }
+    memcpy(entry, buffer + byte_offset % SECTOR_SIZE, sizeof(DirEntry));
+    return 0;
+}
+
+/**
+ * @brief Overwrites a single directory entry in place.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param entry_cluster Cluster holding the entry.
+ * @param entry_index Index of the entry within the cluster.
+ * @param entry New entry contents.
+ * @return 0 on success, -1 on failure.
+ */
+
+int fat32_update_entry(Fat32Volume* ctx, uint32_t entry_cluster, uint32_t entry_index, const DirEntry* entry) {
+    if (entry_index >= ctx->cluster_size / sizeof(DirEntry)) return -1;
+    
+    uint32_t byte_offset = entry_index * sizeof(DirEntry);
+    uint32_t sector = (uint32_t)(fat32_cluster_offset(ctx, entry_cluster) >> SECTOR_SHIFT)
+                      + byte_offset / SECTOR_SIZE;
+    
+    uint8_t buffer[SECTOR_SIZE];
+    if (fat32_read_sector(ctx, sector, buffer) != 0) {
+        return -1;
+    }
+    memcpy(buffer + byte_offset % SECTOR_SIZE, entry, sizeof(DirEntry));
+    return fat32_write_sector(ctx, sector, buffer);
+}
+
+/**
+ * @brief Resolves the parent directory of a path.
+ *
+ * Absolute paths start at the root, relative ones at the current
+ * directory. Intermediate components may be ".", ".." or subdirectory
+ * names; the last component is returned in 8.3 form without being looked up.
+ * Each directory on the way is locked shared while it is searched, so
+ * the caller must not hold a directory lock.
+ *
+ * @param session Session supplying the current directory (volume locked).
+ * @param path Path to resolve (e.g. "/dir/file.txt" or "file.txt").
+ * @param dir_cluster Output first cluster of the parent directory.
+ * @param formatted_name Output buffer of 11 bytes for the last component.
+ * @return 0 on success, -1 if a component is missing or the path is empty.
+ */
+
+int fat32_resolve_parent(Fat32Session* session, const char* path, uint32_t* dir_cluster, char* formatted_name) {
+    if (!session || !path) return -1;
+    
+    Fat32Volume* ctx = session->volume;
+    uint32_t cluster = ROOT_CLUSTER;
+    if (path[0] != '/') {
+        cluster = fat32_session_cwd(session);
+    }
+    
+    char component[256];
+    const char* p = path;
+    while (1) {
+        while (*p == '/') p++;
+        if (*p == '\0') return -1;  // No last component
+        
+        size_t len = strcspn(p, "/");
+        if (len >= sizeof(component)) return -1;
+        memcpy(component, p, len);
+        component[len] = '\0';
+        p += len;
+        
+        while (*p == '/') p++;
+        if (*p == '\0') break;  // component is the last one
         
-        printf("%s\n", name);
+        if (strcmp(component, ".") == 0) continue;
+        
+        char name[11];
+        fat32_format_name(component, name);
+        DirEntry entry;
+        if (find_locked(ctx, cluster, name, &entry) != 0 || !(entry.attr & ATTR_DIRECTORY)) {
+            return -1;
+        }
+        cluster = fat32_get_cluster_from_entry(&entry);
+        if (cluster == 0) {
+            cluster = ROOT_CLUSTER;  // ".." of a first-level directory
+        }
     }
     
+    *dir_cluster = cluster;
+    fat32_format_name(component, formatted_name);
+    return 0;
+}
+
+/**
+ * @brief Resolves a path that must name an existing directory.
+ *
+ * Locks directories like fat32_resolve_parent().
+ *
+ * @param session Session supplying the current directory (volume locked).
+ * @param path Directory path ("/" and relative paths are accepted).
+ * @param dir_cluster Output first cluster of the directory.
+ * @return 0 on success, -1 if the path does not name a directory.
+ */
+
+int fat32_resolve_dir(Fat32Session* session, const char* path, uint32_t* dir_cluster) {
+    if (!session || !path || !dir_cluster) return -1;
+    
+    Fat32Volume* ctx = session->volume;
+    const char* p = path;
+    while (*p == '/') p++;
+    if (*p == '\0' || strcmp(path, ".") == 0) {
+        *dir_cluster = *path == '/' ? ROOT_CLUSTER : fat32_session_cwd(session);
+        return 0;
+    }
+    
+    uint32_t parent;
+    char name[11];
+    if (fat32_resolve_parent(session, path, &parent, name) != 0) {
+        return -1;
+    }
+    if (memcmp(name, ".          ", 11) == 0) {
+        *dir_cluster = parent;
+        return 0;
+    }
+    
+    DirEntry entry;
+    if (find_locked(ctx, parent, name, &entry) != 0 || !(entry.attr & ATTR_DIRECTORY)) {
+        return -1;
+    }
+    *dir_cluster = fat32_get_cluster_from_entry(&entry);
+    if (*dir_cluster == 0) {
+        *dir_cluster = ROOT_CLUSTER;  // ".." of a first-level directory
+    }
     return 0;
 }
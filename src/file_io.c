@@ -0,0 +1,1400 @@
+/**
+ * @file file_io.c
+ * @brief File handle operations for the FAT32 emulator.
+ *
+ * Implements open/read/write/readv/writev/lseek/flush/close on files stored in cluster
+ * chains. Each handle caches the chain it has walked so far, so
+ * sequential access only follows the FAT one link at a time and never
+ * restarts from the first cluster. Appended data is buffered and given
+ * clusters only when the handle is flushed (delayed allocation).
+ *
+ * Handle operations lock the volume shared and the directory holding the
+ * file: shared while they only read, exclusively once they allocate
+ * clusters or update the directory entry. Writers to files of one
+ * directory therefore wait for each other, but not for other
+ * directories. A handle itself is used by one thread at a time.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "fat32.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * @brief Position within a list of caller buffers (iovec list).
+ */
+typedef struct {
+    const struct iovec* iov; /**< Segments */
+    int iovcnt;              /**< Number of segments */
+    int index;               /**< Current segment */
+    size_t offset;           /**< Offset within the current segment */
+} IovCursor;
+
+/**
+ * @brief Tells whether a handle may be used.
+ *
+ * Handles opened before the volume was last formatted, or before their
+ * session aborted a transaction, may refer to clusters that no longer
+ * belong to them and are rejected.
+ *
+ * @param file Handle to check.
+ * @return Nonzero if the handle is open on the current volume.
+ */
+static int file_usable(const Fat32File* file) {
+    return file && file->ctx && file->generation == file->ctx->generation &&
+           file->aborts == file->session->aborts;
+}
+
+/**
+ * @brief Tells whether a handle may change the volume now.
+ *
+ * @param file Usable handle.
+ * @return Nonzero if the handle was opened for writing and no other
+ *         session's transaction is open (see fat32_txn_denies()).
+ */
+static int file_may_write(const Fat32File* file) {
+    return (file->flags & FAT32_O_ACCMODE) != FAT32_O_RDONLY && !fat32_txn_denies(file->session);
+}
+
+/**
+ * @brief Describes the next @p size bytes of the cursor as segments.
+ *
+ * Empty segments are skipped and the cursor is advanced past the bytes
+ * handed out.
+ *
+ * @param cursor Cursor to consume from.
+ * @param size Maximum number of bytes.
+ * @param out Output segments (at least @p max entries).
+ * @param max Maximum number of segments to produce.
+ * @param taken Output number of bytes covered by @p out.
+ * @return Number of segments produced.
+ */
+static int cursor_take(IovCursor* cursor, uint32_t size, struct iovec* out, int max, uint32_t* taken) {
+    int count = 0;
+    *taken = 0;
+    while (*taken < size && count < max && cursor->index < cursor->iovcnt) {
+        const struct iovec* seg = &cursor->iov[cursor->index];
+        size_t avail = seg->iov_len - cursor->offset;
+        if (avail == 0) {
+            cursor->index++;
+            cursor->offset = 0;
+            continue;
+        }
+        if (avail > size - *taken) avail = size - *taken;
+
+        out[count].iov_base = (uint8_t*)seg->iov_base + cursor->offset;
+        out[count].iov_len = avail;
+        count++;
+        *taken += (uint32_t)avail;
+        cursor->offset += avail;
+    }
+    return count;
+}
+
+/**
+ * @brief Copies bytes between the cursor's segments and a flat buffer.
+ *
+ * @param cursor Cursor to consume from.
+ * @param buffer Flat buffer.
+ * @param size Number of bytes.
+ * @param to_cursor Nonzero to copy from @p buffer into the segments,
+ *                  zero to copy from the segments into @p buffer.
+ */
+static void cursor_copy(IovCursor* cursor, uint8_t* buffer, uint32_t size, int to_cursor) {
+    struct iovec seg;
+    uint32_t taken;
+    while (size > 0 && cursor_take(cursor, size, &seg, 1, &taken) == 1) {
+        if (to_cursor) {
+            memcpy(seg.iov_base, buffer, taken);
+        } else {
+            memcpy(buffer, seg.iov_base, taken);
+        }
+        buffer += taken;
+        size -= taken;
+    }
+}
+
+/**
+ * @brief Appends a cluster number to the handle's cached chain.
+ *
+ * @param file Open file handle.
+ * @param cluster Cluster number to append.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int chain_push(Fat32File* file, uint32_t cluster) {
+    if (file->chain_len == file->chain_cap) {
+        uint32_t cap = file->chain_cap ? file->chain_cap * 2 : 16;
+        uint32_t* chain = realloc(file->chain, cap * sizeof(uint32_t));
+        if (!chain) return -1;
+        file->chain = chain;
+        file->chain_cap = cap;
+    }
+    file->chain[file->chain_len++] = cluster;
+    return 0;
+}
+
+/**
+ * @brief Looks up the cached tail of a chain.
+ *
+ * A hit is only trusted if the FAT still marks the cached last cluster
+ * as end-of-chain, which costs a single FAT read.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param first_cluster First cluster of the chain.
+ * @param last_cluster Output last cluster.
+ * @param length Output number of clusters in the chain.
+ * @return 0 on a valid hit, -1 otherwise.
+ */
+int fat32_tail_lookup(Fat32Volume* ctx, uint32_t first_cluster, uint32_t* last_cluster, uint32_t* length) {
+    Fat32TailEntry* slot = &ctx->tail_cache[first_cluster % FAT32_TAIL_CACHE_SIZE];
+    pthread_mutex_lock(&ctx->tail_lock);
+    Fat32TailEntry cached = *slot;
+    pthread_mutex_unlock(&ctx->tail_lock);
+    if (first_cluster < 2 || cached.first_cluster != first_cluster) {
+        fat32_count(&ctx->stats.cache_misses, 1);
+        return -1;
+    }
+    if (fat32_get_fat_entry(ctx, cached.last_cluster) < FAT_EOC_MIN) {
+        fat32_tail_forget(ctx, first_cluster);
+        fat32_count(&ctx->stats.cache_misses, 1);
+        return -1;
+    }
+    fat32_count(&ctx->stats.cache_hits, 1);
+    *last_cluster = cached.last_cluster;
+    *length = cached.length;
+    return 0;
+}
+
+/**
+ * @brief Records the tail of a chain in the volume's tail cache.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param first_cluster First cluster of the chain.
+ * @param last_cluster Last cluster of the chain.
+ * @param length Number of clusters in the chain.
+ */
+void fat32_tail_store(Fat32Volume* ctx, uint32_t first_cluster, uint32_t last_cluster, uint32_t length) {
+    if (first_cluster < 2) return;
+    Fat32TailEntry* slot = &ctx->tail_cache[first_cluster % FAT32_TAIL_CACHE_SIZE];
+    pthread_mutex_lock(&ctx->tail_lock);
+    slot->first_cluster = first_cluster;
+    slot->last_cluster = last_cluster;
+    slot->length = length;
+    pthread_mutex_unlock(&ctx->tail_lock);
+}
+
+/**
+ * @brief Drops the cached tail of a chain that is being freed.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param first_cluster First cluster of the chain.
+ */
+void fat32_tail_forget(Fat32Volume* ctx, uint32_t first_cluster) {
+    Fat32TailEntry* slot = &ctx->tail_cache[first_cluster % FAT32_TAIL_CACHE_SIZE];
+    pthread_mutex_lock(&ctx->tail_lock);
+    if (slot->first_cluster == first_cluster) {
+        slot->first_cluster = 0;
+    }
+    pthread_mutex_unlock(&ctx->tail_lock);
+}
+
+/**
+ * @brief Counts a handle opening or closing on its directory entry.
+ *
+ * A file has at most one writable handle, since two writers would each
+ * link their own clusters and the last to close would leak the others.
+ *
+ * @param file Handle whose dir_cluster, dir_index and flags describe it.
+ * @param opening Nonzero when the handle opens, zero when it closes.
+ * @return 0 on success, -1 if another handle writes to the entry or on
+ *         allocation failure.
+ */
+static int track_entry(const Fat32File* file, int opening) {
+    Fat32Volume* ctx = file->ctx;
+    uint32_t writer = (file->flags & FAT32_O_ACCMODE) != FAT32_O_RDONLY;
+    int result = 0;
+    pthread_mutex_lock(&ctx->open_lock);
+    uint32_t i = 0;
+    while (i < ctx->open_count && (ctx->open_entries[i].cluster != file->dir_cluster ||
+                                   ctx->open_entries[i].index != file->dir_index)) {
+        i++;
+    }
+    if (i < ctx->open_count) {
+        Fat32OpenEntry* slot = &ctx->open_entries[i];
+        if (!opening) {
+            slot->writers -= writer;
+            if (--slot->handles == 0) {
+                *slot = ctx->open_entries[--ctx->open_count];
+            }
+        } else if (writer && slot->writers > 0) {
+            result = -1;
+        } else {
+            slot->handles++;
+            slot->writers += writer;
+        }
+    } else if (opening) {
+        if (ctx->open_count == ctx->open_cap) {
+            uint32_t cap = ctx->open_cap ? ctx->open_cap * 2 : 16;
+            Fat32OpenEntry* grown = realloc(ctx->open_entries, cap * sizeof(Fat32OpenEntry));
+            if (grown) {
+                ctx->open_entries = grown;
+                ctx->open_cap = cap;
+            }
+        }
+        if (ctx->open_count < ctx->open_cap) {
+            Fat32OpenEntry* slot = &ctx->open_entries[ctx->open_count++];
+            slot->cluster = file->dir_cluster;
+            slot->index = file->dir_index;
+            slot->handles = 1;
+            slot->writers = writer;
+        } else {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&ctx->open_lock);
+    return result;
+}
+
+/**
+ * @brief Tells whether any handle is open on a directory entry.
+ *
+ * Handles keep the slot of their entry, so an entry with open handles
+ * must stay where it is. Call with the entry's directory locked, which
+ * keeps handles on it from being opened meanwhile.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param entry_cluster Directory cluster holding the entry.
+ * @param entry_index Index of the entry within that cluster.
+ * @return Nonzero if a handle is open on the entry.
+ */
+int fat32_entry_in_use(Fat32Volume* ctx, uint32_t entry_cluster, uint32_t entry_index) {
+    int found = 0;
+    pthread_mutex_lock(&ctx->open_lock);
+    for (uint32_t i = 0; i < ctx->open_count && !found; i++) {
+        found = ctx->open_entries[i].cluster == entry_cluster && ctx->open_entries[i].index == entry_index;
+    }
+    pthread_mutex_unlock(&ctx->open_lock);
+    return found;
+}
+
+/**
+ * @brief Records the handle's chain tail and publishes it to the tail cache.
+ *
+ * @param file Open file handle.
+ * @param last_cluster Last cluster of the chain (0 if empty).
+ * @param count Number of clusters in the chain.
+ */
+static void set_tail(Fat32File* file, uint32_t last_cluster, uint32_t count) {
+    file->tail_known = 1;
+    file->last_cluster = last_cluster;
+    file->cluster_count = count;
+    fat32_tail_store(file->ctx, file->first_cluster, last_cluster, count);
+}
+
+/**
+ * @brief Extends the cached chain until it holds @p count clusters.
+ *
+ * Continues from the last cached cluster, so each FAT link is read
+ * at most once per handle.
+ *
+ * @param file Open file handle.
+ * @param count Number of chain entries wanted.
+ * @return 0 if at least @p count entries are cached, -1 otherwise.
+ */
+static int chain_load(Fat32File* file, uint32_t count) {
+    if (file->chain_len == 0 && !file->chain_complete) {
+        if (file->first_cluster < 2) {
+            file->chain_complete = 1;
+        } else if (chain_push(file, file->first_cluster) != 0) {
+            return -1;
+        }
+    }
+
+    while (file->chain_len < count && !file->chain_complete) {
+        uint32_t next = fat32_get_fat_entry(file->ctx, file->chain[file->chain_len - 1]);
+        if (next < 2 || next >= FAT_EOC_MIN) {
+            file->chain_complete = 1;
+            break;
+        }
+        if (chain_push(file, next) != 0) {
+            return -1;
+        }
+    }
+
+    if (file->chain_complete && !file->tail_known) {
+        set_tail(file, file->chain_len ? file->chain[file->chain_len - 1] : 0, file->chain_len);
+    }
+    return file->chain_len >= count ? 0 : -1;
+}
+
+/**
+ * @brief Returns the cluster at a given index of the chain.
+ *
+ * The known tail is answered without walking, so writes into the last
+ * cluster of a file opened for appending do not touch the FAT.
+ *
+ * @param file Open file handle.
+ * @param index Index within the chain.
+ * @param cluster Output cluster number.
+ * @return 0 on success, -1 if the chain is shorter.
+ */
+static int chain_get(Fat32File* file, uint32_t index, uint32_t* cluster) {
+    if (index >= file->chain_len && file->tail_known && file->cluster_count > 0 &&
+        index == file->cluster_count - 1) {
+        fat32_count(&file->ctx->stats.cache_hits, 1);
+        *cluster = file->last_cluster;
+        return 0;
+    }
+    fat32_count(index < file->chain_len ? &file->ctx->stats.cache_hits : &file->ctx->stats.cache_misses, 1);
+    if (chain_load(file, index + 1) != 0) {
+        return -1;
+    }
+    *cluster = file->chain[index];
+    return 0;
+}
+
+/**
+ * @brief Appends freshly allocated extents to the handle's chain.
+ *
+ * The cached array only grows if it already held the whole chain, so it
+ * always stays a prefix of the real chain.
+ *
+ * @param file Open file handle.
+ * @param extents Extents in chain order.
+ * @param extent_count Number of extents (> 0).
+ * @return 0 on success, -1 on allocation failure (the handle is unchanged).
+ */
+static int chain_append(Fat32File* file, const Fat32Extent* extents, uint32_t extent_count) {
+    uint32_t chain_len = file->chain_len;
+    uint32_t added = 0;
+    for (uint32_t i = 0; i < extent_count; i++) {
+        for (uint32_t c = 0; c < extents[i].count && file->chain_complete; c++) {
+            if (chain_push(file, extents[i].start + c) != 0) {
+                file->chain_len = chain_len;
+                return -1;
+            }
+        }
+        added += extents[i].count;
+    }
+
+    if (file->first_cluster == 0) {
+        file->first_cluster = extents[0].start;
+    }
+    const Fat32Extent* last = &extents[extent_count - 1];
+    set_tail(file, last->start + last->count - 1, file->cluster_count + added);
+    file->dirty = 1;
+    return 0;
+}
+
+/**
+ * @brief Gives back extents that fat32_alloc_extents() linked after the file's tail.
+ *
+ * For failures before chain_append() recorded them: the old tail is
+ * terminated again and the extents are freed, under one hold of the
+ * allocator lock.
+ *
+ * @param file Open file handle (tail known).
+ * @param extents Extents to release.
+ * @param extent_count Number of extents.
+ */
+static void chain_unlink(Fat32File* file, const Fat32Extent* extents, uint32_t extent_count) {
+    Fat32Volume* ctx = file->ctx;
+    fat32_alloc_lock(ctx);
+    if (file->last_cluster >= 2) {
+        fat32_set_fat_entry(ctx, file->last_cluster, FAT_EOC);
+    }
+    fat32_free_extents(ctx, extents, extent_count);
+    fat32_alloc_unlock(ctx);
+}
+
+/**
+ * @brief Returns the bytes covered by the file's allocated clusters.
+ *
+ * Uses the volume's tail cache when possible and otherwise walks the
+ * chain once.
+ *
+ * @param file Open file handle.
+ * @param bytes Output number of bytes backed by allocated clusters.
+ * @return 0 on success, -1 on failure.
+ */
+static int allocated_bytes(Fat32File* file, uint64_t* bytes) {
+    if (!file->tail_known) {
+        uint32_t last, length;
+        if (fat32_tail_lookup(file->ctx, file->first_cluster, &last, &length) == 0) {
+            file->tail_known = 1;
+            file->last_cluster = last;
+            file->cluster_count = length;
+        } else {
+            chain_load(file, UINT32_MAX);
+            if (!file->chain_complete) {
+                return -1;
+            }
+        }
+    }
+    *bytes = (uint64_t)file->cluster_count << file->ctx->cluster_shift;
+    return 0;
+}
+
+/**
+ * @brief Stores data in the handle's delayed-allocation buffer.
+ *
+ * The buffer holds the file bytes that lie past the last allocated
+ * cluster; @p offset is relative to that point and must not leave a gap.
+ *
+ * @param file Open file handle.
+ * @param offset Offset within the pending region.
+ * @param data Cursor over the data to store, or NULL to store zeros.
+ * @param size Number of bytes.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int pending_store(Fat32File* file, uint32_t offset, IovCursor* data, uint32_t size) {
+    uint32_t end = offset + size;
+    if (end > file->pending_cap) {
+        uint32_t cap = file->pending_cap ? file->pending_cap : file->ctx->cluster_size;
+        while (cap < end) cap *= 2;
+        uint8_t* pending = realloc(file->pending, cap);
+        if (!pending) return -1;
+        file->pending = pending;
+        file->pending_cap = cap;
+    }
+
+    if (data) {
+        cursor_copy(data, file->pending + offset, size, 0);
+    } else {
+        memset(file->pending + offset, 0, size);
+    }
+    if (end > file->pending_len) {
+        file->pending_len = end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a directory entry reflecting the handle's size and first cluster.
+ *
+ * The entry's write time becomes the current time.
+ *
+ * @param file Open file handle.
+ * @return 0 on success, -1 on failure.
+ */
+static int commit_entry(Fat32File* file) {
+    DirEntry entry;
+    if (fat32_read_entry(file->ctx, file->dir_cluster, file->dir_index, &entry) != 0) {
+        return -1;
+    }
+    entry.file_size = file->file_size;
+    fat32_set_cluster_to_entry(&entry, file->first_cluster);
+    fat32_set_entry_time(&entry, time(NULL), 0);
+    if (fat32_update_entry(file->ctx, file->dir_cluster, file->dir_index, &entry) != 0) {
+        return -1;
+    }
+    file->dirty = 0;
+    return 0;
+}
+
+/**
+ * @brief Moves the handle's position and the matching current cluster.
+ *
+ * @param file Open file handle.
+ * @param position New byte offset.
+ */
+static void set_position(Fat32File* file, uint32_t position) {
+    file->position = position;
+    file->cur_index = position >> file->ctx->cluster_shift;
+    if (file->cur_index < file->chain_len) {
+        file->cur_cluster = file->chain[file->cur_index];
+    } else if (file->tail_known && file->cluster_count > 0 && file->cur_index == file->cluster_count - 1) {
+        file->cur_cluster = file->last_cluster;
+    } else {
+        file->cur_cluster = 0;
+    }
+}
+
+/**
+ * @brief Transfers bytes between caller buffers and the file at the current position.
+ *
+ * Clusters that are physically adjacent in the chain form one extent,
+ * and all caller segments that map onto an extent go out as a single
+ * vectored disk request. The chain must already cover the whole range.
+ *
+ * @param file Open file handle.
+ * @param data Cursor over the caller's segments.
+ * @param size Number of bytes to transfer.
+ * @param write Nonzero to write to the file, zero to read from it.
+ * @return 0 on success, -1 on failure.
+ */
+static int transfer(Fat32File* file, IovCursor* data, uint32_t size, int write) {
+    Fat32Volume* ctx = file->ctx;
+    uint32_t done = 0;
+
+    while (done < size) {
+        uint32_t index = file->position >> ctx->cluster_shift;
+        uint32_t offset = file->position & ctx->cluster_mask;
+        uint32_t wanted = (uint32_t)(((uint64_t)offset + (size - done) + ctx->cluster_mask) >> ctx->cluster_shift);
+
+        uint32_t cluster, next;
+        if (chain_get(file, index, &cluster) != 0) {
+            return -1;
+        }
+
+        // Extend the run while the next cluster follows physically
+        uint32_t run = 1;
+        while (run < wanted && chain_get(file, index + run, &next) == 0 && next == cluster + run) {
+            run++;
+        }
+
+        uint32_t chunk = (run << ctx->cluster_shift) - offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        while (chunk > 0) {
+            struct iovec vec[FAT32_IOV_MAX];
+            uint32_t taken;
+            int count = cursor_take(data, chunk, vec, FAT32_IOV_MAX, &taken);
+            if (count == 0) return -1;
+
+            int result = write
+                ? fat32_writev_data(ctx, cluster, offset, vec, count)
+                : fat32_readv_data(ctx, cluster, offset, vec, count);
+            if (result != 0) {
+                return -1;
+            }
+
+            chunk -= taken;
+            offset += taken;
+            done += taken;
+            set_position(file, file->position + taken);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Locks the volume a handle belongs to (shared) and the file's directory.
+ *
+ * @param file Open file handle.
+ * @param exclusive Nonzero to lock the directory exclusively.
+ * @return The locked volume, or NULL if the handle has none or locking failed.
+ */
+static Fat32Volume* lock_file(const Fat32File* file, int exclusive) {
+    if (!file || !file->ctx) return NULL;
+    Fat32Volume* ctx = file->ctx;
+    if (fat32_lock_shared(ctx) != 0) return NULL;
+    if (fat32_lock_dir(ctx, file->parent_cluster, exclusive) != 0) {
+        fat32_unlock(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * @brief Releases the locks taken by lock_file().
+ *
+ * @param ctx Volume returned by lock_file().
+ * @param parent_cluster Directory of the file.
+ */
+static void unlock_file(Fat32Volume* ctx, uint32_t parent_cluster) {
+    fat32_unlock_dir(ctx, parent_cluster);
+    fat32_unlock(ctx);
+}
+
+/**
+ * @brief Looks up or creates the entry of a file being opened.
+ *
+ * Its directory is locked, exclusively when creating or truncating.
+ */
+static int open_entry(Fat32File* file, const char* formatted_name, int flags) {
+    Fat32Volume* ctx = file->ctx;
+    uint32_t dir_cluster = file->parent_cluster;
+    DirEntry entry;
+    if (fat32_find_entry(ctx, dir_cluster, formatted_name, &entry,
+                         &file->dir_cluster, &file->dir_index) != 0) {
+        if (!(flags & FAT32_O_CREAT)) return -1;
+
+        memset(&entry, 0, sizeof(DirEntry));
+        memcpy(entry.name, formatted_name, 11);
+        entry.attr = ATTR_ARCHIVE;
+        fat32_set_entry_time(&entry, time(NULL), 1);
+        if (fat32_add_entry(ctx, dir_cluster, &entry, &file->dir_cluster, &file->dir_index) != 0) {
+            return -1;
+        }
+    }
+
+    if (entry.attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID)) {
+        return -1;
+    }
+    if (track_entry(file, 1) != 0) {
+        return -1;
+    }
+
+    file->first_cluster = fat32_get_cluster_from_entry(&entry);
+    file->file_size = entry.file_size;
+
+    int result = 0;
+    if ((flags & FAT32_O_TRUNC) && (flags & FAT32_O_ACCMODE) != FAT32_O_RDONLY) {
+        // Empty the entry before freeing the chain, so no one finds freed clusters
+        uint32_t old_chain = file->first_cluster;
+        file->first_cluster = 0;
+        file->file_size = 0;
+        file->dirty = 1;
+        if (commit_entry(file) != 0 || fat32_free_chain(ctx, old_chain) != 0) {
+            result = -1;
+        }
+    }
+
+    uint64_t allocated;
+    if (result == 0 && (flags & FAT32_O_APPEND) && allocated_bytes(file, &allocated) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        track_entry(file, 0);
+        return -1;
+    }
+    set_position(file, (flags & FAT32_O_APPEND) ? file->file_size : 0);
+    return 0;
+}
+
+/**
+ * @brief Body of fat32_open(); the volume is locked shared.
+ */
+static int open_file(Fat32Session* session, const char* path, int flags, Fat32File* file) {
+    Fat32Volume* ctx = session->volume;
+    if (!path || !file || !fat32_is_mounted(ctx) || fat32_txn_denies(session)) return -1;
+
+    memset(file, 0, sizeof(Fat32File));
+    file->ctx = ctx;
+    file->session = session;
+    file->flags = flags;
+    file->generation = ctx->generation;
+    file->aborts = session->aborts;
+
+    char formatted_name[11];
+    if (fat32_resolve_parent(session, path, &file->parent_cluster, formatted_name) != 0) {
+        return -1;
+    }
+
+    // Only creating or truncating changes the directory
+    int exclusive = (flags & (FAT32_O_CREAT | FAT32_O_TRUNC)) != 0;
+    if (fat32_lock_dir(ctx, file->parent_cluster, exclusive) != 0) {
+        return -1;
+    }
+    int result = open_entry(file, formatted_name, flags);
+    fat32_unlock_dir(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Opens a file and fills in a handle for it.
+ *
+ * @param session Session supplying the current directory.
+ * @param path Path of the file (absolute or relative to the current directory).
+ * @param flags Combination of FAT32_O_* flags. With FAT32_O_APPEND the
+ *              handle starts at the end of the file, its chain tail comes
+ *              from the tail cache when possible, and every write appends.
+ * @param file Handle to initialize.
+ * @return 0 on success, -1 on failure, if the file is already open for
+ *         writing and @p flags ask for write access, or while another
+ *         session's transaction is open.
+ */
+int fat32_open(Fat32Session* session, const char* path, int flags, Fat32File* file) {
+    if (!session || fat32_lock_shared(session->volume) != 0) return -1;
+
+    Fat32Volume* ctx = session->volume;
+    int result = open_file(session, path, flags, file);
+    fat32_unlock(ctx);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_readv(); the file's directory is locked shared.
+ */
+static int64_t read_file(Fat32File* file, const struct iovec* iov, int iovcnt) {
+    if (!file_usable(file) || (!iov && iovcnt > 0) || iovcnt < 0) return -1;
+    if ((file->flags & FAT32_O_ACCMODE) == FAT32_O_WRONLY) return -1;
+
+    uint64_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    if (file->position >= file->file_size) {
+        return 0;
+    }
+    uint32_t size = total < file->file_size - file->position
+        ? (uint32_t)total : file->file_size - file->position;
+
+    uint64_t allocated;
+    if (allocated_bytes(file, &allocated) != 0) {
+        return -1;
+    }
+
+    IovCursor cursor = { iov, iovcnt, 0, 0 };
+    uint32_t direct = 0;
+    if (file->position < allocated) {
+        direct = allocated - file->position < size ? (uint32_t)(allocated - file->position) : size;
+        if (transfer(file, &cursor, direct, 0) != 0) {
+            return -1;
+        }
+    }
+    if (direct < size) {
+        cursor_copy(&cursor, file->pending + (file->position - allocated), size - direct, 1);
+        set_position(file, file->position + (size - direct));
+    }
+    return size;
+}
+
+/**
+ * @brief Reads from a file at the current position into several buffers.
+ *
+ * The buffers are filled in order as if they were one. Each contiguous
+ * extent of the file costs one vectored disk request no matter how many
+ * buffers it spans; bytes still waiting for allocation are served from
+ * the handle's buffer.
+ *
+ * @param file Open file handle.
+ * @param iov Destination segments.
+ * @param iovcnt Number of segments.
+ * @return Number of bytes read (0 at end of file), or -1 on failure.
+ */
+int64_t fat32_readv(Fat32File* file, const struct iovec* iov, int iovcnt) {
+    Fat32Volume* ctx = lock_file(file, 0);
+    if (!ctx) return -1;
+
+    int64_t result = read_file(file, iov, iovcnt);
+    unlock_file(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Reads from a file at the current position.
+ *
+ * @param file Open file handle.
+ * @param buffer Destination buffer.
+ * @param size Maximum number of bytes to read.
+ * @return Number of bytes read (0 at end of file), or -1 on failure.
+ */
+int64_t fat32_read(Fat32File* file, void* buffer, uint32_t size) {
+    if (!buffer) return -1;
+    struct iovec iov = { buffer, size };
+    return fat32_readv(file, &iov, 1);
+}
+
+/**
+ * @brief Writes data at the current position, splitting it between
+ *        allocated clusters and the delayed-allocation buffer.
+ *
+ * The buffer is flushed whenever it reaches FAT32_DELALLOC_MAX, which
+ * bounds the memory held by a single handle.
+ *
+ * @param file Open file handle.
+ * @param data Cursor over the data to write, or NULL to write zeros.
+ * @param size Number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_at_position(Fat32File* file, IovCursor* data, uint32_t size) {
+    while (size > 0) {
+        uint64_t allocated;
+        if (allocated_bytes(file, &allocated) != 0) {
+            return -1;
+        }
+
+        uint32_t chunk;
+        if (file->position < allocated) {
+            chunk = allocated - file->position < size ? (uint32_t)(allocated - file->position) : size;
+            if (!data) {
+                // Zero fill one cluster at a time; known-zero clusters need no write
+                static const uint8_t zeros[FAT32_MAX_CLUSTER_SIZE];
+                Fat32Volume* ctx = file->ctx;
+                uint32_t in_cluster = ctx->cluster_size - (file->position & ctx->cluster_mask);
+                if (chunk > in_cluster) chunk = in_cluster;
+                uint32_t cluster;
+                if (chain_get(file, file->position >> ctx->cluster_shift, &cluster) != 0) {
+                    return -1;
+                }
+                if (fat32_cluster_is_zero(ctx, cluster)) {
+                    set_position(file, file->position + chunk);
+                } else {
+                    struct iovec zero_iov = { (void*)zeros, chunk };
+                    IovCursor zero_cursor = { &zero_iov, 1, 0, 0 };
+                    if (transfer(file, &zero_cursor, chunk, 1) != 0) {
+                        return -1;
+                    }
+                }
+            } else if (transfer(file, data, chunk, 1) != 0) {
+                return -1;
+            }
+        } else {
+            chunk = size < FAT32_DELALLOC_MAX ? size : FAT32_DELALLOC_MAX;
+            if (pending_store(file, (uint32_t)(file->position - allocated), data, chunk) != 0) {
+                return -1;
+            }
+            set_position(file, file->position + chunk);
+        }
+
+        size -= chunk;
+        if (file->position > file->file_size) {
+            file->file_size = file->position;
+            file->dirty = 1;
+        }
+
+        if (file->pending_len >= FAT32_DELALLOC_MAX && fat32_flush(file) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Body of fat32_writev(); the file's directory is locked exclusively.
+ */
+static int64_t write_file(Fat32File* file, const struct iovec* iov, int iovcnt) {
+    if (!file_usable(file) || (!iov && iovcnt > 0) || iovcnt < 0) return -1;
+    if (!file_may_write(file)) return -1;
+
+    uint64_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    if (file->flags & FAT32_O_APPEND) {
+        set_position(file, file->file_size);
+    }
+
+    if (total > 0xFFFFFFFFu - file->position) {
+        return -1;  // FAT32 files are limited to 4 GiB - 1
+    }
+
+    if (file->position > file->file_size) {
+        uint32_t position = file->position;
+        set_position(file, file->file_size);
+        if (write_at_position(file, NULL, position - file->file_size) != 0) {
+            return -1;
+        }
+    }
+
+    IovCursor cursor = { iov, iovcnt, 0, 0 };
+    if (write_at_position(file, &cursor, (uint32_t)total) != 0) {
+        return -1;
+    }
+    if (total > 0) {
+        file->dirty = 1;  // Overwrites change the write time too
+    }
+    return (int64_t)total;
+}
+
+/**
+ * @brief Writes several buffers to a file at the current position.
+ *
+ * The buffers are written in order as if they were one. Data that falls
+ * inside already allocated clusters is written through, with one
+ * vectored disk request per contiguous extent. Data past the last
+ * cluster is buffered in the handle and clusters are only chosen by
+ * fat32_flush() (or fat32_close()), once the amount to place is known,
+ * so files written side by side do not interleave on disk. Writing past
+ * the end of the file fills the gap with zeros.
+ *
+ * @param file Open file handle.
+ * @param iov Source segments.
+ * @param iovcnt Number of segments.
+ * @return Number of bytes written, or -1 on failure.
+ */
+int64_t fat32_writev(Fat32File* file, const struct iovec* iov, int iovcnt) {
+    Fat32Volume* ctx = lock_file(file, 1);
+    if (!ctx) return -1;
+
+    int64_t result = write_file(file, iov, iovcnt);
+    unlock_file(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Writes to a file at the current position.
+ *
+ * @param file Open file handle.
+ * @param buffer Source buffer.
+ * @param size Number of bytes to write.
+ * @return Number of bytes written, or -1 on failure.
+ * @see fat32_writev()
+ */
+int64_t fat32_write(Fat32File* file, const void* buffer, uint32_t size) {
+    if (!buffer) return -1;
+    struct iovec iov = { (void*)buffer, size };
+    return fat32_writev(file, &iov, 1);
+}
+
+/**
+ * @brief Body of fat32_flush(); the file's directory is locked exclusively when there is anything to write.
+ */
+static int flush_file(Fat32File* file) {
+    if (!file_usable(file)) return -1;
+    if (file->pending_len > 0 || file->dirty) {
+        if (fat32_txn_denies(file->session)) return -1;
+        fat32_count(&file->ctx->stats.flushes, 1);
+    }
+
+    if (file->pending_len > 0) {
+        Fat32Volume* ctx = file->ctx;
+        uint32_t clusters = (uint32_t)(((uint64_t)file->pending_len + ctx->cluster_mask) >> ctx->cluster_shift);
+        uint64_t allocated;
+        Fat32Extent* extents;
+        uint32_t extent_count;
+
+        if (allocated_bytes(file, &allocated) != 0 ||
+            fat32_alloc_extents(ctx, clusters, file->last_cluster, &extents, &extent_count) != 0) {
+            return -1;
+        }
+
+        uint32_t done = 0;
+        for (uint32_t i = 0; i < extent_count; i++) {
+            uint32_t chunk = extents[i].count << ctx->cluster_shift;
+            if (chunk > file->pending_len - done) {
+                chunk = file->pending_len - done;
+            }
+            if (fat32_write_data(ctx, extents[i].start, 0, file->pending + done, chunk) != 0) {
+                chain_unlink(file, extents, extent_count);
+                free(extents);
+                return -1;
+            }
+            done += chunk;
+        }
+
+        int result = chain_append(file, extents, extent_count);
+        if (result != 0) {
+            chain_unlink(file, extents, extent_count);
+        }
+        free(extents);
+        if (result != 0) {
+            return -1;
+        }
+        file->pending_len = 0;
+        set_position(file, file->position);
+    }
+
+    if (file->dirty) {
+        return commit_entry(file);
+    }
+    return 0;
+}
+
+/**
+ * @brief Allocates clusters for buffered data and writes it out.
+ *
+ * All pending bytes are placed with one extent allocation that prefers
+ * the clusters right after the file's current tail, then the directory
+ * entry is updated in the same pass.
+ *
+ * @param file Open file handle.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_flush(Fat32File* file) {
+    Fat32Volume* ctx = lock_file(file, file && (file->pending_len > 0 || file->dirty));
+    if (!ctx) return -1;
+
+    int result = flush_file(file);
+    unlock_file(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_fallocate(); the file's directory is locked exclusively.
+ */
+static int reserve_file(Fat32File* file, uint32_t length, int mode) {
+    if (!file_usable(file) || !file_may_write(file)) return -1;
+
+    if (fat32_flush(file) != 0) {
+        return -1;
+    }
+
+    Fat32Volume* ctx = file->ctx;
+    uint64_t allocated;
+    if (allocated_bytes(file, &allocated) != 0) {
+        return -1;
+    }
+
+    uint32_t clusters = (uint32_t)(((uint64_t)length + ctx->cluster_mask) >> ctx->cluster_shift);
+    if (clusters > file->cluster_count) {
+        Fat32Extent* extents;
+        uint32_t extent_count;
+
+        if (fat32_alloc_extents(file->ctx, clusters - file->cluster_count, file->last_cluster,
+                                &extents, &extent_count) != 0) {
+            return -1;
+        }
+        int result = chain_append(file, extents, extent_count);
+        if (result != 0) {
+            chain_unlink(file, extents, extent_count);
+        }
+        free(extents);
+        if (result != 0) {
+            return -1;
+        }
+    }
+
+    if (!(mode & FAT32_FALLOC_KEEP_SIZE) && length > file->file_size) {
+        if (!(mode & FAT32_FALLOC_NO_ZERO)) {
+            uint32_t position = file->position;
+            set_position(file, file->file_size);
+            if (write_at_position(file, NULL, length - file->file_size) != 0) {
+                return -1;
+            }
+            set_position(file, position);
+        }
+        file->file_size = length;
+        file->dirty = 1;
+    }
+
+    set_position(file, file->position);
+    return file->dirty ? commit_entry(file) : 0;
+}
+
+/**
+ * @brief Reserves clusters so the file can hold @p length bytes.
+ *
+ * Missing clusters are allocated as the fewest contiguous extents,
+ * continuing the file's current tail when possible, with one batched FAT
+ * update. Writes inside the reserved range then go straight to disk
+ * without touching the allocator.
+ *
+ * Unless FAT32_FALLOC_KEEP_SIZE is given, the file size grows to
+ * @p length and the new bytes read as zeros; FAT32_FALLOC_NO_ZERO skips
+ * writing those zeros and leaves whatever the clusters held before.
+ *
+ * @param file Open file handle (writable).
+ * @param length Number of bytes to reserve from the start of the file.
+ * @param mode Combination of FAT32_FALLOC_* flags.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_fallocate(Fat32File* file, uint32_t length, int mode) {
+    Fat32Volume* ctx = lock_file(file, 1);
+    if (!ctx) return -1;
+
+    int result = reserve_file(file, length, mode);
+    unlock_file(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_truncate(); the file's directory is locked exclusively.
+ */
+static int truncate_file(Fat32File* file, uint32_t length) {
+    if (!file_usable(file) || !file_may_write(file)) return -1;
+
+    if (length >= file->file_size) {
+        return length == file->file_size ? 0 : fat32_fallocate(file, length, 0);
+    }
+
+    Fat32Volume* ctx = file->ctx;
+    uint64_t allocated;
+    if (allocated_bytes(file, &allocated) != 0) {
+        return -1;
+    }
+
+    if (length >= allocated) {
+        // Only buffered data is cut off
+        file->pending_len = length - (uint32_t)allocated;
+    } else {
+        uint32_t keep = (uint32_t)(((uint64_t)length + ctx->cluster_mask) >> ctx->cluster_shift);
+        file->pending_len = 0;
+
+        if (keep < file->cluster_count) {
+            uint32_t new_tail = 0;
+            if (keep > 0 && chain_get(file, keep - 1, &new_tail) != 0) {
+                return -1;
+            }
+
+            Fat32Extent* extents = NULL;
+            uint32_t extent_count = 0;
+            if (file->chain_complete) {
+                // The whole chain is cached: build the extents without FAT reads
+                extents = malloc((file->chain_len - keep) * sizeof(Fat32Extent));
+                if (!extents) return -1;
+                for (uint32_t i = keep; i < file->chain_len; i++) {
+                    if (extent_count > 0 &&
+                        extents[extent_count - 1].start + extents[extent_count - 1].count == file->chain[i]) {
+                        extents[extent_count - 1].count++;
+                    } else {
+                        extents[extent_count].start = file->chain[i];
+                        extents[extent_count].count = 1;
+                        extent_count++;
+                    }
+                }
+            } else {
+                uint32_t start = keep > 0 ? fat32_get_fat_entry(ctx, new_tail) : file->first_cluster;
+                if (fat32_chain_extents(ctx, start, UINT32_MAX, &extents, &extent_count) != 0) {
+                    return -1;
+                }
+            }
+
+            int result = fat32_free_extents(ctx, extents, extent_count);
+            free(extents);
+            if (result != 0) {
+                return -1;
+            }
+
+            if (keep > 0) {
+                if (fat32_set_fat_entry(ctx, new_tail, FAT_EOC) != 0) {
+                    return -1;
+                }
+            } else {
+                fat32_tail_forget(ctx, file->first_cluster);
+                file->first_cluster = 0;
+            }
+
+            if (file->chain_len > keep) {
+                file->chain_len = keep;
+            }
+            file->chain_complete = file->chain_len == keep;
+            set_tail(file, new_tail, keep);
+        }
+    }
+
+    file->file_size = length;
+    file->dirty = 1;
+    set_position(file, file->position);
+    return commit_entry(file);
+}
+
+/**
+ * @brief Changes the size of a file.
+ *
+ * Growing behaves like fat32_fallocate() with zero fill. Shrinking drops
+ * buffered bytes past the new end and frees the trailing part of the
+ * chain with one batched FAT update; the handle's tail and the tail cache
+ * are updated so later appends start from the new last cluster.
+ *
+ * @param file Open file handle (writable).
+ * @param length New file size in bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_truncate(Fat32File* file, uint32_t length) {
+    Fat32Volume* ctx = lock_file(file, 1);
+    if (!ctx) return -1;
+
+    int result = truncate_file(file, length);
+    unlock_file(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_replace_chain(); the file's directory is locked exclusively.
+ */
+static int replace_chain(Fat32File* file, uint32_t first_cluster, uint32_t last_cluster,
+                         uint32_t cluster_count, uint32_t size) {
+    if (!file_usable(file) || !file_may_write(file)) return -1;
+
+    Fat32Volume* ctx = file->ctx;
+    uint32_t old_chain = file->first_cluster;
+    uint32_t old_size = file->file_size;
+
+    // Point the entry at the new chain before freeing the old one
+    file->first_cluster = first_cluster;
+    file->file_size = size;
+    if (commit_entry(file) != 0) {
+        file->first_cluster = old_chain;
+        file->file_size = old_size;
+        return -1;
+    }
+
+    file->pending_len = 0;
+    file->chain_len = 0;
+    file->chain_complete = 0;
+    file->tail_known = 0;
+    if (first_cluster >= 2) {
+        set_tail(file, last_cluster, cluster_count);
+    }
+    set_position(file, file->position);
+
+    if (old_chain >= 2) {
+        fat32_tail_forget(ctx, old_chain);
+        return fat32_free_chain(ctx, old_chain);
+    }
+    return 0;
+}
+
+/**
+ * @brief Replaces a file's contents with a chain written beforehand.
+ *
+ * The directory entry is switched to @p first_cluster and @p size in
+ * one update, and only then is the old chain freed, so a failure while
+ * the new data was being written never touches the old contents.
+ * Buffered bytes of the handle are dropped.
+ *
+ * @param file Open file handle (writable).
+ * @param first_cluster First cluster of the new chain (0 for an empty file).
+ * @param last_cluster Last cluster of the new chain.
+ * @param cluster_count Number of clusters in the new chain.
+ * @param size New file size in bytes.
+ * @return 0 on success, -1 on failure (the file is left unchanged if
+ *         the entry could not be updated).
+ */
+int fat32_replace_chain(Fat32File* file, uint32_t first_cluster, uint32_t last_cluster,
+                        uint32_t cluster_count, uint32_t size) {
+    Fat32Volume* ctx = lock_file(file, 1);
+    if (!ctx) return -1;
+
+    int result = replace_chain(file, first_cluster, last_cluster, cluster_count, size);
+    unlock_file(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_map_file(); the file's directory is locked exclusively when data is pending.
+ */
+static int map_range(Fat32File* file, uint32_t offset, uint32_t length, struct iovec** iov) {
+    if (!file_usable(file) || !iov) return -1;
+
+    Fat32Volume* ctx = file->ctx;
+    if (!ctx->map || ctx->txn) return -1;
+
+    if (file->pending_len > 0 && fat32_flush(file) != 0) {
+        return -1;
+    }
+
+    *iov = NULL;
+    if (offset >= file->file_size) {
+        return 0;
+    }
+    if (length > file->file_size - offset) {
+        length = file->file_size - offset;
+    }
+
+    uint32_t first = offset >> ctx->cluster_shift;
+    uint32_t last = (uint32_t)(((uint64_t)offset + length - 1) >> ctx->cluster_shift);
+    struct iovec* segments = NULL;
+    int count = 0, cap = 0;
+    uint32_t prev = 0;
+
+    for (uint32_t index = first; index <= last; index++) {
+        uint32_t cluster;
+        if (chain_get(file, index, &cluster) != 0) {
+            free(segments);
+            return -1;
+        }
+
+        uint32_t start = index == first ? offset & ctx->cluster_mask : 0;
+        uint32_t end = index == last ? ((offset + length - 1) & ctx->cluster_mask) + 1 : ctx->cluster_size;
+        uint64_t image_offset = fat32_cluster_offset(ctx, cluster) + start;
+        if (image_offset + (end - start) > ctx->map_size) {
+            free(segments);
+            return -1;
+        }
+
+        if (count > 0 && cluster == prev + 1) {
+            segments[count - 1].iov_len += end - start;
+        } else {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 8;
+                struct iovec* grown = realloc(segments, cap * sizeof(struct iovec));
+                if (!grown) {
+                    free(segments);
+                    return -1;
+                }
+                segments = grown;
+            }
+            segments[count].iov_base = ctx->map + image_offset;
+            segments[count].iov_len = end - start;
+            count++;
+        }
+        prev = cluster;
+    }
+
+    *iov = segments;
+    return count;
+}
+
+/**
+ * @brief Exposes a byte range of a file as pointers into the image mapping.
+ *
+ * Produces one segment per contiguous extent covered by the range, so a
+ * contiguous file is returned as a single pointer and can be parsed in
+ * place without copying. Buffered data is flushed first so every byte has
+ * a home on disk. The segments stay valid until the image is unmapped or
+ * the file is modified. Unavailable while a transaction is open, since
+ * the mapping does not show its writes.
+ *
+ * @param file Open file handle.
+ * @param offset Byte offset of the range.
+ * @param length Length of the range (clamped to the end of the file).
+ * @param iov Output array of segments (caller frees).
+ * @return Number of segments, or -1 if the image is not mapped, a transaction is open, or on failure.
+ */
+int fat32_map_file(Fat32File* file, uint32_t offset, uint32_t length, struct iovec** iov) {
+    Fat32Volume* ctx = lock_file(file, file && file->pending_len > 0);
+    if (!ctx) return -1;
+
+    int result = map_range(file, offset, length, iov);
+    unlock_file(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_lseek(); the file's directory is locked shared.
+ */
+static int64_t seek_file(Fat32File* file, int64_t offset, int whence) {
+    if (!file_usable(file)) return -1;
+
+    int64_t base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = file->position; break;
+        case SEEK_END: base = file->file_size; break;
+        default: return -1;
+    }
+
+    int64_t position = base + offset;
+    if (position < 0 || position > 0xFFFFFFFF) {
+        return -1;
+    }
+
+    set_position(file, (uint32_t)position);
+    return position;
+}
+
+/**
+ * @brief Repositions the file offset.
+ *
+ * @param file Open file handle.
+ * @param offset Offset relative to @p whence.
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ * @return New position, or -1 on failure.
+ */
+int64_t fat32_lseek(Fat32File* file, int64_t offset, int whence) {
+    Fat32Volume* ctx = lock_file(file, 0);
+    if (!ctx) return -1;
+
+    int64_t result = seek_file(file, offset, whence);
+    unlock_file(ctx, file->parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Closes a file handle.
+ *
+ * Flushes buffered data, writes the final size and first cluster back
+ * to the directory entry if they changed, and frees the handle's buffers.
+ *
+ * @param file Open file handle.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_close(Fat32File* file) {
+    if (!file || !file->ctx) return -1;
+
+    // A handle from before the last format only has its buffers released
+    int result = fat32_flush(file);
+    Fat32Volume* ctx = file->ctx;
+    if (fat32_lock_shared(ctx) == 0) {
+        if (file->generation == ctx->generation) {
+            track_entry(file, 0);  // Also after an abort orphaned the handle
+        }
+        fat32_unlock(ctx);
+    }
+
+    free(file->chain);
+    free(file->pending);
+    memset(file, 0, sizeof(Fat32File));
+    return result;
+}
@@ -0,0 +1,460 @@
+/**
+ * @file host_io.c
+ * @brief Transfers between host files and the FAT32 disk image.
+ *
+ * Implements bulk copy of whole files into and out of the image. On the
+ * way in the source size is known up front, so the destination chain is
+ * allocated at once as the fewest contiguous extents, and data is streamed
+ * in large writes while a separate thread reads ahead from the host file.
+ * On the way out each extent of the chain is a plain byte range of the
+ * image, which the kernel copies without passing it through user space.
+ */
+
+#define _GNU_SOURCE
+#include "fat32.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#define PUT_BUFFER_SIZE (1024 * 1024)  /**< Bytes per pipeline buffer (multiple of any cluster size) */
+#define PUT_BUFFER_COUNT 4             /**< Buffers in flight between reader and writer */
+#define GET_BUFFER_SIZE (1024 * 1024)  /**< Bounce buffer for the pread/write fallback */
+
+/**
+ * @brief Ring of buffers shared by the host reader and the image writer.
+ */
+typedef struct {
+    Fat32Volume* ctx;                       /**< Context whose counters the reader updates */
+    int fd;                                  /**< Host file being read */
+    uint64_t remaining;                      /**< Bytes the reader still has to read */
+    uint8_t* buffers[PUT_BUFFER_COUNT];      /**< Buffer storage */
+    uint32_t lengths[PUT_BUFFER_COUNT];      /**< Valid bytes per filled buffer */
+    unsigned filled;                         /**< Buffers ready for the writer */
+    unsigned head;                           /**< Next buffer the writer consumes */
+    int error;                               /**< Set by either side to stop the other */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} PutPipeline;
+
+/**
+ * @brief Reader thread: fills buffers from the host file in order.
+ *
+ * @param arg Pointer to the PutPipeline.
+ * @return Always NULL.
+ */
+static void* put_reader(void* arg) {
+    PutPipeline* pipe = arg;
+    unsigned tail = 0;
+
+    while (pipe->remaining > 0) {
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->filled == PUT_BUFFER_COUNT && !pipe->error) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        int stop = pipe->error;
+        pthread_mutex_unlock(&pipe->lock);
+        if (stop) break;
+
+        uint32_t want = pipe->remaining < PUT_BUFFER_SIZE ? (uint32_t)pipe->remaining : PUT_BUFFER_SIZE;
+        uint32_t got = 0;
+        while (got < want) {
+            ssize_t n = read(pipe->fd, pipe->buffers[tail] + got, want - got);
+            fat32_count(&pipe->ctx->stats.syscalls, 1);
+            if (n <= 0) break;
+            got += (uint32_t)n;
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        if (got != want) {
+            pipe->error = 1;  // Short read: the host file changed or failed
+        } else {
+            pipe->lengths[tail] = got;
+            pipe->filled++;
+        }
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+        if (got != want) break;
+
+        pipe->remaining -= got;
+        tail = (tail + 1) % PUT_BUFFER_COUNT;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Writes one buffer to the image at the given stream offset.
+ *
+ * The buffer is split only where it crosses an extent boundary, so each
+ * write covers as many adjacent clusters as possible.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param extents Extents of the destination chain.
+ * @param extent Index of the extent holding @p offset (updated).
+ * @param extent_offset Byte offset within that extent (updated).
+ * @param data Buffer to write.
+ * @param size Number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+static int put_write(Fat32Volume* ctx, const Fat32Extent* extents, uint32_t* extent,
+                     uint32_t* extent_offset, const uint8_t* data, uint32_t size) {
+    while (size > 0) {
+        uint64_t extent_bytes = (uint64_t)extents[*extent].count << ctx->cluster_shift;
+        uint32_t chunk = extent_bytes - *extent_offset < size ? (uint32_t)(extent_bytes - *extent_offset) : size;
+
+        if (fat32_write_data(ctx, extents[*extent].start, *extent_offset, data, chunk) != 0) {
+            return -1;
+        }
+
+        data += chunk;
+        size -= chunk;
+        *extent_offset += chunk;
+        if (*extent_offset == extent_bytes) {
+            (*extent)++;
+            *extent_offset = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Body of fat32_put(); the volume is locked shared.
+ *
+ * The data goes to clusters no entry points to until it is complete;
+ * fat32_replace_chain() then switches the entry over and frees the old
+ * chain. Only the handle calls lock the destination directory.
+ */
+static int put_file(Fat32Session* session, const char* host_path, const char* image_path) {
+    Fat32Volume* ctx = session->volume;
+    if (!host_path || !image_path) return -1;
+
+    int fd = open(host_path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size > 0xFFFFFFFFu) {
+        close(fd);
+        return -1;
+    }
+    uint32_t size = (uint32_t)st.st_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Not truncated: the old contents stay until the new chain is complete
+    Fat32File file;
+    if (fat32_open(session, image_path, FAT32_O_WRONLY | FAT32_O_CREAT, &file) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (size == 0) {
+        close(fd);
+        int replaced = fat32_replace_chain(&file, 0, 0, 0, 0);
+        return fat32_close(&file) == 0 && replaced == 0 ? 0 : -1;
+    }
+
+    Fat32Extent* extents;
+    uint32_t extent_count;
+    uint32_t clusters = (uint32_t)(((uint64_t)size + ctx->cluster_mask) >> ctx->cluster_shift);
+    if (fat32_alloc_extents(ctx, clusters, 0, &extents, &extent_count) != 0) {
+        close(fd);
+        fat32_close(&file);
+        return -1;
+    }
+
+    PutPipeline pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.ctx = ctx;
+    pipe.fd = fd;
+    pipe.remaining = size;
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.cond, NULL);
+
+    int result = 0;
+    for (int i = 0; i < PUT_BUFFER_COUNT; i++) {
+        pipe.buffers[i] = malloc(PUT_BUFFER_SIZE);
+        if (!pipe.buffers[i]) result = -1;
+    }
+
+    pthread_t reader;
+    if (result == 0 && pthread_create(&reader, NULL, put_reader, &pipe) != 0) {
+        result = -1;
+    }
+
+    if (result == 0) {
+        uint32_t written = 0;
+        uint32_t extent = 0;
+        uint32_t extent_offset = 0;
+
+        while (written < size) {
+            pthread_mutex_lock(&pipe.lock);
+            while (pipe.filled == 0 && !pipe.error) {
+                pthread_cond_wait(&pipe.cond, &pipe.lock);
+            }
+            int failed = pipe.filled == 0;
+            pthread_mutex_unlock(&pipe.lock);
+            if (failed) {
+                result = -1;
+                break;
+            }
+
+            uint32_t length = pipe.lengths[pipe.head];
+            if (put_write(ctx, extents, &extent, &extent_offset, pipe.buffers[pipe.head], length) != 0) {
+                result = -1;
+            }
+
+            pthread_mutex_lock(&pipe.lock);
+            if (result != 0) pipe.error = 1;
+            pipe.filled--;
+            pipe.head = (pipe.head + 1) % PUT_BUFFER_COUNT;
+            pthread_cond_broadcast(&pipe.cond);
+            pthread_mutex_unlock(&pipe.lock);
+            if (result != 0) break;
+
+            written += length;
+        }
+        pthread_join(reader, NULL);
+    }
+
+    for (int i = 0; i < PUT_BUFFER_COUNT; i++) {
+        free(pipe.buffers[i]);
+    }
+    pthread_mutex_destroy(&pipe.lock);
+    pthread_cond_destroy(&pipe.cond);
+    close(fd);
+
+    const Fat32Extent* tail = &extents[extent_count - 1];
+    if (result == 0 &&
+        fat32_replace_chain(&file, extents[0].start, tail->start + tail->count - 1, clusters, size) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        fat32_free_extents(ctx, extents, extent_count);
+    }
+    free(extents);
+    if (fat32_close(&file) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * @brief Copies a host file into the image.
+ *
+ * An existing file at @p image_path is replaced once the new contents
+ * are written; if the copy fails it keeps its old contents. The whole
+ * destination chain is allocated before any data is written.
+ *
+ * @param session Session supplying the current directory.
+ * @param host_path Path of the source file on the host.
+ * @param image_path Destination path inside the image.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_put(Fat32Session* session, const char* host_path, const char* image_path) {
+    if (!session || fat32_lock_shared(session->volume) != 0) return -1;
+
+    int result = put_file(session, host_path, image_path);
+    fat32_unlock(session->volume);
+    return result;
+}
+
+/**
+ * @brief Copies a byte range of one descriptor to the current position of another.
+ *
+ * Tries copy_file_range() first, then sendfile(), and finally falls back
+ * to pread()/write() through a bounce buffer when neither is supported
+ * for the pair of files.
+ *
+ * @param ctx Pointer to FAT32 volume (for the syscall counter).
+ * @param in_fd Source descriptor.
+ * @param in_offset Offset of the range in the source.
+ * @param out_fd Destination descriptor (written at its file position).
+ * @param length Number of bytes to copy.
+ * @return 0 on success, -1 on failure.
+ */
+static int copy_range(Fat32Volume* ctx, int in_fd, off_t in_offset, int out_fd, uint64_t length) {
+    while (length > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, NULL, length, 0);
+        fat32_count(&ctx->stats.syscalls, 1);
+        if (n > 0) {
+            length -= (uint64_t)n;
+            continue;
+        }
+        if (n == 0) return -1;  // Source shorter than expected
+        if (errno == EINTR) continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        break;
+    }
+
+    while (length > 0) {
+        ssize_t n = sendfile(out_fd, in_fd, &in_offset, length);
+        fat32_count(&ctx->stats.syscalls, 1);
+        if (n > 0) {
+            length -= (uint64_t)n;
+            continue;
+        }
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno != EINVAL && errno != ENOSYS) {
+            return -1;
+        }
+        break;
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    uint8_t* buffer = malloc(GET_BUFFER_SIZE);
+    if (!buffer) return -1;
+    while (length > 0) {
+        size_t want = length < GET_BUFFER_SIZE ? (size_t)length : GET_BUFFER_SIZE;
+        ssize_t n = pread(in_fd, buffer, want, in_offset);
+        fat32_count(&ctx->stats.syscalls, 2);
+        if (n <= 0) break;
+        if (write(out_fd, buffer, (size_t)n) != n) break;
+        in_offset += n;
+        length -= (uint64_t)n;
+    }
+    free(buffer);
+    return length == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Copies bytes from a run of clusters through the volume's read path.
+ *
+ * Used while a transaction is open, because the kernel copy would miss
+ * the writes held in memory.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the run.
+ * @param out_fd Destination descriptor (written at its file position).
+ * @param length Number of bytes to copy.
+ * @return 0 on success, -1 on failure.
+ */
+static int copy_from_volume(Fat32Volume* ctx, uint32_t cluster, int out_fd, uint64_t length) {
+    uint8_t* buffer = malloc(GET_BUFFER_SIZE);
+    if (!buffer) return -1;
+
+    uint64_t done = 0;
+    while (done < length) {
+        size_t want = length - done < GET_BUFFER_SIZE ? (size_t)(length - done) : GET_BUFFER_SIZE;
+        if (fat32_read_data(ctx, cluster, (uint32_t)done, buffer, (uint32_t)want) != 0 ||
+            write(out_fd, buffer, want) != (ssize_t)want) {
+            break;
+        }
+        fat32_count(&ctx->stats.syscalls, 1);
+        done += want;
+    }
+    free(buffer);
+    return done == length ? 0 : -1;
+}
+
+/**
+ * @brief Copies a file's clusters to a host file.
+ *
+ * @param ctx Pointer to FAT32 volume (the file's directory locked shared).
+ * @param first_cluster First cluster of the file.
+ * @param size File size in bytes.
+ * @param host_path Destination path on the host (created or truncated).
+ * @return 0 on success, -1 on failure.
+ */
+static int copy_out(Fat32Volume* ctx, uint32_t first_cluster, uint32_t size, const char* host_path) {
+    Fat32Extent* extents = NULL;
+    uint32_t extent_count = 0;
+    uint32_t clusters = (uint32_t)(((uint64_t)size + ctx->cluster_mask) >> ctx->cluster_shift);
+    if (size > 0 && (fat32_chain_extents(ctx, first_cluster, clusters, &extents, &extent_count) != 0 ||
+                     extent_count == 0)) {
+        free(extents);
+        return -1;
+    }
+
+    int out_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        free(extents);
+        return -1;
+    }
+
+    int in_fd = fileno(ctx->disk_file);
+    uint32_t remaining = size;
+    int result = 0;
+    for (uint32_t i = 0; i < extent_count && remaining > 0 && result == 0; i++) {
+        uint64_t length = (uint64_t)extents[i].count << ctx->cluster_shift;
+        if (length > remaining) length = remaining;
+        if (ctx->txn) {
+            result = copy_from_volume(ctx, extents[i].start, out_fd, length);
+        } else {
+            result = copy_range(ctx, in_fd, (off_t)fat32_cluster_offset(ctx, extents[i].start), out_fd, length);
+            fat32_count(&ctx->stats.sectors_read, (length + SECTOR_SIZE - 1) >> SECTOR_SHIFT);
+            if (ctx->trace) {
+                trace_io(ctx, TRACE_READ, fat32_cluster_offset(ctx, extents[i].start), length);
+            }
+        }
+        remaining -= (uint32_t)length;
+    }
+    if (result == 0 && remaining > 0) {
+        result = -1;  // Chain shorter than the recorded size
+    }
+
+    free(extents);
+    if (close(out_fd) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * @brief Body of fat32_get(); the volume is locked shared.
+ *
+ * The entry is looked up by name with its directory locked, and the
+ * lock is held through the copy, so no writer changes the chain meanwhile.
+ */
+static int get_file(Fat32Session* session, const char* image_path, const char* host_path) {
+    Fat32Volume* ctx = session->volume;
+    if (!ctx->disk_file || !image_path || !host_path || !fat32_is_mounted(ctx)) return -1;
+
+    uint32_t parent_cluster;
+    char name[11];
+    if (fat32_resolve_parent(session, image_path, &parent_cluster, name) != 0 ||
+        fat32_lock_dir(ctx, parent_cluster, 0) != 0) {
+        return -1;
+    }
+    DirEntry entry;
+    int result = fat32_find_entry(ctx, parent_cluster, name, &entry, NULL, NULL);
+    if (result == 0 && (entry.attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID))) {
+        result = -1;
+    }
+    if (result == 0) {
+        result = copy_out(ctx, fat32_get_cluster_from_entry(&entry), entry.file_size, host_path);
+    }
+    fat32_unlock_dir(ctx, parent_cluster);
+    return result;
+}
+
+/**
+ * @brief Copies a file from the image to the host.
+ *
+ * The file's chain is turned into extents of image byte ranges and each
+ * extent is copied in the kernel, so a contiguous file takes a handful of
+ * system calls regardless of its size. Inside a transaction the extents
+ * are read through the volume instead.
+ *
+ * @param session Session supplying the current directory.
+ * @param image_path Source path inside the image.
+ * @param host_path Destination path on the host (created or truncated).
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_get(Fat32Session* session, const char* image_path, const char* host_path) {
+    if (!session || fat32_lock_shared(session->volume) != 0) return -1;
+
+    int result = get_file(session, image_path, host_path);
+    fat32_unlock(session->volume);
+    return result;
+}
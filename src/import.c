@@ -0,0 +1,615 @@
+/**
+ * @file import.c
+ * @brief Parallel import of a host directory tree into the disk image.
+ *
+ * The import runs in phases so that the image is only touched once the
+ * whole tree is known:
+ *
+ * 1. The host tree is walked by a pool of workers, one task per directory.
+ * 2. Every cluster the tree needs (file data and directory tables) is
+ *    reserved with a single free-space scan and carved per node, grouped
+ *    by parent directory, so each file and directory is contiguous
+ *    whenever free space allows.
+ * 3. Each new directory table is built in memory and written once, and
+ *    file contents are streamed into their clusters by the pool.
+ * 4. The FAT chains are written with one batched update per reserved
+ *    extent, and finally the top-level entries are linked into the
+ *    target directory.
+ *
+ * Nothing becomes reachable from the existing tree before the last step.
+ */
+
+#define _GNU_SOURCE
+#include "fat32.h"
+#include "thread_pool.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define IMPORT_BUFFER_SIZE (1024 * 1024)  /**< Largest read from a host file (multiple of any cluster size) */
+
+/**
+ * @brief One file or directory found on the host.
+ */
+typedef struct {
+    char* host_path;        /**< Full host path */
+    char name[11];          /**< 8.3 name inside the image */
+    int parent;             /**< Index of the parent node, -1 for top-level nodes */
+    int is_dir;             /**< Nonzero for directories */
+    uint32_t size;          /**< File size in bytes (0 for directories) */
+    time_t mtime;           /**< Modification time on the host */
+    uint32_t child_begin;   /**< First child in the sorted order (directories) */
+    uint32_t child_count;   /**< Number of children (directories) */
+    uint32_t first_pos;     /**< First reserved position owned by the node */
+    uint32_t cluster_count; /**< Clusters owned by the node */
+} ImportNode;
+
+/**
+ * @brief Shared state of one import.
+ */
+typedef struct {
+    Fat32Volume* ctx;
+    ThreadPool* pool;
+    ImportNode* nodes;      /**< Discovered nodes (grows during the walk) */
+    uint32_t node_count;
+    uint32_t node_cap;
+    uint32_t* clusters;     /**< Cluster number of every reserved position */
+    Fat32Extent* extents;   /**< Reserved extents, in position order */
+    uint32_t extent_count;
+    int linked;             /**< Set once the FAT may hold the new chains */
+    int error;              /**< Set by any task on failure (guarded by lock) */
+    pthread_mutex_t lock;
+} Importer;
+
+/**
+ * @brief Argument of a per-node task.
+ */
+typedef struct {
+    Importer* imp;
+    int node;               /**< Node index, -1 for the host root */
+    char* host_path;        /**< Path to scan (directory tasks) */
+} ImportTask;
+
+/**
+ * @brief Records a failure so the remaining tasks stop early.
+ *
+ * @param imp Importer state.
+ */
+static void import_fail(Importer* imp) {
+    pthread_mutex_lock(&imp->lock);
+    imp->error = 1;
+    pthread_mutex_unlock(&imp->lock);
+}
+
+/**
+ * @brief Tells whether any task has failed.
+ *
+ * @param imp Importer state.
+ * @return Nonzero once import_fail() was called.
+ */
+static int import_failed(Importer* imp) {
+    pthread_mutex_lock(&imp->lock);
+    int error = imp->error;
+    pthread_mutex_unlock(&imp->lock);
+    return error;
+}
+
+/**
+ * @brief Appends a node under the importer lock.
+ *
+ * @param imp Importer state.
+ * @param node Node to append (ownership of host_path moves to the importer).
+ * @return Index of the new node, or -1 on allocation failure.
+ */
+static int add_node(Importer* imp, const ImportNode* node) {
+    int index = -1;
+    pthread_mutex_lock(&imp->lock);
+    if (imp->node_count == imp->node_cap) {
+        uint32_t cap = imp->node_cap ? imp->node_cap * 2 : 64;
+        ImportNode* grown = realloc(imp->nodes, cap * sizeof(ImportNode));
+        if (!grown) {
+            imp->error = 1;
+            pthread_mutex_unlock(&imp->lock);
+            return -1;
+        }
+        imp->nodes = grown;
+        imp->node_cap = cap;
+    }
+    index = (int)imp->node_count++;
+    imp->nodes[index] = *node;
+    pthread_mutex_unlock(&imp->lock);
+    return index;
+}
+
+static void scan_task(void* arg);
+
+/**
+ * @brief Queues a scan of one host directory.
+ *
+ * @param imp Importer state.
+ * @param node Node index of the directory, -1 for the host root.
+ * @param host_path Path of the directory (copied).
+ * @return 0 on success, -1 on failure.
+ */
+static int queue_scan(Importer* imp, int node, const char* host_path) {
+    ImportTask* task = malloc(sizeof(ImportTask));
+    if (!task) return -1;
+    task->imp = imp;
+    task->node = node;
+    task->host_path = strdup(host_path);
+    if (!task->host_path || thread_pool_submit(imp->pool, scan_task, task) != 0) {
+        free(task->host_path);
+        free(task);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Scans one host directory and queues its subdirectories.
+ *
+ * Symlinks and special files are skipped; regular files larger than
+ * 4 GiB fail the import.
+ *
+ * @param arg ImportTask describing the directory (freed here).
+ */
+static void scan_task(void* arg) {
+    ImportTask* task = arg;
+    Importer* imp = task->imp;
+
+    int failed = import_failed(imp);
+    DIR* dir = failed ? NULL : opendir(task->host_path);
+    if (!dir) {
+        if (!failed) import_fail(imp);
+        free(task->host_path);
+        free(task);
+        return;
+    }
+
+    size_t base_len = strlen(task->host_path);
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        size_t path_len = base_len + 1 + strlen(de->d_name) + 1;
+        char* path = malloc(path_len);
+        if (!path) {
+            import_fail(imp);
+            break;
+        }
+        snprintf(path, path_len, "%s/%s", task->host_path, de->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            free(path);
+            import_fail(imp);
+            break;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > 0xFFFFFFFFu) {
+            free(path);
+            import_fail(imp);
+            break;
+        }
+
+        ImportNode node;
+        memset(&node, 0, sizeof(node));
+        node.host_path = path;
+        node.parent = task->node;
+        node.is_dir = S_ISDIR(st.st_mode);
+        node.size = node.is_dir ? 0 : (uint32_t)st.st_size;
+        node.mtime = st.st_mtime;
+        fat32_format_name(de->d_name, node.name);
+
+        int index = add_node(imp, &node);
+        if (index < 0) {
+            free(path);
+            break;
+        }
+        if (node.is_dir && queue_scan(imp, index, path) != 0) {
+            import_fail(imp);
+            break;
+        }
+    }
+    closedir(dir);
+    free(task->host_path);
+    free(task);
+}
+
+/**
+ * @brief Orders node indices by parent, then by 8.3 name.
+ *
+ * @param nodes Node array the indices refer to.
+ */
+static int compare_nodes(const void* a, const void* b, void* nodes) {
+    const ImportNode* x = &((const ImportNode*)nodes)[*(const uint32_t*)a];
+    const ImportNode* y = &((const ImportNode*)nodes)[*(const uint32_t*)b];
+    if (x->parent != y->parent) return x->parent < y->parent ? -1 : 1;
+    return memcmp(x->name, y->name, 11);
+}
+
+/**
+ * @brief Returns the first cluster of a node, or 0 if it owns none.
+ */
+static uint32_t node_cluster(const Importer* imp, const ImportNode* node) {
+    return node->cluster_count ? imp->clusters[node->first_pos] : 0;
+}
+
+/**
+ * @brief Calls @p fn for every physically contiguous run of a node.
+ *
+ * @param imp Importer state.
+ * @param node Node whose clusters are visited.
+ * @param fn Callback receiving the run's first cluster, its length and
+ *           the node-relative index of that cluster.
+ * @param arg Extra argument for @p fn.
+ * @return 0 on success, -1 as soon as @p fn fails.
+ */
+static int for_each_run(const Importer* imp, const ImportNode* node,
+                        int (*fn)(void* arg, uint32_t cluster, uint32_t count, uint32_t index),
+                        void* arg) {
+    uint32_t i = 0;
+    while (i < node->cluster_count) {
+        uint32_t start = imp->clusters[node->first_pos + i];
+        uint32_t count = 1;
+        while (i + count < node->cluster_count &&
+               imp->clusters[node->first_pos + i + count] == start + count) {
+            count++;
+        }
+        if (fn(arg, start, count, i) != 0) return -1;
+        i += count;
+    }
+    return 0;
+}
+
+/**
+ * @brief State of one file copy.
+ */
+typedef struct {
+    Importer* imp;
+    int fd;                 /**< Host file being read */
+    uint32_t size;          /**< File size */
+    uint8_t* buffer;        /**< Read buffer */
+    uint32_t buffer_size;   /**< Capacity of @p buffer */
+} CopyState;
+
+/**
+ * @brief Copies the bytes of one contiguous run from the host file.
+ */
+static int copy_run(void* arg, uint32_t cluster, uint32_t count, uint32_t index) {
+    CopyState* copy = arg;
+    Fat32Volume* ctx = copy->imp->ctx;
+    uint64_t offset = (uint64_t)index << ctx->cluster_shift;
+    uint64_t end = offset + ((uint64_t)count << ctx->cluster_shift);
+    if (end > copy->size) end = copy->size;
+
+    while (offset < end) {
+        if (import_failed(copy->imp)) return -1;
+        uint32_t chunk = end - offset < copy->buffer_size ? (uint32_t)(end - offset) : copy->buffer_size;
+        uint32_t done = 0;
+        while (done < chunk) {
+            ssize_t n = pread(copy->fd, copy->buffer + done, chunk - done, (off_t)(offset + done));
+            fat32_count(&ctx->stats.syscalls, 1);
+            if (n <= 0) return -1;  // Error, or the file shrank since the walk
+            done += (uint32_t)n;
+        }
+        uint32_t rel = (uint32_t)(offset - ((uint64_t)index << ctx->cluster_shift));
+        if (fat32_write_data(ctx, cluster, rel, copy->buffer, chunk) != 0) {
+            return -1;
+        }
+        offset += chunk;
+    }
+    return 0;
+}
+
+/**
+ * @brief Streams one host file into its reserved clusters.
+ *
+ * @param arg ImportTask naming the file node (freed here).
+ */
+static void copy_task(void* arg) {
+    ImportTask* task = arg;
+    Importer* imp = task->imp;
+    ImportNode* node = &imp->nodes[task->node];
+    free(task);
+    if (import_failed(imp)) return;
+
+    CopyState copy;
+    copy.imp = imp;
+    copy.size = node->size;
+    copy.buffer_size = node->size < IMPORT_BUFFER_SIZE ? node->size : IMPORT_BUFFER_SIZE;
+    copy.buffer = malloc(copy.buffer_size);
+    copy.fd = open(node->host_path, O_RDONLY);
+    if (copy.fd >= 0) {
+        posix_fadvise(copy.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (!copy.buffer || copy.fd < 0 || for_each_run(imp, node, copy_run, &copy) != 0) {
+        import_fail(imp);
+    }
+    if (copy.fd >= 0) close(copy.fd);
+    free(copy.buffer);
+}
+
+/**
+ * @brief Cursor used to write a directory table run by run.
+ */
+typedef struct {
+    Fat32Volume* ctx;
+    const uint8_t* table;   /**< Whole directory table */
+} TableWrite;
+
+/**
+ * @brief Writes the part of a directory table stored in one run.
+ */
+static int write_table_run(void* arg, uint32_t cluster, uint32_t count, uint32_t index) {
+    TableWrite* write = arg;
+    Fat32Volume* ctx = write->ctx;
+    return fat32_write_data(ctx, cluster, 0, write->table + ((size_t)index << ctx->cluster_shift),
+                            count << ctx->cluster_shift);
+}
+
+/**
+ * @brief Fills a directory entry describing a node, dated with its host mtime.
+ */
+static void make_entry(const Importer* imp, const ImportNode* node, DirEntry* entry) {
+    memset(entry, 0, sizeof(DirEntry));
+    memcpy(entry->name, node->name, 11);
+    entry->attr = node->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+    entry->file_size = node->size;
+    fat32_set_cluster_to_entry(entry, node_cluster(imp, node));
+    fat32_set_entry_time(entry, node->mtime, 1);
+}
+
+/**
+ * @brief Lays out every node's clusters and builds the FAT values.
+ *
+ * @param imp Importer state (nodes already sorted via @p order).
+ * @param order Node indices in allocation order.
+ * @param target_cluster First cluster of the target directory.
+ * @return 0 on success, -1 on failure.
+ */
+static int layout_tree(Importer* imp, const uint32_t* order, uint32_t target_cluster) {
+    Fat32Volume* ctx = imp->ctx;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < imp->node_count; i++) {
+        ImportNode* node = &imp->nodes[order[i]];
+        uint64_t bytes = node->is_dir ? (uint64_t)(node->child_count + 2) * sizeof(DirEntry) : node->size;
+        node->first_pos = total;
+        node->cluster_count = (uint32_t)((bytes + ctx->cluster_mask) >> ctx->cluster_shift);
+        total += node->cluster_count;
+    }
+    if (total == 0) return 0;
+
+    if (fat32_reserve_extents(ctx, total, 0, &imp->extents, &imp->extent_count) != 0) {
+        return -1;
+    }
+    const Fat32Extent* extents = imp->extents;
+    uint32_t extent_count = imp->extent_count;
+
+    imp->clusters = malloc((size_t)total * sizeof(uint32_t));
+    uint32_t* values = malloc((size_t)total * sizeof(uint32_t));
+    if (!imp->clusters || !values) {
+        free(values);
+        return -1;
+    }
+
+    uint32_t pos = 0;
+    for (uint32_t e = 0; e < extent_count; e++) {
+        for (uint32_t c = 0; c < extents[e].count; c++) {
+            imp->clusters[pos++] = extents[e].start + c;
+        }
+    }
+
+    // Each position links to the next one unless it ends its node's chain
+    for (uint32_t i = 0; i < imp->node_count; i++) {
+        const ImportNode* node = &imp->nodes[order[i]];
+        for (uint32_t c = 0; c < node->cluster_count; c++) {
+            uint32_t p = node->first_pos + c;
+            values[p] = c + 1 < node->cluster_count ? imp->clusters[p + 1] : FAT_EOC;
+        }
+    }
+
+    // Directory tables, built fully in memory and written once each
+    int result = 0;
+    for (uint32_t i = 0; i < imp->node_count && result == 0; i++) {
+        const ImportNode* node = &imp->nodes[order[i]];
+        if (!node->is_dir) continue;
+
+        uint8_t* table = calloc(node->cluster_count, ctx->cluster_size);
+        if (!table) {
+            result = -1;
+            break;
+        }
+        DirEntry* entries = (DirEntry*)table;
+        memcpy(entries[0].name, ".          ", 11);
+        entries[0].attr = ATTR_DIRECTORY;
+        fat32_set_cluster_to_entry(&entries[0], node_cluster(imp, node));
+        memcpy(entries[1].name, "..         ", 11);
+        entries[1].attr = ATTR_DIRECTORY;
+        fat32_set_cluster_to_entry(&entries[1], node->parent < 0 ? target_cluster
+                                   : node_cluster(imp, &imp->nodes[node->parent]));
+        for (uint32_t c = 0; c < node->child_count; c++) {
+            make_entry(imp, &imp->nodes[order[node->child_begin + c]], &entries[2 + c]);
+        }
+        TableWrite write = { ctx, table };
+        result = for_each_run(imp, node, write_table_run, &write);
+        free(table);
+    }
+
+    // File data goes through the pool while the FAT is still untouched
+    for (uint32_t i = 0; i < imp->node_count && result == 0; i++) {
+        const ImportNode* node = &imp->nodes[order[i]];
+        if (node->is_dir || node->cluster_count == 0) continue;
+        ImportTask* task = malloc(sizeof(ImportTask));
+        if (!task) {
+            result = -1;
+            break;
+        }
+        task->imp = imp;
+        task->node = (int)order[i];
+        task->host_path = NULL;
+        if (thread_pool_submit(imp->pool, copy_task, task) != 0) {
+            free(task);
+            result = -1;
+        }
+    }
+    thread_pool_wait(imp->pool);
+    if (import_failed(imp)) result = -1;
+
+    pos = 0;
+    imp->linked = result == 0;
+    for (uint32_t e = 0; e < extent_count && result == 0; e++) {
+        result = fat32_set_fat_values(ctx, extents[e].start, extents[e].count, values + pos);
+        pos += extents[e].count;
+    }
+
+    free(values);
+    return result;
+}
+
+/**
+ * @brief Undoes an import that failed after its chains reached the FAT.
+ *
+ * The top-level entries added so far are deleted again and every
+ * reserved cluster is freed, so the tree is neither partly visible nor
+ * leaked.
+ *
+ * @param imp Importer state.
+ * @param order Node indices in allocation order (top-level nodes first).
+ * @param added Number of top-level entries already added.
+ * @param target_cluster First cluster of the target directory.
+ */
+static void release_tree(Importer* imp, const uint32_t* order, uint32_t added, uint32_t target_cluster) {
+    Fat32Volume* ctx = imp->ctx;
+    for (uint32_t i = 0; i < added; i++) {
+        DirEntry entry;
+        uint32_t entry_cluster, entry_index;
+        if (fat32_find_entry(ctx, target_cluster, imp->nodes[order[i]].name, &entry,
+                             &entry_cluster, &entry_index) == 0) {
+            entry.name[0] = (char)0xE5;
+            fat32_update_entry(ctx, entry_cluster, entry_index, &entry);
+        }
+    }
+    fat32_free_extents(ctx, imp->extents, imp->extent_count);
+}
+
+/**
+ * @brief Body of fat32_import(); the volume is locked exclusively.
+ */
+
+static int import_tree(Fat32Session* session, const char* host_dir, const char* image_dir) {
+    Fat32Volume* ctx = session->volume;
+    if (!host_dir || !image_dir) return -1;
+
+    uint32_t target_cluster;
+    if (fat32_resolve_dir(session, image_dir, &target_cluster) != 0) {
+        return -1;
+    }
+
+    Importer imp;
+    memset(&imp, 0, sizeof(imp));
+    imp.ctx = ctx;
+    pthread_mutex_init(&imp.lock, NULL);
+    imp.pool = thread_pool_create(thread_pool_default_size());
+    if (!imp.pool) {
+        pthread_mutex_destroy(&imp.lock);
+        return -1;
+    }
+
+    int result = queue_scan(&imp, -1, host_dir);
+    thread_pool_wait(imp.pool);
+    if (import_failed(&imp)) result = -1;
+
+    uint32_t* order = NULL;
+    if (result == 0 && imp.node_count > 0) {
+        order = malloc(imp.node_count * sizeof(uint32_t));
+        if (!order) result = -1;
+    }
+
+    if (order) {
+        for (uint32_t i = 0; i < imp.node_count; i++) order[i] = i;
+        qsort_r(order, imp.node_count, sizeof(uint32_t), compare_nodes, imp.nodes);
+
+        // Children of each directory are now adjacent in the order
+        for (uint32_t i = 0; i < imp.node_count && result == 0; i++) {
+            const ImportNode* node = &imp.nodes[order[i]];
+            if (i > 0) {
+                const ImportNode* prev = &imp.nodes[order[i - 1]];
+                if (prev->parent == node->parent && memcmp(prev->name, node->name, 11) == 0) {
+                    result = -1;  // 8.3 name collision
+                    break;
+                }
+            }
+            if (node->parent < 0) {
+                if (fat32_find_entry(ctx, target_cluster, node->name, NULL, NULL, NULL) == 0) {
+                    result = -1;  // Already present in the target directory
+                }
+            } else {
+                ImportNode* parent = &imp.nodes[node->parent];
+                if (parent->child_count++ == 0) parent->child_begin = i;
+            }
+        }
+    }
+
+    if (order && result == 0) {
+        result = layout_tree(&imp, order, target_cluster);
+    }
+
+    // Top-level entries last: only now does the new tree become reachable
+    uint32_t added = 0;
+    for (uint32_t i = 0; order && result == 0 && i < imp.node_count; i++) {
+        const ImportNode* node = &imp.nodes[order[i]];
+        if (node->parent >= 0) break;
+        DirEntry entry;
+        make_entry(&imp, node, &entry);
+        result = fat32_add_entry(ctx, target_cluster, &entry, NULL, NULL);
+        if (result == 0) added++;
+    }
+    if (result != 0 && imp.linked) {
+        release_tree(&imp, order, added, target_cluster);
+    }
+
+    thread_pool_destroy(imp.pool);
+    for (uint32_t i = 0; i < imp.node_count; i++) {
+        free(imp.nodes[i].host_path);
+    }
+    free(imp.nodes);
+    free(imp.clusters);
+    free(imp.extents);
+    free(order);
+    pthread_mutex_destroy(&imp.lock);
+    return result;
+}
+
+/**
+ * @brief Imports a host directory tree into an image directory.
+ *
+ * The contents of @p host_dir (not the directory itself) become entries
+ * of @p image_dir. Names are converted to 8.3 form; the import fails
+ * before anything is written if two names collide, in the new tree or
+ * with entries already present in @p image_dir. Symlinks and special
+ * files are skipped.
+ *
+ * @param session Session supplying the current directory.
+ * @param host_dir Host directory to read.
+ * @param image_dir Existing directory in the image to import into.
+ * @return 0 on success, -1 on failure.
+ */
+
+int fat32_import(Fat32Session* session, const char* host_dir, const char* image_dir) {
+    if (!session || fat32_lock_exclusive(session->volume) != 0) return -1;
+
+    int result = fat32_is_mounted(session->volume) && !fat32_txn_denies(session)
+        ? import_tree(session, host_dir, image_dir) : -1;
+    fat32_unlock(session->volume);
+    return result;
+}
@@ -0,0 +1,150 @@
+/**
+ * @file json_writer.c
+ * @brief Buffered writer for newline-delimited JSON (NDJSON) records.
+ */
+
+#include "json_writer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Initializes a writer and allocates its buffer.
+ *
+ * @param writer Writer to initialize.
+ * @param out Destination stream.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int json_writer_init(JsonWriter* writer, FILE* out) {
+    memset(writer, 0, sizeof(JsonWriter));
+    writer->out = out;
+    writer->buffer = malloc(JSON_WRITER_BUFFER_SIZE);
+    return writer->buffer ? 0 : -1;
+}
+
+/**
+ * @brief Hands the buffered bytes to the stream in one fwrite().
+ *
+ * A failed write is remembered, so later calls keep reporting it.
+ *
+ * @param writer Writer.
+ * @return 0 on success, -1 if any write so far failed.
+ */
+int json_flush(JsonWriter* writer) {
+    if (writer->len > 0) {
+        if (fwrite(writer->buffer, 1, writer->len, writer->out) != writer->len) {
+            writer->error = 1;
+        }
+        writer->len = 0;
+    }
+    return writer->error ? -1 : 0;
+}
+
+/**
+ * @brief Appends raw bytes, flushing whenever the buffer fills up.
+ */
+static void put(JsonWriter* writer, const char* data, size_t size) {
+    while (size > 0) {
+        if (writer->len == JSON_WRITER_BUFFER_SIZE) {
+            json_flush(writer);
+        }
+        size_t chunk = JSON_WRITER_BUFFER_SIZE - writer->len;
+        if (chunk > size) chunk = size;
+        memcpy(writer->buffer + writer->len, data, chunk);
+        writer->len += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+/**
+ * @brief Appends a quoted, escaped string.
+ */
+static void put_quoted(JsonWriter* writer, const char* text) {
+    static const char hex[] = "0123456789abcdef";
+    put(writer, "\"", 1);
+
+    const char* run = text;
+    for (const char* p = text; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        put(writer, run, (size_t)(p - run));
+        run = p + 1;
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char)c };
+            put(writer, escaped, 2);
+        } else {
+            char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            put(writer, escaped, 6);
+        }
+    }
+    put(writer, run, strlen(run));
+    put(writer, "\"", 1);
+}
+
+/**
+ * @brief Appends the separator and name of the next field.
+ */
+static void put_key(JsonWriter* writer, const char* key) {
+    if (writer->fields++ > 0) put(writer, ",", 1);
+    put_quoted(writer, key);
+    put(writer, ":", 1);
+}
+
+/**
+ * @brief Opens a record.
+ *
+ * @param writer Writer.
+ */
+void json_begin(JsonWriter* writer) {
+    writer->fields = 0;
+    put(writer, "{", 1);
+}
+
+/**
+ * @brief Adds a string field; quotes, backslashes and control characters are escaped.
+ *
+ * @param writer Writer with an open record.
+ * @param key Field name (plain ASCII, not escaped).
+ * @param value Field value.
+ */
+void json_string(JsonWriter* writer, const char* key, const char* value) {
+    put_key(writer, key);
+    put_quoted(writer, value);
+}
+
+/**
+ * @brief Adds an unsigned integer field.
+ *
+ * @param writer Writer with an open record.
+ * @param key Field name (plain ASCII, not escaped).
+ * @param value Field value.
+ */
+void json_uint(JsonWriter* writer, const char* key, uint64_t value) {
+    char digits[21];
+    int n = snprintf(digits, sizeof(digits), "%llu", (unsigned long long)value);
+    put_key(writer, key);
+    put(writer, digits, (size_t)n);
+}
+
+/**
+ * @brief Closes the record and ends its line.
+ *
+ * @param writer Writer with an open record.
+ */
+void json_end(JsonWriter* writer) {
+    put(writer, "}\n", 2);
+}
+
+/**
+ * @brief Flushes the remaining records and frees the buffer.
+ *
+ * @param writer Writer.
+ * @return 0 on success, -1 if any write failed.
+ */
+int json_writer_destroy(JsonWriter* writer) {
+    int result = json_flush(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return result;
+}
@@ -0,0 +1,403 @@
+/**
+ * @file lock.c
+ * @brief Volume and directory locking for concurrent sessions.
+ *
+ * Every public operation on a volume runs under its reader/writer lock.
+ * Operations on the whole volume (format, mount, transactions, clone,
+ * import) hold it exclusively. Everything else holds it shared and locks
+ * the directories it works in: a reader/writer lock per directory, keyed
+ * by the directory's first cluster. Listing, lookups and reads lock a
+ * directory shared, so readers of a directory run in parallel; creating
+ * entries and changing a file lock its directory exclusively, which
+ * blocks only that directory. Cluster allocation and every FAT update go
+ * through the allocator lock, because different directories share FAT
+ * sectors and the free space.
+ *
+ * Lock order (a thread only waits for a lock later in this list than
+ * every lock it holds):
+ * -# the volume lock;
+ * -# the rename lock, for renames that move a directory to another parent;
+ * -# directory locks, by ascending first cluster (fat32_lock_dirs());
+ * -# the allocator lock;
+ * -# the tail cache, open entry, transaction and profile mutexes.
+ *
+ * Path lookups lock each directory on the way only while reading it, and
+ * must be done before an operation locks its directories. Public
+ * operations call each other (put opens, writes and closes a file), so
+ * volume and directory locks are reentrant per thread: each thread keeps
+ * a small table of the locks it holds and nested calls only count. A
+ * thread holding a lock shared cannot upgrade; asking for exclusive
+ * access then fails instead of deadlocking. Low-level functions
+ * (disc_io.c) never take the volume or directory locks and must be
+ * called with them held, or before the volume is shared.
+ */
+
+#define _GNU_SOURCE
+#include "fat32.h"
+#include <string.h>
+#include <pthread.h>
+
+#define LOCK_HELD_MAX 8  /**< Locks one thread may hold at the same time */
+
+/**
+ * @brief A volume or directory lock held by the calling thread.
+ */
+typedef struct {
+    Fat32Volume* volume;  /**< Volume of the lock (NULL marks a free slot) */
+    uint32_t cluster;     /**< Directory, or 0 for the volume lock */
+    Fat32DirLock* dir;    /**< Slot of a directory lock */
+    int depth;            /**< Nesting depth of the hold */
+    int exclusive;        /**< Nonzero if held exclusively */
+} HeldLock;
+
+static __thread HeldLock held[LOCK_HELD_MAX];
+
+/**
+ * @brief Finds the calling thread's slot for a lock.
+ *
+ * @param volume Volume to look up, or NULL for a free slot.
+ * @param cluster Directory, or 0 for the volume lock.
+ * @return Slot, or NULL if there is none.
+ */
+static HeldLock* find_held(const Fat32Volume* volume, uint32_t cluster) {
+    for (int i = 0; i < LOCK_HELD_MAX; i++) {
+        if (held[i].volume == volume && held[i].cluster == cluster) return &held[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Takes the volume lock, or nests inside a hold of this thread.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param exclusive Nonzero for exclusive access.
+ * @return 0 on success, -1 if an exclusive hold was requested under a
+ *         shared one or the thread holds too many locks.
+ */
+static int lock_volume(Fat32Volume* ctx, int exclusive) {
+    HeldLock* slot = find_held(ctx, 0);
+    if (slot) {
+        if (exclusive && !slot->exclusive) return -1;  // No upgrades
+        slot->depth++;
+        return 0;
+    }
+
+    slot = find_held(NULL, 0);
+    if (!slot) return -1;
+    if (exclusive) {
+        pthread_rwlock_wrlock(&ctx->lock);
+    } else {
+        pthread_rwlock_rdlock(&ctx->lock);
+    }
+    slot->volume = ctx;
+    slot->depth = 1;
+    slot->exclusive = exclusive;
+    return 0;
+}
+
+/**
+ * @brief Finds or claims the directory lock slots of some directories.
+ *
+ * All slots are claimed at once, waiting until enough are free, so a
+ * thread never waits for a slot while it holds one.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param clusters Distinct directory clusters.
+ * @param count Number of directories (1 or 2).
+ * @param dirs Output slots, in the order of @p clusters.
+ */
+static void claim_dirs(Fat32Volume* ctx, const uint32_t* clusters, int count, Fat32DirLock** dirs) {
+    pthread_mutex_lock(&ctx->dir_table_lock);
+    while (1) {
+        int missing = count;
+        int free_slots = 0;
+        for (int i = 0; i < count; i++) dirs[i] = NULL;
+        for (int s = 0; s < FAT32_DIR_LOCKS; s++) {
+            Fat32DirLock* dir = &ctx->dir_locks[s];
+            if (dir->cluster == 0) {
+                free_slots++;
+                continue;
+            }
+            for (int i = 0; i < count; i++) {
+                if (dir->cluster == clusters[i]) {
+                    dirs[i] = dir;
+                    missing--;
+                }
+            }
+        }
+        if (free_slots >= missing) break;
+        pthread_cond_wait(&ctx->dir_table_cond, &ctx->dir_table_lock);
+    }
+
+    int s = 0;
+    for (int i = 0; i < count; i++) {
+        if (!dirs[i]) {
+            while (ctx->dir_locks[s].cluster != 0) s++;
+            dirs[i] = &ctx->dir_locks[s];
+            dirs[i]->cluster = clusters[i];
+        }
+        dirs[i]->users++;
+    }
+    pthread_mutex_unlock(&ctx->dir_table_lock);
+}
+
+/**
+ * @brief Gives up a directory lock slot once its lock is released.
+ *
+ * The last user recycles the slot with a fresh rwlock, so that the lock
+ * of one directory is never mistaken for that of the next.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param dir Slot claimed with claim_dirs().
+ */
+static void release_dir(Fat32Volume* ctx, Fat32DirLock* dir) {
+    pthread_mutex_lock(&ctx->dir_table_lock);
+    if (--dir->users == 0) {
+        dir->cluster = 0;
+        pthread_rwlock_destroy(&dir->lock);
+        pthread_rwlock_init(&dir->lock, NULL);
+        pthread_cond_broadcast(&ctx->dir_table_cond);
+    }
+    pthread_mutex_unlock(&ctx->dir_table_lock);
+}
+
+/**
+ * @brief Records a directory lock in the calling thread's table.
+ */
+static void hold_dir(HeldLock* slot, Fat32Volume* ctx, Fat32DirLock* dir, int exclusive) {
+    slot->volume = ctx;
+    slot->cluster = dir->cluster;
+    slot->dir = dir;
+    slot->depth = 1;
+    slot->exclusive = exclusive;
+}
+
+/**
+ * @brief Initializes the locks of a volume.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ */
+void fat32_lock_init(Fat32Volume* ctx) {
+    pthread_rwlock_init(&ctx->lock, NULL);
+    for (int s = 0; s < FAT32_DIR_LOCKS; s++) {
+        ctx->dir_locks[s].cluster = 0;
+        ctx->dir_locks[s].users = 0;
+        pthread_rwlock_init(&ctx->dir_locks[s].lock, NULL);
+    }
+    pthread_mutex_init(&ctx->dir_table_lock, NULL);
+    pthread_cond_init(&ctx->dir_table_cond, NULL);
+    pthread_mutex_init(&ctx->rename_lock, NULL);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);  // FAT helpers nest
+    pthread_mutex_init(&ctx->alloc_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_mutex_init(&ctx->tail_lock, NULL);
+    pthread_mutex_init(&ctx->open_lock, NULL);
+    pthread_mutex_init(&ctx->profile_lock, NULL);
+}
+
+/**
+ * @brief Destroys the locks of a volume no thread uses any more.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ */
+void fat32_lock_destroy(Fat32Volume* ctx) {
+    pthread_rwlock_destroy(&ctx->lock);
+    for (int s = 0; s < FAT32_DIR_LOCKS; s++) {
+        pthread_rwlock_destroy(&ctx->dir_locks[s].lock);
+    }
+    pthread_mutex_destroy(&ctx->dir_table_lock);
+    pthread_cond_destroy(&ctx->dir_table_cond);
+    pthread_mutex_destroy(&ctx->rename_lock);
+    pthread_mutex_destroy(&ctx->alloc_lock);
+    pthread_mutex_destroy(&ctx->tail_lock);
+    pthread_mutex_destroy(&ctx->open_lock);
+    pthread_mutex_destroy(&ctx->profile_lock);
+}
+
+/**
+ * @brief Locks a volume for reading.
+ *
+ * Other readers proceed in parallel; writers wait.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_lock_shared(Fat32Volume* ctx) {
+    return lock_volume(ctx, 0);
+}
+
+/**
+ * @brief Locks a volume for writing.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @return 0 on success, -1 if the thread holds the volume shared.
+ */
+int fat32_lock_exclusive(Fat32Volume* ctx) {
+    return lock_volume(ctx, 1);
+}
+
+/**
+ * @brief Releases one hold taken with fat32_lock_shared() or fat32_lock_exclusive().
+ *
+ * @param ctx Pointer to FAT32 volume.
+ */
+void fat32_unlock(Fat32Volume* ctx) {
+    HeldLock* slot = find_held(ctx, 0);
+    if (!slot || --slot->depth > 0) return;
+
+    memset(slot, 0, sizeof(HeldLock));
+    pthread_rwlock_unlock(&ctx->lock);
+}
+
+/**
+ * @brief Locks one directory.
+ *
+ * The caller holds the volume lock and no other directory lock, except
+ * when nesting inside its own hold of the same directory.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the directory.
+ * @param exclusive Nonzero to change the directory, zero to read it.
+ * @return 0 on success, -1 if an exclusive hold was requested under a
+ *         shared one or the thread holds too many locks.
+ */
+int fat32_lock_dir(Fat32Volume* ctx, uint32_t cluster, int exclusive) {
+    if (!ctx || cluster < 2) return -1;
+
+    HeldLock* slot = find_held(ctx, cluster);
+    if (slot) {
+        if (exclusive && !slot->exclusive) return -1;  // No upgrades
+        slot->depth++;
+        return 0;
+    }
+
+    slot = find_held(NULL, 0);
+    if (!slot) return -1;
+    Fat32DirLock* dir;
+    claim_dirs(ctx, &cluster, 1, &dir);
+    if (exclusive) {
+        pthread_rwlock_wrlock(&dir->lock);
+    } else {
+        pthread_rwlock_rdlock(&dir->lock);
+    }
+    hold_dir(slot, ctx, dir, exclusive);
+    return 0;
+}
+
+/**
+ * @brief Sorts directory clusters into lock order and drops duplicates.
+ *
+ * @param clusters Clusters to order.
+ * @param count Number of clusters.
+ * @param order Output distinct clusters, ascending (LOCK_HELD_MAX entries).
+ * @return Number of distinct clusters, or -1 if one is invalid or there are too many.
+ */
+static int lock_order(const uint32_t* clusters, int count, uint32_t* order) {
+    if (!clusters || count < 1 || count > LOCK_HELD_MAX) return -1;
+
+    int distinct = 0;
+    for (int i = 0; i < count; i++) {
+        if (clusters[i] < 2) return -1;
+        int at = distinct;
+        while (at > 0 && order[at - 1] > clusters[i]) at--;
+        if (at > 0 && order[at - 1] == clusters[i]) continue;
+        memmove(&order[at + 1], &order[at], (distinct - at) * sizeof(uint32_t));
+        order[at] = clusters[i];
+        distinct++;
+    }
+    return distinct;
+}
+
+/**
+ * @brief Locks several directories exclusively, in lock order.
+ *
+ * For operations that change more than one directory at once, such as
+ * moving an entry (both parents, and the ".." of a moved directory).
+ * Lower clusters are locked first and a cluster named twice is locked
+ * once. Release with fat32_unlock_dirs() and the same list.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param clusters First clusters of the directories.
+ * @param count Number of clusters.
+ * @return 0 on success, -1 if the thread already holds one of the
+ *         directories or too many locks.
+ */
+int fat32_lock_dirs(Fat32Volume* ctx, const uint32_t* clusters, int count) {
+    uint32_t order[LOCK_HELD_MAX];
+    int distinct = ctx ? lock_order(clusters, count, order) : -1;
+    if (distinct < 0) return -1;
+
+    HeldLock* slots[LOCK_HELD_MAX];
+    int free_slots = 0;
+    for (int i = 0; i < distinct; i++) {
+        if (find_held(ctx, order[i])) return -1;
+    }
+    for (int i = 0; i < LOCK_HELD_MAX && free_slots < distinct; i++) {
+        if (!held[i].volume) slots[free_slots++] = &held[i];
+    }
+    if (free_slots < distinct) return -1;
+
+    Fat32DirLock* dirs[LOCK_HELD_MAX];
+    claim_dirs(ctx, order, distinct, dirs);
+    for (int i = 0; i < distinct; i++) {
+        pthread_rwlock_wrlock(&dirs[i]->lock);
+        hold_dir(slots[i], ctx, dirs[i], 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Releases the directories locked with fat32_lock_dirs().
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param clusters The list passed to fat32_lock_dirs().
+ * @param count Number of clusters.
+ */
+void fat32_unlock_dirs(Fat32Volume* ctx, const uint32_t* clusters, int count) {
+    uint32_t order[LOCK_HELD_MAX];
+    int distinct = ctx ? lock_order(clusters, count, order) : -1;
+    for (int i = distinct - 1; i >= 0; i--) {
+        fat32_unlock_dir(ctx, order[i]);
+    }
+}
+
+/**
+ * @brief Releases one hold taken with fat32_lock_dir().
+ *
+ * @param ctx Pointer to FAT32 volume.
+ * @param cluster First cluster of the directory.
+ */
+void fat32_unlock_dir(Fat32Volume* ctx, uint32_t cluster) {
+    HeldLock* slot = find_held(ctx, cluster);
+    if (!slot || cluster == 0 || --slot->depth > 0) return;
+
+    Fat32DirLock* dir = slot->dir;
+    memset(slot, 0, sizeof(HeldLock));
+    pthread_rwlock_unlock(&dir->lock);
+    release_dir(ctx, dir);
+}
+
+/**
+ * @brief Takes the allocator lock.
+ *
+ * Held around every FAT update and around reserving clusters until they
+ * are linked. The lock is recursive.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ */
+void fat32_alloc_lock(Fat32Volume* ctx) {
+    pthread_mutex_lock(&ctx->alloc_lock);
+}
+
+/**
+ * @brief Releases the allocator lock.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ */
+void fat32_alloc_unlock(Fat32Volume* ctx) {
+    pthread_mutex_unlock(&ctx->alloc_lock);
+}
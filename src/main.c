@@ -4,45 +4,232 @@
  *
  * Implements a simple command-line interface to interact with the
  * FAT32 filesystem emulator. Supports commands like format, ls,
- * mkdir, touch, cd, exit, etc.
+ * mkdir, touch, cd, exit, etc. Commands are read interactively,
+ * with --batch from a script without any prompts, or with --serve from
+ * clients of a UNIX domain socket. --record and --replay capture a
+ * workload and run it again.
  */
 
+#define _POSIX_C_SOURCE 200809L
 #include "fat32.h"
+#include "server.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
 
-extern int process_command(Fat32Context* ctx, const char* command);
-extern void print_prompt(Fat32Context* ctx);
+extern int process_command(Fat32Session* session, const char* command);
+extern int execute_command(Fat32Session* session, const char* command, int* status);
+extern void print_prompt(Fat32Session* session);
+extern void print_profile_summary(Fat32Volume* ctx);
+extern int run_batch(Fat32Session* session, const char* script, int print_status, int stop_on_error);
+
+#define BATCH_STDOUT_BUFFER (64 * 1024) /**< stdout buffer size in batch mode */
+
+static Server* active_server; /**< Server stopped by SIGINT / SIGTERM */
+
+/**
+ * @brief Signal handler asking the server to stop.
+ */
+static void stop_server(int sig) {
+    (void)sig;
+    server_stop(active_server);
+}
+
+/**
+ * @brief Serves commands on a UNIX domain socket until SIGINT or SIGTERM.
+ *
+ * @param ctx Pointer to FAT32 volume, mounted once for all clients.
+ * @param socket_path Path of the socket to create.
+ * @return 0 on a clean stop, -1 on failure.
+ */
+static int run_server(Fat32Volume* ctx, const char* socket_path) {
+    active_server = server_create(ctx, socket_path, 0);
+    if (!active_server) return -1;
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_server;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    fprintf(stderr, "Serving %s\n", socket_path);
+    int result = server_run(active_server);
+    server_destroy(active_server);
+    active_server = NULL;
+    return result;
+}
+
+/**
+ * @brief Prints the outcome of a replay.
+ *
+ * @param report Replay statistics.
+ */
+static void print_replay_report(const TraceReport* report) {
+    double seconds = report->elapsed_ms / 1e3;
+    printf("Replayed %llu commands (%llu failed, %llu skipped) in %.3f ms: %.1f commands/s\n",
+           (unsigned long long)report->commands, (unsigned long long)report->failures,
+           (unsigned long long)report->skipped, report->elapsed_ms,
+           seconds > 0 ? (double)report->commands / seconds : 0.0);
+    printf("Latency ms: p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n", report->latency_p50_ms,
+           report->latency_p95_ms, report->latency_p99_ms, report->latency_max_ms);
+    printf("Recorded: %.3f ms, %llu bytes read, %llu bytes written\n", report->recorded_ms,
+           (unsigned long long)report->recorded_read, (unsigned long long)report->recorded_written);
+    printf("Replay I/O: %llu sectors read, %llu sectors written, %llu syscalls (%.1f MiB/s)\n",
+           (unsigned long long)report->io.sectors_read, (unsigned long long)report->io.sectors_written,
+           (unsigned long long)report->io.syscalls,
+           seconds > 0 ? (double)((report->io.sectors_read + report->io.sectors_written) * SECTOR_SIZE) /
+                         (1024.0 * 1024.0) / seconds : 0.0);
+}
+
+/**
+ * @brief Prints the profile summary, closes the trace and releases the volume.
+ *
+ * @param ctx Pointer to FAT32 volume.
+ */
+static void finish(Fat32Volume* ctx) {
+    print_profile_summary(ctx);
+    if (ctx->trace && trace_stop(ctx) != 0) {
+        fprintf(stderr, "Failed to write the trace\n");
+    }
+    fat32_cleanup(ctx);
+}
 
 /**
  * @brief Main entry point of the FAT32 Emulator.
  *
- * Initializes the FAT32 context with the given disk image file,
+ * Initializes the FAT32 volume with the given disk image file,
  * then enters a command loop reading user input and executing commands.
  *
- * @param argc Argument count. Must be 2.
- * @param argv Argument vector. argv[1] should be path to disk image.
- * @return 0 on normal exit, 1 on error.
+ * Options:
+ * - --mmap : access the image through a shared memory mapping
+ * - --preallocate : reserve host blocks when creating a new image (default: sparse)
+ * - --batch <script|-> : run the commands of a script (or stdin) without prompts
+ * - --status : in batch mode, print "status 0" or "status 1" after each command
+ * - --stop-on-error : in batch mode, stop at the first failing command
+ * - --profile : print timing and I/O counters per command and a summary at exit
+ * - --json : ls, stat and stats print NDJSON records instead of text
+ * - --serve <socket> : serve commands to clients of a UNIX domain socket (see server.h)
+ * - --record <trace> : record commands and device I/O to a binary trace (see trace.h)
+ * - --replay <trace> : replay a trace against a fresh image at <disk_file> and report
+ *   throughput and latency; with --paced, commands keep their recorded timing
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector: options followed by the path to the disk image.
+ * @return 0 on normal exit, 1 on error (in batch mode: if any command failed).
  */
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <disk_file>\n", argv[0]);
+    const char* disk_path = NULL;
+    const char* batch_script = NULL;
+    const char* serve_socket = NULL;
+    const char* record_path = NULL;
+    const char* replay_path = NULL;
+    int paced = 0;
+    int use_mmap = 0;
+    int init_flags = 0;
+    int print_status = 0;
+    int stop_on_error = 0;
+    int profile = 0;
+    int json = 0;
+    int usage_error = 0;
+    
+    for (int i = 1; i < argc && !usage_error; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            use_mmap = 1;
+        } else if (strcmp(argv[i], "--preallocate") == 0) {
+            init_flags |= FAT32_INIT_PREALLOCATE;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_script = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_socket = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--paced") == 0) {
+            paced = 1;
+        } else if (strcmp(argv[i], "--status") == 0) {
+            print_status = 1;
+        } else if (strcmp(argv[i], "--stop-on-error") == 0) {
+            stop_on_error = 1;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (!disk_path && argv[i][0] != '-') {
+            disk_path = argv[i];
+        } else {
+            usage_error = 1;
+        }
+    }
+    
+    if (!disk_path || usage_error || (batch_script && serve_socket) ||
+        (replay_path && (batch_script || serve_socket || record_path))) {
+        printf("Usage: %s [--mmap] [--preallocate] [--profile] [--json] [--record <trace>] "
+               "[--batch <script|-> [--status] [--stop-on-error] | --serve <socket>] <disk_file>\n"
+               "       %s --replay <trace> [--paced] <new_disk_file>\n", argv[0], argv[0]);
         return 1;
     }
     
-    Fat32Context ctx;
-    if (fat32_init(&ctx, argv[1]) != 0) {
+    if (replay_path) {
+        TraceReport report;
+        if (trace_replay(replay_path, disk_path, paced, &report) != 0) {
+            fprintf(stderr, "Cannot replay %s\n", replay_path);
+            return 1;
+        }
+        print_replay_report(&report);
+        return 0;
+    }
+    
+    Fat32Volume ctx;
+    if (fat32_init_opts(&ctx, disk_path, init_flags) != 0) {
         printf("Failed to initialize FAT32 emulator\n");
         return 1;
     }
     
+    if (use_mmap && fat32_map_image(&ctx) != 0) {
+        printf("Failed to map disk image, using file I/O\n");
+    }
+    ctx.profiling = profile;
+    ctx.json = json;
+    if (record_path && trace_start(&ctx, record_path) != 0) {
+        fprintf(stderr, "Cannot record to %s\n", record_path);
+        fat32_cleanup(&ctx);
+        return 1;
+    }
+    
+    Fat32Session session;
+    fat32_session_init(&session, &ctx);
+    
+    if (batch_script) {
+        // No prompts and fully buffered output: the volume is the only per-run state
+        setvbuf(stdout, NULL, _IOFBF, BATCH_STDOUT_BUFFER);
+        int failures = run_batch(&session, batch_script, print_status, stop_on_error);
+        if (failures < 0) {
+            fprintf(stderr, "Cannot read batch script %s\n", batch_script);
+        }
+        finish(&ctx);
+        return failures == 0 ? 0 : 1;
+    }
+    
+    if (serve_socket) {
+        int result = run_server(&ctx, serve_socket);
+        if (result != 0) {
+            fprintf(stderr, "Cannot serve on %s\n", serve_socket);
+        }
+        finish(&ctx);
+        return result == 0 ? 0 : 1;
+    }
+    
     printf("FAT32 Emulator started. Type 'exit' or 'quit' to exit.\n");
     
     char command[256];
     while (1) {
-        print_prompt(&ctx);
+        print_prompt(&session);
         
         if (fgets(command, sizeof(command), stdin) == NULL) {
             break;
@@ -51,12 +238,12 @@ int main(int argc, char* argv[]) {
         // Remove newline
         command[strcspn(command, "\n")] = '\0';
         
-        if (process_command(&ctx, command) == -1) {
+        if (process_command(&session, command) == -1) {
             break;
         }
     }
     
-    fat32_cleanup(&ctx);
+    finish(&ctx);
     printf("Goodbye!\n");
     return 0;
 }
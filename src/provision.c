@@ -0,0 +1,227 @@
+/**
+ * @file provision.c
+ * @brief Parallel provisioning of image copies from a template image.
+ *
+ * Every copy is first attempted as a reflink (FICLONE), which shares all
+ * extents with the template and costs only metadata. Hosts without
+ * reflink support get a sparse copy instead: the copy is sized with
+ * ftruncate() and only the template's data ranges (found with
+ * SEEK_DATA/SEEK_HOLE) are transferred with copy_file_range(), falling
+ * back to pread()/pwrite() where the kernel cannot copy between the two
+ * files. Copies are made concurrently on a thread pool.
+ */
+
+#define _GNU_SOURCE
+#include "fat32.h"
+#include "thread_pool.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define PROVISION_BUFFER_SIZE (1024 * 1024)  /**< Chunk size of the read/write fallback */
+
+/**
+ * @brief State shared by the copy tasks of one provisioning run.
+ */
+typedef struct {
+    int src_fd;             /**< Template image, opened read-only */
+    uint64_t size;          /**< Template size in bytes */
+    const char* out_dir;    /**< Directory receiving the copies */
+    const char* base;       /**< File name of the template */
+    pthread_mutex_t lock;
+    int error;              /**< Set by the first failing copy */
+} Provisioner;
+
+/**
+ * @brief One copy to make.
+ */
+typedef struct {
+    Provisioner* prov;
+    uint32_t index;         /**< Copy number, used in the file name */
+} ProvisionTask;
+
+/**
+ * @brief Copies a byte range with pread()/pwrite().
+ *
+ * @param src_fd Source descriptor.
+ * @param dst_fd Destination descriptor.
+ * @param offset Offset of the range in both files.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+static int copy_range_rw(int src_fd, int dst_fd, uint64_t offset, uint64_t length) {
+    uint8_t* buf = malloc(PROVISION_BUFFER_SIZE);
+    if (!buf) return -1;
+
+    int result = 0;
+    while (result == 0 && length > 0) {
+        size_t chunk = length < PROVISION_BUFFER_SIZE ? (size_t)length : PROVISION_BUFFER_SIZE;
+        ssize_t got = pread(src_fd, buf, chunk, (off_t)offset);
+        if (got <= 0 || pwrite(dst_fd, buf, (size_t)got, (off_t)offset) != got) {
+            result = -1;
+            break;
+        }
+        offset += (uint64_t)got;
+        length -= (uint64_t)got;
+    }
+
+    free(buf);
+    return result;
+}
+
+/**
+ * @brief Copies a byte range inside the kernel, falling back to read/write.
+ *
+ * @param src_fd Source descriptor.
+ * @param dst_fd Destination descriptor.
+ * @param offset Offset of the range in both files.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+static int copy_range(int src_fd, int dst_fd, uint64_t offset, uint64_t length) {
+    while (length > 0) {
+        off_t in = (off_t)offset, out = (off_t)offset;
+        ssize_t copied = copy_file_range(src_fd, &in, dst_fd, &out, (size_t)length, 0);
+        if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                           errno == EOPNOTSUPP)) {
+            return copy_range_rw(src_fd, dst_fd, offset, length);
+        }
+        if (copied <= 0) return -1;
+        offset += (uint64_t)copied;
+        length -= (uint64_t)copied;
+    }
+    return 0;
+}
+
+/**
+ * @brief Makes a sparse copy holding only the template's data ranges.
+ *
+ * @param prov Provisioning state.
+ * @param dst_fd Empty destination file.
+ * @return 0 on success, -1 on failure.
+ */
+static int copy_sparse(Provisioner* prov, int dst_fd) {
+    if (ftruncate(dst_fd, (off_t)prov->size) != 0) return -1;
+
+    off_t pos = 0;
+    off_t end = (off_t)prov->size;
+    while (pos < end) {
+        off_t data = lseek(prov->src_fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break;  // Only a hole remains
+            data = pos;                 // Holes not reported: copy everything
+        }
+        if (data >= end) break;
+        off_t hole = lseek(prov->src_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > end) hole = end;
+
+        if (copy_range(prov->src_fd, dst_fd, (uint64_t)data, (uint64_t)(hole - data)) != 0) {
+            return -1;
+        }
+        pos = hole;
+    }
+    return 0;
+}
+
+/**
+ * @brief Pool task creating one copy of the template.
+ *
+ * @param arg ProvisionTask describing the copy (freed here).
+ */
+static void provision_task(void* arg) {
+    ProvisionTask* task = (ProvisionTask*)arg;
+    Provisioner* prov = task->prov;
+
+    char path[4096];
+    int result = -1;
+    int n = snprintf(path, sizeof(path), "%s/%s.%u", prov->out_dir, prov->base, task->index);
+    if (n > 0 && (size_t)n < sizeof(path)) {
+        int dst_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (dst_fd >= 0) {
+            if (ioctl(dst_fd, FICLONE, prov->src_fd) == 0) {
+                result = 0;
+            } else {
+                result = copy_sparse(prov, dst_fd);
+            }
+            if (close(dst_fd) != 0) result = -1;
+            if (result != 0) unlink(path);
+        }
+    }
+
+    if (result != 0) {
+        pthread_mutex_lock(&prov->lock);
+        prov->error = 1;
+        pthread_mutex_unlock(&prov->lock);
+    }
+    free(task);
+}
+
+/**
+ * @brief Creates copies of a template image in parallel.
+ *
+ * The copies are named "<out_dir>/<template name>.<n>" for n = 1..count;
+ * @p out_dir is created if it does not exist. The template must not be
+ * written while the copies are made.
+ *
+ * @param template_path Image to copy.
+ * @param count Number of copies.
+ * @param out_dir Directory receiving the copies.
+ * @return 0 on success, -1 if any copy failed.
+ */
+int fat32_provision(const char* template_path, uint32_t count, const char* out_dir) {
+    if (!template_path || !out_dir) return -1;
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) return -1;
+
+    Provisioner prov;
+    memset(&prov, 0, sizeof(prov));
+    prov.out_dir = out_dir;
+    const char* slash = strrchr(template_path, '/');
+    prov.base = slash ? slash + 1 : template_path;
+
+    struct stat st;
+    prov.src_fd = open(template_path, O_RDONLY);
+    if (prov.src_fd < 0) return -1;
+    if (fstat(prov.src_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(prov.src_fd);
+        return -1;
+    }
+    prov.size = (uint64_t)st.st_size;
+
+    int threads = thread_pool_default_size();
+    if ((uint32_t)threads > count) threads = count > 0 ? (int)count : 1;
+    ThreadPool* pool = thread_pool_create(threads);
+    if (!pool) {
+        close(prov.src_fd);
+        return -1;
+    }
+    pthread_mutex_init(&prov.lock, NULL);
+
+    int result = 0;
+    for (uint32_t i = 1; i <= count; i++) {
+        ProvisionTask* task = malloc(sizeof(ProvisionTask));
+        if (!task) {
+            result = -1;
+            break;
+        }
+        task->prov = &prov;
+        task->index = i;
+        if (thread_pool_submit(pool, provision_task, task) != 0) {
+            free(task);
+            result = -1;
+            break;
+        }
+    }
+
+    thread_pool_wait(pool);
+    thread_pool_destroy(pool);
+    pthread_mutex_destroy(&prov.lock);
+    close(prov.src_fd);
+    return (result == 0 && !prov.error) ? 0 : -1;
+}
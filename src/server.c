@@ -0,0 +1,384 @@
+/**
+ * @file server.c
+ * @brief Long-running command server on a UNIX domain socket.
+ *
+ * One thread runs an epoll loop over the listening socket, a stop
+ * eventfd and every client socket. Client sockets are registered with
+ * EPOLLONESHOT: when data arrives the loop appends it to the client's
+ * input buffer and, once a full line is buffered, hands the client to a
+ * worker of the thread pool. The worker executes every complete line,
+ * sends the framed responses and re-arms the socket, so a client is
+ * owned by at most one thread at a time and its responses stay in
+ * request order.
+ *
+ * Each client has its own Fat32Session on the shared volume, so commands
+ * of different clients run in parallel on the workers; the volume lock
+ * lets readers proceed together and serializes only what modifies the
+ * volume. Command output is captured into a memory stream.
+ */
+
+#define _GNU_SOURCE
+#include "server.h"
+#include "thread_pool.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+extern int execute_command(Fat32Session* session, const char* command, int* status);
+
+#define SERVER_MAX_EVENTS 64    /**< Events fetched per epoll_wait() */
+#define SERVER_READ_SIZE 4096   /**< Bytes read from a client per event */
+
+/**
+ * @brief One connected client.
+ */
+typedef struct ServerClient {
+    Server* server;
+    int fd;
+    char* in;                       /**< Buffered request bytes */
+    size_t in_len;                  /**< Bytes in @p in */
+    size_t in_cap;                  /**< Capacity of @p in */
+    Fat32Session session;           /**< Client's working directory and output */
+    struct ServerClient* prev;
+    struct ServerClient* next;
+} ServerClient;
+
+struct Server {
+    Fat32Volume* ctx;
+    char* socket_path;
+    int listen_fd;
+    int epoll_fd;
+    int stop_fd;                    /**< eventfd written by server_stop() */
+    ThreadPool* pool;
+    pthread_mutex_t clients_lock;   /**< Protects @p clients */
+    ServerClient* clients;          /**< Connected clients */
+};
+
+/**
+ * @brief Adds a descriptor to the epoll set.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int watch(Server* server, int fd, uint32_t events, void* ptr) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ptr;
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * @brief Re-enables events for a client after a worker is done with it.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int rearm(ServerClient* client) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = client;
+    return epoll_ctl(client->server->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+/**
+ * @brief Disconnects a client, discards its open transaction and frees it.
+ */
+static void client_close(ServerClient* client) {
+    Server* server = client->server;
+    fat32_abort(&client->session);  // Drops a transaction the client left open
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+
+    pthread_mutex_lock(&server->clients_lock);
+    if (client->prev) client->prev->next = client->next;
+    else server->clients = client->next;
+    if (client->next) client->next->prev = client->prev;
+    pthread_mutex_unlock(&server->clients_lock);
+
+    free(client->in);
+    free(client);
+}
+
+/**
+ * @brief Accepts every pending connection.
+ */
+static void accept_clients(Server* server) {
+    while (1) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;  // EAGAIN, or out of descriptors until a client leaves
+        }
+
+        ServerClient* client = calloc(1, sizeof(ServerClient));
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        client->server = server;
+        client->fd = fd;
+        fat32_session_init(&client->session, server->ctx);
+
+        pthread_mutex_lock(&server->clients_lock);
+        client->next = server->clients;
+        if (server->clients) server->clients->prev = client;
+        server->clients = client;
+        pthread_mutex_unlock(&server->clients_lock);
+
+        if (watch(server, fd, EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, client) != 0) {
+            client_close(client);
+        }
+    }
+}
+
+/**
+ * @brief Sends a whole buffer set, retrying partial writes.
+ *
+ * @return 0 on success, -1 if the client went away.
+ */
+static int send_all(int fd, struct iovec* iov, int count) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)count;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= (ssize_t)msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= (size_t)sent;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends one framed response.
+ *
+ * @return 0 on success, -1 if the client went away.
+ */
+static int send_response(ServerClient* client, int status, const char* body, size_t len) {
+    char header[32];
+    int n = snprintf(header, sizeof(header), "%d %zu\n", status, len);
+    struct iovec iov[2] = { { header, (size_t)n }, { (void*)body, len } };
+    return send_all(client->fd, iov, len > 0 ? 2 : 1);
+}
+
+/**
+ * @brief Executes one command in the client's working directory.
+ *
+ * @return 0 on success, -1 if the response could not be sent.
+ */
+static int run_command(ServerClient* client, const char* command) {
+    char* body = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&body, &len);
+    if (!out) {
+        return send_response(client, 1, NULL, 0);
+    }
+
+    int status;
+    client->session.out = out;
+    execute_command(&client->session, command, &status);
+    client->session.out = NULL;
+
+    int result = fclose(out) == 0 ? send_response(client, status, body, len)
+                                  : send_response(client, 1, NULL, 0);
+    free(body);
+    return result;
+}
+
+/**
+ * @brief Pool task executing every complete line buffered for a client.
+ *
+ * @param arg ServerClient to serve.
+ */
+static void client_task(void* arg) {
+    ServerClient* client = (ServerClient*)arg;
+    char* newline;
+    while ((newline = memchr(client->in, '\n', client->in_len)) != NULL) {
+        size_t line_len = (size_t)(newline - client->in);
+        *newline = '\0';
+        if (line_len > 0 && client->in[line_len - 1] == '\r') {
+            client->in[line_len - 1] = '\0';
+        }
+
+        char name[8] = {0};
+        sscanf(client->in, "%7s", name);
+        if (strcmp(name, "exit") == 0 || strcmp(name, "quit") == 0) {
+            send_response(client, 0, NULL, 0);
+            client_close(client);
+            return;
+        }
+        if (run_command(client, client->in) != 0) {
+            client_close(client);
+            return;
+        }
+
+        client->in_len -= line_len + 1;
+        memmove(client->in, newline + 1, client->in_len);
+    }
+
+    if (rearm(client) != 0) {
+        client_close(client);
+    }
+}
+
+/**
+ * @brief Reads from a readable client and dispatches complete lines.
+ */
+static void client_readable(ServerClient* client) {
+    if (client->in_cap - client->in_len < SERVER_READ_SIZE) {
+        size_t cap = client->in_cap ? client->in_cap * 2 : SERVER_READ_SIZE * 2;
+        char* in = realloc(client->in, cap);
+        if (!in) {
+            client_close(client);
+            return;
+        }
+        client->in = in;
+        client->in_cap = cap;
+    }
+
+    ssize_t got = read(client->fd, client->in + client->in_len, SERVER_READ_SIZE);
+    if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+        if (rearm(client) != 0) client_close(client);
+        return;
+    }
+    if (got <= 0) {
+        client_close(client);
+        return;
+    }
+
+    size_t scanned = client->in_len;
+    client->in_len += (size_t)got;
+    if (memchr(client->in + scanned, '\n', (size_t)got)) {
+        if (thread_pool_submit(client->server->pool, client_task, client) != 0) {
+            client_close(client);
+        }
+    } else if (client->in_len > SERVER_MAX_LINE) {
+        const char message[] = "Request line too long\n";
+        send_response(client, 1, message, sizeof(message) - 1);
+        client_close(client);
+    } else if (rearm(client) != 0) {
+        client_close(client);
+    }
+}
+
+Server* server_create(Fat32Volume* ctx, const char* socket_path, int workers) {
+    struct sockaddr_un addr;
+    if (!ctx || !socket_path || strlen(socket_path) >= sizeof(addr.sun_path)) return NULL;
+
+    Server* server = calloc(1, sizeof(Server));
+    if (!server) return NULL;
+    server->ctx = ctx;
+    server->listen_fd = server->epoll_fd = server->stop_fd = -1;
+    pthread_mutex_init(&server->clients_lock, NULL);
+
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);  // Left behind by a previous run
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    server->socket_path = strdup(socket_path);
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (!server->socket_path || server->listen_fd < 0 ||
+        bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        free(server->socket_path);
+        server->socket_path = NULL;  // Not ours to unlink
+        server_destroy(server);
+        return NULL;
+    }
+
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->pool = thread_pool_create(workers > 0 ? workers : thread_pool_default_size());
+    if (listen(server->listen_fd, SOMAXCONN) != 0 || server->epoll_fd < 0 ||
+        server->stop_fd < 0 || !server->pool ||
+        watch(server, server->listen_fd, EPOLLIN, &server->listen_fd) != 0 ||
+        watch(server, server->stop_fd, EPOLLIN, &server->stop_fd) != 0) {
+        server_destroy(server);
+        return NULL;
+    }
+    return server;
+}
+
+int server_run(Server* server) {
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int result = 0;
+    int stopping = 0;
+
+    while (!stopping) {
+        int n = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &server->stop_fd) {
+                stopping = 1;
+            } else if (ptr == &server->listen_fd) {
+                accept_clients(server);
+            } else {
+                client_readable((ServerClient*)ptr);
+            }
+        }
+    }
+
+    // Let in-flight commands finish, then drop the remaining connections
+    thread_pool_wait(server->pool);
+    while (server->clients) {
+        client_close(server->clients);
+    }
+    uint64_t value;
+    if (read(server->stop_fd, &value, sizeof(value)) < 0) {
+        // Already drained
+    }
+    return result;
+}
+
+void server_stop(Server* server) {
+    uint64_t one = 1;
+    if (write(server->stop_fd, &one, sizeof(one)) < 0) {
+        // Counter saturated: a stop is already pending
+    }
+}
+
+void server_destroy(Server* server) {
+    if (!server) return;
+    if (server->pool) thread_pool_destroy(server->pool);
+    while (server->clients) {
+        client_close(server->clients);
+    }
+    if (server->stop_fd >= 0) close(server->stop_fd);
+    if (server->epoll_fd >= 0) close(server->epoll_fd);
+    if (server->listen_fd >= 0) close(server->listen_fd);
+    if (server->socket_path) {
+        unlink(server->socket_path);
+        free(server->socket_path);
+    }
+    pthread_mutex_destroy(&server->clients_lock);
+    free(server);
+}
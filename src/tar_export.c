@@ -0,0 +1,394 @@
+/**
+ * @file tar_export.c
+ * @brief Streams a directory tree of the image out as a POSIX tar archive.
+ *
+ * The tree is walked depth-first and every entry is emitted as a ustar
+ * header followed by the file contents, so the archive is produced in a
+ * single pass without extracting anything to the host first. File data is
+ * read extent by extent in chain order; the kernel is asked to read the
+ * next chunk ahead while the current one is written out. Small headers
+ * and file tails are gathered in one output buffer to keep the number of
+ * writes low, and with a mapped image data is written straight from the
+ * mapping.
+ *
+ * A directory is locked shared while its entries and files are emitted,
+ * and released while a subdirectory is, so the walk holds one directory
+ * lock at a time (see lock.c).
+ */
+
+#define _GNU_SOURCE
+#include "fat32.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TAR_BLOCK_SIZE 512                 /**< ustar record size */
+#define TAR_BUFFER_SIZE (1024 * 1024)      /**< Output buffer (multiple of any cluster size) */
+#define TAR_PATH_MAX 256                   /**< Longest archive path (prefix + name) */
+
+/**
+ * @brief ustar header block.
+ */
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+/**
+ * @brief Buffered archive writer.
+ */
+typedef struct {
+    Fat32Volume* ctx;
+    int fd;                 /**< Destination descriptor */
+    uint8_t* buffer;        /**< Pending output */
+    size_t len;             /**< Bytes in @p buffer */
+} TarWriter;
+
+/**
+ * @brief Writes all bytes to the destination, retrying short writes.
+ */
+static int write_all(TarWriter* tw, const void* data, size_t size) {
+    const uint8_t* p = data;
+    while (size > 0) {
+        ssize_t n = write(tw->fd, p, size);
+        fat32_count(&tw->ctx->stats.syscalls, 1);
+        if (n <= 0) return -1;
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Flushes the output buffer.
+ */
+static int tar_flush(TarWriter* tw) {
+    if (tw->len == 0) return 0;
+    int result = write_all(tw, tw->buffer, tw->len);
+    tw->len = 0;
+    return result;
+}
+
+/**
+ * @brief Appends bytes to the output buffer (zeros if @p data is NULL).
+ */
+static int tar_put(TarWriter* tw, const void* data, size_t size) {
+    while (size > 0) {
+        if (tw->len == TAR_BUFFER_SIZE && tar_flush(tw) != 0) return -1;
+        size_t chunk = TAR_BUFFER_SIZE - tw->len;
+        if (chunk > size) chunk = size;
+        if (data) {
+            memcpy(tw->buffer + tw->len, data, chunk);
+            data = (const uint8_t*)data + chunk;
+        } else {
+            memset(tw->buffer + tw->len, 0, chunk);
+        }
+        tw->len += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a FAT write date and time to seconds since the epoch.
+ *
+ * FAT stores no time zone, so the fields are taken as UTC.
+ *
+ * @param date FAT date (year since 1980, month, day).
+ * @param time FAT time (hours, minutes, two-second units).
+ * @return Seconds since 1970-01-01, or 0 if the entry has no date.
+ */
+static uint64_t tar_mtime(uint16_t date, uint16_t time) {
+    unsigned month = (date >> 5) & 0x0F;
+    unsigned day = date & 0x1F;
+    if (month < 1 || month > 12 || day < 1) return 0;
+    // Days from the civil date, with March as the first month of the year
+    int year = 1980 + (date >> 9) - (month <= 2);
+    unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned yoe = (unsigned)(year % 400);
+    uint64_t days = (uint64_t)(year / 400) * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    return days * 86400 + (uint64_t)(time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+}
+
+/**
+ * @brief Emits the ustar header for one entry.
+ *
+ * @param tw Archive writer.
+ * @param path Archive path (directories end with '/').
+ * @param is_dir Nonzero for directories.
+ * @param size File size in bytes.
+ * @param mtime Modification time in seconds since the epoch.
+ * @return 0 on success, -1 if the path does not fit or on write failure.
+ */
+static int tar_header(TarWriter* tw, const char* path, int is_dir, uint32_t size, uint64_t mtime) {
+    TarHeader h;
+    memset(&h, 0, sizeof(h));
+
+    size_t len = strlen(path);
+    if (len <= sizeof(h.name)) {
+        memcpy(h.name, path, len);
+    } else {
+        // Split at a '/' so that prefix + "/" + name reproduces the path
+        const char* split = path + len - sizeof(h.name) - 1;
+        while (*split && *split != '/') split++;
+        size_t prefix_len = (size_t)(split - path);
+        if (!*split || prefix_len > sizeof(h.prefix)) return -1;
+        memcpy(h.prefix, path, prefix_len);
+        memcpy(h.name, split + 1, len - prefix_len - 1);
+    }
+
+    snprintf(h.mode, sizeof(h.mode), "%07o", is_dir ? 0755 : 0644);
+    snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+    snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+    snprintf(h.size, sizeof(h.size), "%011o", is_dir ? 0 : size);
+    snprintf(h.mtime, sizeof(h.mtime), "%011llo", (unsigned long long)mtime);
+    h.typeflag = is_dir ? '5' : '0';
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(h); i++) {
+        sum += ((const uint8_t*)&h)[i];
+    }
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);  // NUL then the trailing space
+    h.chksum[7] = ' ';
+
+    return tar_put(tw, &h, sizeof(h));
+}
+
+/**
+ * @brief Streams one file's contents in chain order and pads the record.
+ *
+ * @param tw Archive writer.
+ * @param first_cluster First cluster of the file.
+ * @param size File size in bytes.
+ * @return 0 on success, -1 on failure.
+ */
+static int tar_file_data(TarWriter* tw, uint32_t first_cluster, uint32_t size) {
+    Fat32Volume* ctx = tw->ctx;
+    if (size == 0) return 0;
+
+    Fat32Extent* extents;
+    uint32_t extent_count;
+    uint32_t clusters = (uint32_t)(((uint64_t)size + ctx->cluster_mask) >> ctx->cluster_shift);
+    if (fat32_chain_extents(ctx, first_cluster, clusters, &extents, &extent_count) != 0) {
+        return -1;
+    }
+
+    int fd = fileno(ctx->disk_file);
+    uint32_t remaining = size;
+    int result = 0;
+    for (uint32_t i = 0; i < extent_count && remaining > 0 && result == 0; i++) {
+        uint64_t offset = fat32_cluster_offset(ctx, extents[i].start);
+        uint64_t length = (uint64_t)extents[i].count << ctx->cluster_shift;
+        if (length > remaining) length = remaining;
+        remaining -= (uint32_t)length;
+
+        while (length > 0 && result == 0) {
+            size_t chunk = length < TAR_BUFFER_SIZE ? (size_t)length : TAR_BUFFER_SIZE;
+
+            // Ask for the following chunk (or the next extent) while this one is written
+            uint64_t next = chunk < length ? offset + chunk
+                            : i + 1 < extent_count ? fat32_cluster_offset(ctx, extents[i + 1].start) : 0;
+            if (next) {
+                fat32_count(&ctx->stats.syscalls, 1);
+                if (ctx->map && next + TAR_BUFFER_SIZE <= ctx->map_size) {
+                    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+                    uint64_t aligned = next & ~(uint64_t)(page - 1);
+                    madvise(ctx->map + aligned, TAR_BUFFER_SIZE, MADV_WILLNEED);
+                } else {
+                    posix_fadvise(fd, (off_t)next, TAR_BUFFER_SIZE, POSIX_FADV_WILLNEED);
+                }
+            }
+
+            if (ctx->map && !ctx->txn && offset + chunk <= ctx->map_size) {
+                // Zero-copy: hand the mapped bytes to write() directly
+                fat32_count(&ctx->stats.sectors_read, (chunk + SECTOR_SIZE - 1) >> SECTOR_SHIFT);
+                if (ctx->trace) {
+                    trace_io(ctx, TRACE_READ, offset, chunk);
+                }
+                if (tw->len + chunk > TAR_BUFFER_SIZE || chunk == TAR_BUFFER_SIZE) {
+                    result = tar_flush(tw);
+                    if (result == 0) result = write_all(tw, ctx->map + offset, chunk);
+                } else {
+                    result = tar_put(tw, ctx->map + offset, chunk);
+                }
+            } else {
+                if (tw->len + chunk > TAR_BUFFER_SIZE) result = tar_flush(tw);
+                if (result == 0) {
+                    result = fat32_read_data(ctx, extents[i].start,
+                                             (uint32_t)(offset - fat32_cluster_offset(ctx, extents[i].start)),
+                                             tw->buffer + tw->len, (uint32_t)chunk);
+                    tw->len += chunk;
+                }
+            }
+            offset += chunk;
+            length -= chunk;
+        }
+    }
+    free(extents);
+
+    if (result == 0 && remaining > 0) result = -1;  // Chain shorter than the recorded size
+    if (result == 0 && size % TAR_BLOCK_SIZE) {
+        result = tar_put(tw, NULL, TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE);
+    }
+    return result;
+}
+
+/**
+ * @brief Emits every entry of a directory, recursing into subdirectories.
+ *
+ * The directory is unlocked while a subdirectory is emitted and its
+ * current cluster is read again afterwards, so entries are only taken
+ * from what was read under the lock. Directory clusters are never freed,
+ * so the cluster still belongs to the directory.
+ *
+ * @param tw Archive writer.
+ * @param dir_cluster First cluster of the directory.
+ * @param path Archive path of the directory ("" or ending with '/').
+ * @return 0 on success, -1 on failure.
+ */
+static int tar_directory(TarWriter* tw, uint32_t dir_cluster, const char* path) {
+    Fat32Volume* ctx = tw->ctx;
+    int entry_count = ctx->cluster_size / sizeof(DirEntry);
+    uint32_t top = dir_cluster;
+    if (fat32_lock_dir(ctx, top, 0) != 0) return -1;
+    uint8_t* cluster = malloc(ctx->cluster_size);  // Heap, as this recurses once per level
+    DirEntry* entries = (DirEntry*)cluster;
+    int result = cluster ? 0 : -1;
+
+    while (result == 0 && dir_cluster >= 2 && dir_cluster < FAT_EOC_MIN) {
+        if (fat32_read_cluster(ctx, dir_cluster, cluster) != 0) {
+            result = -1;
+            break;
+        }
+
+        for (int i = 0; i < entry_count && result == 0; i++) {
+            const DirEntry* entry = &entries[i];
+            if (entry->name[0] == 0x00) {
+                dir_cluster = FAT_EOC;  // End of directory
+                break;
+            }
+            if ((uint8_t)entry->name[0] == 0xE5) continue;  // Deleted entry
+            if (entry->attr == ATTR_LONG_NAME || (entry->attr & ATTR_VOLUME_ID)) continue;
+            if (entry->name[0] == '.') {
+                if (memcmp(entry->name, ".          ", 11) == 0 ||
+                    memcmp(entry->name, "..         ", 11) == 0) continue;
+            }
+
+            char name[13];
+            char child[TAR_PATH_MAX];
+            int is_dir = (entry->attr & ATTR_DIRECTORY) != 0;
+            fat32_entry_name(entry, name);
+            int n = snprintf(child, sizeof(child), "%s%s%s", path, name, is_dir ? "/" : "");
+            if (n < 0 || (size_t)n >= sizeof(child)) {
+                result = -1;
+                break;
+            }
+
+            uint32_t first = fat32_get_cluster_from_entry(entry);
+            result = tar_header(tw, child, is_dir, entry->file_size,
+                                tar_mtime(entry->wrt_date, entry->wrt_time));
+            if (result == 0 && is_dir && first >= 2) {
+                fat32_unlock_dir(ctx, top);
+                result = tar_directory(tw, first, child);
+                if (fat32_lock_dir(ctx, top, 0) != 0) {
+                    free(cluster);
+                    return -1;
+                }
+                // The directory may have changed meanwhile: go on from its current entries
+                if (result == 0 && fat32_read_cluster(ctx, dir_cluster, cluster) != 0) {
+                    result = -1;
+                }
+            } else if (result == 0 && !is_dir) {
+                result = tar_file_data(tw, first, entry->file_size);
+            }
+        }
+        if (dir_cluster < FAT_EOC_MIN) {
+            dir_cluster = fat32_get_fat_entry(ctx, dir_cluster);
+        }
+    }
+    free(cluster);
+    fat32_unlock_dir(ctx, top);
+    return result;
+}
+
+/**
+ * @brief Body of fat32_export_tar(); the volume is locked shared.
+ */
+static int export_tree(Fat32Session* session, const char* image_dir, const char* out_path) {
+    Fat32Volume* ctx = session->volume;
+    if (!ctx->disk_file || !image_dir || !out_path) return -1;
+
+    uint32_t dir_cluster;
+    if (fat32_resolve_dir(session, image_dir, &dir_cluster) != 0) {
+        return -1;
+    }
+
+    TarWriter tw;
+    tw.ctx = ctx;
+    tw.len = 0;
+    tw.buffer = malloc(TAR_BUFFER_SIZE);
+    if (!tw.buffer) return -1;
+
+    int to_stdout = strcmp(out_path, "-") == 0;
+    if (to_stdout) {
+        fflush(stdout);  // Keep earlier buffered output ahead of the archive
+        tw.fd = STDOUT_FILENO;
+    } else {
+        tw.fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (tw.fd < 0) {
+        free(tw.buffer);
+        return -1;
+    }
+
+    int result = tar_directory(&tw, dir_cluster, "");
+    if (result == 0) result = tar_put(&tw, NULL, 2 * TAR_BLOCK_SIZE);
+    if (result == 0) result = tar_flush(&tw);
+
+    if (!to_stdout && close(tw.fd) != 0) {
+        result = -1;
+    }
+    free(tw.buffer);
+    return result;
+}
+
+/**
+ * @brief Writes a directory tree of the image as a POSIX (ustar) tar stream.
+ *
+ * Archive paths are relative to @p image_dir. The archive ends with the
+ * usual two zero blocks.
+ *
+ * @param session Session supplying the current directory.
+ * @param image_dir Directory in the image to export.
+ * @param out_path Destination file, or "-" for standard output.
+ * @return 0 on success, -1 on failure.
+ */
+int fat32_export_tar(Fat32Session* session, const char* image_dir, const char* out_path) {
+    if (!session || fat32_lock_shared(session->volume) != 0) return -1;
+
+    int result = fat32_is_mounted(session->volume) ? export_tree(session, image_dir, out_path) : -1;
+    fat32_unlock(session->volume);
+    return result;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file thread_pool.c
+ * @brief Fixed-size worker thread pool used by bulk operations.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/**
+ * @brief Queued task.
+ */
+typedef struct PoolJob {
+    ThreadPoolTask task;   /**< Function to run */
+    void* arg;             /**< Argument for the function */
+    struct PoolJob* next;  /**< Next job in FIFO order */
+} PoolJob;
+
+struct ThreadPool {
+    pthread_t* threads;    /**< Worker threads */
+    int thread_count;      /**< Number of workers */
+    PoolJob* head;         /**< First queued job */
+    PoolJob* tail;         /**< Last queued job */
+    int active;            /**< Jobs currently running */
+    int stopping;          /**< Set when workers should exit */
+    pthread_mutex_t lock;
+    pthread_cond_t work;   /**< Signalled when a job is queued or on stop */
+    pthread_cond_t idle;   /**< Signalled when the pool may have drained */
+};
+
+/**
+ * @brief Worker loop: runs jobs until the pool is stopped.
+ *
+ * @param arg Pointer to the ThreadPool.
+ * @return Always NULL.
+ */
+static void* pool_worker(void* arg) {
+    ThreadPool* pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (!pool->head) break;  // Stopping and nothing left
+
+        PoolJob* job = pool->head;
+        pool->head = job->next;
+        if (!pool->head) pool->tail = NULL;
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->task(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+        if (!pool->head && pool->active == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int thread_pool_default_size(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > 64) cpus = 64;
+    return (int)cpus;
+}
+
+ThreadPool* thread_pool_create(int threads) {
+    if (threads < 1) threads = thread_pool_default_size();
+
+    ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) return NULL;
+    pool->threads = calloc((size_t)threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            break;
+        }
+        pool->thread_count++;
+    }
+    if (pool->thread_count == 0) {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int thread_pool_submit(ThreadPool* pool, ThreadPoolTask task, void* arg) {
+    PoolJob* job = malloc(sizeof(PoolJob));
+    if (!job) return -1;
+    job->task = task;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void thread_pool_wait(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head || pool->active > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(ThreadPool* pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool);
+}
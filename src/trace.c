@@ -0,0 +1,318 @@
+/**
+ * @file trace.c
+ * @brief Workload recorder and replay.
+ *
+ * Records are appended under a lock (pool workers issue device I/O
+ * concurrently) to a fully buffered stream, so recording costs a memory
+ * copy per event and one write per TRACE_BUFFER_SIZE bytes.
+ */
+
+#define _GNU_SOURCE
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+extern int execute_command(Fat32Session* session, const char* command, int* status);
+
+#define TRACE_BUFFER_SIZE (256 * 1024)  /**< Stream buffer of the trace file */
+
+/**
+ * @brief Recording state.
+ */
+struct Fat32Trace {
+    FILE* file;
+    pthread_mutex_t lock;
+    uint64_t start;     /**< trace_clock() at the start of the recording */
+    int error;          /**< Set once a write failed */
+};
+
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int trace_start(Fat32Volume* ctx, const char* path) {
+    if (!ctx || !path || ctx->trace) return -1;
+
+    Fat32Trace* trace = calloc(1, sizeof(Fat32Trace));
+    if (!trace) return -1;
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        free(trace);
+        return -1;
+    }
+    setvbuf(trace->file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    pthread_mutex_init(&trace->lock, NULL);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    if (fat32_is_mounted(ctx)) {
+        header.cluster_size = ctx->cluster_size;
+        header.volume_size = (uint64_t)ctx->total_sectors << SECTOR_SHIFT;
+    }
+    header.start_time = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+    trace->start = trace_clock();
+
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+        fclose(trace->file);
+        pthread_mutex_destroy(&trace->lock);
+        free(trace);
+        return -1;
+    }
+    ctx->trace = trace;
+    return 0;
+}
+
+int trace_stop(Fat32Volume* ctx) {
+    if (!ctx || !ctx->trace) return -1;
+
+    Fat32Trace* trace = ctx->trace;
+    ctx->trace = NULL;
+    int result = trace->error ? -1 : 0;
+    if (fclose(trace->file) != 0) result = -1;
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+    return result;
+}
+
+/**
+ * @brief Appends a record and its optional text.
+ */
+static void append(Fat32Trace* trace, TraceRecord* record, const char* text) {
+    pthread_mutex_lock(&trace->lock);
+    if (fwrite(record, sizeof(*record), 1, trace->file) != 1 ||
+        (record->text_len > 0 && fwrite(text, 1, record->text_len, trace->file) != record->text_len)) {
+        trace->error = 1;
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void trace_io(Fat32Volume* ctx, int type, uint64_t offset, uint64_t size) {
+    Fat32Trace* trace = ctx->trace;
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = (uint8_t)type;
+    record.time = trace_clock() - trace->start;
+    record.offset = offset;
+
+    // Transfers larger than a record can describe are split
+    do {
+        record.size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+        append(trace, &record, NULL);
+        record.offset += record.size;
+        size -= record.size;
+    } while (size > 0);
+}
+
+void trace_command(Fat32Session* session, const char* command, uint64_t start, int status) {
+    Fat32Trace* trace = session->volume->trace;
+    uint64_t duration_us = (trace_clock() - start) / 1000;
+    size_t len = strlen(command);
+
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = TRACE_COMMAND;
+    record.status = (uint8_t)(status != 0);
+    record.text_len = (uint16_t)(len > UINT16_MAX ? UINT16_MAX : len);
+    record.size = duration_us > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_us;
+    record.time = start - trace->start;
+    record.session = session->id;
+    append(trace, &record, command);
+}
+
+/**
+ * @brief Replay sessions, one per recorded session id.
+ *
+ * Sessions are allocated one by one: a transaction remembers its owner
+ * by address, so they must not move.
+ */
+typedef struct {
+    Fat32Session** list;
+    uint32_t count;
+} ReplaySessions;
+
+/**
+ * @brief Returns the replay session of a recorded session id, starting one on first use.
+ *
+ * @return The session, or NULL on allocation failure.
+ */
+static Fat32Session* replay_session(ReplaySessions* sessions, Fat32Volume* ctx, FILE* sink, uint32_t id) {
+    for (uint32_t i = 0; i < sessions->count; i++) {
+        if (sessions->list[i]->id == id) return sessions->list[i];
+    }
+
+    Fat32Session** grown = realloc(sessions->list, (sessions->count + 1) * sizeof(Fat32Session*));
+    if (!grown) return NULL;
+    sessions->list = grown;
+    Fat32Session* session = malloc(sizeof(Fat32Session));
+    if (!session) return NULL;
+    fat32_session_init(session, ctx);
+    session->id = id;  // Looked up by the recorded id from now on
+    session->out = sink;
+    sessions->list[sessions->count++] = session;
+    return session;
+}
+
+/**
+ * @brief Tells whether a recorded command reads or writes host files.
+ *
+ * put, get, import, export-tar and clone name host paths (export-tar
+ * may also write to the real standard output). Replaying them would act
+ * on whatever those paths hold on the replaying machine.
+ */
+static int uses_host_files(const char* command) {
+    char cmd[256];
+    if (sscanf(command, "%255s", cmd) != 1) return 0;
+    return strcmp(cmd, "put") == 0 || strcmp(cmd, "get") == 0 || strcmp(cmd, "import") == 0 ||
+           strcmp(cmd, "export-tar") == 0 || strcmp(cmd, "clone") == 0;
+}
+
+/**
+ * @brief Orders doubles ascending (qsort callback).
+ */
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Returns a percentile of sorted samples (nearest rank).
+ */
+static double percentile(const double* sorted, uint64_t count, double p) {
+    if (count == 0) return 0.0;
+    uint64_t rank = (uint64_t)(p * (double)count + 0.999999);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+int trace_replay(const char* trace_path, const char* image_path, int paced, TraceReport* report) {
+    if (!trace_path || !image_path || !report) return -1;
+    memset(report, 0, sizeof(*report));
+
+    FILE* in = fopen(trace_path, "rb");
+    if (!in) return -1;
+    setvbuf(in, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION) {
+        fclose(in);
+        return -1;
+    }
+
+    Fat32Volume ctx;
+    FILE* sink = fopen("/dev/null", "w");
+    if (!sink || (remove(image_path) != 0 && errno != ENOENT) || fat32_init(&ctx, image_path) != 0) {
+        if (sink) fclose(sink);
+        fclose(in);
+        return -1;
+    }
+    if (header.volume_size > 0 &&
+        fat32_format_opts(&ctx, header.volume_size, header.cluster_size) != 0) {
+        fat32_cleanup(&ctx);
+        fclose(sink);
+        fclose(in);
+        return -1;
+    }
+    ReplaySessions sessions = { NULL, 0 };
+
+    Fat32Stats before;
+    fat32_stats_get(&ctx, &before);
+    double* latencies = NULL;
+    uint64_t latency_cap = 0;
+    char* text = malloc(UINT16_MAX + 1);
+    int result = text ? 0 : -1;
+    uint64_t start = trace_clock();
+
+    TraceRecord record;
+    while (result == 0 && fread(&record, sizeof(record), 1, in) == 1) {
+        if (record.time / 1e6 > report->recorded_ms) {
+            report->recorded_ms = record.time / 1e6;
+        }
+        if (record.type == TRACE_READ) {
+            report->recorded_read += record.size;
+            continue;
+        }
+        if (record.type == TRACE_WRITE) {
+            report->recorded_written += record.size;
+            continue;
+        }
+        if (record.type != TRACE_COMMAND) continue;
+
+        if (fread(text, 1, record.text_len, in) != record.text_len) {
+            result = -1;  // Truncated trace
+            break;
+        }
+        text[record.text_len] = '\0';
+        double end_ms = (record.time + (uint64_t)record.size * 1000) / 1e6;
+        if (end_ms > report->recorded_ms) report->recorded_ms = end_ms;
+        if (uses_host_files(text)) {
+            report->skipped++;
+            continue;
+        }
+        Fat32Session* session = replay_session(&sessions, &ctx, sink, record.session);
+        if (!session) {
+            result = -1;
+            break;
+        }
+
+        if (paced) {
+            uint64_t due = start + record.time;
+            struct timespec ts = { (time_t)(due / 1000000000ull), (long)(due % 1000000000ull) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) continue;
+        }
+
+        if (report->commands == latency_cap) {
+            latency_cap = latency_cap ? latency_cap * 2 : 1024;
+            double* grown = realloc(latencies, latency_cap * sizeof(double));
+            if (!grown) {
+                result = -1;
+                break;
+            }
+            latencies = grown;
+        }
+
+        int status;
+        uint64_t issued = trace_clock();
+        execute_command(session, text, &status);
+        latencies[report->commands++] = (trace_clock() - issued) / 1e6;
+        report->failures += status != 0;
+    }
+
+    report->elapsed_ms = (trace_clock() - start) / 1e6;
+    Fat32Stats after;
+    fat32_stats_get(&ctx, &after);
+    report->io.sectors_read = after.sectors_read - before.sectors_read;
+    report->io.sectors_written = after.sectors_written - before.sectors_written;
+    report->io.syscalls = after.syscalls - before.syscalls;
+    report->io.flushes = after.flushes - before.flushes;
+    report->io.cache_hits = after.cache_hits - before.cache_hits;
+    report->io.cache_misses = after.cache_misses - before.cache_misses;
+
+    if (report->commands > 0) {
+        qsort(latencies, report->commands, sizeof(double), compare_double);
+        report->latency_p50_ms = percentile(latencies, report->commands, 0.50);
+        report->latency_p95_ms = percentile(latencies, report->commands, 0.95);
+        report->latency_p99_ms = percentile(latencies, report->commands, 0.99);
+        report->latency_max_ms = latencies[report->commands - 1];
+    }
+
+    free(latencies);
+    free(text);
+    fat32_cleanup(&ctx);  // May abort a transaction owned by a replay session
+    for (uint32_t i = 0; i < sessions.count; i++) {
+        free(sessions.list[i]);
+    }
+    free(sessions.list);
+    fclose(sink);
+    fclose(in);
+    return result;
+}
@@ -3,13 +3,30 @@
  * @brief Unit tests for FAT32 emulator CLI and filesystem operations.
  *
  * This file contains automated tests for the FAT32 emulator, verifying:
- * - Disk creation and size
+ * - Disk creation and size (sparse or preallocated)
  * - Format operations
  * - Directory creation (mkdir)
  * - File creation (touch)
  * - Navigation (cd)
  * - Listing directory contents (ls)
  * - Handling of unknown commands
+ * - File handle read/write/lseek/close
+ * - Copying host files into and out of the image (put, get)
+ * - Importing a host directory tree (import)
+ * - Exporting a directory tree as a tar stream (export-tar)
+ * - Volume geometry chosen at format time and read back from the BPB
+ * - Tracking of clusters known to be zero
+ * - Returning the host space of freed clusters
+ * - Provisioning copies of a template image (clone)
+ * - Mount-once lifecycle and format generations
+ * - Per-command status codes (batch mode)
+ * - I/O counters and command profiling
+ * - JSON output mode
+ * - Server mode over a UNIX domain socket
+ * - Transactions (begin, commit, abort)
+ * - Workload recording and replay
+ * - Concurrent sessions on a shared volume
+ * - Renames and per-directory locking
  *
  * Tests are implemented using assertions.
  */
@@ -20,17 +37,80 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "fat32.h"
 #include "cli.h"
+#include "json_writer.h"
+#include "server.h"
+#include "trace.h"
 
 /// Path to temporary test disk image
 #define TEST_DISK "test_fat32.img"
+/// Path to temporary host file used by transfer tests
+#define TEST_HOST_FILE "test_fat32.host"
+/// Path to temporary host directory used by import tests
+#define TEST_HOST_TREE "test_fat32.tree"
+/// Path to temporary host directory receiving cloned images
+#define TEST_CLONE_DIR "test_fat32.clones"
+/// Path to the socket of the server test
+#define TEST_SOCKET "test_fat32.sock"
+/// Path to the workload trace of the replay test
+#define TEST_TRACE "test_fat32.trace"
+/// Path to the script of the batch mode test
+#define TEST_SCRIPT "test_fat32.script"
+
+/**
+ * @brief Recursively remove a host directory tree
+ * @param path Directory to remove
+ */
+void remove_tree(const char* path) {
+    DIR* dir = opendir(path);
+    if (!dir) return;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char child[512];
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        struct stat st;
+        if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            remove_tree(child);
+        } else {
+            remove(child);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/**
+ * @brief Write a host file
+ * @param path File to create
+ * @param buf Contents
+ * @param size Number of bytes
+ */
+void write_host_file(const char* path, const void* buf, size_t size) {
+    FILE* f = fopen(path, "wb");
+    assert(f);
+    assert(fwrite(buf, 1, size, f) == size);
+    fclose(f);
+}
 
 /**
  * @brief Remove test disk file
  */
 void cleanup() {
     remove(TEST_DISK);
+    remove(TEST_HOST_FILE);
+    remove_tree(TEST_HOST_TREE);
+    remove_tree(TEST_CLONE_DIR);
+    remove(TEST_SOCKET);
+    remove(TEST_TRACE);
+    remove(TEST_SCRIPT);
 }
 
 /**
@@ -47,22 +127,66 @@ long get_file_size(const char* path) {
     return size;
 }
 
+/// Status reported by execute_command() for the last run_command()
+static int last_status;
+
 /**
  * @brief Execute a CLI command and capture its stdout output
- * @param ctx FAT32 context
+ * @param session Session to run the command in
  * @param cmd Command string
  * @param output Buffer to store stdout output
  * @param out_size Size of the output buffer
- * @return Return value of process_command()
+ * @return Return value of process_command() (the command's status goes to last_status)
+ */
+int run_command(Fat32Session* session, const char* cmd, char* output, size_t out_size) {
+    FILE* tmp = tmpfile();
+    assert(tmp);
+    int stdout_backup = dup(fileno(stdout));
+    fflush(stdout);
+    dup2(fileno(tmp), fileno(stdout));
+
+    int ret = execute_command(session, cmd, &last_status);
+
+    fflush(stdout);
+    fseek(tmp, 0, SEEK_SET);
+    size_t n = fread(output, 1, out_size - 1, tmp);
+    output[n] = '\0';
+
+    dup2(stdout_backup, fileno(stdout));
+    close(stdout_backup);
+    fclose(tmp);
+    return ret;
+}
+
+/**
+ * @brief Run a batch script and capture its stdout output
+ * @param session Session to run the script in
+ * @param script Script text, written to TEST_SCRIPT
+ * @param from_stdin Nonzero to pass the script as "-" on stdin
+ * @param stop_on_error Passed to run_batch()
+ * @param output Buffer to store stdout output
+ * @param out_size Size of the output buffer
+ * @return Return value of run_batch()
  */
-int run_command(Fat32Context* ctx, const char* cmd, char* output, size_t out_size) {
+int run_script(Fat32Session* session, const char* script, int from_stdin, int stop_on_error,
+               char* output, size_t out_size) {
+    FILE* f = fopen(TEST_SCRIPT, "w");
+    assert(f && fputs(script, f) >= 0 && fclose(f) == 0);
+    int stdin_backup = dup(fileno(stdin));
+    if (from_stdin) {
+        int fd = open(TEST_SCRIPT, O_RDONLY);
+        assert(fd >= 0 && dup2(fd, fileno(stdin)) >= 0);
+        close(fd);
+        clearerr(stdin);
+    }
+
     FILE* tmp = tmpfile();
     assert(tmp);
     int stdout_backup = dup(fileno(stdout));
     fflush(stdout);
     dup2(fileno(tmp), fileno(stdout));
 
-    int ret = process_command(ctx, cmd);
+    int ret = run_batch(session, from_stdin ? "-" : TEST_SCRIPT, 1, stop_on_error);
 
     fflush(stdout);
     fseek(tmp, 0, SEEK_SET);
@@ -72,14 +196,198 @@ int run_command(Fat32Context* ctx, const char* cmd, char* output, size_t out_siz
     dup2(stdout_backup, fileno(stdout));
     close(stdout_backup);
     fclose(tmp);
+    dup2(stdin_backup, fileno(stdin));
+    close(stdin_backup);
+    clearerr(stdin);
     return ret;
 }
 
+/**
+ * @brief Thread body running a server until it is stopped
+ * @param arg Server
+ * @return NULL
+ */
+void* serve(void* arg) {
+    assert(server_run((Server*)arg) == 0);
+    return NULL;
+}
+
+/**
+ * @brief Connect to the test server
+ * @return Connected socket
+ */
+int connect_client(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, TEST_SOCKET);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+/**
+ * @brief Send a request string to the server
+ * @param fd Client socket
+ * @param text Request bytes
+ */
+void send_text(int fd, const char* text) {
+    assert(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+}
+
+/**
+ * @brief Read exactly size bytes from a socket
+ * @param fd Client socket
+ * @param buf Destination
+ * @param size Number of bytes
+ */
+void read_exact(int fd, char* buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, buf, size);
+        assert(n > 0);
+        buf += n;
+        size -= (size_t)n;
+    }
+}
+
+/**
+ * @brief Read one framed server response
+ * @param fd Client socket
+ * @param output Buffer receiving the command output (NUL-terminated)
+ * @param out_size Size of the output buffer
+ * @return Status from the response header
+ */
+int read_response(int fd, char* output, size_t out_size) {
+    char header[32];
+    size_t len = 0;
+    do {
+        assert(len < sizeof(header) - 1);
+        read_exact(fd, header + len, 1);
+    } while (header[len++] != '\n');
+    header[len] = '\0';
+
+    int status;
+    size_t body;
+    assert(sscanf(header, "%d %zu", &status, &body) == 2 && body < out_size);
+    read_exact(fd, output, body);
+    output[body] = '\0';
+    return status;
+}
+
+/// Number of threads in the concurrent session test
+#define SESSION_THREADS 4
+/// Appends each session thread makes to its file
+#define SESSION_APPENDS 16
+/// Bytes per append in the concurrent session test
+#define SESSION_CHUNK 1500
+
+/// Arguments of one thread in the concurrent session test
+typedef struct {
+    Fat32Volume* volume;
+    int id;
+} SessionJob;
+
+/**
+ * @brief Work of one thread in the concurrent session test
+ *
+ * Creates and enters /w<id> in its own session, appends to data.bin
+ * there and lists the root while the other threads do the same.
+ *
+ * @param arg Volume and thread number (SessionJob)
+ * @return NULL
+ */
+void* session_worker(void* arg) {
+    SessionJob* job = arg;
+    Fat32Session session;
+    fat32_session_init(&session, job->volume);
+    session.out = tmpfile();
+    assert(session.out);
+
+    char cmd[32];
+    int status;
+    snprintf(cmd, sizeof(cmd), "mkdir w%d", job->id);
+    execute_command(&session, cmd, &status);
+    assert(status == 0);
+    snprintf(cmd, sizeof(cmd), "cd /w%d", job->id);
+    execute_command(&session, cmd, &status);
+    assert(status == 0);
+
+    char chunk[SESSION_CHUNK];
+    Fat32File file;
+    for (int i = 0; i < SESSION_APPENDS; i++) {
+        memset(chunk, 'A' + job->id * 8 + i % 8, sizeof(chunk));
+        assert(fat32_open(&session, "data.bin", FAT32_O_WRONLY | FAT32_O_CREAT | FAT32_O_APPEND, &file) == 0);
+        assert(fat32_write(&file, chunk, sizeof(chunk)) == (int64_t)sizeof(chunk));
+        assert(fat32_close(&file) == 0);
+        execute_command(&session, "ls /", &status);
+        assert(status == 0);
+    }
+    execute_command(&session, "mkdir sub", &status);
+    assert(status == 0 && strcmp(session.current_path, "/") != 0);
+    fclose(session.out);
+    return NULL;
+}
+
+/// Number of threads in the concurrent rename test
+#define RENAME_THREADS 4
+/// Round trips each rename thread makes between /mva and /mvb
+#define RENAME_ROUNDS 16
+
+/**
+ * @brief Work of one thread in the concurrent rename test
+ *
+ * Moves r<id> from its home directory (/mva for even ids, /mvb for odd
+ * ones) to the other directory and back, listing both in between, so
+ * moves in opposite directions overlap.
+ *
+ * @param arg Volume and thread number (SessionJob)
+ * @return NULL
+ */
+void* rename_worker(void* arg) {
+    SessionJob* job = arg;
+    Fat32Session session;
+    fat32_session_init(&session, job->volume);
+    session.out = tmpfile();
+    assert(session.out);
+
+    char home[32], away[32];
+    snprintf(home, sizeof(home), "/%s/r%d", job->id % 2 ? "mvb" : "mva", job->id);
+    snprintf(away, sizeof(away), "/%s/r%d", job->id % 2 ? "mva" : "mvb", job->id);
+    int status;
+    for (int i = 0; i < RENAME_ROUNDS; i++) {
+        assert(fat32_rename(&session, home, away) == 0);
+        execute_command(&session, "ls /mva", &status);
+        assert(status == 0);
+        assert(fat32_rename(&session, away, home) == 0);
+        execute_command(&session, "ls /mvb", &status);
+        assert(status == 0);
+    }
+    fclose(session.out);
+    return NULL;
+}
+
+/**
+ * @brief Moves /mva/dm to /mvb and back while files are created inside it
+ *
+ * @param arg Volume and thread number (SessionJob)
+ * @return NULL
+ */
+void* dir_mover(void* arg) {
+    SessionJob* job = arg;
+    Fat32Session session;
+    fat32_session_init(&session, job->volume);
+    for (int i = 0; i < RENAME_ROUNDS; i++) {
+        assert(fat32_rename(&session, "/mva/dm", "/mvb/dm") == 0);
+        assert(fat32_rename(&session, "/mvb/dm", "/mva/dm") == 0);
+    }
+    return NULL;
+}
+
 /**
  * @brief Main test function
  *
  * Executes a sequence of tests for FAT32 emulator:
- * 1. Verify disk file size
+ * 1. Verify disk file size, sparse and preallocated creation
  * 2. Attempt `ls` before formatting
  * 3. Format the disk
  * 4. `ls` after formatting
@@ -91,66 +399,1012 @@ int run_command(Fat32Context* ctx, const char* cmd, char* output, size_t out_siz
  * 10. Create file `file1.txt`
  * 11. Verify file creation
  * 12. Test unknown command handling
+ * 13. Write a multi-cluster file through a handle
+ * 14. Read it back after reopening
+ * 15. put a host file and verify its contents
+ * 16. get it back to the host and compare
+ * 17. Interleaved writes to two files still leave each file contiguous
+ * 18. Preallocate a file and append into the reserved space
+ * 19. Truncate a file and append to it through the cached tail
+ * 20. Scatter/gather writes and reads
+ * 21. Map a file's contents straight out of the memory-mapped image
+ * 22. Import a host tree with enough entries to span several directory clusters
+ * 23. Export it as tar, from the mapped image and through file I/O
+ * 24. Format other sizes and cluster sizes, including an image over 4 GiB
+ * 25. Quick format of a 1 TiB volume
+ * 26. Known-zero cluster tracking across writes, clears and remounts
+ * 27. Freeing clusters punches holes, with and without the mapping
+ * 28. clone the image into several sparse copies
+ * 29. Commands rely on the mounted state; format orphans open handles
+ * 30. Per-command success status for batch mode
+ * 31. I/O counters and the per-command profile
+ * 32. NDJSON output of ls, stat and stats, and the JSON writer
+ * 33. Serve pipelined commands to concurrent clients with their own cwd
+ * 34. Writes inside a transaction stay in memory until commit; abort drops them
+ * 35. Record a workload trace and replay it against a fresh image
+ * 36. Sessions on one volume run commands from several threads at once
+ * 37. mv renames in place and across directories while others list them
  */
 int main() {
     cleanup();
 
-    Fat32Context ctx;
+    Fat32Volume ctx;
+    Fat32Session session;
     assert(fat32_init(&ctx, TEST_DISK) == 0);
+    fat32_session_init(&session, &ctx);
 
     // === 1. Verify file size is 20MB ===
     long size = get_file_size(TEST_DISK);
     assert(size == 20 * 1024 * 1024);
+    struct stat disk_st;
+    assert(stat(TEST_DISK, &disk_st) == 0);
+    assert((long)disk_st.st_blocks * 512 < size);  // Created sparse
+
+    // Preallocated creation reserves every block up front
+    Fat32Volume prealloc_ctx;
+    assert(fat32_init_opts(&prealloc_ctx, TEST_HOST_FILE, FAT32_INIT_PREALLOCATE) == 0);
+    assert(stat(TEST_HOST_FILE, &disk_st) == 0);
+    assert(disk_st.st_size == size && (long)disk_st.st_blocks * 512 >= size);
+    fat32_cleanup(&prealloc_ctx);
+    remove(TEST_HOST_FILE);
 
     // === 2. ls before formatting ===
     char out[1024];
-    int ret = run_command(&ctx, "ls", out, sizeof(out));
+    int ret = run_command(&session, "ls", out, sizeof(out));
     assert(strstr(out, "Unknown disk format") != NULL);
 
     // === 3. format ===
-    ret = run_command(&ctx, "format", out, sizeof(out));
+    ret = run_command(&session, "format", out, sizeof(out));
     assert(strstr(out, "Ok") != NULL);
     assert(fat32_is_valid(&ctx) == 0);
 
     // === 4. ls after formatting ===
-    ret = run_command(&ctx, "ls", out, sizeof(out));
+    ret = run_command(&session, "ls", out, sizeof(out));
     assert(strstr(out, ".") != NULL && strstr(out, "..") != NULL);
 
     // === 5. mkdir ttt ===
-    ret = run_command(&ctx, "mkdir ttt", out, sizeof(out));
+    ret = run_command(&session, "mkdir ttt", out, sizeof(out));
     assert(strstr(out, "Ok") != NULL);
 
     // === 6. ls confirms ttt ===
-    ret = run_command(&ctx, "ls", out, sizeof(out));
+    ret = run_command(&session, "ls", out, sizeof(out));
     assert(strstr(out, "ttt") != NULL);
 
     // === 7. cd /ttt ===
-    ret = run_command(&ctx, "cd /ttt", out, sizeof(out));
-    assert(ctx.current_cluster != ROOT_CLUSTER);
-    assert(strcmp(ctx.current_path, "/ttt") == 0);
+    ret = run_command(&session, "cd /ttt", out, sizeof(out));
+    assert(session.current_cluster != ROOT_CLUSTER);
+    assert(strcmp(session.current_path, "/ttt") == 0);
 
     // === 8. ls in subdirectory ===
-    ret = run_command(&ctx, "ls", out, sizeof(out));
+    ret = run_command(&session, "ls", out, sizeof(out));
     assert(strstr(out, ".") != NULL && strstr(out, "..") != NULL);
 
     // === 9. cd / ===
-    ret = run_command(&ctx, "cd /", out, sizeof(out));
-    assert(ctx.current_cluster == ROOT_CLUSTER);
-    assert(strcmp(ctx.current_path, "/") == 0);
+    ret = run_command(&session, "cd /", out, sizeof(out));
+    assert(session.current_cluster == ROOT_CLUSTER);
+    assert(strcmp(session.current_path, "/") == 0);
 
     // === 10. touch file1.txt ===
-    ret = run_command(&ctx, "touch file1.txt", out, sizeof(out));
+    ret = run_command(&session, "touch file1.txt", out, sizeof(out));
     assert(strstr(out, "Ok") != NULL);
 
     // === 11. ls confirms file1.txt ===
-    ret = run_command(&ctx, "ls", out, sizeof(out));
+    ret = run_command(&session, "ls", out, sizeof(out));
     assert(strstr(out, "file1.txt") != NULL);
 
     // === 12. Unknown command ===
-    ret = run_command(&ctx, "unknowncmd", out, sizeof(out));
+    ret = run_command(&session, "unknowncmd", out, sizeof(out));
     assert(strstr(out, "Unknown command") != NULL);
 
+    // === 13. write a multi-cluster file ===
+    static uint8_t data[3 * CLUSTER_SIZE + 100];
+    static uint8_t check[sizeof(data)];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + 3);
+    }
+    Fat32File file;
+    assert(fat32_open(&session, "/ttt/data.bin", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_write(&file, data, 1000) == 1000);
+    assert(fat32_write(&file, data + 1000, sizeof(data) - 1000) == (int64_t)(sizeof(data) - 1000));
+    assert(fat32_lseek(&file, 0, SEEK_CUR) == (int64_t)sizeof(data));
+    assert(fat32_close(&file) == 0);
+
+    // === 14. read it back ===
+    assert(fat32_open(&session, "/ttt/data.bin", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_lseek(&file, 0, SEEK_END) == (int64_t)sizeof(data));
+    assert(fat32_lseek(&file, CLUSTER_SIZE - 10, SEEK_SET) == CLUSTER_SIZE - 10);
+    assert(fat32_read(&file, check, 20) == 20);
+    assert(memcmp(check, data + CLUSTER_SIZE - 10, 20) == 0);
+    assert(fat32_lseek(&file, 0, SEEK_SET) == 0);
+    assert(fat32_read(&file, check, sizeof(check)) == (int64_t)sizeof(data));
+    assert(memcmp(check, data, sizeof(data)) == 0);
+    assert(fat32_read(&file, check, 1) == 0);
+    assert(fat32_write(&file, data, 1) == -1);
+    assert(fat32_close(&file) == 0);
+
+    // === 15. put a host file ===
+    static uint8_t big[300 * 1024 + 17];
+    static uint8_t big_check[sizeof(big)];
+    for (size_t i = 0; i < sizeof(big); i++) {
+        big[i] = (uint8_t)(i * 31 + (i >> 12));
+    }
+    FILE* host = fopen(TEST_HOST_FILE, "wb");
+    assert(host && fwrite(big, 1, sizeof(big), host) == sizeof(big));
+    fclose(host);
+    ret = run_command(&session, "put " TEST_HOST_FILE " /ttt/put.bin", out, sizeof(out));
+    assert(strstr(out, "Ok") != NULL);
+    assert(fat32_open(&session, "/ttt/put.bin", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == (int64_t)sizeof(big));
+    assert(memcmp(big, big_check, sizeof(big)) == 0);
+    assert(fat32_close(&file) == 0);
+    // A put that cannot complete leaves the existing file as it was
+    host = fopen(TEST_HOST_FILE, "wb");
+    assert(host && ftruncate(fileno(host), 2 * (off_t)TOTAL_SECTORS * SECTOR_SIZE) == 0);
+    fclose(host);
+    ret = run_command(&session, "put " TEST_HOST_FILE " /ttt/put.bin", out, sizeof(out));
+    assert(last_status == 1);
+    assert(fat32_open(&session, "/ttt/put.bin", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == (int64_t)sizeof(big));
+    assert(memcmp(big, big_check, sizeof(big)) == 0);
+    assert(fat32_close(&file) == 0);
+
+    // === 16. get it back ===
+    remove(TEST_HOST_FILE);
+    ret = run_command(&session, "get /ttt/put.bin " TEST_HOST_FILE, out, sizeof(out));
+    assert(strstr(out, "Ok") != NULL);
+    assert(get_file_size(TEST_HOST_FILE) == (long)sizeof(big));
+    host = fopen(TEST_HOST_FILE, "rb");
+    assert(host && fread(big_check, 1, sizeof(big_check), host) == sizeof(big));
+    fclose(host);
+    assert(memcmp(big, big_check, sizeof(big)) == 0);
+
+    // === 17. interleaved writes with delayed allocation ===
+    Fat32File file_b;
+    assert(fat32_open(&session, "a.log", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_open(&session, "b.log", FAT32_O_RDWR | FAT32_O_CREAT, &file_b) == 0);
+    for (int i = 0; i < 20; i++) {
+        assert(fat32_write(&file, big + 100000 + i * 1000, 1000) == 1000);
+        assert(fat32_write(&file_b, big + i * 1000, 1000) == 1000);
+    }
+    assert(fat32_lseek(&file, 0, SEEK_SET) == 0);
+    assert(fat32_read(&file, big_check, 20000) == 20000);
+    assert(memcmp(big_check, big + 100000, 20000) == 0);
+    assert(file.first_cluster == 0);
+    assert(fat32_close(&file) == 0);
+    assert(fat32_close(&file_b) == 0);
+    Fat32Extent* extents;
+    uint32_t extent_count;
+    assert(fat32_open(&session, "b.log", FAT32_O_RDONLY, &file_b) == 0);
+    assert(fat32_chain_extents(&ctx, file_b.first_cluster, UINT32_MAX, &extents, &extent_count) == 0);
+    assert(extent_count == 1 && extents[0].count == (20000 + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+    free(extents);
+    assert(fat32_read(&file_b, big_check, 20000) == 20000);
+    assert(memcmp(big_check, big, 20000) == 0);
+    assert(fat32_close(&file_b) == 0);
+
+    // === 18. fallocate ===
+    assert(fat32_open(&session, "prealloc.bin", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_fallocate(&file, 16 * CLUSTER_SIZE, FAT32_FALLOC_KEEP_SIZE) == 0);
+    assert(file.file_size == 0 && file.chain_len == 16);
+    uint32_t reserved_first = file.first_cluster;
+    assert(fat32_write(&file, big, 10000) == 10000);
+    assert(file.pending_len == 0 && file.first_cluster == reserved_first);
+    assert(fat32_fallocate(&file, 20000, 0) == 0);
+    assert(fat32_lseek(&file, 0, SEEK_END) == 20000);
+    assert(fat32_lseek(&file, 0, SEEK_SET) == 0);
+    assert(fat32_read(&file, big_check, 20000) == 20000);
+    assert(memcmp(big_check, big, 10000) == 0);
+    for (int i = 10000; i < 20000; i++) {
+        assert(big_check[i] == 0);
+    }
+    assert(fat32_close(&file) == 0);
+    assert(fat32_chain_extents(&ctx, reserved_first, UINT32_MAX, &extents, &extent_count) == 0);
+    assert(extent_count == 1 && extents[0].count == 16);
+    free(extents);
+
+    // === 19. truncate and append ===
+    assert(fat32_open(&session, "/ttt/put.bin", FAT32_O_RDWR, &file) == 0);
+    assert(fat32_truncate(&file, 5000) == 0);
+    assert(fat32_close(&file) == 0);
+    assert(fat32_open(&session, "/ttt/put.bin", FAT32_O_WRONLY | FAT32_O_APPEND, &file) == 0);
+    assert(file.chain_len == 0 && file.cluster_count == 2);
+    assert(fat32_write(&file, big + 5000, 1000) == 1000);
+    assert(file.chain_len == 0 && file.pending_len == 0);
+    assert(fat32_write(&file, big + 6000, 10000) == 10000);
+    assert(fat32_close(&file) == 0);
+    assert(fat32_open(&session, "/ttt/put.bin", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == 16000);
+    assert(memcmp(big_check, big, 16000) == 0);
+    assert(fat32_close(&file) == 0);
+    // Writes through a handle date the entry
+    uint32_t ttt_cluster;
+    char put_name[11];
+    DirEntry put_entry;
+    fat32_format_name("put.bin", put_name);
+    assert(fat32_resolve_dir(&session, "/ttt", &ttt_cluster) == 0);
+    assert(fat32_find_entry(&ctx, ttt_cluster, put_name, &put_entry, NULL, NULL) == 0);
+    assert(put_entry.wrt_date != 0 && put_entry.crt_date != 0);
+
+    // === 20. writev/readv ===
+    struct iovec wv[3] = {
+        { big, 100 }, { big + 100, 3 * CLUSTER_SIZE }, { big + 100 + 3 * CLUSTER_SIZE, 900 }
+    };
+    uint32_t vec_total = 1000 + 3 * CLUSTER_SIZE;
+    assert(fat32_open(&session, "vec.bin", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_writev(&file, wv, 3) == vec_total);
+    assert(fat32_flush(&file) == 0);
+    assert(fat32_lseek(&file, 50, SEEK_SET) == 50);
+    assert(fat32_writev(&file, wv, 2) == 100 + 3 * CLUSTER_SIZE);
+    memset(big_check, 0, sizeof(big_check));
+    struct iovec rv[2] = { { big_check, 7 }, { big_check + 7, vec_total } };
+    assert(fat32_lseek(&file, 0, SEEK_SET) == 0);
+    assert(fat32_readv(&file, rv, 2) == vec_total);
+    assert(memcmp(big_check, big, 50) == 0);
+    assert(memcmp(big_check + 50, big, 100 + 3 * CLUSTER_SIZE) == 0);
+    assert(memcmp(big_check + 150 + 3 * CLUSTER_SIZE, big + 150 + 3 * CLUSTER_SIZE, 850) == 0);
+    assert(fat32_close(&file) == 0);
+
+    // === 21. fat32_map_file ===
+    assert(fat32_open(&session, "/ttt/data.bin", FAT32_O_RDONLY, &file) == 0);
+    struct iovec* mapped;
+    assert(fat32_map_file(&file, 0, 100, &mapped) == -1);
+    assert(fat32_map_image(&ctx) == 0);
+    int segments = fat32_map_file(&file, 10, UINT32_MAX, &mapped);
+    assert(segments >= 1);
+    size_t mapped_total = 0;
+    for (int i = 0; i < segments; i++) {
+        assert(memcmp(mapped[i].iov_base, data + 10 + mapped_total, mapped[i].iov_len) == 0);
+        mapped_total += mapped[i].iov_len;
+    }
+    assert(mapped_total == sizeof(data) - 10);
+    free(mapped);
+    assert(fat32_close(&file) == 0);
+
+    // === 22. import ===
+    int dir_entries = CLUSTER_SIZE / sizeof(DirEntry) + 2;
+    char host_path[256];
+    assert(mkdir(TEST_HOST_TREE, 0755) == 0);
+    assert(mkdir(TEST_HOST_TREE "/sub", 0755) == 0);
+    write_host_file(TEST_HOST_TREE "/a.txt", big, 10000);
+    const struct timespec a_times[2] = { { 951830054, 0 }, { 951830054, 0 } };  // 2000-02-29 13:14:14 UTC
+    assert(utimensat(AT_FDCWD, TEST_HOST_TREE "/a.txt", a_times, 0) == 0);
+    time_t import_start = time(NULL);
+    write_host_file(TEST_HOST_TREE "/sub/b.bin", big + 1, 5000);
+    write_host_file(TEST_HOST_TREE "/sub/empty.txt", big, 0);
+    for (int i = 0; i < dir_entries; i++) {
+        snprintf(host_path, sizeof(host_path), TEST_HOST_TREE "/sub/f%d", i);
+        write_host_file(host_path, host_path, strlen(host_path));
+        snprintf(host_path, sizeof(host_path), TEST_HOST_TREE "/g%d", i);
+        write_host_file(host_path, host_path, strlen(host_path));
+    }
+    ret = run_command(&session, "mkdir imp", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    ret = run_command(&session, "import " TEST_HOST_TREE " /imp", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+
+    assert(fat32_open(&session, "/imp/a.txt", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == 10000);
+    assert(memcmp(big_check, big, 10000) == 0);
+    assert(fat32_close(&file) == 0);
+    assert(fat32_open(&session, "/imp/sub/b.bin", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == 5000);
+    assert(memcmp(big_check, big + 1, 5000) == 0);
+    assert(fat32_close(&file) == 0);
+    assert(fat32_open(&session, "/imp/sub/empty.txt", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == 0);
+    assert(fat32_close(&file) == 0);
+    for (int i = 0; i < dir_entries; i++) {
+        char image_path[64];
+        snprintf(host_path, sizeof(host_path), TEST_HOST_TREE "/sub/f%d", i);
+        snprintf(image_path, sizeof(image_path), "/imp/sub/f%d", i);
+        assert(fat32_open(&session, image_path, FAT32_O_RDONLY, &file) == 0);
+        assert(fat32_read(&file, big_check, sizeof(big_check)) == (int64_t)strlen(host_path));
+        assert(memcmp(big_check, host_path, strlen(host_path)) == 0);
+        assert(fat32_close(&file) == 0);
+        snprintf(image_path, sizeof(image_path), "/imp/g%d", i);
+        assert(fat32_open(&session, image_path, FAT32_O_RDONLY, &file) == 0);
+        assert(fat32_close(&file) == 0);
+    }
+    snprintf(host_path, sizeof(host_path), "g%d", dir_entries - 1);
+    ret = run_command(&session, "cd /imp", out, sizeof(out));
+    assert(ret == 0);
+    ret = run_command(&session, "ls", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "a.txt") != NULL && strstr(out, host_path) != NULL);
+    // mkdir, touch and cd see every cluster of the directory
+    ret = run_command(&session, "touch late.txt", out, sizeof(out));
+    assert(last_status == 0);
+    ret = run_command(&session, "mkdir late", out, sizeof(out));
+    assert(last_status == 0);
+    ret = run_command(&session, "cd /late", out, sizeof(out));
+    assert(last_status == 0 && strcmp(session.current_path, "/late") == 0);
+    ret = run_command(&session, "cd /..", out, sizeof(out));
+    assert(last_status == 0);
+    assert(fat32_rename(&session, "/imp/a.txt", "/a.txt") == 0);  // Frees a slot in the first cluster
+    ret = run_command(&session, "touch late.txt", out, sizeof(out));
+    assert(last_status == 1);
+    ret = run_command(&session, "mkdir late", out, sizeof(out));
+    assert(last_status == 1);
+    assert(fat32_rename(&session, "/a.txt", "/imp/a.txt") == 0);
+    ret = run_command(&session, "cd /", out, sizeof(out));
+    assert(ret == 0);
+    // Importing again collides with the existing names and changes nothing
+    ret = run_command(&session, "import " TEST_HOST_TREE " /imp", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "import failed") != NULL);
+
+    // === 23. export-tar ===
+    ret = run_command(&session, "export-tar /imp " TEST_HOST_FILE, out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    long tar_size = get_file_size(TEST_HOST_FILE);
+    assert(tar_size % 512 == 0);
+    uint8_t* tar = malloc(tar_size);
+    FILE* tar_file = fopen(TEST_HOST_FILE, "rb");
+    assert(tar && tar_file && fread(tar, 1, tar_size, tar_file) == (size_t)tar_size);
+    fclose(tar_file);
+    int tar_entries = 0;
+    int found = 0;
+    long pos = 0;
+    while (pos + 512 <= tar_size && tar[pos] != 0) {
+        const char* name = (const char*)tar + pos;
+        assert(memcmp(tar + pos + 257, "ustar", 6) == 0);
+        long size = strtol((const char*)tar + pos + 124, NULL, 8);
+        if (strcmp(name, "a.txt") == 0) {
+            assert(size == 10000 && memcmp(tar + pos + 512, big, 10000) == 0);
+            assert(strtol((const char*)tar + pos + 136, NULL, 8) == 951830054);  // Host mtime
+            found++;
+        } else if (strcmp(name, "late.txt") == 0) {
+            long mtime = strtol((const char*)tar + pos + 136, NULL, 8);  // Set by touch
+            assert(mtime >= (long)import_start - 2 && mtime <= (long)time(NULL));
+        } else if (strcmp(name, "sub/b.bin") == 0) {
+            assert(size == 5000 && memcmp(tar + pos + 512, big + 1, 5000) == 0);
+            found++;
+        } else if (strcmp(name, "sub/") == 0) {
+            assert(tar[pos + 156] == '5');
+            found++;
+        }
+        tar_entries++;
+        pos += 512 + (size + 511) / 512 * 512;
+    }
+    assert(found == 3 && tar_entries == 2 * dir_entries + 6);
+    assert(pos + 1024 == tar_size);
+
+    // Same archive without the mapping
+    fat32_unmap_image(&ctx);
+    ret = run_command(&session, "export-tar /imp " TEST_HOST_FILE, out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    assert(get_file_size(TEST_HOST_FILE) == tar_size);
+    tar_file = fopen(TEST_HOST_FILE, "rb");
+    uint8_t* tar_again = malloc(tar_size);
+    assert(tar_again && tar_file && fread(tar_again, 1, tar_size, tar_file) == (size_t)tar_size);
+    fclose(tar_file);
+    assert(memcmp(tar, tar_again, tar_size) == 0);
+    free(tar);
+    free(tar_again);
+
     fat32_cleanup(&ctx);
+
+    // === 24. Runtime geometry ===
+    Fat32Volume geo;
+    Fat32Session geo_session;
+    assert(fat32_init(&geo, TEST_HOST_FILE) == 0);
+    fat32_session_init(&geo_session, &geo);
+    ret = run_command(&geo_session, "format 8M 512", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    assert(get_file_size(TEST_HOST_FILE) == 8 * 1024 * 1024);
+    assert(geo.cluster_size == 512 && geo.cluster_shift == 9 && geo.cluster_mask == 511);
+    assert(geo.total_clusters == (geo.total_sectors - geo.data_start));
+    assert((uint64_t)geo.fat_size * (SECTOR_SIZE / 4) >= geo.cluster_end);
+    assert(fat32_open(&geo_session, "multi.bin", FAT32_O_WRONLY | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_write(&file, big, 20000) == 20000);
+    assert(fat32_close(&file) == 0);
+    fat32_cleanup(&geo);
+
+    // Remount: geometry comes from the boot sector
+    assert(fat32_init(&geo, TEST_HOST_FILE) == 0);
+    fat32_session_init(&geo_session, &geo);
+    assert(geo.cluster_size == 512 && geo.total_sectors == 8 * 2048);
+    assert(fat32_open(&geo_session, "multi.bin", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == 20000);
+    assert(memcmp(big_check, big, 20000) == 0);
+    assert(fat32_close(&file) == 0);
+    ret = run_command(&geo_session, "format 8M 3000", out, sizeof(out));
+    assert(strstr(out, "Format failed") != NULL);
+    ret = run_command(&geo_session, "format 8M 64K", out, sizeof(out));
+    assert(strstr(out, "Format failed") != NULL);
+
+    // 5 GiB sparse image with 32 KiB clusters: data beyond the 4 GiB offset
+    ret = run_command(&geo_session, "format 5G 32K", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    assert(geo.cluster_size == 32768 && geo.cluster_shift == 15);
+    uint32_t high = geo.cluster_end - 1;
+    assert(fat32_cluster_offset(&geo, high) > 0xFFFFFFFFull);
+    assert(fat32_write_data(&geo, high, 100, big, 5000) == 0);
+    assert(fat32_read_data(&geo, high, 100, big_check, 5000) == 0);
+    assert(memcmp(big_check, big, 5000) == 0);
+    assert(fat32_open(&geo_session, "/huge.bin", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_write(&file, big, 70000) == 70000);
+    assert(fat32_lseek(&file, 0, SEEK_SET) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == 70000);
+    assert(memcmp(big_check, big, 70000) == 0);
+    assert(fat32_close(&file) == 0);
+    fat32_cleanup(&geo);
+    assert(fat32_init(&geo, TEST_HOST_FILE) == 0);
+    fat32_session_init(&geo_session, &geo);
+    assert(geo.cluster_size == 32768 && geo.cluster_end - 1 == high);
+
+    // === 25. Quick format of a 1 TiB volume clears the old chains ===
+    assert(fat32_get_fat_entry(&geo, 3) != 0);
+    ret = run_command(&geo_session, "format 1T 32K", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    assert(geo.total_sectors == 0x80000000u);
+    assert(fat32_get_fat_entry(&geo, ROOT_CLUSTER) == FAT_EOC);
+    assert(fat32_get_fat_entry(&geo, 3) == 0);
+    assert(fat32_get_fat_entry(&geo, geo.cluster_end - 1) == 0);
+    // Small allocations and appends read a few FAT sectors, not the whole FAT
+    Fat32Stats before_append, after_append;
+    fat32_stats_get(&geo, &before_append);
+    assert(fat32_open(&geo_session, "/log.bin", FAT32_O_WRONLY | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_write(&file, big, 40000) == 40000);
+    assert(fat32_close(&file) == 0);
+    ret = run_command(&geo_session, "mkdir logs", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    fat32_stats_get(&geo, &after_append);
+    assert(after_append.sectors_read - before_append.sectors_read < 1024);  // The FAT has 262144
+    assert(fat32_open(&geo_session, "/log.bin", FAT32_O_WRONLY | FAT32_O_APPEND, &file) == 0);
+    fat32_stats_get(&geo, &before_append);
+    assert(fat32_write(&file, big, 40000) == 40000);
+    assert(fat32_flush(&file) == 0);
+    fat32_stats_get(&geo, &after_append);
+    assert(after_append.sectors_read - before_append.sectors_read < 64);
+    assert(fat32_close(&file) == 0);
+
+    // === 26. Known-zero clusters skip redundant zero writes ===
+    ret = run_command(&geo_session, "format 8M", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    uint32_t last = geo.cluster_end - 1;
+    assert(fat32_cluster_is_zero(&geo, last));
+    assert(!fat32_cluster_is_zero(&geo, ROOT_CLUSTER));
+    assert(fat32_write_data(&geo, last, 10, "x", 1) == 0);
+    assert(!fat32_cluster_is_zero(&geo, last));
+    assert(fat32_clear_cluster(&geo, last) == 0);
+    assert(fat32_cluster_is_zero(&geo, last));
+    assert(fat32_read_data(&geo, last, 0, big_check, geo.cluster_size) == 0);
+    for (uint32_t i = 0; i < geo.cluster_size; i++) assert(big_check[i] == 0);
+    ret = run_command(&geo_session, "mkdir zdir", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    assert(fat32_open(&geo_session, "/zdir/sparse.bin", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_lseek(&file, 3 * geo.cluster_size, SEEK_SET) == 3 * geo.cluster_size);
+    assert(fat32_write(&file, "end", 3) == 3);
+    assert(fat32_close(&file) == 0);
+    fat32_cleanup(&geo);
+
+    // Remount rebuilds the map from the image's holes
+    assert(fat32_init(&geo, TEST_HOST_FILE) == 0);
+    fat32_session_init(&geo_session, &geo);
+    assert(fat32_cluster_is_zero(&geo, last - 1));
+    assert(!fat32_cluster_is_zero(&geo, ROOT_CLUSTER));
+    ret = run_command(&geo_session, "cd /zdir", out, sizeof(out));
+    assert(ret == 0);
+    ret = run_command(&geo_session, "ls", out, sizeof(out));
+    assert(strstr(out, "sparse.bin") != NULL);
+    assert(fat32_open(&geo_session, "/zdir/sparse.bin", FAT32_O_RDONLY, &file) == 0);
+    assert(fat32_read(&file, big_check, sizeof(big_check)) == (int64_t)(3 * geo.cluster_size + 3));
+    for (uint32_t i = 0; i < 3 * geo.cluster_size; i++) assert(big_check[i] == 0);
+    assert(memcmp(big_check + 3 * geo.cluster_size, "end", 3) == 0);
+    assert(fat32_close(&file) == 0);
+    // A cluster written by another tool is no longer known zero after a remount
+    assert(fat32_cluster_is_zero(&geo, last - 1));
+    FILE* other_tool = fopen(TEST_HOST_FILE, "r+b");
+    assert(other_tool && fseeko(other_tool, (off_t)fat32_cluster_offset(&geo, last - 1), SEEK_SET) == 0);
+    assert(fwrite("GHOST", 1, 5, other_tool) == 5 && fclose(other_tool) == 0);
+    assert(fat32_mount(&geo) == 0);
+    assert(!fat32_cluster_is_zero(&geo, last - 1));
+    assert(fat32_cluster_is_zero(&geo, last));
+
+    // === 27. Freed clusters give their host space back ===
+    struct stat before, after;
+    assert(fat32_open(&geo_session, "/freed.bin", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_write(&file, big, sizeof(big)) == sizeof(big));
+    assert(fat32_close(&file) == 0);
+    assert(stat(TEST_HOST_FILE, &before) == 0);
+    assert(fat32_open(&geo_session, "/freed.bin", FAT32_O_RDWR, &file) == 0);
+    uint32_t freed = file.first_cluster;
+    assert(!fat32_cluster_is_zero(&geo, freed));
+    assert(fat32_truncate(&file, 0) == 0);
+    assert(stat(TEST_HOST_FILE, &after) == 0);
+    assert((before.st_blocks - after.st_blocks) * 512 >= (long)sizeof(big) - geo.cluster_size);
+    assert(fat32_cluster_is_zero(&geo, freed));
+    assert(fat32_close(&file) == 0);
+
+    // Same through the mapping
+    assert(fat32_map_image(&geo) == 0);
+    assert(fat32_open(&geo_session, "/freed.bin", FAT32_O_RDWR, &file) == 0);
+    assert(fat32_write(&file, big, sizeof(big)) == sizeof(big));
+    assert(fat32_close(&file) == 0);
+    assert(fat32_open(&geo_session, "/freed.bin", FAT32_O_RDWR, &file) == 0);
+    freed = file.first_cluster;
+    assert(!fat32_cluster_is_zero(&geo, freed));
+    assert(fat32_truncate(&file, 0) == 0);
+    assert(fat32_cluster_is_zero(&geo, freed));
+    assert(fat32_read_data(&geo, freed, 0, big_check, geo.cluster_size) == 0);
+    for (uint32_t i = 0; i < geo.cluster_size; i++) assert(big_check[i] == 0);
+    assert(fat32_close(&file) == 0);
+    fat32_unmap_image(&geo);
+
+    // === 28. Provision copies of a template image ===
+    assert(fat32_open(&geo_session, "/golden.bin", FAT32_O_WRONLY | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_write(&file, big, 20000) == 20000);
+    assert(fat32_close(&file) == 0);
+    ret = run_command(&geo_session, "clone 0 " TEST_CLONE_DIR, out, sizeof(out));
+    assert(strstr(out, "Usage") != NULL);
+    ret = run_command(&geo_session, "clone 4 " TEST_CLONE_DIR, out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    struct stat template_st;
+    assert(stat(TEST_HOST_FILE, &template_st) == 0);
+    for (int i = 1; i <= 4; i++) {
+        char clone_path[256];
+        snprintf(clone_path, sizeof(clone_path), TEST_CLONE_DIR "/" TEST_HOST_FILE ".%d", i);
+        struct stat clone_st;
+        assert(stat(clone_path, &clone_st) == 0);
+        assert(clone_st.st_size == template_st.st_size);
+        assert(clone_st.st_blocks <= template_st.st_blocks);  // Holes stay holes
+        Fat32Volume copy;
+        Fat32Session copy_session;
+        assert(fat32_init(&copy, clone_path) == 0);
+        fat32_session_init(&copy_session, &copy);
+        assert(fat32_open(&copy_session, "/golden.bin", FAT32_O_RDONLY, &file) == 0);
+        assert(fat32_read(&file, big_check, sizeof(big_check)) == 20000);
+        assert(memcmp(big_check, big, 20000) == 0);
+        assert(fat32_close(&file) == 0);
+        fat32_cleanup(&copy);
+    }
+
+    // === 29. Mounted state and format generations ===
+    assert(fat32_is_mounted(&geo));
+    uint32_t generation = geo.generation;
+    Fat32File stale;
+    assert(fat32_open(&geo_session, "/golden.bin", FAT32_O_RDWR, &stale) == 0);
+    // Commands trust the mounted state instead of re-reading sector 0
+    static const uint8_t garbage[SECTOR_SIZE] = {0xFF};
+    FILE* raw = fopen(TEST_HOST_FILE, "r+b");
+    assert(raw && fwrite(garbage, 1, sizeof(garbage), raw) == sizeof(garbage) && fclose(raw) == 0);
+    ret = run_command(&geo_session, "ls /", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "golden.bin") != NULL);
+    // Remounting validates again and notices the damage
+    assert(fat32_mount(&geo) != 0 && !fat32_is_mounted(&geo));
+    ret = run_command(&geo_session, "ls", out, sizeof(out));
+    assert(strstr(out, "Unknown disk format") != NULL);
+    assert(fat32_open(&geo_session, "/golden.bin", FAT32_O_RDONLY, &file) != 0);
+    ret = run_command(&geo_session, "format", out, sizeof(out));
+    assert(ret == 0 && strstr(out, "Ok") != NULL);
+    assert(fat32_is_mounted(&geo) && geo.generation == generation + 1);
+    // Handles from the previous volume are orphaned
+    assert(fat32_write(&stale, big, 10) == -1);
+    assert(fat32_read(&stale, big_check, 10) == -1);
+    assert(fat32_close(&stale) == -1);
+
+    // === 30. Per-command status used by batch mode ===
+    ret = run_command(&geo_session, "mkdir batch", out, sizeof(out));
+    assert(ret == 0 && last_status == 0);
+    ret = run_command(&geo_session, "mkdir batch", out, sizeof(out));
+    assert(ret == 0 && last_status == 1);
+    ret = run_command(&geo_session, "mkdir", out, sizeof(out));
+    assert(last_status == 1 && strstr(out, "Usage") != NULL);
+    ret = run_command(&geo_session, "bogus", out, sizeof(out));
+    assert(last_status == 1);
+    ret = run_command(&geo_session, "", out, sizeof(out));
+    assert(ret == 0 && last_status == 0);
+    ret = run_command(&geo_session, "exit", out, sizeof(out));
+    assert(ret == -1 && last_status == 0);
+    geo.mounted = 0;
+    ret = run_command(&geo_session, "ls", out, sizeof(out));
+    assert(ret == -1 && last_status == 1);
+    assert(fat32_mount(&geo) == 0);
+    // Batch scripts: comments and blank lines are skipped, one status per command
+    ret = run_command(&geo_session, "cd /batch", out, sizeof(out));
+    assert(last_status == 0);
+    ret = run_script(&geo_session, "# setup\n\nmkdir bat1\n  \nmkdir bat1\nls\n", 0, 0, out, sizeof(out));
+    assert(ret == 1 && strncmp(out, "Ok\nstatus 0\n", 12) == 0 && strstr(out, "status 1\n") != NULL);
+    assert(strstr(out, "bat1\nstatus 0\n") != NULL);
+    ret = run_script(&geo_session, "mkdir bat2\nmkdir bat2\nmkdir bat3\n", 1, 1, out, sizeof(out));
+    assert(ret == 1 && strstr(out, "status 1\n") != NULL);
+    assert(strcmp(strstr(out, "status 1\n"), "status 1\n") == 0);  // Stopped at the failure
+    ret = run_command(&geo_session, "ls", out, sizeof(out));
+    assert(strstr(out, "bat2") != NULL && strstr(out, "bat3") == NULL);
+    ret = run_script(&geo_session, "mkdir bat3\nexit\nmkdir bat4\n", 0, 0, out, sizeof(out));
+    assert(ret == 0 && strcmp(out, "Ok\nstatus 0\nstatus 0\n") == 0);
+    assert(run_batch(&geo_session, TEST_SCRIPT ".missing", 0, 0) == -1);
+    ret = run_command(&geo_session, "cd /", out, sizeof(out));
+
+    // === 31. I/O counters and per-command profile ===
+    Fat32Stats io_before, io_after;
+    fat32_stats_get(&geo, &io_before);
+    assert(fat32_open(&geo_session, "/prof.bin", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_write(&file, big, 3 * SECTOR_SIZE) == 3 * SECTOR_SIZE);
+    assert(fat32_close(&file) == 0);
+    fat32_stats_get(&geo, &io_after);
+    assert(io_after.sectors_written - io_before.sectors_written >= 3);
+    assert(io_after.flushes - io_before.flushes == 1);
+    assert(io_after.syscalls > io_before.syscalls);
+    ret = run_command(&geo_session, "profile", out, sizeof(out));
+    assert(last_status == 1 && strstr(out, "Usage") != NULL);
+    FILE* profile_err = tmpfile();  // Per-command lines go to stderr
+    int stderr_backup = dup(fileno(stderr));
+    assert(profile_err && stderr_backup >= 0);
+    fflush(stderr);
+    dup2(fileno(profile_err), fileno(stderr));
+    ret = run_command(&geo_session, "profile on", out, sizeof(out));
+    assert(ret == 0 && last_status == 0 && geo.profiling);
+    ret = run_command(&geo_session, "ls /", out, sizeof(out));
+    ret = run_command(&geo_session, "ls /batch", out, sizeof(out));
+    ret = run_command(&geo_session, "profile off", out, sizeof(out));
+    assert(!geo.profiling);
+    fflush(stderr);
+    dup2(stderr_backup, fileno(stderr));
+    close(stderr_backup);
+    fseek(profile_err, 0, SEEK_SET);
+    size_t profile_len = fread(out, 1, sizeof(out) - 1, profile_err);
+    out[profile_len] = '\0';
+    fclose(profile_err);
+    assert(strncmp(out, "[profile] ls: wall ", 19) == 0);
+    ret = run_command(&geo_session, "ls /", out, sizeof(out));
+    int ls_row = -1;
+    for (uint32_t i = 0; i < geo.profile_rows; i++) {
+        if (strcmp(geo.profile[i].command, "ls") == 0) ls_row = (int)i;
+    }
+    assert(ls_row >= 0 && geo.profile[ls_row].calls == 2);
+    assert(geo.profile[ls_row].io.sectors_read > 0 && geo.profile[ls_row].io.sectors_written == 0);
+
+    // === 32. NDJSON output ===
+    geo.json = 1;
+    ret = run_command(&geo_session, "ls /", out, sizeof(out));
+    assert(ret == 0 && last_status == 0);
+    int records = 0;
+    for (char* line = strtok(out, "\n"); line; line = strtok(NULL, "\n")) {
+        assert(line[0] == '{' && line[strlen(line) - 1] == '}');
+        records++;
+    }
+    assert(records == 4);  // . .. batch prof.bin
+    ret = run_command(&geo_session, "stat /prof.bin", out, sizeof(out));
+    assert(strstr(out, "\"name\":\"prof.bin\",\"type\":\"file\",\"size\":1536") != NULL);
+    assert(strstr(out, "\"clusters\":1}\n") != NULL);
+    ret = run_command(&geo_session, "stat /missing", out, sizeof(out));
+    assert(last_status == 1 && strcmp(out, "{\"error\":\"stat failed\"}\n") == 0);
+    ret = run_command(&geo_session, "stats", out, sizeof(out));
+    assert(strstr(out, "\"cluster_size\":4096") != NULL && strstr(out, "\"syscalls\":") != NULL);
+    geo.json = 0;
+    ret = run_command(&geo_session, "stat /", out, sizeof(out));
+    assert(strstr(out, "type: dir") != NULL && strstr(out, "cluster: 2") != NULL);
+
+    FILE* json_out = tmpfile();
+    JsonWriter writer;
+    assert(json_out && json_writer_init(&writer, json_out) == 0);
+    for (int i = 0; i < 5000; i++) {
+        json_begin(&writer);
+        json_string(&writer, "s", "a\"b\\c\n");
+        json_uint(&writer, "n", (uint64_t)i);
+        json_end(&writer);
+    }
+    assert(json_writer_destroy(&writer) == 0);
+    rewind(json_out);
+    char json_line[64];
+    for (int i = 0; i < 5000; i++) {
+        char expected[64];
+        snprintf(expected, sizeof(expected), "{\"s\":\"a\\\"b\\\\c\\u000a\",\"n\":%d}\n", i);
+        assert(fgets(json_line, sizeof(json_line), json_out) && strcmp(json_line, expected) == 0);
+    }
+    fclose(json_out);
+
+    // === 33. Server mode ===
+    Server* server = server_create(&geo, TEST_SOCKET, 2);
+    assert(server);
+    pthread_t server_thread;
+    assert(pthread_create(&server_thread, NULL, serve, server) == 0);
+    int client1 = connect_client();
+    int client2 = connect_client();
+    send_text(client1, "mkdir srv\ncd /srv\nmkdir sub\nls\n");
+    assert(read_response(client1, out, sizeof(out)) == 0 && strcmp(out, "Ok\n") == 0);
+    assert(read_response(client1, out, sizeof(out)) == 0 && strcmp(out, "") == 0);
+    assert(read_response(client1, out, sizeof(out)) == 0 && strcmp(out, "Ok\n") == 0);
+    assert(read_response(client1, out, sizeof(out)) == 0 && strcmp(out, ".\n..\nsub\n") == 0);
+    send_text(client2, "l");  // Request split across writes
+    send_text(client2, "s\r\nbogus\n");
+    assert(read_response(client2, out, sizeof(out)) == 0 && strstr(out, "srv\n") != NULL);
+    assert(strstr(out, "sub") == NULL);  // client2 is still in the root
+    assert(read_response(client2, out, sizeof(out)) == 1 && strstr(out, "Unknown command") != NULL);
+    // Diagnostics of the filesystem calls reach the client, not the server's stdout
+    send_text(client2, "touch srv.txt\ntouch srv.txt\ncd /srv/sub\n");
+    assert(read_response(client2, out, sizeof(out)) == 0 && strstr(out, "Ok\n") != NULL);
+    assert(read_response(client2, out, sizeof(out)) == 1 && strstr(out, "Name already exists") != NULL);
+    assert(read_response(client2, out, sizeof(out)) == 1 && strstr(out, "Multi-level paths") != NULL);
+    send_text(client1, "ls\nexit\n");
+    assert(read_response(client1, out, sizeof(out)) == 0 && strstr(out, "sub\n") != NULL);
+    assert(read_response(client1, out, sizeof(out)) == 0 && strcmp(out, "") == 0);
+    assert(read(client1, out, 1) == 0);  // Closed after exit
+    close(client1);
+    server_stop(server);
+    assert(pthread_join(server_thread, NULL) == 0);
+    close(client2);
+    server_destroy(server);
+    assert(access(TEST_SOCKET, F_OK) != 0);
+    assert(strcmp(geo_session.current_path, "/") == 0 && geo_session.out == NULL);
+
+    // === 34. Transactions ===
+    ret = run_command(&geo_session, "commit", out, sizeof(out));
+    assert(last_status == 1 && strcmp(out, "No open transaction\n") == 0);
+    ret = run_command(&geo_session, "begin", out, sizeof(out));
+    assert(last_status == 0 && geo.txn != NULL);
+    ret = run_command(&geo_session, "begin", out, sizeof(out));
+    assert(last_status == 1);
+    fat32_stats_get(&geo, &io_before);
+    ret = run_command(&geo_session, "mkdir txa", out, sizeof(out));
+    ret = run_command(&geo_session, "cd /txa", out, sizeof(out));
+    ret = run_command(&geo_session, "mkdir sub", out, sizeof(out));
+    assert(last_status == 0);
+    ret = run_command(&geo_session, "cd /", out, sizeof(out));
+    assert(fat32_open(&geo_session, "/txa/f.bin", FAT32_O_RDWR | FAT32_O_CREAT, &file) == 0);
+    assert(fat32_write(&file, big, 3 * SECTOR_SIZE + 100) == 3 * SECTOR_SIZE + 100);
+    assert(fat32_close(&file) == 0);
+    ret = run_command(&geo_session, "ls /txa", out, sizeof(out));
+    assert(strstr(out, "sub\n") != NULL && strstr(out, "f.bin\n") != NULL);
+    fat32_stats_get(&geo, &io_after);
+    assert(io_after.sectors_written == io_before.sectors_written);  // Nothing reached the image
+    Fat32Volume peek;
+    Fat32Session peek_session;
+    DirEntry peek_entry;
+    assert(fat32_init(&peek, TEST_HOST_FILE) == 0);
+    fat32_session_init(&peek_session, &peek);
+    assert(fat32_stat(&peek_session, "/txa", &peek_entry) != 0);
+    ret = run_command(&geo_session, "format", out, sizeof(out));
+    assert(last_status == 1 && fat32_is_mounted(&geo));
+    ret = run_command(&geo_session, "clone 1 " TEST_CLONE_DIR, out, sizeof(out));
+    assert(last_status == 1);
+    ret = run_command(&geo_session, "commit", out, sizeof(out));
+    assert(last_status == 0 && geo.txn == NULL);
+    fat32_stats_get(&geo, &io_after);
+    assert(io_after.sectors_written > io_before.sectors_written);
+    assert(fat32_stat(&peek_session, "/txa/sub", &peek_entry) == 0);
+    assert(fat32_open(&peek_session, "/txa/f.bin", FAT32_O_RDONLY, &file) == 0);
+    assert(file.file_size == 3 * SECTOR_SIZE + 100);
+    assert(fat32_read(&file, big_check, 3 * SECTOR_SIZE + 100) == 3 * SECTOR_SIZE + 100);
+    assert(memcmp(big_check, big, 3 * SECTOR_SIZE + 100) == 0);
+    assert(fat32_close(&file) == 0);
+
+    Fat32Session other;
+    Fat32File other_file, probe;
+    fat32_session_init(&other, &geo);
+    assert(fat32_cd(&other, "/txa") == 0);
+    assert(fat32_open(&other, "/txa/o.txt", FAT32_O_RDWR | FAT32_O_CREAT, &other_file) == 0);
+    ret = run_command(&geo_session, "cd /txa", out, sizeof(out));
+    ret = run_command(&geo_session, "begin", out, sizeof(out));
+    ret = run_command(&geo_session, "mkdir txb", out, sizeof(out));
+    assert(fat32_open(&geo_session, "/txa/f.bin", FAT32_O_RDWR | FAT32_O_TRUNC, &file) == 0);
+    assert(fat32_flush(&file) == 0);
+    ret = run_command(&other, "commit", out, sizeof(out));  // Only the owner ends it
+    assert(last_status == 1 && strcmp(out, "No open transaction\n") == 0);
+    ret = run_command(&other, "abort", out, sizeof(out));
+    assert(last_status == 1 && geo.txn != NULL);
+    ret = run_command(&other, "begin", out, sizeof(out));
+    assert(last_status == 1);
+    assert(fat32_stat(&other, "/txa/txb", &peek_entry) == 0);  // Reads see the transaction
+    assert(fat32_mkdir(&other, "oth") != 0);
+    assert(fat32_rename(&other, "/txa/o.txt", "/txa/p.txt") != 0);
+    assert(fat32_cd(&other, "/") != 0);
+    assert(fat32_open(&other, "/txa/f.bin", FAT32_O_RDONLY, &probe) != 0);
+    assert(fat32_write(&other_file, big, 10) == -1);
+    assert(fat32_read(&other_file, big_check, 10) == 0);
+    ret = run_command(&geo_session, "abort", out, sizeof(out));
+    assert(last_status == 0 && geo.txn == NULL);
+    assert(fat32_session_cwd(&geo_session) == ROOT_CLUSTER && strcmp(geo_session.current_path, "/") == 0);
+    assert(fat32_write(&file, big, 1) == -1);  // Handle predates the abort
+    assert(strcmp(other.current_path, "/txa") == 0 && fat32_session_cwd(&other) != ROOT_CLUSTER);
+    assert(fat32_write(&other_file, big, 10) == 10);  // Other sessions keep their handles
+    assert(fat32_close(&other_file) == 0);
+    assert(fat32_stat(&geo_session, "/txa/txb", &peek_entry) != 0);
+    assert(fat32_stat(&geo_session, "/txa/f.bin", &peek_entry) == 0 && peek_entry.file_size == 3 * SECTOR_SIZE + 100);
+    assert(fat32_stat(&peek_session, "/txa/txb", &peek_entry) != 0);
+    ret = run_command(&geo_session, "begin", out, sizeof(out));
+    fat32_cleanup(&peek);
+    fat32_cleanup(&geo);  // Drops the open transaction
+
+    // === 35. Record and replay a workload ===
+    assert(fat32_init(&geo, TEST_HOST_FILE) == 0);
+    fat32_session_init(&geo_session, &geo);
+    assert(trace_start(&geo, TEST_TRACE) == 0);
+    assert(trace_start(&geo, TEST_TRACE) == -1);
+    ret = run_command(&geo_session, "mkdir tr", out, sizeof(out));
+    ret = run_command(&geo_session, "cd /tr", out, sizeof(out));
+    ret = run_command(&geo_session, "", out, sizeof(out));  // Not recorded
+    ret = run_command(&geo_session, "mkdir sub", out, sizeof(out));
+    ret = run_command(&geo_session, "bogus", out, sizeof(out));
+    Fat32Session trace_other;
+    fat32_session_init(&trace_other, &geo);
+    assert(trace_other.id != geo_session.id);
+    ret = run_command(&trace_other, "mkdir sub2", out, sizeof(out));  // In its own cwd, the root
+    ret = run_command(&trace_other, "put " TEST_SOCKET " /p.bin", out, sizeof(out));
+    ret = run_command(&trace_other, "export-tar /tr -", out, sizeof(out));
+    assert(trace_stop(&geo) == 0 && geo.trace == NULL);
+    uint64_t volume_size = (uint64_t)geo.total_sectors << SECTOR_SHIFT;
+    fat32_cleanup(&geo);
+
+    FILE* trace_in = fopen(TEST_TRACE, "rb");
+    TraceHeader trace_header;
+    TraceRecord trace_record;
+    assert(trace_in && fread(&trace_header, sizeof(trace_header), 1, trace_in) == 1);
+    assert(memcmp(trace_header.magic, TRACE_MAGIC, 8) == 0 && trace_header.version == TRACE_VERSION);
+    assert(trace_header.volume_size == volume_size && trace_header.cluster_size == 4096);
+    int trace_counts[5] = {0};
+    uint64_t last_time = 0;
+    char first_command[32] = "";
+    uint32_t trace_sessions[8];
+    while (fread(&trace_record, sizeof(trace_record), 1, trace_in) == 1) {
+        assert(trace_record.type >= TRACE_COMMAND && trace_record.type <= TRACE_DISCARD);
+        trace_counts[trace_record.type]++;
+        if (trace_record.type == TRACE_COMMAND) {
+            assert(trace_record.time >= last_time && trace_record.text_len < sizeof(out));
+            last_time = trace_record.time;
+            assert(fread(out, 1, trace_record.text_len, trace_in) == trace_record.text_len);
+            out[trace_record.text_len] = '\0';
+            if (!first_command[0]) strcpy(first_command, out);
+            trace_sessions[trace_counts[TRACE_COMMAND] - 1] = trace_record.session;
+        }
+    }
+    fclose(trace_in);
+    assert(trace_counts[TRACE_COMMAND] == 7 && strcmp(first_command, "mkdir tr") == 0);
+    assert(trace_sessions[0] == geo_session.id && trace_sessions[3] == geo_session.id);
+    assert(trace_sessions[4] == trace_other.id && trace_sessions[6] == trace_other.id);
+    assert(trace_counts[TRACE_READ] > 0 && trace_counts[TRACE_WRITE] > 0);
+
+    TraceReport report;
+    assert(trace_replay(TEST_TRACE, TEST_DISK, 0, &report) == 0);
+    assert(report.commands == 5 && report.failures == 1 && report.skipped == 2);  // put and export-tar
+    assert(report.recorded_written > 0 && report.io.sectors_written > 0);
+    assert(report.latency_p50_ms <= report.latency_max_ms && report.elapsed_ms > 0);
+    assert(fat32_init(&geo, TEST_DISK) == 0);
+    fat32_session_init(&geo_session, &geo);
+    assert(((uint64_t)geo.total_sectors << SECTOR_SHIFT) == volume_size);
+    assert(fat32_stat(&geo_session, "/tr/sub", &peek_entry) == 0);
+    assert(fat32_stat(&geo_session, "/sub2", &peek_entry) == 0);  // Replayed in its own session
+    assert(fat32_stat(&geo_session, "/tr/sub2", &peek_entry) != 0);
+    assert(fat32_stat(&geo_session, "/txa", &peek_entry) != 0);  // Fresh image
+    fat32_cleanup(&geo);
+    assert(trace_replay(TEST_DISK, TEST_HOST_FILE, 0, &report) == -1);  // Not a trace
+
+    // === 36. Concurrent sessions ===
+    assert(fat32_init(&geo, TEST_DISK) == 0);
+    fat32_session_init(&geo_session, &geo);
+    pthread_t session_threads[SESSION_THREADS];
+    SessionJob jobs[SESSION_THREADS];
+    for (int i = 0; i < SESSION_THREADS; i++) {
+        jobs[i].volume = &geo;
+        jobs[i].id = i;
+        assert(pthread_create(&session_threads[i], NULL, session_worker, &jobs[i]) == 0);
+    }
+    for (int i = 0; i < SESSION_THREADS; i++) {
+        assert(pthread_join(session_threads[i], NULL) == 0);
+    }
+    assert(strcmp(geo_session.current_path, "/") == 0);
+    for (int i = 0; i < SESSION_THREADS; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/w%d/data.bin", i);
+        assert(fat32_open(&geo_session, path, FAT32_O_RDONLY, &file) == 0);
+        assert(file.file_size == SESSION_APPENDS * SESSION_CHUNK);
+        for (int j = 0; j < SESSION_APPENDS; j++) {
+            assert(fat32_read(&file, big_check, SESSION_CHUNK) == SESSION_CHUNK);
+            for (int k = 0; k < SESSION_CHUNK; k++) {
+                assert(big_check[k] == (uint8_t)('A' + i * 8 + j % 8));
+            }
+        }
+        assert(fat32_close(&file) == 0);
+        snprintf(path, sizeof(path), "/w%d/sub", i);
+        assert(fat32_stat(&geo_session, path, &peek_entry) == 0);
+    }
+    fat32_cleanup(&geo);
+
+    // === 37. Rename and move ===
+    assert(fat32_init(&geo, TEST_DISK) == 0);
+    fat32_session_init(&geo_session, &geo);
+    const char* mv_setup[] = {
+        "mkdir mva", "mkdir mvb", "cd /mva", "touch f.txt", "mkdir d", "cd /d", "touch g.txt", "cd /"
+    };
+    for (size_t i = 0; i < sizeof(mv_setup) / sizeof(mv_setup[0]); i++) {
+        run_command(&geo_session, mv_setup[i], out, sizeof(out));
+        assert(last_status == 0);
+    }
+    run_command(&geo_session, "mv /mva/f.txt /mva/h.txt", out, sizeof(out));
+    assert(last_status == 0 && strstr(out, "Ok") != NULL);
+    assert(fat32_stat(&geo_session, "/mva/f.txt", &peek_entry) != 0);
+    assert(fat32_stat(&geo_session, "/mva/h.txt", &peek_entry) == 0);
+    assert(fat32_rename(&geo_session, "/mva/h.txt", "/mvb/h.txt") == 0);
+    assert(fat32_stat(&geo_session, "/mva/h.txt", &peek_entry) != 0);
+    assert(fat32_stat(&geo_session, "/mvb/h.txt", &peek_entry) == 0);
+    assert(fat32_rename(&geo_session, "/mva/d", "/mvb/e") == 0);
+    assert(fat32_stat(&geo_session, "/mvb/e/g.txt", &peek_entry) == 0);
+    DirEntry parent_entry;
+    assert(fat32_stat(&geo_session, "/mvb", &parent_entry) == 0);
+    assert(fat32_stat(&geo_session, "/mvb/e/..", &peek_entry) == 0);  // ".." follows the move
+    assert(peek_entry.cluster_high == parent_entry.cluster_high && peek_entry.cluster_low == parent_entry.cluster_low);
+    run_command(&geo_session, "cd /mvb", out, sizeof(out));
+    run_command(&geo_session, "cd /e", out, sizeof(out));  // cd looks up single names in the cwd
+    assert(last_status == 0);
+    run_command(&geo_session, "mv g.txt ../g.txt", out, sizeof(out));
+    assert(last_status == 0);
+    run_command(&geo_session, "cd /", out, sizeof(out));
+    assert(fat32_stat(&geo_session, "/mvb/g.txt", &peek_entry) == 0);
+    assert(fat32_rename(&geo_session, "/mvb", "/mvb/e/x") != 0);     // Into its own subtree
+    assert(fat32_rename(&geo_session, "/mvb/h.txt", "/mvb/e") != 0);  // Target exists
+    assert(fat32_rename(&geo_session, "/mva/none", "/mvb/none") != 0);
+    assert(fat32_open(&geo_session, "/mvb/h.txt", FAT32_O_RDWR, &file) == 0);
+    assert(fat32_rename(&geo_session, "/mvb/h.txt", "/mva/h.txt") != 0);  // Open handle
+    assert(fat32_rename(&geo_session, "/mvb/h.txt", "/mvb/i.txt") == 0);  // Same slot
+    Fat32File second;
+    assert(fat32_open(&geo_session, "/mvb/i.txt", FAT32_O_WRONLY, &second) != 0);  // One writer
+    assert(fat32_put(&geo_session, TEST_HOST_FILE, "/mvb/i.txt") != 0);
+    assert(fat32_open(&geo_session, "/mvb/i.txt", FAT32_O_RDONLY, &second) == 0);
+    assert(fat32_close(&second) == 0);
+    run_command(&geo_session, "cd /mvb", out, sizeof(out));
+    run_command(&geo_session, "touch h.txt", out, sizeof(out));
+    assert(last_status == 0);
+    memset(big, 'm', 5000);
+    assert(fat32_write(&file, big, 5000) == 5000);
+    assert(fat32_close(&file) == 0);
+    assert(fat32_stat(&geo_session, "/mvb/i.txt", &peek_entry) == 0 && peek_entry.file_size == 5000);
+    assert(fat32_stat(&geo_session, "/mvb/h.txt", &peek_entry) == 0 && peek_entry.file_size == 0);
+    assert(fat32_rename(&geo_session, "/mvb/i.txt", "/mva/i.txt") == 0);  // Closed
+    assert(fat32_stat(&geo_session, "/mva/i.txt", &peek_entry) == 0 && peek_entry.file_size == 5000);
+    assert(fat32_get(&geo_session, "/mva/i.txt", TEST_HOST_FILE) == 0 && get_file_size(TEST_HOST_FILE) == 5000);
+    assert(fat32_get(&geo_session, "/mva", TEST_HOST_FILE) != 0);
+    run_command(&geo_session, "mv /mvb/h.txt", out, sizeof(out));
+    assert(last_status == 1 && strstr(out, "Usage: mv") != NULL);
+    run_command(&geo_session, "mv /nowhere /mva", out, sizeof(out));
+    assert(last_status == 1 && strstr(out, "mv failed") != NULL);
+
+    for (int i = 0; i < RENAME_THREADS; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/%s/r%d", i % 2 ? "mvb" : "mva", i);
+        Fat32File created;
+        assert(fat32_open(&geo_session, path, FAT32_O_WRONLY | FAT32_O_CREAT, &created) == 0);
+        assert(fat32_close(&created) == 0);
+    }
+    run_command(&geo_session, "cd /", out, sizeof(out));
+    run_command(&geo_session, "cd /mva", out, sizeof(out));
+    run_command(&geo_session, "mkdir dm", out, sizeof(out));
+    run_command(&geo_session, "cd /dm", out, sizeof(out));
+    assert(last_status == 0);
+    pthread_t rename_threads[RENAME_THREADS + 1];
+    SessionJob rename_jobs[RENAME_THREADS + 1];
+    for (int i = 0; i <= RENAME_THREADS; i++) {
+        rename_jobs[i].volume = &geo;
+        rename_jobs[i].id = i;
+        assert(pthread_create(&rename_threads[i], NULL, i < RENAME_THREADS ? rename_worker : dir_mover,
+                              &rename_jobs[i]) == 0);
+    }
+    for (int i = 0; i < 24; i++) {  // Entries sharing the first sector with ".."
+        char name[8];
+        snprintf(name, sizeof(name), "t%d", i);
+        Fat32File created;
+        assert(fat32_open(&geo_session, name, FAT32_O_WRONLY | FAT32_O_CREAT, &created) == 0);
+        assert(fat32_close(&created) == 0);
+    }
+    for (int i = 0; i <= RENAME_THREADS; i++) {
+        assert(pthread_join(rename_threads[i], NULL) == 0);
+    }
+    assert(fat32_stat(&geo_session, "/mva", &parent_entry) == 0);
+    assert(fat32_stat(&geo_session, "/mva/dm/..", &peek_entry) == 0);
+    assert(peek_entry.cluster_high == parent_entry.cluster_high && peek_entry.cluster_low == parent_entry.cluster_low);
+    for (int i = 0; i < 24; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/mva/dm/t%d", i);
+        assert(fat32_stat(&geo_session, path, &peek_entry) == 0);
+    }
+    for (int i = 0; i < RENAME_THREADS; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/%s/r%d", i % 2 ? "mvb" : "mva", i);
+        assert(fat32_stat(&geo_session, path, &peek_entry) == 0);
+        snprintf(path, sizeof(path), "/%s/r%d", i % 2 ? "mva" : "mvb", i);
+        assert(fat32_stat(&geo_session, path, &peek_entry) != 0);
+    }
+    fat32_cleanup(&geo);
+
     cleanup();
 
     printf("All Task #3 tests passed!\n");